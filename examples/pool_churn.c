@@ -0,0 +1,89 @@
+// Memory pool churn benchmark
+//
+// Times Mp_New / Mp_Free on a pool that has been fragmented: a large
+// number of items are live, and each round frees one item from the
+// low pages, then allocates twice.  The second allocation finds the
+// first page with a free slot full and must locate the next free
+// slot, which sits at the far end of the pool.  This is the access
+// pattern of the skip list node stacks and HashSequence nodes under
+// heavy insert/delete traffic.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "errorhandling.h"
+#include "memorypool.h"
+#include "randfunctions.h"
+
+typedef struct {
+    MEMORY_POOL_ITEMS;
+    long payload[4];
+} ChurnItem;
+
+LOCAL_MEMORY_POOL(ChurnItem);
+
+static double churn(size_t n_live, size_t n_rounds, uint32_t seed)
+{
+    ChurnItem **live = (ChurnItem**)malloc(sizeof(ChurnItem*) * (n_live + 1));
+    LCGState rng = Lcg_New(seed);
+    size_t i, r;
+
+    Mp_ReserveChurnItem(n_live);
+
+    for(i = 0; i < n_live; ++i)
+	live[i] = Mp_NewChurnItem();
+
+    /* One free slot at the end of the pool. */
+    Mp_FreeChurnItem(live[n_live - 1]);
+    --n_live;
+
+    double start = (double)clock();
+
+    for(r = 0; r < n_rounds; ++r)
+    {
+	/* Free something in the lower half; the pool's free pointer
+	 * drops back to its page. */
+	i = Lcg_Next(&rng) % (n_live / 2);
+	Mp_FreeChurnItem(live[i]);
+
+	/* This refills the slot just freed ... */
+	live[i] = Mp_NewChurnItem();
+
+	/* ... and this one has to go find the free slot at the end. */
+	live[n_live] = Mp_NewChurnItem();
+	Mp_FreeChurnItem(live[n_live]);
+    }
+
+    double elapsed = ((double)clock() - start) / CLOCKS_PER_SEC;
+
+    for(i = 0; i < n_live; ++i)
+	Mp_FreeChurnItem(live[i]);
+
+    free(live);
+
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n_rounds = 200000;
+    size_t sizes[] = {1000, 10000, 100000, 1000000};
+    size_t k;
+
+    if(argc > 1)
+	n_rounds = (size_t)atol(argv[1]);
+
+    printf("\nMemory pool churn, %lu rounds of free + 2 allocations.\n\n", (unsigned long)n_rounds);
+    printf("%-12s %-12s %-12s\n", "Live items", "Seconds", "ns / round");
+
+    for(k = 0; k < sizeof(sizes) / sizeof(size_t); ++k)
+    {
+	double t = churn(sizes[k], n_rounds, (uint32_t)k);
+	printf("%-12lu %-12.4f %-12.1f\n", (unsigned long)sizes[k], t, 1e9 * t / n_rounds);
+    }
+
+    printf("\n");
+
+    return 0;
+}
@@ -112,6 +112,36 @@ static inline int getFirstBitOff(bitfield bf)
     return getFirstBitOn(~bf);
 }
 
+static inline int getLastBitOn(bitfield bf)
+{
+    assert(bf != 0);
+
+#ifdef HAVE__builtin_clzl
+    return bitsizeof(bitfield) - 1 - __builtin_clzl(bf);
+#else
+    int c = 0;
+
+    while(bf >>= 1)
+	++c;
+
+    return c;
+#endif
+}
+
+static inline int bitCount(bitfield bf)
+{
+#ifdef HAVE__builtin_clzl
+    return __builtin_popcountl(bf);
+#else
+    int c;
+
+    for(c = 0; bf != 0; ++c)
+	bf &= bf - 1;
+
+    return c;
+#endif
+}
+
 static inline int bitwise_log2(unsigned long bf)
 {
 
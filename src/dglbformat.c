@@ -0,0 +1,492 @@
+/* The dglb format: a binary form of a dglf file that loads without
+ * any text parsing or name hashing.  The layout is
+ *
+ *   header             DglbHeader
+ *   edge keys          n_edge_keys HashKeys
+ *   node keys          n_node_keys HashKeys
+ *   graph offsets      n_graphs + 1 uint64_t's from the start of the
+ *                      file; the last one is the end of the records
+ *   graph records
+ *
+ * A graph record is a run of lines, each as
+ *
+ *   2*<edge index> + <1 if the line starts a pair>
+ *   <node 0 index> <node 1 index> <n changes>
+ *   [<zigzag delta of the marker from the previous one> <node index>]*
+ *
+ * all as unsigned LEB128 varints, with the first marker delta taken
+ * from 1.  Keys are stored as the hash keys themselves, so a file is
+ * only readable by builds using the same key width (and byte order),
+ * both of which the header records.  The graph offsets let graphs be
+ * built on several threads without scanning the records first. */
+
+#include <stdint.h>
+
+#define DGLB_MAGIC        "DGLB"
+#define DGLB_VERSION      1
+#define DGLB_BYTE_ORDER   0x01020304u
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t key_size;
+    uint64_t n_graphs;
+    uint64_t n_edge_keys;
+    uint64_t n_node_keys;
+    uint64_t n_line_pairs;
+    uint64_t reserved[2];
+} DglbHeader;
+
+/* What the graph builder needs besides the records; graph i runs
+ * from starts[i] to starts[i+1]. */
+typedef struct {
+    const HashKey *edge_keys, *node_keys;
+    uint64_t n_edge_keys, n_node_keys;
+    const char **starts;
+} DglbSource;
+
+/* True if the buffer starts like a dglb file. */
+static inline bool Dglb_IsBinary(const char *data, size_t size)
+{
+    return size >= 4 && memcmp(data, DGLB_MAGIC, 4) == 0;
+}
+
+/* True if the input behind c starts like a dglb file; a stream is
+ * first refilled if nothing has been read from it yet. */
+static inline bool Dglb_CursorIsBinary(DglfCursor *c)
+{
+    if(c->pos == c->end && c->stream != NULL)
+	Dglf_StreamRefill(c);
+
+    return Dglb_IsBinary(c->pos, (size_t)(c->end - c->pos));
+}
+
+/************************************************************
+ * Varints.
+ ************************************************************/
+
+static inline bool _Dglb_ReadVarint(DglfCursor *c, uint64_t *x)
+{
+    uint64_t v = 0;
+    unsigned shift = 0;
+
+    while(likely(c->pos != c->end && shift < 64))
+    {
+	uint8_t b = (uint8_t)*(c->pos++);
+
+	v |= ((uint64_t)(b & 0x7f)) << shift;
+
+	if(!(b & 0x80))
+	{
+	    *x = v;
+	    return true;
+	}
+
+	shift += 7;
+    }
+
+    return false;
+}
+
+static inline uint64_t _Dglb_ZigZag(long x)
+{
+    return (((uint64_t)x) << 1) ^ (uint64_t)(-(int64_t)(x < 0));
+}
+
+static inline long _Dglb_UnZigZag(uint64_t x)
+{
+    return (long)(x >> 1) ^ -(long)(x & 1);
+}
+
+typedef struct {
+    uint8_t *data;
+    size_t size, capacity;
+} _DglbBuffer;
+
+static inline void _Dglb_WriteVarint(_DglbBuffer *b, uint64_t x)
+{
+    if(unlikely(b->size + 10 > b->capacity))
+    {
+	b->capacity = max(2*b->capacity, (size_t)4096);
+	b->data = (uint8_t*)realloc(b->data, b->capacity);
+	CHECK_MALLOC(b->data);
+    }
+
+    while(x >= 0x80)
+    {
+	b->data[b->size++] = (uint8_t)(x | 0x80);
+	x >>= 7;
+    }
+
+    b->data[b->size++] = (uint8_t)x;
+}
+
+/************************************************************
+ * Converting from dglf.
+ ************************************************************/
+
+/* Maps keys to their positions in a key table. */
+typedef struct {
+    HashKey *keys;
+    size_t *slots;
+    size_t size, count, capacity;
+} _DglbKeyTable;
+
+static void _Dglb_KeyTableGrow(_DglbKeyTable *kt)
+{
+    size_t i;
+
+    kt->size = (kt->size == 0) ? 1024 : 2*kt->size;
+
+    free(kt->slots);
+    kt->slots = (size_t*)malloc(kt->size*sizeof(size_t));
+    CHECK_MALLOC(kt->slots);
+
+    /* Slots hold the index plus one; zero is empty. */
+    memset(kt->slots, 0, kt->size*sizeof(size_t));
+
+    for(i = 0; i < kt->count; ++i)
+    {
+	size_t j = (size_t)kt->keys[i].hk64[0] & (kt->size - 1);
+
+	while(kt->slots[j] != 0)
+	    j = (j + 1) & (kt->size - 1);
+
+	kt->slots[j] = i + 1;
+    }
+}
+
+static size_t _Dglb_KeyIndex(_DglbKeyTable *kt, const HashKey *key)
+{
+    if(unlikely(2*(kt->count + 1) > kt->size))
+	_Dglb_KeyTableGrow(kt);
+
+    size_t mask = kt->size - 1;
+    size_t j = (size_t)key->hk64[0] & mask;
+
+    for(; kt->slots[j] != 0; j = (j + 1) & mask)
+    {
+	if(Hk_EQUAL(&kt->keys[kt->slots[j] - 1], key))
+	    return kt->slots[j] - 1;
+    }
+
+    if(unlikely(kt->count == kt->capacity))
+    {
+	kt->capacity = max(2*kt->capacity, (size_t)1024);
+	kt->keys = (HashKey*)realloc(kt->keys, kt->capacity*sizeof(HashKey));
+	CHECK_MALLOC(kt->keys);
+    }
+
+    kt->keys[kt->count] = *key;
+    kt->slots[j] = ++kt->count;
+
+    return kt->count - 1;
+}
+
+typedef struct {
+    _DglbKeyTable edges, nodes;
+    _DglbBuffer records;
+    long *changes;
+    size_t changes_capacity;
+} _DglbWriter;
+
+static inline size_t _Dglb_NodeIndex(_DglbWriter *w, long number)
+{
+    HashKey key = Hk_FromInt(number);
+    return _Dglb_KeyIndex(&w->nodes, &key);
+}
+
+/* Reads one line's connections, as _Dglf_ReadConnections does, and
+ * writes it out as a record line. */
+static void _Dglb_ConvertLine(DglfCursor *c, _DglbWriter *w, uint64_t edge_code,
+			      long ibd0, long ibd1, long changes)
+{
+    long k, n, prev = 1;
+
+    for(n = 0; n < changes; ++n)
+    {
+	if(unlikely(2*(size_t)n + 2 > w->changes_capacity))
+	{
+	    w->changes_capacity = max(2*w->changes_capacity, (size_t)64);
+	    w->changes = (long*)realloc(w->changes, w->changes_capacity*sizeof(long));
+	    CHECK_MALLOC(w->changes);
+	}
+
+	if(unlikely(!(Dglf_NextLong(c, &w->changes[2*n]) && Dglf_NextLong(c, &w->changes[2*n+1]))))
+	    break;
+    }
+
+    _Dglb_WriteVarint(&w->records, edge_code);
+    _Dglb_WriteVarint(&w->records, _Dglb_NodeIndex(w, ibd0));
+    _Dglb_WriteVarint(&w->records, _Dglb_NodeIndex(w, ibd1));
+    _Dglb_WriteVarint(&w->records, (uint64_t)n);
+
+    for(k = 0; k < n; ++k)
+    {
+	_Dglb_WriteVarint(&w->records, _Dglb_ZigZag(w->changes[2*k] - prev));
+	_Dglb_WriteVarint(&w->records, _Dglb_NodeIndex(w, w->changes[2*k+1]));
+	prev = w->changes[2*k];
+    }
+}
+
+/* Converts the dglf text in c to a dglb file.  Graphs are split
+ * exactly as Dglf_BuildGraphs splits them.  Returns false if the
+ * output can't be written. */
+static bool Dglb_Convert(DglfCursor *c, const char *out_filename)
+{
+    _DglbWriter w;
+    DglbHeader h;
+    const char *name, *name2;
+    size_t name_len, name2_len, k;
+    long ibd0, ibd1, changes, g, n_graphs = 1;
+    uint64_t pairs = 0;
+
+    /* The graph each edge was last seen in, by edge index. */
+    long *last_graph = NULL;
+    size_t last_graph_size = 0;
+
+    /* Where each graph's lines start in the records. */
+    size_t *graph_starts = (size_t*)malloc(256*sizeof(size_t));
+    size_t graph_starts_capacity = 256;
+
+    CHECK_MALLOC(graph_starts);
+    memset(&w, 0, sizeof(w));
+
+    graph_starts[0] = 0;
+
+    while(Dglf_NextToken(c, &name, &name_len))
+    {
+	HashKey key = Dglf_KeyFromName(name, name_len);
+
+	name = Dglf_Hold(c, name, name_len);
+
+	if(!_Dglf_ReadLineHead(c, &ibd0, &ibd1, &changes))
+	    break;
+
+	++pairs;
+
+	size_t e = _Dglb_KeyIndex(&w.edges, &key);
+
+	if(unlikely(e >= last_graph_size))
+	{
+	    size_t old_size = last_graph_size;
+	    last_graph_size = max(2*last_graph_size, (size_t)1024);
+	    last_graph = (long*)realloc(last_graph, last_graph_size*sizeof(long));
+	    CHECK_MALLOC(last_graph);
+
+	    for(k = old_size; k < last_graph_size; ++k)
+		last_graph[k] = 0;
+	}
+
+	/* An edge already in this graph starts the next one. */
+	if(last_graph[e] == n_graphs)
+	{
+	    if(unlikely((size_t)n_graphs + 1 >= graph_starts_capacity))
+	    {
+		graph_starts_capacity *= 2;
+		graph_starts = (size_t*)realloc(graph_starts, graph_starts_capacity*sizeof(size_t));
+		CHECK_MALLOC(graph_starts);
+	    }
+
+	    graph_starts[n_graphs++] = w.records.size;
+	}
+
+	last_graph[e] = n_graphs;
+
+	_Dglb_ConvertLine(c, &w, 2*(uint64_t)e + 1, ibd0, ibd1, changes);
+
+	if(Dglf_NextToken(c, &name2, &name2_len)
+	   && name2_len == name_len && memcmp(name, name2, name_len) == 0
+	   && _Dglf_ReadLineHead(c, &ibd0, &ibd1, &changes))
+	{
+	    _Dglb_ConvertLine(c, &w, 2*(uint64_t)e, ibd0, ibd1, changes);
+	    continue;
+	}
+
+	printf("  ERROR: Parsing error.");
+	Dglf_SkipLine(c);
+    }
+
+    graph_starts[n_graphs] = w.records.size;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DGLB_MAGIC, 4);
+    h.version = DGLB_VERSION;
+    h.byte_order = DGLB_BYTE_ORDER;
+    h.key_size = sizeof(HashKey);
+    h.n_graphs = (uint64_t)n_graphs;
+    h.n_edge_keys = w.edges.count;
+    h.n_node_keys = w.nodes.count;
+    h.n_line_pairs = pairs;
+
+    size_t base = sizeof(DglbHeader) + (w.edges.count + w.nodes.count)*sizeof(HashKey)
+	+ ((size_t)n_graphs + 1)*sizeof(uint64_t);
+
+    FILE *f = fopen(out_filename, "wb");
+    bool okay = (f != NULL);
+
+    if(okay)
+    {
+	okay = (fwrite(&h, sizeof(h), 1, f) == 1)
+	    && fwrite(w.edges.keys, sizeof(HashKey), w.edges.count, f) == w.edges.count
+	    && fwrite(w.nodes.keys, sizeof(HashKey), w.nodes.count, f) == w.nodes.count;
+
+	for(g = 0; okay && g <= n_graphs; ++g)
+	{
+	    uint64_t offset = base + graph_starts[g];
+	    okay = (fwrite(&offset, sizeof(offset), 1, f) == 1);
+	}
+
+	okay = okay && fwrite(w.records.data, 1, w.records.size, f) == w.records.size;
+	okay = (fclose(f) == 0) && okay;
+    }
+
+    free(w.edges.keys);
+    free(w.edges.slots);
+    free(w.nodes.keys);
+    free(w.nodes.slots);
+    free(w.records.data);
+    free(w.changes);
+    free(last_graph);
+    free(graph_starts);
+
+    return okay;
+}
+
+/************************************************************
+ * Loading.
+ ************************************************************/
+
+/* Builds the graphs whose records are in c, as Dglf_BuildGraphs does
+ * for the text.  Returns the number of line pairs read. */
+static long Dglb_BuildGraphs(DglfCursor *c, DglfSink *sink, long first_id,
+			     long end_id, long *n_graphs, const void *source)
+{
+    const DglbSource *src = (const DglbSource*)source;
+    long lines = 0, id = first_id;
+    uint64_t code, ibd0, ibd1, changes, delta, node, k;
+
+    /* Empty graphs take up no room, so the graphs are counted off by
+     * id rather than by how far into c they reach. */
+    while(id < end_id)
+    {
+	IBDGraph *g = NewIBDGraph(id);
+	DglfCursor gc = {c->pos, src->starts[id++]};
+
+	while(gc.pos != gc.end)
+	{
+	    if(unlikely(!(_Dglb_ReadVarint(&gc, &code) && _Dglb_ReadVarint(&gc, &ibd0)
+			  && _Dglb_ReadVarint(&gc, &ibd1) && _Dglb_ReadVarint(&gc, &changes)
+			  && (code >> 1) < src->n_edge_keys
+			  && ibd0 < src->n_node_keys && ibd1 < src->n_node_keys)))
+		goto corrupt;
+
+	    lines += (long)(code & 1);
+
+	    IBDGraphEdge *e = IBDGraphEdgeByHashKey(g, src->edge_keys[code >> 1]);
+	    long cur_range_min = 1;
+
+	    IBDGraph_Connect(g, e, IBDGraphNodeByHashKey(g, src->node_keys[ibd0]), 0, 1);
+
+	    IBDGraphNode *cur_node = IBDGraphNodeByHashKey(g, src->node_keys[ibd1]);
+
+	    for(k = 0; k < changes; ++k)
+	    {
+		if(unlikely(!(_Dglb_ReadVarint(&gc, &delta) && _Dglb_ReadVarint(&gc, &node)
+			      && node < src->n_node_keys)))
+		    goto corrupt;
+
+		long change_pos = cur_range_min + _Dglb_UnZigZag(delta);
+
+		IBDGraph_Connect(g, e, cur_node, cur_range_min, change_pos);
+		cur_range_min = change_pos;
+		cur_node = IBDGraphNodeByHashKey(g, src->node_keys[node]);
+	    }
+
+	    IBDGraph_Connect(g, e, cur_node, cur_range_min, Mr_Plus_Infinity());
+	    continue;
+
+	corrupt:
+	    fprintf(stderr, "  ERROR: Corrupt record in graph %ld.\n", id - 1);
+	    break;
+	}
+
+	Dglf_Emit(sink, g);
+	c->pos = gc.end;
+    }
+
+    *n_graphs = id - first_id;
+
+    return lines;
+}
+
+/* Builds the graphs in the dglb file in df, handing them to sink.
+ * Returns the number of line pairs read, or -1 if the file isn't
+ * usable; *n_graphs is set to the number of graphs. */
+static long Dglb_LoadGraphs(const DglfFile *df, DglfSink *sink, long *n_graphs)
+{
+    DglbHeader h;
+    DglbSource src;
+    uint64_t i;
+
+    if(df->size < sizeof(h))
+	return -1;
+
+    memcpy(&h, df->data, sizeof(h));
+
+    if(memcmp(h.magic, DGLB_MAGIC, 4) != 0 || h.version != DGLB_VERSION
+       || h.byte_order != DGLB_BYTE_ORDER || h.key_size != sizeof(HashKey))
+	return -1;
+
+    uint64_t keys_end = sizeof(h) + (h.n_edge_keys + h.n_node_keys)*sizeof(HashKey);
+    uint64_t offsets_end = keys_end + (h.n_graphs + 1)*sizeof(uint64_t);
+
+    /* Every file holds at least one graph, if only an empty one. */
+    if(h.n_graphs == 0 || h.n_graphs >= df->size
+       || h.n_edge_keys > df->size || h.n_node_keys > df->size || offsets_end > df->size)
+	return -1;
+
+    const char **starts = (const char**)malloc((h.n_graphs + 1)*sizeof(const char*));
+    uint64_t offset, prev = offsets_end;
+
+    CHECK_MALLOC(starts);
+
+    src.edge_keys = (const HashKey*)(df->data + sizeof(h));
+    src.node_keys = src.edge_keys + h.n_edge_keys;
+    src.n_edge_keys = h.n_edge_keys;
+    src.n_node_keys = h.n_node_keys;
+    src.starts = starts;
+
+    /* The offsets have to run forward and stay inside the file. */
+    for(i = 0; i <= h.n_graphs; ++i)
+    {
+	memcpy(&offset, df->data + keys_end + i*sizeof(uint64_t), sizeof(offset));
+
+	if(offset < prev || offset > df->size)
+	{
+	    free(starts);
+	    return -1;
+	}
+
+	starts[i] = df->data + offset;
+	prev = offset;
+    }
+
+    long lines;
+
+#ifdef DGLF_PARALLEL
+    if(IBD_NumThreads() > 1 && h.n_graphs >= 2)
+	lines = Dglf_BuildInParallel(starts, h.n_graphs, Dglb_BuildGraphs, &src,
+				     sink, n_graphs);
+    else
+#endif
+    {
+	DglfCursor c = {starts[0], starts[h.n_graphs]};
+	lines = Dglb_BuildGraphs(&c, sink, 1, (long)h.n_graphs + 1, n_graphs, &src);
+    }
+
+    free(starts);
+
+    return lines;
+}
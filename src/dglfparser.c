@@ -0,0 +1,1338 @@
+/* Parsing of dglf graph files for the ibd_compare program.  The file
+ * is memory mapped (or read whole where mmap isn't available) and
+ * tokenized in place; edge names are hashed straight from the mapped
+ * bytes, and integers are parsed without going through stdio.
+ *
+ * A dglf file is a sequence of paired lines,
+
+     <edge name> <node 0> <node 1> <n changes> [<marker> <node>]*
+
+ * the two lines of a pair sharing the same edge name.  A new graph
+ * starts whenever an edge name repeats within the current graph.
+ *
+ * Built with ENABLE_BIASED_REFCOUNT, the graphs are built on several
+ * threads: a quick pass over the file finds where each graph starts,
+ * and runs of whole graphs are handed out to worker threads, as many
+ * as IBD_NumThreads() gives.
+ *
+ * Input compressed with gzip or zstd (where the libraries were found
+ * at build time) is decompressed on a separate thread into a ring of
+ * buffers that the parser works through as they fill. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Threads share interned MarkerInfo instances, so their counts have
+ * to be safe to change from any thread. */
+#ifdef ENABLE_BIASED_REFCOUNT
+#include <pthread.h>
+#define DGLF_PARALLEL
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+#include <pthread.h>
+#define DGLF_COMPRESSED_INPUT
+#endif
+
+/* Names are hashed in pieces of this many characters. */
+#define DGLF_NAME_CHUNK_SIZE 64
+
+/* Input that can't be mapped is read starting with a buffer of this
+ * size, doubled as needed. */
+#define DGLF_READ_CHUNK_SIZE (1 << 16)
+
+struct DglfStream;
+
+/* The text left to parse.  A cursor over a stream is refilled from it
+ * whenever it runs out; otherwise stream is NULL. */
+typedef struct {
+    const char *pos, *end;
+    struct DglfStream *stream;
+} DglfCursor;
+
+static bool Dglf_StreamRefill(DglfCursor *c);
+
+typedef struct {
+    const char *data;
+    size_t size;
+    bool mapped;
+} DglfFile;
+
+/************************************************************
+ * Opening and closing the input.
+ ************************************************************/
+
+static bool Dglf_Open(DglfFile *df, const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+
+    df->data = NULL;
+    df->size = 0;
+    df->mapped = false;
+
+    if(fd < 0)
+	return false;
+
+    if(fstat(fd, &st) != 0)
+    {
+	close(fd);
+	return false;
+    }
+
+    /* Pipes and the like report no size; only a regular file's size
+     * can be trusted. */
+    size_t capacity = S_ISREG(st.st_mode) ? (size_t)st.st_size : 0;
+
+#ifdef HAVE_SYS_MMAN_H
+    void *p = (capacity != 0)
+	? mmap(NULL, capacity, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+
+    if(p != MAP_FAILED)
+    {
+	df->size = capacity;
+#ifdef MADV_SEQUENTIAL
+	madvise(p, df->size, MADV_SEQUENTIAL);
+#endif
+	df->data = (const char*)p;
+	df->mapped = true;
+	close(fd);
+	return true;
+    }
+#endif
+
+    /* Not mappable (e.g. a pipe); read the whole thing, growing the
+     * buffer until the end is reached. */
+    capacity = max(capacity + 1, DGLF_READ_CHUNK_SIZE);
+
+    char *buf = (char*)malloc(capacity);
+    size_t n = 0;
+
+    CHECK_MALLOC(buf);
+
+    while(true)
+    {
+	if(n == capacity)
+	{
+	    capacity *= 2;
+	    buf = (char*)realloc(buf, capacity);
+	    CHECK_MALLOC(buf);
+	}
+
+	ssize_t r = read(fd, buf + n, capacity - n);
+
+	if(r < 0 && errno == EINTR)
+	    continue;
+
+	if(r <= 0)
+	    break;
+
+	n += (size_t)r;
+    }
+
+    close(fd);
+
+    df->data = buf;
+    df->size = n;
+
+    return true;
+}
+
+static void Dglf_Close(DglfFile *df)
+{
+    if(df->data == NULL)
+	return;
+
+#ifdef HAVE_SYS_MMAN_H
+    if(df->mapped)
+    {
+	munmap((void*)df->data, df->size);
+	df->data = NULL;
+	return;
+    }
+#endif
+
+    free((void*)df->data);
+    df->data = NULL;
+}
+
+/************************************************************
+ * Compressed input.
+ ************************************************************/
+
+/* Ring buffers between the decompressing thread and the parser. */
+#define DGLF_STREAM_SLOTS      4
+#define DGLF_STREAM_SLOT_SIZE  (1 << 20)
+
+/* The most compressed input zlib is given at once. */
+#define DGLF_GZ_INPUT_PIECE    UINT_MAX
+
+typedef enum {
+    DGLF_UNCOMPRESSED = 0,
+    DGLF_GZIP,
+    DGLF_ZSTD
+} DglfCompression;
+
+/* Recognizes compressed input by its magic number. */
+static DglfCompression Dglf_Compression(const DglfFile *df)
+{
+    const unsigned char *d = (const unsigned char*)df->data;
+
+    if(df->size >= 2 && d[0] == 0x1f && d[1] == 0x8b)
+	return DGLF_GZIP;
+
+    if(df->size >= 4 && d[0] == 0x28 && d[1] == 0xb5 && d[2] == 0x2f && d[3] == 0xfd)
+	return DGLF_ZSTD;
+
+    return DGLF_UNCOMPRESSED;
+}
+
+#ifdef DGLF_COMPRESSED_INPUT
+
+typedef struct {
+    char *data;
+    size_t size, capacity;
+} _DglfSlot;
+
+typedef struct DglfStream {
+    /* Filled slots are those from tail up to head, modulo the ring
+     * size; the consumer holds the one at tail while parsing it. */
+    _DglfSlot slots[DGLF_STREAM_SLOTS];
+    size_t head, tail;
+    bool holding, done, failed, cancelled;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    pthread_t thread;
+
+    /* The compressed input. */
+    const DglfFile *df;
+    DglfCompression compression;
+
+#ifdef HAVE_ZLIB
+    z_stream zs;
+    bool gz_member_done;
+
+    /* zlib counts its input in 32 bits, so it's given the input a
+     * piece at a time; this much is left after the current piece. */
+    size_t gz_in_left;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *zd;
+    ZSTD_inBuffer zin;
+    bool zstd_frame_done;
+#endif
+
+    /* The producer's partial last line, and the consumer's copy of
+     * names it has to keep past the end of a slot. */
+    char *carry, *held;
+    size_t carry_size, carry_capacity, held_capacity;
+} DglfStream;
+
+#ifdef HAVE_ZLIB
+/* Hands zlib the next piece of the input once it has used up the
+ * last one. */
+static inline void _Dglf_GzRefill(DglfStream *s)
+{
+    if(s->zs.avail_in != 0 || s->gz_in_left == 0)
+	return;
+
+    uInt n = (uInt)min(s->gz_in_left, (size_t)DGLF_GZ_INPUT_PIECE);
+
+    s->zs.avail_in = n;
+    s->gz_in_left -= n;
+}
+#endif
+
+/* Decompresses the next piece of input into out; returns the number
+ * of bytes written, 0 at the end of the input, or -1 if the input is
+ * corrupt or cut short. */
+static long _Dglf_Decompress(DglfStream *s, char *out, size_t avail)
+{
+#ifdef HAVE_ZLIB
+    if(s->compression == DGLF_GZIP)
+    {
+	uInt n = (uInt)min(avail, (size_t)UINT_MAX);
+
+	s->zs.next_out = (Bytef*)out;
+	s->zs.avail_out = n;
+
+	while(s->zs.avail_out == n)
+	{
+	    _Dglf_GzRefill(s);
+
+	    /* gzip writes concatenated members as one stream. */
+	    if(s->gz_member_done)
+	    {
+		if(s->zs.avail_in == 0)
+		    return 0;
+
+		if(inflateReset(&s->zs) != Z_OK)
+		    return -1;
+
+		s->gz_member_done = false;
+	    }
+
+	    int ret = inflate(&s->zs, Z_NO_FLUSH);
+
+	    if(ret == Z_STREAM_END)
+		s->gz_member_done = true;
+	    else if(ret != Z_OK)
+		return -1;
+	}
+
+	return (long)(n - s->zs.avail_out);
+    }
+#endif
+
+#ifdef HAVE_ZSTD
+    if(s->compression == DGLF_ZSTD)
+    {
+	ZSTD_outBuffer zout = {out, avail, 0};
+
+	while(zout.pos == 0)
+	{
+	    if(s->zin.pos == s->zin.size && s->zstd_frame_done)
+		return 0;
+
+	    size_t ret = ZSTD_decompressStream(s->zd, &zout, &s->zin);
+
+	    if(ZSTD_isError(ret))
+		return -1;
+
+	    s->zstd_frame_done = (ret == 0);
+
+	    /* Wants more input than there is. */
+	    if(zout.pos == 0 && s->zin.pos == s->zin.size && ret != 0)
+		return -1;
+	}
+
+	return (long)zout.pos;
+    }
+#endif
+
+    (void)out;
+    (void)avail;
+    return -1;
+}
+
+/* Fills slots with whole lines until the input runs out. */
+static void* _Dglf_StreamProducer(void *arg)
+{
+    DglfStream *s = (DglfStream*)arg;
+    bool eof = false;
+
+    while(!eof)
+    {
+	pthread_mutex_lock(&s->lock);
+
+	while(s->head - s->tail == DGLF_STREAM_SLOTS && !s->cancelled)
+	    pthread_cond_wait(&s->not_full, &s->lock);
+
+	bool cancelled = s->cancelled;
+
+	pthread_mutex_unlock(&s->lock);
+
+	if(cancelled)
+	    break;
+
+	/* Not visible to the consumer until head moves past it. */
+	_DglfSlot *sl = &s->slots[s->head % DGLF_STREAM_SLOTS];
+
+	if(sl->capacity < 2*s->carry_size)
+	{
+	    sl->capacity = 2*s->carry_size;
+	    sl->data = (char*)realloc(sl->data, sl->capacity);
+	    CHECK_MALLOC(sl->data);
+	}
+
+	memcpy(sl->data, s->carry, s->carry_size);
+	sl->size = s->carry_size;
+	s->carry_size = 0;
+
+	while(true)
+	{
+	    /* A line longer than the slot makes the slot bigger. */
+	    if(sl->size == sl->capacity)
+	    {
+		if(memchr(sl->data, '\n', sl->size) != NULL)
+		    break;
+
+		sl->capacity *= 2;
+		sl->data = (char*)realloc(sl->data, sl->capacity);
+		CHECK_MALLOC(sl->data);
+	    }
+
+	    long n = _Dglf_Decompress(s, sl->data + sl->size, sl->capacity - sl->size);
+
+	    if(n <= 0)
+	    {
+		s->failed = (n < 0);
+		eof = true;
+		break;
+	    }
+
+	    sl->size += (size_t)n;
+	}
+
+	if(!eof)
+	{
+	    size_t keep = sl->size;
+
+	    while(sl->data[keep - 1] != '\n')
+		--keep;
+
+	    s->carry_size = sl->size - keep;
+
+	    if(s->carry_size > s->carry_capacity)
+	    {
+		s->carry_capacity = 2*s->carry_size;
+		s->carry = (char*)realloc(s->carry, s->carry_capacity);
+		CHECK_MALLOC(s->carry);
+	    }
+
+	    memcpy(s->carry, sl->data + keep, s->carry_size);
+	    sl->size = keep;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	++s->head;
+	pthread_cond_signal(&s->not_empty);
+	pthread_mutex_unlock(&s->lock);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->done = true;
+    pthread_cond_signal(&s->not_empty);
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+/* Starts decompressing df; returns NULL if this build can't read it.
+ * df must stay open until the stream is closed. */
+static DglfStream* Dglf_OpenStream(const DglfFile *df)
+{
+    DglfStream *s = (DglfStream*)calloc(1, sizeof(DglfStream));
+    size_t k;
+
+    CHECK_MALLOC(s);
+
+    s->df = df;
+    s->compression = Dglf_Compression(df);
+
+    switch(s->compression)
+    {
+#ifdef HAVE_ZLIB
+    case DGLF_GZIP:
+	/* 32 lets zlib take either a gzip or a zlib header. */
+	if(inflateInit2(&s->zs, 32 + MAX_WBITS) != Z_OK)
+	{
+	    free(s);
+	    return NULL;
+	}
+
+	s->zs.next_in = (Bytef*)df->data;
+	s->zs.avail_in = 0;
+	s->gz_in_left = df->size;
+	break;
+#endif
+
+#ifdef HAVE_ZSTD
+    case DGLF_ZSTD:
+	s->zd = ZSTD_createDCtx();
+	s->zin.src = df->data;
+	s->zin.size = df->size;
+	s->zin.pos = 0;
+	break;
+#endif
+
+    default:
+	free(s);
+	return NULL;
+    }
+
+    for(k = 0; k < DGLF_STREAM_SLOTS; ++k)
+    {
+	s->slots[k].capacity = DGLF_STREAM_SLOT_SIZE;
+	s->slots[k].data = (char*)malloc(DGLF_STREAM_SLOT_SIZE);
+	CHECK_MALLOC(s->slots[k].data);
+    }
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->not_empty, NULL);
+    pthread_cond_init(&s->not_full, NULL);
+
+    if(pthread_create(&s->thread, NULL, _Dglf_StreamProducer, s) != 0)
+    {
+	fprintf(stderr, "Unable to start the decompression thread.\n");
+	exit(1);
+    }
+
+    return s;
+}
+
+/* Stops the stream, whether or not all of it was read; returns false
+ * if the input was corrupt. */
+static bool Dglf_CloseStream(DglfStream *s)
+{
+    size_t k;
+
+    pthread_mutex_lock(&s->lock);
+    s->cancelled = true;
+    pthread_cond_signal(&s->not_full);
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_join(s->thread, NULL);
+
+    bool okay = !s->failed;
+
+#ifdef HAVE_ZLIB
+    if(s->compression == DGLF_GZIP)
+	inflateEnd(&s->zs);
+#endif
+#ifdef HAVE_ZSTD
+    if(s->compression == DGLF_ZSTD)
+	ZSTD_freeDCtx(s->zd);
+#endif
+
+    for(k = 0; k < DGLF_STREAM_SLOTS; ++k)
+	free(s->slots[k].data);
+
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->not_empty);
+    pthread_cond_destroy(&s->not_full);
+
+    free(s->carry);
+    free(s->held);
+    free(s);
+
+    return okay;
+}
+
+/* Hands the cursor the next slot, giving back the one it had. */
+static bool Dglf_StreamRefill(DglfCursor *c)
+{
+    DglfStream *s = c->stream;
+
+    pthread_mutex_lock(&s->lock);
+
+    if(s->holding)
+    {
+	++s->tail;
+	s->holding = false;
+	pthread_cond_signal(&s->not_full);
+    }
+
+    while(s->head == s->tail && !s->done)
+	pthread_cond_wait(&s->not_empty, &s->lock);
+
+    bool okay = (s->head != s->tail);
+
+    if(okay)
+    {
+	_DglfSlot *sl = &s->slots[s->tail % DGLF_STREAM_SLOTS];
+	s->holding = true;
+	c->pos = sl->data;
+	c->end = sl->data + sl->size;
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    return okay;
+}
+
+/* Returns a copy of the token at tok that stays valid once the
+ * cursor moves on to later slots; without a stream, tok itself. */
+static inline const char* Dglf_Hold(DglfCursor *c, const char *tok, size_t len)
+{
+    DglfStream *s = c->stream;
+
+    if(likely(s == NULL))
+	return tok;
+
+    if(unlikely(len > s->held_capacity))
+    {
+	s->held_capacity = max(2*len, (size_t)DGLF_NAME_CHUNK_SIZE);
+	s->held = (char*)realloc(s->held, s->held_capacity);
+	CHECK_MALLOC(s->held);
+    }
+
+    memcpy(s->held, tok, len);
+
+    return s->held;
+}
+
+#else
+
+struct DglfStream { int unused; };
+typedef struct DglfStream DglfStream;
+
+static DglfStream* Dglf_OpenStream(const DglfFile *df)
+{
+    (void)df;
+    return NULL;
+}
+
+static bool Dglf_CloseStream(DglfStream *s)
+{
+    (void)s;
+    return true;
+}
+
+static bool Dglf_StreamRefill(DglfCursor *c)
+{
+    (void)c;
+    return false;
+}
+
+static inline const char* Dglf_Hold(DglfCursor *c, const char *tok, size_t len)
+{
+    (void)c;
+    (void)len;
+    return tok;
+}
+
+#endif
+
+/* Reads the rest of the stream behind c into df, for input (like a
+ * dglb file) that has to be held whole; df is closed as usual. */
+static void Dglf_ReadStream(DglfCursor *c, DglfFile *df)
+{
+    size_t capacity = DGLF_READ_CHUNK_SIZE, n = 0;
+    char *buf = (char*)malloc(capacity);
+
+    CHECK_MALLOC(buf);
+
+    do
+    {
+	size_t len = (size_t)(c->end - c->pos);
+
+	if(len == 0)
+	    continue;
+
+	if(n + len > capacity)
+	{
+	    while(n + len > capacity)
+		capacity *= 2;
+
+	    buf = (char*)realloc(buf, capacity);
+	    CHECK_MALLOC(buf);
+	}
+
+	memcpy(buf + n, c->pos, len);
+	n += len;
+	c->pos = c->end;
+    }
+    while(c->stream != NULL && Dglf_StreamRefill(c));
+
+    df->data = buf;
+    df->size = n;
+    df->mapped = false;
+}
+
+/************************************************************
+ * Tokenizing.
+ ************************************************************/
+
+static inline bool _Dglf_IsSpace(char c)
+{
+    return (c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f');
+}
+
+/* Streams hand out whole lines at a time, so only whitespace can run
+ * from one buffer into the next; tokens never do. */
+static inline void Dglf_SkipSpace(DglfCursor *c)
+{
+    do{
+	while(c->pos != c->end && _Dglf_IsSpace(*c->pos))
+	    ++c->pos;
+    }while(unlikely(c->pos == c->end) && c->stream != NULL && Dglf_StreamRefill(c));
+}
+
+/* The first whitespace character at or after p, or end. */
+static inline const char* _Dglf_FindSpace(const char *p, const char *end)
+{
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+
+    while(p + 16 <= end)
+    {
+	/* Flags the bytes <= ' ', which include all the whitespace. */
+	__m128i x = _mm_loadu_si128((const __m128i*)p);
+	int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(x, space), x));
+
+	while(mask != 0)
+	{
+	    int i = __builtin_ctz(mask);
+
+	    if(_Dglf_IsSpace(p[i]))
+		return p + i;
+
+	    mask &= mask - 1;
+	}
+
+	p += 16;
+    }
+#endif
+
+    while(p != end && !_Dglf_IsSpace(*p))
+	++p;
+
+    return p;
+}
+
+/* The next whitespace delimited token. */
+static inline bool Dglf_NextToken(DglfCursor *c, const char **tok, size_t *len)
+{
+    Dglf_SkipSpace(c);
+
+    if(unlikely(c->pos == c->end))
+	return false;
+
+    const char *e = _Dglf_FindSpace(c->pos, c->end);
+
+    *tok = c->pos;
+    *len = (size_t)(e - c->pos);
+    c->pos = e;
+
+    return true;
+}
+
+/* Reads a decimal integer as fscanf's %ld does, saturating on
+ * overflow. */
+static inline bool Dglf_NextLong(DglfCursor *c, long *x)
+{
+    Dglf_SkipSpace(c);
+
+    const char *p = c->pos;
+    bool negative = false;
+
+    if(p != c->end && (*p == '-' || *p == '+'))
+    {
+	negative = (*p == '-');
+	++p;
+    }
+
+    if(unlikely(p == c->end || (unsigned)(*p - '0') >= 10))
+	return false;
+
+    unsigned long v = 0;
+    bool overflow = false;
+
+    do{
+	unsigned d = (unsigned)(*p - '0');
+
+	if(unlikely(v > (ULONG_MAX - d) / 10))
+	    overflow = true;
+	else
+	    v = 10*v + d;
+
+	++p;
+    }while(p != c->end && (unsigned)(*p - '0') < 10);
+
+    c->pos = p;
+
+    if(unlikely(overflow || v > (unsigned long)LONG_MAX + negative))
+	*x = negative ? LONG_MIN : LONG_MAX;
+    else
+	*x = negative ? -(long)(v - 1) - 1 : (long)v;
+
+    return true;
+}
+
+static inline void Dglf_SkipLine(DglfCursor *c)
+{
+    const char *p;
+
+    while((p = (const char*)memchr(c->pos, '\n', (size_t)(c->end - c->pos))) == NULL)
+    {
+	c->pos = c->end;
+
+	if(c->stream == NULL || !Dglf_StreamRefill(c))
+	    return;
+    }
+
+    c->pos = p + 1;
+}
+
+/************************************************************
+ * Edge names.
+ ************************************************************/
+
+/* The key for an edge name.  Names made only of digits (and shorter
+ * than a chunk) are hashed as the integer they spell, unless that is
+ * zero; everything else is hashed as text, a chunk at a time. */
+static HashKey Dglf_KeyFromName(const char *s, size_t len)
+{
+    size_t i;
+
+    if(likely(len < DGLF_NAME_CHUNK_SIZE))
+    {
+	bool is_int = true;
+	unsigned long v = 0;
+
+	for(i = 0; i < len; ++i)
+	{
+	    unsigned d = (unsigned)(s[i] - '0');
+
+	    if(d >= 10)
+	    {
+		is_int = false;
+		break;
+	    }
+
+	    v = (v > ((unsigned long)LONG_MAX - d) / 10) ? (unsigned long)LONG_MAX : 10*v + d;
+	}
+
+	if(is_int && v != 0)
+	    return Hk_FromInt((long)v);
+
+	return Hk_FromCharBuffer(s, len);
+    }
+
+    HashKey key = Hk_FromCharBuffer(s, DGLF_NAME_CHUNK_SIZE);
+
+    for(i = DGLF_NAME_CHUNK_SIZE; i < len; i += DGLF_NAME_CHUNK_SIZE)
+    {
+	HashKey piece = Hk_FromCharBuffer(s + i, min(len - i, DGLF_NAME_CHUNK_SIZE));
+	Hk_InplaceCombine(&key, &piece);
+    }
+
+    return key;
+}
+
+/************************************************************
+ * Where built graphs go.
+ ************************************************************/
+
+/* One location of a graph's hashes, kept after the graph is gone. */
+typedef struct {
+    HashKey hk;
+    long graph_id;
+    markertype start, end;
+} DglfLocation;
+
+/* Built graphs are appended to graphs if it is set.  Otherwise each
+ * one is hashed and released as soon as it is finished, and only its
+ * locations are kept: they go straight into loc_eq, or, without
+ * loc_eq, into locs to be added later. */
+typedef struct {
+    IBDGraphList *graphs;
+    IBDGraphLocationEquivalences *loc_eq;
+    DglfLocation *locs;
+    size_t n_locs, locs_size;
+} DglfSink;
+
+static inline DglfSink Dglf_ListSink(IBDGraphList *ibd_graphs)
+{
+    DglfSink sink = {ibd_graphs, NULL, NULL, 0, 0};
+    return sink;
+}
+
+static inline DglfSink Dglf_LocationSink(IBDGraphLocationEquivalences *loc_eq)
+{
+    DglfSink sink = {NULL, loc_eq, NULL, 0, 0};
+    return sink;
+}
+
+static inline void _Dglf_AddLocation(DglfSink *sink, const DglfLocation *loc)
+{
+    if(sink->loc_eq != NULL)
+    {
+	IBDLocEq_AddLocation(sink->loc_eq, &loc->hk, loc->graph_id, loc->start, loc->end);
+	return;
+    }
+
+    if(sink->n_locs == sink->locs_size)
+    {
+	sink->locs_size = max(64, 2*sink->locs_size);
+	sink->locs = (DglfLocation*)realloc(sink->locs, sink->locs_size*sizeof(DglfLocation));
+	CHECK_MALLOC(sink->locs);
+    }
+
+    sink->locs[sink->n_locs++] = *loc;
+}
+
+/* Takes over the reference to g. */
+static void Dglf_Emit(DglfSink *sink, IBDGraph *g)
+{
+    if(sink->graphs != NULL)
+    {
+	/* Nothing changes a graph once it is built. */
+	IBDGraph_Freeze(g);
+	Igl_Give(sink->graphs, g);
+	return;
+    }
+
+    if(sink->loc_eq != NULL)
+    {
+	IBDLocEq_AddGraph(sink->loc_eq, g);
+    }
+    else
+    {
+	IBDGraph_Refresh(g);
+
+	HashTableMarkerIterator* htmi = Htmi_New(g->graph_hashes);
+	HashValidityItem hvi;
+	DglfLocation loc;
+
+	loc.graph_id = g->id;
+
+	while(Htmi_NEXT(&hvi, htmi))
+	{
+	    loc.hk = hvi.hk;
+	    loc.start = hvi.start;
+	    loc.end = hvi.end;
+	    _Dglf_AddLocation(sink, &loc);
+	}
+
+	Htmi_Finish(htmi);
+    }
+
+    O_DECREF(g);
+}
+
+/************************************************************
+ * Building the graphs.
+ ************************************************************/
+
+/* The three fields after the edge name. */
+static inline bool _Dglf_ReadLineHead(DglfCursor *c, long *ibd0, long *ibd1, long *changes)
+{
+    return Dglf_NextLong(c, ibd0) && Dglf_NextLong(c, ibd1) && Dglf_NextLong(c, changes);
+}
+
+/* Reads the changes on one line into edge e, given the fields read
+ * by _Dglf_ReadLineHead. */
+static void _Dglf_ReadConnections(DglfCursor *c, IBDGraph *g, IBDGraphEdge *e, 
+				  long ibd0, long ibd1, long changes)
+{
+    long k, change_pos, ibd;
+    markertype cur_range_min = 0;
+
+    IBDGraph_Connect(g, e, IBDGraphNodeByNumber(g, ibd0), cur_range_min, 1);
+    cur_range_min = 1;
+
+    IBDGraphNode *cur_node = IBDGraphNodeByNumber(g, ibd1);
+
+    for(k = 0; k < changes; ++k)
+    {
+	if(unlikely(!(Dglf_NextLong(c, &change_pos) && Dglf_NextLong(c, &ibd))))
+	    break;
+
+	IBDGraph_Connect(g, e, cur_node, cur_range_min, change_pos);
+	cur_range_min = change_pos;
+	cur_node = IBDGraphNodeByNumber(g, ibd);
+    }
+
+    IBDGraph_Connect(g, e, cur_node, cur_range_min, Mr_Plus_Infinity());
+}
+
+/* Builds graphs from the paired lines in c, numbering them from
+ * first_id, and hands them to sink.  Returns the number of line pairs
+ * read; *n_graphs is set to the number of graphs. */
+static long Dglf_BuildGraphs(DglfCursor *c, DglfSink *sink, long first_id, long *n_graphs)
+{
+    long lines = 0, id = first_id;
+    long ibd0, ibd1, changes;
+    const char *name, *name2;
+    size_t name_len, name2_len;
+
+    IBDGraph *g = NewIBDGraph(id);
+
+    while(Dglf_NextToken(c, &name, &name_len))
+    {
+	HashKey key = Dglf_KeyFromName(name, name_len);
+
+	name = Dglf_Hold(c, name, name_len);
+
+	if(!_Dglf_ReadLineHead(c, &ibd0, &ibd1, &changes))
+	    break;
+
+	++lines;
+
+	/* An edge already in this graph starts the next one. */
+	if(IBDGraphContainsEdgeWithHashKey(g, key))
+	{
+	    Dglf_Emit(sink, g);
+	    g = NewIBDGraph(++id);
+	}
+
+	IBDGraphEdge *e = IBDGraphEdgeByHashKey(g, key);
+
+	_Dglf_ReadConnections(c, g, e, ibd0, ibd1, changes);
+
+	/* The paired line. */
+	if(Dglf_NextToken(c, &name2, &name2_len)
+	   && name2_len == name_len && memcmp(name, name2, name_len) == 0
+	   && _Dglf_ReadLineHead(c, &ibd0, &ibd1, &changes))
+	{
+	    _Dglf_ReadConnections(c, g, e, ibd0, ibd1, changes);
+	    continue;
+	}
+
+	printf("  ERROR: Parsing error.");
+	Dglf_SkipLine(c);
+    }
+
+    Dglf_Emit(sink, g);
+
+    *n_graphs = id - first_id + 1;
+
+    return lines;
+}
+
+/************************************************************
+ * Loading a whole file.
+ ************************************************************/
+
+#ifdef DGLF_PARALLEL
+
+/* Graphs per thread; more pieces than threads evens out the load. */
+#define DGLF_CHUNKS_PER_THREAD 8
+
+/* Builds the graphs in c, numbering them from first_id, into sink;
+ * end_id is one past the id of the last graph in c, and source is
+ * whatever else the input format needs.  Returns the number of line
+ * pairs read. */
+typedef long (*DglfBuildFunction)(DglfCursor *c, DglfSink *sink, long first_id,
+				  long end_id, long *n_graphs, const void *source);
+
+/* The edge keys of the graph being scanned.  A slot belongs to the
+ * current graph only if its generation matches, so starting the next
+ * graph is just a matter of bumping the generation. */
+typedef struct {
+    HashKey key;
+    size_t generation;
+} _DglfKeySlot;
+
+typedef struct {
+    _DglfKeySlot *slots;
+    size_t size, count, generation;
+} _DglfKeySet;
+
+static void _Dglf_KeySetGrow(_DglfKeySet *ks)
+{
+    size_t old_size = ks->size, i;
+    _DglfKeySlot *old_slots = ks->slots;
+
+    ks->size = (old_size == 0) ? 256 : 2*old_size;
+    ks->slots = (_DglfKeySlot*)calloc(ks->size, sizeof(_DglfKeySlot));
+    CHECK_MALLOC(ks->slots);
+
+    for(i = 0; i < old_size; ++i)
+    {
+	if(old_slots[i].generation == ks->generation)
+	{
+	    size_t j = (size_t)old_slots[i].key.hk64[0] & (ks->size - 1);
+
+	    while(ks->slots[j].generation == ks->generation)
+		j = (j + 1) & (ks->size - 1);
+
+	    ks->slots[j] = old_slots[i];
+	}
+    }
+
+    free(old_slots);
+}
+
+/* Adds key to the set; returns false if it was already there. */
+static bool _Dglf_KeySetAdd(_DglfKeySet *ks, const HashKey *key)
+{
+    if(unlikely(2*(ks->count + 1) > ks->size))
+	_Dglf_KeySetGrow(ks);
+
+    size_t mask = ks->size - 1;
+    size_t j = (size_t)key->hk64[0] & mask;
+
+    for(; ks->slots[j].generation == ks->generation; j = (j + 1) & mask)
+    {
+	if(Hk_EQUAL(&ks->slots[j].key, key))
+	    return false;
+    }
+
+    ks->slots[j].key = *key;
+    ks->slots[j].generation = ks->generation;
+    ++ks->count;
+
+    return true;
+}
+
+static inline void _Dglf_KeySetClear(_DglfKeySet *ks)
+{
+    ++ks->generation;
+    ks->count = 0;
+}
+
+/* Skips over the changes on one line, as _Dglf_ReadConnections reads
+ * them. */
+static inline void _Dglf_SkipConnections(DglfCursor *c, long changes)
+{
+    long k, x;
+
+    for(k = 0; k < 2*changes; ++k)
+	if(unlikely(!Dglf_NextLong(c, &x)))
+	    break;
+}
+
+/* Finds where each graph in c starts, following Dglf_BuildGraphs
+ * token for token but without building anything.  Returns the number
+ * of graphs; (*starts)[i] is where graph i starts, and an extra entry
+ * at the end is c->end. */
+static size_t Dglf_FindGraphStarts(DglfCursor c, const char ***starts)
+{
+    size_t n = 0, capacity = 1024;
+    const char **st = (const char**)malloc(capacity*sizeof(const char*));
+    const char *name, *name2;
+    size_t name_len, name2_len;
+    long ibd0, ibd1, changes;
+    _DglfKeySet ks = {NULL, 0, 0, 1};
+
+    CHECK_MALLOC(st);
+
+    st[n++] = c.pos;
+
+    while(Dglf_NextToken(&c, &name, &name_len))
+    {
+	HashKey key = Dglf_KeyFromName(name, name_len);
+
+	if(!_Dglf_ReadLineHead(&c, &ibd0, &ibd1, &changes))
+	    break;
+
+	if(!_Dglf_KeySetAdd(&ks, &key))
+	{
+	    if(unlikely(n + 1 == capacity))
+	    {
+		capacity *= 2;
+		st = (const char**)realloc(st, capacity*sizeof(const char*));
+		CHECK_MALLOC(st);
+	    }
+
+	    st[n++] = name;
+
+	    _Dglf_KeySetClear(&ks);
+	    _Dglf_KeySetAdd(&ks, &key);
+	}
+
+	_Dglf_SkipConnections(&c, changes);
+
+	if(Dglf_NextToken(&c, &name2, &name2_len)
+	   && name2_len == name_len && memcmp(name, name2, name_len) == 0
+	   && _Dglf_ReadLineHead(&c, &ibd0, &ibd1, &changes))
+	{
+	    _Dglf_SkipConnections(&c, changes);
+	    continue;
+	}
+
+	Dglf_SkipLine(&c);
+    }
+
+    free(ks.slots);
+
+    st[n] = c.end;
+    *starts = st;
+
+    return n;
+}
+
+/* A chunk holds either its graphs or, when only their locations are
+ * wanted, those locations; the graphs are then released on the thread
+ * that built them. */
+typedef struct {
+    IBDGraph **graphs;
+    DglfLocation *locs;
+    size_t n_locs;
+    long n_graphs, lines;
+} _DglfChunk;
+
+typedef struct {
+    const char **starts;
+    size_t n_graphs, n_chunks;
+    size_t next_chunk;
+    _DglfChunk *chunks;
+    DglfBuildFunction build;
+    const void *source;
+    bool keep_graphs;
+} _DglfLoad;
+
+static void* _Dglf_LoadWorker(void *arg)
+{
+    _DglfLoad *ld = (_DglfLoad*)arg;
+    size_t k;
+    long i;
+
+    while((k = __atomic_fetch_add(&ld->next_chunk, 1, __ATOMIC_RELAXED)) < ld->n_chunks)
+    {
+	size_t first = (k * ld->n_graphs) / ld->n_chunks;
+	size_t last = ((k + 1) * ld->n_graphs) / ld->n_chunks;
+
+	DglfCursor c = {ld->starts[first], ld->starts[last]};
+	_DglfChunk *ch = &ld->chunks[k];
+
+	if(!ld->keep_graphs)
+	{
+	    DglfSink sink = Dglf_LocationSink(NULL);
+
+	    ch->lines = ld->build(&c, &sink, (long)first + 1, (long)last + 1,
+				   &ch->n_graphs, ld->source);
+	    ch->locs = sink.locs;
+	    ch->n_locs = sink.n_locs;
+	    continue;
+	}
+
+	IBDGraphList *gl = NewIBDGraphList();
+	DglfSink sink = Dglf_ListSink(gl);
+
+	ch->lines = ld->build(&c, &sink, (long)first + 1, (long)last + 1,
+				   &ch->n_graphs, ld->source);
+	ch->graphs = (IBDGraph**)malloc(ch->n_graphs*sizeof(IBDGraph*));
+	CHECK_MALLOC(ch->graphs);
+
+	/* The chunk keeps the references the list held. */
+	for(i = 0; i < ch->n_graphs; ++i)
+	{
+	    ch->graphs[i] = Igl_ViewItem(gl, (size_t)i);
+	    O_INCREF(ch->graphs[i]);
+	}
+
+	O_DECREF(gl);
+    }
+
+    O_MergeRefCounts();
+
+    return NULL;
+}
+
+/* The graphs outlive the workers that build them, so are made
+ * unbiased; nothing would merge their counts once a worker is gone. */
+static void* _Dglf_LoadThread(void *arg)
+{
+    O_BiasNewObjects(false);
+
+    return _Dglf_LoadWorker(arg);
+}
+
+/* Builds n_graphs graphs on several threads, graph i from the input
+ * between starts[i] and starts[i+1], and hands them to sink in order.
+ * Returns the total of what build returned. */
+static long Dglf_BuildInParallel(const char **starts, size_t n_graphs,
+				 DglfBuildFunction build, const void *source,
+				 DglfSink *sink, long *n_built)
+{
+    _DglfLoad ld;
+    size_t n_threads = IBD_NumThreads(), k;
+    long i, lines = 0;
+
+    ld.starts = starts;
+    ld.n_graphs = n_graphs;
+    ld.n_chunks = max(1, min(n_graphs, DGLF_CHUNKS_PER_THREAD * n_threads));
+    ld.next_chunk = 0;
+    ld.chunks = (_DglfChunk*)calloc(ld.n_chunks, sizeof(_DglfChunk));
+    ld.build = build;
+    ld.source = source;
+    ld.keep_graphs = (sink->graphs != NULL);
+    CHECK_MALLOC(ld.chunks);
+
+    n_threads = min(n_threads, ld.n_chunks);
+
+    pthread_t *threads = (pthread_t*)malloc(n_threads*sizeof(pthread_t));
+    size_t n_started = 0;
+
+    CHECK_MALLOC(threads);
+
+    /* This thread works through chunks as well, so a thread that fails
+     * to start only slows things down. */
+    for(k = 1; k < n_threads; ++k)
+	if(pthread_create(&threads[n_started], NULL, _Dglf_LoadThread, &ld) == 0)
+	    ++n_started;
+
+    _Dglf_LoadWorker(&ld);
+
+    for(k = 0; k < n_started; ++k)
+	pthread_join(threads[k], NULL);
+
+    *n_built = 0;
+
+    for(k = 0; k < ld.n_chunks; ++k)
+    {
+	_DglfChunk *ch = &ld.chunks[k];
+	size_t j;
+
+	for(i = 0; ch->graphs != NULL && i < ch->n_graphs; ++i)
+	    Dglf_Emit(sink, ch->graphs[i]);
+
+	for(j = 0; j < ch->n_locs; ++j)
+	    _Dglf_AddLocation(sink, &ch->locs[j]);
+
+	*n_built += ch->n_graphs;
+	lines += ch->lines;
+
+	free(ch->graphs);
+	free(ch->locs);
+    }
+
+    free(threads);
+    free(ld.chunks);
+
+    return lines;
+}
+
+static long _Dglf_BuildTextGraphs(DglfCursor *c, DglfSink *sink, long first_id,
+				  long end_id, long *n_graphs, const void *source)
+{
+    (void)end_id;
+    (void)source;
+    return Dglf_BuildGraphs(c, sink, first_id, n_graphs);
+}
+
+#endif
+
+/* Builds the graphs in c, handing them to sink in the order they
+ * appear.  Returns the number of line pairs read; *n_graphs is set to
+ * the number of graphs. */
+static long Dglf_LoadGraphs(DglfCursor *c, DglfSink *sink, long *n_graphs)
+{
+#ifdef DGLF_PARALLEL
+    if(IBD_NumThreads() > 1)
+    {
+	const char **starts;
+	size_t n = Dglf_FindGraphStarts(*c, &starts);
+
+	if(n >= 2)
+	{
+	    long lines = Dglf_BuildInParallel(starts, n, _Dglf_BuildTextGraphs, NULL,
+					      sink, n_graphs);
+	    c->pos = c->end;
+	    free(starts);
+	    return lines;
+	}
+
+	free(starts);
+    }
+#endif
+
+    return Dglf_BuildGraphs(c, sink, 1, n_graphs);
+}
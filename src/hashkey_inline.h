@@ -10,7 +10,65 @@
  *
  ************************************************************/
 
-#ifdef NO_UINT128 
+#if defined(HASHKEY_64BIT)
+
+/********************************************************************************
+ *
+ *   The versions where the hash keys themselves are 64 bits; the
+ *   arithmetic is done mod 2^64 - H_HASHKEY_PRIME_OFFSET.
+ *
+ ********************************************************************************/
+
+#define Hk_CLEAR(hk)					\
+    do {						\
+	(hk)->hk64[0] = 0;				\
+    }while(0)
+
+#define Hk_ISZERO(hk) ( ! ((hk)->hk64[0] ) )
+
+#define Hk_COPY(hk_dest, hk_src)			\
+    do {						\
+	assert((hk_dest) != NULL);			\
+	assert((hk_src) != NULL);			\
+	assert((hk_dest) != (hk_src));			\
+	assert((hk_src)->hk64[0] < HK_GF_PRIME);	\
+	(hk_dest)->hk64[0] = (hk_src)->hk64[0];		\
+    }while(0)
+
+#define Hk_REDUCE_UPDATE(dest_hk, hk)					\
+    do {								\
+	assert((dest_hk) != NULL);					\
+	assert((hk) != NULL);						\
+	assert((hk)->hk64[0] < HK_GF_PRIME);				\
+	assert((dest_hk)->hk64[0] < HK_GF_PRIME);			\
+	(dest_hk)->hk64[0] += (hk)->hk64[0];				\
+	(dest_hk)->hk64[0] += (((dest_hk)->hk64[0] < (hk)->hk64[0])	\
+			       ? H_HASHKEY_PRIME_OFFSET : 0);		\
+	if(unlikely((dest_hk)->hk64[0] >= HK_GF_PRIME))			\
+	    (dest_hk)->hk64[0] -= HK_GF_PRIME;				\
+	assert((dest_hk)->hk64[0] < HK_GF_PRIME);			\
+    }while(0)
+
+#define Hk_INPLACE_NEGATIVE(hk)						\
+    do {								\
+	assert((hk)->hk64[0] < HK_GF_PRIME);				\
+	(hk)->hk64[0] = likely((hk)->hk64[0]) ? (HK_GF_PRIME - (hk)->hk64[0]) : 0; \
+    }while(0)
+
+#define Hk_INPLACE_REHASH(hk)				\
+    do{							\
+	if(likely(!!((hk)->hk64[0])))			\
+	    Hk_InplaceHash(hk);				\
+    }while(0)
+
+#define Hk_EQUAL(hk1, hk2) ((hk1)->hk64[0] == (hk2)->hk64[0])
+
+#define Hk_LT(hk1, hk2)	((hk1)->hk64[0] < (hk2)->hk64[0])
+#define Hk_GT(hk1, hk2)	((hk1)->hk64[0] > (hk2)->hk64[0])
+#define Hk_LEQ(hk1, hk2)  (!Hk_GT((hk1),(hk2)))
+#define Hk_GEQ(hk1, hk2)  (!Hk_LT((hk1),(hk2)))
+
+#elif defined(NO_UINT128)
 
 /********************************************************************************
  *
@@ -258,7 +316,9 @@ static inline void Hk_INPLACE_REHASH(hk_ptr hk)
  * it's not really working for me. */
 
 /* #define Hk_EQUAL(hk1, hk2) ((hk1)->hk128 == (hk2)->hk128) */
+#ifndef HASHKEY_64BIT
 #define Hk_EQUAL(hk1, hk2) ( ((hk1)->hk64[1] == (hk2)->hk64[1]) && ((hk1)->hk64[0] == (hk2)->hk64[0]))
+#endif
 
 
 /********************************************************************************
@@ -47,6 +47,15 @@
 /* doesn't hold for any hash functions in this file. */
 
 
+/* The CityHash routines produce 128 bit values.  With 128 bit hash
+ * keys these are simply the HashKey union; with 64 bit keys, they are
+ * folded down to 64 bits when stored (see _Hk_SET_FROM_CITY below). */
+#ifdef HASHKEY_64BIT
+typedef struct { uint64_t hk64[2]; } city_uint128;
+#else
+typedef HashKey city_uint128;
+#endif
+
 #define UNALIGNED_LOAD64(p) (*(const uint64_t*)(p))
 #define UNALIGNED_LOAD32(p) (*(const uint32_t*)(p))
 
@@ -134,7 +143,7 @@ static inline uint64_t HashLen17to32(const char *s, size_t len) {
 
 // Return a 16-byte hash for 48 bytes.  Quick and dirty.
 // Callers do best to use "random-looking" values for a and b.
-static inline HashKey WeakHashLen32WithSeeds(
+static inline city_uint128 WeakHashLen32WithSeeds(
     uint64_t w, uint64_t x, uint64_t y, uint64_t z, uint64_t a, uint64_t b) {
   a += w;
   b = Rotate(b + a + z, 21);
@@ -142,14 +151,14 @@ static inline HashKey WeakHashLen32WithSeeds(
   a += x;
   a += y;
   b += Rotate(a, 44);
-  HashKey hk;
+  city_uint128 hk;
   hk.hk64[0] = a + z;
   hk.hk64[1] = b + c;
   return hk;
 }
 
 // Return a 16-byte hash for s[0] ... s[31], a, and b.  Quick and dirty.
-static inline HashKey WeakStringHashLen32WithSeeds(
+static inline city_uint128 WeakStringHashLen32WithSeeds(
     const char* s, uint64_t a, uint64_t b) {
   return WeakHashLen32WithSeeds(UNALIGNED_LOAD64(s),
                                 UNALIGNED_LOAD64(s + 8),
@@ -199,8 +208,8 @@ static inline uint64_t CityHash64(const char *s, size_t len) {
   uint64_t x = UNALIGNED_LOAD64(s);
   uint64_t y = UNALIGNED_LOAD64(s + len - 16) ^ k1;
   uint64_t z = UNALIGNED_LOAD64(s + len - 56) ^ k0;
-  HashKey v = WeakStringHashLen32WithSeeds(s + len - 64, len, y);
-  HashKey w = WeakStringHashLen32WithSeeds(s + len - 32, len * k1, k0);
+  city_uint128 v = WeakStringHashLen32WithSeeds(s + len - 64, len, y);
+  city_uint128 w = WeakStringHashLen32WithSeeds(s + len - 32, len * k1, k0);
   z += ShiftMix(v.hk64[1]) * k1;
   x = Rotate(z + x, 39) * k1;
   y = Rotate(y, 33) * k1;
@@ -235,7 +244,7 @@ static inline uint64_t CityHash64WithSeed(const char *s, size_t len, uint64_t se
 
 // A subroutine for CityHash128().  Returns a decent 128-bit hash for strings
 // of any length representable in ssize_t.  Based on City and Murmur.
-static inline HashKey CityMurmur(const char *s, size_t len, uint64_t seed0, uint64_t seed1) {
+static inline city_uint128 CityMurmur(const char *s, size_t len, uint64_t seed0, uint64_t seed1) {
   uint64_t a = seed0;
   uint64_t b = seed1;
   uint64_t c = 0;
@@ -262,19 +271,19 @@ static inline HashKey CityMurmur(const char *s, size_t len, uint64_t seed0, uint
   a = HashLen16(a, c);
   b = HashLen16(d, b);
 
-  HashKey hk;
+  city_uint128 hk;
   hk.hk64[0] = a ^ b;
   hk.hk64[1] = HashLen16(b, a);
   
   return hk;
 }
 
-static inline HashKey CityHash128WithSeed(const char *s, size_t len, uint64_t seed0, uint64_t seed1) {
+static inline city_uint128 CityHash128WithSeed(const char *s, size_t len, uint64_t seed0, uint64_t seed1) {
     if (likely(len < 128)) {
 	return CityMurmur(s, len, seed0, seed1);
   }
 
-  HashKey v, w;
+  city_uint128 v, w;
   uint64_t x = seed0;
   uint64_t y = seed1;
   uint64_t z = len * k1;
@@ -323,14 +332,15 @@ static inline HashKey CityHash128WithSeed(const char *s, size_t len, uint64_t se
   x = HashLen16(x, v.hk64[0]);
   y = HashLen16(y, w.hk64[0]);
 
-  HashKey hk;
+  city_uint128 hk;
   hk.hk64[0] = HashLen16(x + v.hk64[1], w.hk64[1]) + y;
   hk.hk64[1] = HashLen16(x + w.hk64[1], y + v.hk64[1]);
 
   return hk;
 }
 
-static HashKey CityHash128(const char *s, size_t len) {
+cpu_dispatch
+static city_uint128 CityHash128(const char *s, size_t len) {
   if (len >= 16) {
     return CityHash128WithSeed(s + 16,
                                len - 16,
@@ -378,7 +388,10 @@ void Hk_Copy(hk_ptr hk_dest, chk_ptr hk_src)
 
 static inline void check_hashkey_range(hk_ptr hk)
 {
-#ifdef NO_UINT128
+#if defined(HASHKEY_64BIT)
+    if(unlikely(hk->hk64[0] >= HK_GF_PRIME))
+	hk->hk64[0] -= k0;
+#elif defined(NO_UINT128)
     /* Ensure (pedantically) that we're less than 2^128 - 159 */
     if(unlikely(!(~hk->hk64[0])))
     {
@@ -393,6 +406,33 @@ static inline void check_hashkey_range(hk_ptr hk)
 #endif
 }
 
+/* Storing the results of the CityHash routines in a key, and the two
+ * 64 bit words of a key used to seed them.  With 64 bit keys, both
+ * words are the key itself. */
+
+#ifdef HASHKEY_64BIT
+
+#define _Hk_SET_FROM_CITY(hk, v)					\
+    do {								\
+	const city_uint128 _cv = (v);					\
+	(hk)->hk64[0] = HashLen16(_cv.hk64[0], _cv.hk64[1]);		\
+    }while(0)
+
+#define _HK_W0(hk) ((hk)->hk64[0])
+#define _HK_W1(hk) ((hk)->hk64[0])
+
+#else
+
+#define _Hk_SET_FROM_CITY(hk, v)					\
+    do {								\
+	*(hk) = (v);							\
+    }while(0)
+
+#define _HK_W0(hk) ((hk)->hk64[0])
+#define _HK_W1(hk) ((hk)->hk64[1])
+
+#endif
+
 /*******************************************************************************
  *
  *  Routines for creating hash values from other objects.
@@ -403,7 +443,7 @@ static inline void check_hashkey_range(hk_ptr hk)
  * a set paraemter. */
 void Hkf_FromCharBuffer(hk_ptr dest_key, const char *string, size_t length)
 {
-    *dest_key = CityHash128(string, length);
+    _Hk_SET_FROM_CITY(dest_key, CityHash128(string, length));
     check_hashkey_range(dest_key);
 }
 
@@ -422,7 +462,7 @@ void Hkf_FromIntBuffer(hk_ptr dest_key, const unsigned int *it, size_t length)
 static inline void _Hf_FromUInt(hk_ptr dest_key, unsigned long x, unsigned long salt)
 {
     unsigned long z[2] = {x, salt};
-    *dest_key = CityHash128((const char*)z, 2*sizeof(unsigned long));
+    _Hk_SET_FROM_CITY(dest_key, CityHash128((const char*)z, 2*sizeof(unsigned long)));
     check_hashkey_range(dest_key);
 }
 
@@ -432,33 +472,16 @@ static inline void _Hf_FromUInt(hk_ptr dest_key, unsigned long x, unsigned long
  *
  ****************************************/
 
-static HashKey* _hk_uint_lookup = NULL;
-
-static void _Hk_PopulateHKIntLookup()
-{
-    assert(_hk_uint_lookup == NULL);
-    _hk_uint_lookup = malloc(HK_UNSIGNED_INT_LOOKUP_SIZE*sizeof(HashKey));
-
-    size_t i, j;
-    
-    MTRandState* mts = Mtr_New(0);
-
-    for(i = 0; i < HK_UNSIGNED_INT_LOOKUP_SIZE; ++i)
-	for(j = 0; j < H_NUM_32BIT_COMPONENTS; ++j)
-	    _hk_uint_lookup[i].hk32[j] = Mtr_Next(mts);
-
-    Mtr_Delete(mts);
-}
+/* Defines _hk_uint_lookup, holding the keys for [0, size), and
+ * _hk_nint_lookup, holding the keys for -1, -2, ..., -size.  Both
+ * are static constant tables generated at build time, so there is
+ * no initialization at run time. */
+#include "hashkeys_int_table.h"
 
 inline void Hkf_FromUnsignedInt(hk_ptr dest_key, unsigned long x)
 {
-    if(x < HK_UNSIGNED_INT_LOOKUP_SIZE)
-    {
-	if(unlikely(_hk_uint_lookup == NULL))
-	    _Hk_PopulateHKIntLookup();
-	
+    if(likely(x < HK_UNSIGNED_INT_LOOKUP_SIZE))
 	*dest_key = _hk_uint_lookup[x];
-    }
     else
 	_Hf_FromUInt(dest_key, x, __LINE__);
 }
@@ -467,7 +490,13 @@ void Hkf_FromInt(hk_ptr dest_key, signed long x)
 {
     if(x < 0)
     {
-	_Hf_FromUInt(dest_key, (unsigned long)(-x), __LINE__);
+	/* Written this way to avoid overflow on LONG_MIN. */
+	unsigned long nx = ((unsigned long)(-(x + 1)));
+
+	if(likely(nx < HK_UNSIGNED_INT_LOOKUP_SIZE))
+	    *dest_key = _hk_nint_lookup[nx];
+	else
+	    _Hf_FromUInt(dest_key, nx + 1, __LINE__);
     }
     else
     {
@@ -478,17 +507,17 @@ void Hkf_FromInt(hk_ptr dest_key, signed long x)
 void Hkf_FromHashKey(hk_ptr dest_key, chk_ptr hk)
 {
     /* Can use the weaker, faster version since we already have strong hashes. */
-    *dest_key = WeakHashLen32WithSeeds(hk->hk64[0], hk->hk64[1], 
-				       ShiftMix(hk->hk64[0]), ShiftMix(hk->hk64[1]),
-				       k0*k1 + hk->hk64[0], k2*k3 + hk->hk64[1]);
+    _Hk_SET_FROM_CITY(dest_key, WeakHashLen32WithSeeds(_HK_W0(hk), _HK_W1(hk), 
+				       ShiftMix(_HK_W0(hk)), ShiftMix(_HK_W1(hk)),
+				       k0*k1 + _HK_W0(hk), k2*k3 + _HK_W1(hk)));
 }
 
 void Hkf_FromHashKeyAndInt(hk_ptr dest_key, chk_ptr hk, signed long x)
 {
     /* Can use the weaker, faster version since we already have strong hashes. */
-    *dest_key = WeakHashLen32WithSeeds(hk->hk64[0], hk->hk64[1], 
-				       ShiftMix(hk->hk64[0]), ShiftMix(hk->hk64[1]),
-				       k0*k1*x + hk->hk64[1], k2*k3*x + hk->hk64[1]);
+    _Hk_SET_FROM_CITY(dest_key, WeakHashLen32WithSeeds(_HK_W0(hk), _HK_W1(hk), 
+				       ShiftMix(_HK_W0(hk)), ShiftMix(_HK_W1(hk)),
+				       k0*k1*x + _HK_W1(hk), k2*k3*x + _HK_W1(hk)));
     check_hashkey_range(dest_key);
 }
 
@@ -503,20 +532,20 @@ void Hkf_FromHashKeyAndInt(hk_ptr dest_key, chk_ptr hk, signed long x)
 /* Update the value of the first depending on the value of the second. */
 void Hk_InplaceCombine(hk_ptr dest_key, chk_ptr hk)
 {
-    *dest_key = WeakHashLen32WithSeeds(dest_key->hk64[0], dest_key->hk64[1], 
-				       hk->hk64[0], hk->hk64[1],
-				       ShiftMix(dest_key->hk64[0])*ShiftMix(hk->hk64[0]), 
-				       ShiftMix(dest_key->hk64[1])*ShiftMix(hk->hk64[1]));
+    _Hk_SET_FROM_CITY(dest_key, WeakHashLen32WithSeeds(_HK_W0(dest_key), _HK_W1(dest_key), 
+				       _HK_W0(hk), _HK_W1(hk),
+				       ShiftMix(_HK_W0(dest_key))*ShiftMix(_HK_W0(hk)), 
+				       ShiftMix(_HK_W1(dest_key))*ShiftMix(_HK_W1(hk))));
     check_hashkey_range(dest_key);
 }
 
 /* Update the value of the first depending on the value of the second, along with two ints */
 void Hk_InplaceCombinePlusTwoInts(hk_ptr dest_key, chk_ptr hk, int64_t s1, int64_t s2)
 {
-    *dest_key = WeakHashLen32WithSeeds(dest_key->hk64[0], dest_key->hk64[1], 
-				       hk->hk64[0], hk->hk64[1],
-				       ShiftMix(dest_key->hk64[0])*ShiftMix(hk->hk64[0]), 
-				       ShiftMix(dest_key->hk64[1])*ShiftMix(hk->hk64[1]));
+    _Hk_SET_FROM_CITY(dest_key, WeakHashLen32WithSeeds(_HK_W0(dest_key), _HK_W1(dest_key), 
+				       _HK_W0(hk), _HK_W1(hk),
+				       ShiftMix(_HK_W0(dest_key))*ShiftMix(_HK_W0(hk)), 
+				       ShiftMix(_HK_W1(dest_key))*ShiftMix(_HK_W1(hk))));
     check_hashkey_range(dest_key);
     
     Hk_UpdateWithTwoInts(dest_key, s1*(k0^k1), s2*(k0^k1));
@@ -536,29 +565,29 @@ void Hkf_Combine(hk_ptr dest_key, chk_ptr hk1, chk_ptr hk2)
  * below, which special cases the null hash. */
 void Hk_InplaceHash(hk_ptr hk)
 {
-    *hk = WeakHashLen32WithSeeds(hk->hk64[0], hk->hk64[1], 
-				 (k2 + hk->hk64[0]) * (k3 + hk->hk64[1]), 
-				 (k1 * hk->hk64[0]) ^ (k0 * hk->hk64[1]),
-				 (k0*k2) ^ hk->hk64[0], 
-				 (k1*k3) ^ hk->hk64[1]);
+    _Hk_SET_FROM_CITY(hk, WeakHashLen32WithSeeds(_HK_W0(hk), _HK_W1(hk), 
+				 (k2 + _HK_W0(hk)) * (k3 + _HK_W1(hk)), 
+				 (k1 * _HK_W0(hk)) ^ (k0 * _HK_W1(hk)),
+				 (k0*k2) ^ _HK_W0(hk), 
+				 (k1*k3) ^ _HK_W1(hk)));
     check_hashkey_range(hk);
 }
 
 void Hk_UpdateWithInt(hk_ptr hk, int64_t v)
 {
-    *hk = WeakHashLen32WithSeeds(hk->hk64[0], hk->hk64[1], 
-				 v + ShiftMix(hk->hk64[0]), 
-				 v + ShiftMix(hk->hk64[1]),
-				 (k0*k1 ^ hk->hk64[0]) * v, (k2*k3 ^ hk->hk64[1])*v);
+    _Hk_SET_FROM_CITY(hk, WeakHashLen32WithSeeds(_HK_W0(hk), _HK_W1(hk), 
+				 v + ShiftMix(_HK_W0(hk)), 
+				 v + ShiftMix(_HK_W1(hk)),
+				 (k0*k1 ^ _HK_W0(hk)) * v, (k2*k3 ^ _HK_W1(hk))*v));
     check_hashkey_range(hk);
 }
 
 void Hk_UpdateWithTwoInts(hk_ptr hk, int64_t v, int64_t w)
 {
-    *hk = WeakHashLen32WithSeeds(hk->hk64[0], hk->hk64[1], 
-				 v + ShiftMix(hk->hk64[0]), 
-				 w + ShiftMix(hk->hk64[1]),
-				 ((k0*k1) ^ hk->hk64[0])*v, ((k2*k3) ^ hk->hk64[1])*w);
+    _Hk_SET_FROM_CITY(hk, WeakHashLen32WithSeeds(_HK_W0(hk), _HK_W1(hk), 
+				 v + ShiftMix(_HK_W0(hk)), 
+				 w + ShiftMix(_HK_W1(hk)),
+				 ((k0*k1) ^ _HK_W0(hk))*v, ((k2*k3) ^ _HK_W1(hk))*w));
     check_hashkey_range(hk);
 }
 
@@ -616,9 +645,10 @@ void Hkf_FillExact(hk_ptr dest_key, const char *hash_string)
     for(i = 0; i < 32; ++i) 
 	hash[32 - 1 - i] = hash_string[i];
 #else
+    /* 64 bit keys are given by the last 16 characters. */
     int i;
-    for(i = 0; i < 32; ++i) 
-	hash[i] = hash_string[i];
+    for(i = 0; i < 2*H_NUM_8BIT_COMPONENTS; ++i) 
+	hash[i] = hash_string[i + 32 - 2*H_NUM_8BIT_COMPONENTS];
 #endif
 
     assert(dest_key != NULL);
@@ -670,10 +700,16 @@ void Hkf_FillFromComponents(hk_ptr dest_key, uint32_t a, uint32_t b, uint32_t c,
 {
     assert(dest_key != NULL);
 
+#ifdef HASHKEY_64BIT
+    assert(a == 0 && b == 0);
+    dest_key->hk32[HK32I(0)] = c;
+    dest_key->hk32[HK32I(1)] = d;
+#else
     dest_key->hk32[HK32I(0)] = a;
     dest_key->hk32[HK32I(1)] = b;
     dest_key->hk32[HK32I(2)] = c;
     dest_key->hk32[HK32I(3)] = d;
+#endif
 }
 
 
@@ -681,8 +717,11 @@ unsigned long Hk_ExtractHashComponent(chk_ptr hk, unsigned int pos)
 {
     assert(hk != NULL);
 
-    if(pos < 4)
-	return hk->hk32[HK32I(pos)];
+    /* With 64 bit keys, the upper two components are zero. */
+    const unsigned int offset = 4 - H_NUM_32BIT_COMPONENTS;
+
+    if(pos >= offset && pos < 4)
+	return hk->hk32[HK32I(pos - offset)];
     else
 	return 0;
 }
@@ -703,7 +742,10 @@ void Hk_ExtractHash(char* dest_string, chk_ptr hk)
 
     static const char map[16] = 
 	{ '0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f'};
-    
+
+    /* 64 bit keys are written out zero-padded to the full width. */
+    memset(dest, '0', 32);
+
     int hi;
     for(hi = 0; hi < H_NUM_8BIT_COMPONENTS; ++hi)
     {
@@ -723,7 +765,7 @@ void Hk_ExtractHash(char* dest_string, chk_ptr hk)
 #else
     int i;
     for(i = 0; i < 32; ++i) 
-	dest_string[i] = dest[i];
+	dest_string[i] = dest[(i + 2*H_NUM_8BIT_COMPONENTS) % 32];
 #endif
 }
 
@@ -17,19 +17,38 @@
 /**************************************************
  * All constants related to the hash keys.
  **************************************************/
+
+/* With HASHKEY_64BIT defined (the HASHKEY_64BIT cmake option), hash
+ * keys are 64 bits wide and arithmetic is done mod 2^64 - 59.  This
+ * halves the memory taken by keys at the cost of a much higher
+ * collision probability; it should only be used on moderately sized
+ * problems.  The API is identical in both cases. */
+
+#ifdef HASHKEY_64BIT
+
+#define H_HASHKEY_BITS          64
+#define H_HASHKEY_PRIME_OFFSET  59    /* using GF(2^64 - H_HASHKEY_PRIME_OFFSET)
+				       * for ring.*/
+#define HK_GF_PRIME ( 0xFFFFFFFFFFFFFFFFull - (H_HASHKEY_PRIME_OFFSET - 1))
+
+#else
+
+#define H_HASHKEY_BITS          128
 #define H_HASHKEY_PRIME_OFFSET  159   /* using GF(2^128 - H_HASHKEY_PRIME_OFFSET)
 				       * for ring.*/
 #ifndef NO_UINT128
 #define HK_GF_PRIME ( ( ~( (uint128_type) 0) ) - (H_HASHKEY_PRIME_OFFSET - 1))
 #endif
 
+#endif
+
 #define H_COMPONENT_SIZE (sizeof(unsigned int)*8)
 #define H_64BIT          (H_COMPONENT_SIZE == 64)
 #define H_32BIT          (H_COMPONENT_SIZE == 32)
-#define H_NUM_COMPONENTS (128 / H_COMPONENT_SIZE)
-#define H_NUM_64BIT_COMPONENTS 2
-#define H_NUM_32BIT_COMPONENTS 4
-#define H_NUM_8BIT_COMPONENTS  16
+#define H_NUM_COMPONENTS (H_HASHKEY_BITS / H_COMPONENT_SIZE)
+#define H_NUM_64BIT_COMPONENTS (H_HASHKEY_BITS / 64)
+#define H_NUM_32BIT_COMPONENTS (H_HASHKEY_BITS / 32)
+#define H_NUM_8BIT_COMPONENTS  (H_HASHKEY_BITS / 8)
 
 
 typedef unsigned int hashfieldtype;
@@ -40,7 +59,7 @@ typedef unsigned int hashfieldtype;
  **************************************************/
 
 typedef union {
-#ifndef NO_UINT128
+#if !defined(NO_UINT128) && !defined(HASHKEY_64BIT)
   uint128_type  hk128;
 #endif
   hashfieldtype hk[H_NUM_COMPONENTS];
@@ -59,10 +78,10 @@ typedef const HashKey* _restrict_ chk_ptr;
 
 #if(PLATFORM_BYTE_ORDER == IS_LITTLE_ENDIAN)
 
-#define HK64I(i)        (H_NUM_64BIT_COMPONENTS - 1 - i)
-#define HK32I(i)        (H_NUM_32BIT_COMPONENTS - 1 - i)
-#define HK8I(i)         (H_NUM_8BIT_COMPONENTS - 1 - i)
-#define HKI(i)          (H_NUM_COMPONENTS - 1 - i)
+#define HK64I(i)        (H_NUM_64BIT_COMPONENTS - 1 - (i))
+#define HK32I(i)        (H_NUM_32BIT_COMPONENTS - 1 - (i))
+#define HK8I(i)         (H_NUM_8BIT_COMPONENTS - 1 - (i))
+#define HKI(i)          (H_NUM_COMPONENTS - 1 - (i))
 
 //#warning "Is little endian"
 #else
@@ -101,7 +120,13 @@ void Hk_Copy(hk_ptr hk_dest, chk_ptr hk_src);
  *
  ************************************************************/
 
-#define HK_UNSIGNED_INT_LOOKUP_SIZE 4096
+/* Integers in (-HK_UNSIGNED_INT_LOOKUP_SIZE, HK_UNSIGNED_INT_LOOKUP_SIZE)
+ * are mapped to keys by a table lookup; the tables are generated at
+ * build time (see hashkeys_int_table_gen.c).  Set the size with the
+ * HK_INT_LOOKUP_SIZE cmake option. */
+#ifndef HK_UNSIGNED_INT_LOOKUP_SIZE
+#define HK_UNSIGNED_INT_LOOKUP_SIZE 65536
+#endif
 
 /* Create or fill Hash Keys. */
 void Hkf_FromString       (hk_ptr dest_key, const char *string);
@@ -167,7 +192,9 @@ void Hk_InplaceNegative(hk_ptr hk);
 void Hkf_FillExact(hk_ptr dest_key, const char *hash);
 void Hkf_FillFromComponents(hk_ptr dest_key, uint32_t a, uint32_t b, uint32_t c, uint32_t d); 
 
-/* Extract the 4 32bit values associated with the hash keys, pos = {0,1,2,3} */
+/* Extract the 4 32bit values associated with the hash keys, pos =
+ * {0,1,2,3}.  64 bit keys are treated as 128 bit keys with the upper
+ * half zero, here and in the fill/extract functions. */
 unsigned long Hk_ExtractHashComponent(chk_ptr hk, unsigned int pos);
 
 /* Fills the dest string with a hex representation of the given data. */
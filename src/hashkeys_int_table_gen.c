@@ -0,0 +1,115 @@
+/************************************************************
+ *
+ * Build-time generator for the small integer hash key tables used
+ * by Hkf_FromUnsignedInt and Hkf_FromInt.  Writes a header
+ * containing two static const arrays of HashKeys, one for the
+ * non-negative integers [0, size) and one for the negative integers
+ * [-size, -1].  Both are drawn from fixed-seed Mersenne-Twister
+ * streams, so the keys are identical from build to build (and the
+ * first 4096 non-negative keys match the old lazily-built table).
+ *
+ * Usage: hashkeys_int_table_gen <size> <output file>
+ *
+ ************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "hashkeys.h"
+#include "randfunctions.h"
+
+#define _HK_INT_TABLE_POS_SEED 0
+#define _HK_INT_TABLE_NEG_SEED 1
+
+/* Draws the next key from the stream, redrawing in the
+ * (astronomically unlikely) case that it is not below the prime. */
+static void _nextKey(HashKey *hk, MTRandState *mts)
+{
+    size_t j;
+
+    while(1)
+    {
+	for(j = 0; j < H_NUM_32BIT_COMPONENTS; ++j)
+	    hk->hk32[j] = Mtr_Next(mts);
+
+#ifdef HASHKEY_64BIT
+	if(likely(hk->hk64[0] < HK_GF_PRIME))
+	    return;
+#else
+	if(likely( (~(hk->hk64[HK64I(0)])) != 0
+		   || hk->hk64[HK64I(1)] < (0ull - H_HASHKEY_PRIME_OFFSET)))
+	    return;
+#endif
+    }
+}
+
+static void _writeTable(FILE *f, const char *name, unsigned long size, uint32_t seed)
+{
+    MTRandState* mts = Mtr_New(seed);
+    HashKey hk;
+    unsigned long i;
+    size_t j;
+
+    fprintf(f, "static const HashKey %s[%lu] = {\n", name, size);
+
+    for(i = 0; i < size; ++i)
+    {
+	_nextKey(&hk, mts);
+	fprintf(f, "    {.hk32 = {");
+
+	for(j = 0; j < H_NUM_32BIT_COMPONENTS; ++j)
+	    fprintf(f, "%s0x%08lxu", (j == 0) ? "" : ", ", (unsigned long)hk.hk32[j]);
+
+	fprintf(f, "}}%s\n", (i + 1 == size) ? "" : ",");
+    }
+
+    fprintf(f, "};\n\n");
+
+    Mtr_Delete(mts);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long size;
+    FILE *f;
+
+    if(argc != 3)
+    {
+	fprintf(stderr, "Usage: %s <size> <output file>\n", argv[0]);
+	return 1;
+    }
+
+    size = strtoul(argv[1], NULL, 10);
+
+    if(size == 0)
+    {
+	fprintf(stderr, "Integer lookup table size must be positive.\n");
+	return 1;
+    }
+
+    f = fopen(argv[2], "w");
+
+    if(f == NULL)
+    {
+	fprintf(stderr, "Unable to open %s for writing.\n", argv[2]);
+	return 1;
+    }
+
+    fprintf(f, "/* Generated by hashkeys_int_table_gen; do not edit. */\n\n");
+    fprintf(f, "#ifndef _HASHKEYS_INT_TABLE_H_\n#define _HASHKEYS_INT_TABLE_H_\n\n");
+    fprintf(f, "#if HK_UNSIGNED_INT_LOOKUP_SIZE != %lu\n", size);
+    fprintf(f, "#error \"Integer lookup table generated with a different size.\"\n");
+    fprintf(f, "#endif\n\n");
+
+    _writeTable(f, "_hk_uint_lookup", size, _HK_INT_TABLE_POS_SEED);
+    _writeTable(f, "_hk_nint_lookup", size, _HK_INT_TABLE_NEG_SEED);
+
+    fprintf(f, "#endif /* _HASHKEYS_INT_TABLE_H_ */\n");
+
+    if(fclose(f) != 0)
+    {
+	fprintf(stderr, "Error writing %s.\n", argv[2]);
+	return 1;
+    }
+
+    return 0;
+}
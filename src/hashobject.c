@@ -213,6 +213,11 @@ void H_SetMarkerInfo(obj_ptr x, MarkerInfo *mi)
     H_SET_MARKER_INFO(x, mi);
 }
 
+void H_InternMarkerInfo(obj_ptr x)
+{
+    H_INTERN_MARKER_INFO(x);
+}
+
 markertype H_RangeMin(cobj_ptr x)
 {
     const HashObject *h = O_CastC(HashObject, x);
@@ -215,6 +215,12 @@ static inline void H_GIVE_MARKER_INFO(obj_ptr x, MarkerInfo *mi);
 void H_SetMarkerInfo(obj_ptr x, MarkerInfo *mi);
 static inline void H_SET_MARKER_INFO(obj_ptr x, MarkerInfo *mi);
 
+/* Swaps the marker info for the shared, interned instance with the
+ * same ranges (see Mi_Intern).  Later changes through the functions
+ * above copy it first. */
+void H_InternMarkerInfo(obj_ptr x);
+static inline void H_INTERN_MARKER_INFO(obj_ptr x);
+
 /* Steals the refernce for mi */
 void H_GiveMarkerInfo(obj_ptr x, MarkerInfo *mi);
 
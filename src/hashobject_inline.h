@@ -59,7 +59,7 @@ static inline void H_ReleaseMarkerLock(obj_ptr x)
     if(H_Mi(x) != NULL)
     {
 	Mi_ReleaseDebugLock(H_Mi(x));
-	assert(h->marker_lock_count == Mi_DebugLockCount(H_Mi(x)));
+	assert(h->marker_lock_count <= Mi_DebugLockCount(H_Mi(x)));
     }
 #endif
 }
@@ -73,7 +73,7 @@ static inline void H_ClaimMarkerLock(obj_ptr x)
     if(H_Mi(x) != NULL)
     {
 	Mi_ClaimDebugLock(H_Mi(x));
-	assert(h->marker_lock_count == Mi_DebugLockCount(H_Mi(x)));
+	assert(h->marker_lock_count <= Mi_DebugLockCount(H_Mi(x)));
     }
 #endif
 }
@@ -85,7 +85,7 @@ static inline size_t H_MarkerLockCount(cobj_ptr x)
      size_t ret = h->marker_lock_count;
 
      if(ret != 0 && H_Mi(x) != NULL)
-	 assert(Mi_DebugLockCount(H_Mi(x)) == ret);
+	 assert(Mi_DebugLockCount(H_Mi(x)) >= ret);
      
      return ret;
 #else
@@ -140,7 +140,12 @@ static inline void H_ADD_MARKER_VALID_RANGE(obj_ptr x, markertype r_start, marke
     if(unlikely(h->mi == NULL))
 	h->mi = Mi_NEW(r_start, r_end);
     else
+    {
+	if(unlikely(Mi_IS_INTERNED(h->mi)))
+	    h->mi = Mi_Thaw(h->mi);
+
 	Mi_AddValidRange(h->mi, r_start, r_end);
+    }
 }
 
 static inline void H_REMOVE_MARKER_VALID_RANGE(obj_ptr x, markertype r_start, markertype r_end)
@@ -149,7 +154,20 @@ static inline void H_REMOVE_MARKER_VALID_RANGE(obj_ptr x, markertype r_start, ma
     assert(!H_MarkerIsLocked(h));
 
     if(h->mi != NULL)
+    {
+	if(unlikely(Mi_IS_INTERNED(h->mi)))
+	    h->mi = Mi_Thaw(h->mi);
+
 	Mi_RemoveValidRange(h->mi, r_start, r_end);
+    }
+}
+
+static inline void H_INTERN_MARKER_INFO(obj_ptr x)
+{
+    HashObject *h = O_Cast(HashObject, x);
+    assert(!H_MarkerIsLocked(h));
+
+    h->mi = Mi_Intern(h->mi);
 }
 
 static inline void H_GIVE_MARKER_INFO(obj_ptr x, MarkerInfo *mi)
@@ -178,7 +196,13 @@ static inline void H_SET_MARKER_INFO(obj_ptr x, MarkerInfo *mi)
 static inline HashObject* H_COPY(obj_ptr dest_key, cobj_ptr h)
 {
     HashObject *ret_h = Hf_COPY_FROM_KEY(dest_key, H_Hash_RO(h));
-    H_GIVE_MARKER_INFO(ret_h, Mi_Copy(H_Mi(h)));
+
+    /* Interned marker infos are never changed in place, so they can
+     * be shared. */
+    if(Mi_IS_INTERNED(H_Mi(h)))
+	H_SET_MARKER_INFO(ret_h, H_Mi(h));
+    else
+	H_GIVE_MARKER_INFO(ret_h, Mi_Copy(H_Mi(h)));
 
 #ifndef NDEBUG
     if(unlikely(!Mi_Equal(H_Mi(ret_h), H_Mi(h))))
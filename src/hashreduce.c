@@ -99,6 +99,31 @@ vset_ptr VSetIntersectionUpdate(vset_ptr v_dest, cobj_ptr v)
     return Mi_IntersectionUpdate(v_dest, _GetAsVSet(v));
 }
 
+static vset_ptr _VSetOf(cobj_ptr *v, size_t n, mi_ptr (*op)(const MarkerInfo**, size_t))
+{
+    size_t i;
+    const MarkerInfo **mis = (const MarkerInfo**)malloc(sizeof(MarkerInfo*)*max(n, 1));
+
+    for(i = 0; i < n; ++i)
+	mis[i] = _GetAsVSet(v[i]);
+
+    vset_ptr mi = op(mis, n);
+
+    free(mis);
+
+    return mi;
+}
+
+vset_ptr VSetUnionOf(cobj_ptr *v, size_t n)
+{
+    return _VSetOf(v, n, Mi_UnionMany);
+}
+
+vset_ptr VSetIntersectionOf(cobj_ptr *v, size_t n)
+{
+    return _VSetOf(v, n, Mi_IntersectionMany);
+}
+
 vset_ptr Difference(cobj_ptr v1, cobj_ptr v2)
 {
     return Mi_Difference(_GetAsVSet(v1), _GetAsVSet(v2));
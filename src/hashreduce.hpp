@@ -0,0 +1,321 @@
+#ifndef _HASHREDUCE_HPP_
+#define _HASHREDUCE_HPP_
+
+/********************************************************************************
+ *
+ *  A header-only C++ (C++11 or later) layer over the API in
+ *  hashreduce.h.  Each handle owns exactly one reference to the
+ *  object it wraps and gives it back when it goes out of scope, so
+ *  callers never touch O_INCREF / O_DECREF.
+ *
+ *  HashObj, VSet and MSet are intrusively reference counted: copying
+ *  a handle takes a reference, moving one transfers it without any
+ *  reference count traffic.  Accumulator is move-only, as the
+ *  underlying sequence is updated in place.
+ *
+ *  Where the C API has a stealing variant, the rvalue overload uses
+ *  it: MSet::insert(HashObj&&) calls Ht_Give rather than Ht_Set,
+ *  HashObj::setVSet(VSet&&) calls H_GIVE_MARKER_INFO, and the set
+ *  operations on an rvalue first argument call the in-place Update
+ *  functions when the handle is the only reference, e.g.
+
+     MSet u;
+     for(const MSet& T : tables)
+	 u = Union(std::move(u), T);
+
+ *  reuses the same table for the whole loop.
+ *
+ ********************************************************************************/
+
+extern "C" {
+#include "hashreduce.h"
+}
+
+/* From utilities.h; these would break std::min, std::max and
+ * std::swap in the including code. */
+#undef min
+#undef max
+#undef swap
+
+#include <cstddef>
+#include <utility>
+
+namespace hashreduce {
+
+/* Passed to a handle constructor to adopt a reference the caller
+ * already owns, e.g. one returned from a New or Get function. */
+struct steal_t {};
+static const steal_t steal = steal_t();
+
+/********************************************************************************
+ *
+ *  The common handle.
+ *
+ ********************************************************************************/
+
+template <typename T> class Ref {
+public:
+    Ref() noexcept : p_(NULL) {}
+
+    /* Adopts the caller's reference. */
+    Ref(T *p, steal_t) noexcept : p_(p) {}
+
+    /* Takes a new reference. */
+    explicit Ref(T *p) : p_(p) { if(p_ != NULL) O_INCREF(p_); }
+
+    Ref(const Ref& r) : p_(r.p_) { if(p_ != NULL) O_INCREF(p_); }
+    Ref(Ref&& r) noexcept : p_(r.p_) { r.p_ = NULL; }
+
+    ~Ref() { if(p_ != NULL) O_DECREF(p_); }
+
+    Ref& operator=(const Ref& r)
+    {
+	if(r.p_ != NULL) O_INCREF(r.p_);
+	reset(r.p_, steal);
+	return *this;
+    }
+
+    Ref& operator=(Ref&& r) noexcept
+    {
+	if(this != &r)
+	{
+	    T *p = r.p_;
+	    r.p_ = NULL;
+	    reset(p, steal);
+	}
+	return *this;
+    }
+
+    /* The wrapped pointer; the handle keeps its reference. */
+    T* get() const noexcept { return p_; }
+
+    /* Gives up the reference to the caller. */
+    T* release() noexcept { T *p = p_; p_ = NULL; return p; }
+
+    void reset(T *p, steal_t) { T *old = p_; p_ = p; if(old != NULL) O_DECREF(old); }
+
+    explicit operator bool() const noexcept { return p_ != NULL; }
+
+    /* True if this handle holds the only reference, so the object
+     * may be changed in place. */
+    bool unique() const { return p_ != NULL && O_REF_COUNT(p_) == 1; }
+
+protected:
+    T *p_;
+};
+
+class HashObj;
+class VSet;
+class MSet;
+
+/********************************************************************************
+ *
+ *  Validity sets.
+ *
+ ********************************************************************************/
+
+class VSet : public Ref<MarkerInfo> {
+public:
+    VSet() {}
+    VSet(MarkerInfo *mi, steal_t) noexcept : Ref<MarkerInfo>(mi, steal) {}
+    explicit VSet(MarkerInfo *mi) : Ref<MarkerInfo>(mi) {}
+
+    /* The interval [start, end). */
+    VSet(markertype start, markertype end) : Ref<MarkerInfo>(Mi_New(start, end), steal) {}
+
+    static VSet Empty() { return VSet(Mi_NewInvalid(), steal); }
+
+    bool isValid(markertype m) const { return Mi_IsValid(p_, m); }
+    markertype min() const { return Mi_Min(p_); }
+    markertype max() const { return Mi_Max(p_); }
+
+    bool operator==(const VSet& v) const { return Mi_Equal(p_, v.p_); }
+    bool operator!=(const VSet& v) const { return !Mi_Equal(p_, v.p_); }
+};
+
+inline VSet Union(const VSet& v1, const VSet& v2)        { return VSet(Mi_Union(v1.get(), v2.get()), steal); }
+inline VSet Intersection(const VSet& v1, const VSet& v2) { return VSet(Mi_Intersection(v1.get(), v2.get()), steal); }
+inline VSet Difference(const VSet& v1, const VSet& v2)   { return VSet(Mi_Difference(v1.get(), v2.get()), steal); }
+
+inline VSet Union(VSet&& v1, const VSet& v2)
+{
+    if(!v1.unique())
+	return Union(static_cast<const VSet&>(v1), v2);
+
+    return VSet(Mi_UnionUpdate(v1.release(), v2.get()), steal);
+}
+
+inline VSet Intersection(VSet&& v1, const VSet& v2)
+{
+    if(!v1.unique())
+	return Intersection(static_cast<const VSet&>(v1), v2);
+
+    return VSet(Mi_IntersectionUpdate(v1.release(), v2.get()), steal);
+}
+
+/********************************************************************************
+ *
+ *  Hash objects.
+ *
+ ********************************************************************************/
+
+class HashObj : public Ref<HashObject> {
+public:
+    HashObj() {}
+    HashObj(HashObject *h, steal_t) noexcept : Ref<HashObject>(h, steal) {}
+    explicit HashObj(HashObject *h) : Ref<HashObject>(h) {}
+
+    static HashObj New()                              { return HashObj(NewHashObject(), steal); }
+    static HashObj FromString(const char *s)          { return HashObj(Hf_FromString(NULL, s), steal); }
+    static HashObj FromBuffer(const char *s, size_t n) { return HashObj(Hf_FromCharBuffer(NULL, s, n), steal); }
+    static HashObj FromInt(signed long x)             { return HashObj(Hf_FromInt(NULL, x), steal); }
+    static HashObj FromUnsignedInt(unsigned long x)   { return HashObj(Hf_FromUnsignedInt(NULL, x), steal); }
+
+    const HashKey& key() const { return *H_Hash_RO(p_); }
+
+    /* The validity set; unmarked objects are valid everywhere. */
+    VSet vset() const { return VSet(GetVSet(p_), steal); }
+
+    void setVSet(const VSet& v) { H_SET_MARKER_INFO(p_, v.get()); }
+    void setVSet(VSet&& v)      { H_GIVE_MARKER_INFO(p_, v.release()); }
+
+    void addInterval(markertype a, markertype b) { H_ADD_MARKER_VALID_RANGE(p_, a, b); }
+    bool isValid(markertype m) const { return IsValid(p_, m); }
+
+    /* Order independent combination into this hash. */
+    HashObj& reduceUpdate(const HashObj& h) { H_ReduceUpdate(p_, h.p_); return *this; }
+
+    bool operator==(const HashObj& h) const { return H_Equal(p_, h.p_); }
+    bool operator!=(const HashObj& h) const { return !H_Equal(p_, h.p_); }
+};
+
+/********************************************************************************
+ *
+ *  Multisets (hash tables).
+ *
+ ********************************************************************************/
+
+class MSet : public Ref<HashTable> {
+public:
+    MSet() : Ref<HashTable>(NewHashTable(), steal) {}
+    MSet(HashTable *ht, steal_t) noexcept : Ref<HashTable>(ht, steal) {}
+    explicit MSet(HashTable *ht) : Ref<HashTable>(ht) {}
+
+    static MSet WithExpectedSize(size_t n) { return MSet(NewSizeOptimizedHashTable(n), steal); }
+
+    /* A new table with the same contents. */
+    MSet copy() const { return MSet(Ht_Copy(p_), steal); }
+
+    size_t size() const { return Ht_Size(p_); }
+
+    bool contains(const HashObj& h) const { return Ht_Contains(p_, h.get()); }
+    bool containsAt(const HashObj& h, markertype m) const { return Ht_ContainsAt(p_, h.get(), m); }
+
+    using Ref<HashTable>::get;
+
+    /* The stored object with the same key as h, if any. */
+    HashObj get(const HashObj& h) const { return HashObj(Ht_Get(p_, h.get()), steal); }
+
+    /* Removes and returns the stored object with the key of h. */
+    HashObj pop(const HashObj& h) { return HashObj(Ht_Pop(p_, h.get()), steal); }
+
+    bool clear(const HashObj& h) { return Ht_Clear(p_, h.get()); }
+
+    void insert(const HashObj& h) { Ht_Set(p_, h.get()); }
+    void insert(HashObj&& h)      { Ht_Give(p_, h.release()); }
+
+    HashObj hashAt(markertype m) const { return HashObj(Ht_HashAtMarkerPoint(NULL, p_, m), steal); }
+    HashObj hash() const { return HashObj(Ht_HashOfEverything(NULL, p_), steal); }
+
+    bool equalAt(const MSet& T, markertype m) const { return Ht_EqualAtMarker(p_, T.p_, m); }
+
+    /* Where this table has the given hash. */
+    VSet equalToHash(const HashObj& h) const { return VSet(Ht_EqualToHash(p_, h.key()), steal); }
+
+    /* Where this table and T hash the same. */
+    VSet equalityVSet(const MSet& T) const { return VSet(Ht_EqualitySet(p_, T.p_), steal); }
+
+    MSet keySet() const { return MSet(Ht_KeySet(p_), steal); }
+    MSet reduce() const { return MSet(Ht_ReduceTable(p_), steal); }
+};
+
+inline MSet Union(const MSet& T1, const MSet& T2)        { return MSet(Ht_Union(T1.get(), T2.get()), steal); }
+inline MSet Intersection(const MSet& T1, const MSet& T2) { return MSet(Ht_Intersection(T1.get(), T2.get()), steal); }
+inline MSet Difference(const MSet& T1, const MSet& T2)   { return MSet(Ht_Difference(T1.get(), T2.get()), steal); }
+
+inline MSet Union(MSet&& T1, const MSet& T2)
+{
+    if(!T1.unique())
+	return Union(static_cast<const MSet&>(T1), T2);
+
+    return MSet(Ht_UnionUpdate(T1.release(), T2.get()), steal);
+}
+
+inline MSet Intersection(MSet&& T1, const MSet& T2)
+{
+    if(!T1.unique())
+	return Intersection(static_cast<const MSet&>(T1), T2);
+
+    return MSet(Ht_IntersectionUpdate(T1.release(), T2.get()), steal);
+}
+
+/********************************************************************************
+ *
+ *  Accumulators for summarizing, or finding where, a collection of
+ *  tables are equal.  Use one kind of update per accumulator:
+
+     Accumulator acc;
+     for(const MSet& T : tables)
+	 acc.summarize(T);
+     MSet summary = acc.finishSummary();
+
+ ********************************************************************************/
+
+class Accumulator {
+public:
+    Accumulator() noexcept : hs_(NULL) {}
+    Accumulator(Accumulator&& a) noexcept : hs_(a.hs_) { a.hs_ = NULL; }
+    Accumulator(const Accumulator&) = delete;
+
+    Accumulator& operator=(Accumulator&& a) noexcept
+    {
+	HashSequence *hs = hs_;
+	hs_ = a.hs_;
+	a.hs_ = hs;
+	return *this;
+    }
+    Accumulator& operator=(const Accumulator&) = delete;
+
+    ~Accumulator() { if(hs_ != NULL) O_DECREF(hs_); }
+
+    void summarize(const MSet& T) { hs_ = Ht_Summarize_Update(hs_, T.get()); }
+    void equality(const MSet& T)  { hs_ = Ht_EqualitySetUpdate(hs_, T.get()); }
+
+    /* Both leave the accumulator empty. */
+    MSet finishSummary()
+    {
+	HashSequence *hs = hs_;
+	hs_ = NULL;
+
+	if(hs == NULL)
+	    return MSet();
+
+	HashTable *ht = Ht_Summarize_Finish(hs);
+	O_DECREF(hs);
+	return MSet(ht, steal);
+    }
+
+    VSet finishEquality()
+    {
+	HashSequence *hs = hs_;
+	hs_ = NULL;
+	return (hs == NULL) ? VSet::Empty() : VSet(Ht_EqualitySetFinish(hs), steal);
+    }
+
+private:
+    HashSequence *hs_;
+};
+
+} /* namespace hashreduce */
+
+#endif /* _HASHREDUCE_HPP_ */
@@ -1464,10 +1464,16 @@ void _Ht_MSL_Drop(HashTable *ht)
 
 	/* Clear all the branches. */
 
-	do {
+	/* The lowest level of branches points down to the leaves,
+	 * which are cleared separately. */
+	unsigned int level;
+
+	for(level = msl->start_node_level; level != 0; --level)
+	{
 	    assert(msl->start_node != NULL);
 
 	    _HT_MSL_Node *br = (_HT_MSL_Node*)(msl->start_node);
+	    _HT_MSL_Node *down = msl->start_node->down;
 
 	    do{
 		_HT_MSL_Node *old_br = br;
@@ -1475,8 +1481,8 @@ void _Ht_MSL_Drop(HashTable *ht)
 		Mp_Free_HT_MSL_Branch(_HT_MSL_AsBranch(old_br));
 	    }while(br != NULL);
 		    
-	    msl->start_node = (_HT_MSL_Branch*) msl->start_node->down;
-	} while(msl->start_node != NULL);
+	    msl->start_node = (level == 1) ? NULL : _HT_MSL_AsBranch(down);
+	}
  
 	/* Now clear all the nodes. */
 
@@ -1818,6 +1824,45 @@ bool Ht_ContainsAt(ht_crptr ht, const HashObject * hk, markertype m)
     return (h != NULL) ? H_MarkerPointIsValid(h, m) : false;
 }
 
+/* How many lookups ahead to prefetch the table nodes. */
+#define _HT_BATCH_PREFETCH_DISTANCE 8
+
+cpu_dispatch
+void Ht_ContainsAtBatch(ht_crptr ht, const HashKey *hk, const markertype *m, 
+			size_t n, bitfield *out)
+{
+    const size_t B = bitsizeof(bitfield);
+    size_t i;
+    bitfield w = 0;
+
+    _Ht_debug_HashTableConsistent(ht);
+
+    for(i = 0; i < min(n, _HT_BATCH_PREFETCH_DISTANCE); ++i)
+	prefetch_ro(&(ht->table[_Ht_Table_Index(ht, hk[i].hk64[HK64I(0)])]));
+
+    for(i = 0; i < n; ++i)
+    {
+	if(likely(i + _HT_BATCH_PREFETCH_DISTANCE < n))
+	{
+	    const HashKey *hk_next = &hk[i + _HT_BATCH_PREFETCH_DISTANCE];
+	    prefetch_ro(&(ht->table[_Ht_Table_Index(ht, hk_next->hk64[HK64I(0)])]));
+	}
+
+	HashObject *h = Ht_ViewByKey(ht, hk[i]);
+
+	w |= ((bitfield)(h != NULL && H_MarkerPointIsValid(h, m[i]))) << (i % B);
+
+	if(i % B == B - 1)
+	{
+	    out[i / B] = w;
+	    w = 0;
+	}
+    }
+
+    if(n % B != 0)
+	out[n / B] = w;
+}
+
 HashObject* Ht_InsertValidRange(HashTable *ht, HashObject *hk, 
 				markertype r_start, markertype r_end)
 {
@@ -1953,6 +1998,7 @@ bool Ht_EqualAtMarker(ht_rptr ht1, ht_rptr ht2, markertype m)
     return Hk_EQUAL(&hk1, &hk2);
 }
 
+cpu_dispatch
 HashObject* Ht_HashOfEverything(HashObject* h_dest, ht_rptr ht)
 {
     if(h_dest == NULL)
@@ -2368,6 +2414,7 @@ void Htib_Delete(HashTableBufferedIterator *htib)
  *
  **********************************************************************/
 
+cpu_dispatch
 ht_rptr Ht_Intersection(ht_crptr ht1, ht_crptr ht2)
 {
     /* Simply iterate through the two nodes, checking which is
@@ -2435,6 +2482,7 @@ ht_rptr Ht_IntersectionUpdate(ht_rptr ht_accumulator, ht_crptr ht_src)
     return ht_accumulator;
 }
 
+cpu_dispatch
 ht_rptr Ht_Union(ht_crptr ht1, ht_crptr ht2)
 {
     /* Simply iterate through the two nodes, checking which is
@@ -2451,8 +2499,13 @@ ht_rptr Ht_Union(ht_crptr ht1, ht_crptr ht2)
     HashObject *h1 = NULL, *h2 = NULL;
 
     if(unlikely(!_Hti_NEXT(&h1, &hti1)))
-	goto HT_FINISH_OUT_H2;
+    {
+	/* h2 has not been loaded yet. */
+	if(!_Hti_NEXT(&h2, &hti2))
+	    goto HT_UNION_DONE;
 
+	goto HT_FINISH_OUT_H2;
+    }
 
     if(unlikely(!_Hti_NEXT(&h2, &hti2)))
 	goto HT_FINISH_OUT_H1;
@@ -2597,6 +2650,34 @@ ht_rptr Ht_KeySet(ht_crptr ht)
     return new_ht;
 }
 
+MarkerInfo *Ht_MarkerInfoUnion(HashTable *ht)
+{
+    size_t n = 0;
+    HashObject *h;
+    _HashTableInternalIterator hti;
+    _Hti_INIT(ht, &hti);
+
+    const MarkerInfo **mis = (const MarkerInfo**)malloc(sizeof(MarkerInfo*)*max(Ht_Size(ht), 1));
+
+    while(_Hti_NEXT(&h, &hti))
+    {
+	/* An unmarked object is valid everywhere. */
+	if(H_Mi(h) == NULL)
+	{
+	    free(mis);
+	    return Mi_NEW(MARKER_MINUS_INFTY, MARKER_PLUS_INFTY);
+	}
+
+	mis[n++] = H_Mi(h);
+    }
+
+    MarkerInfo *mi = Mi_UnionMany(mis, n);
+
+    free(mis);
+
+    return mi;
+}
+
 
 /********************************************************************************
  *
@@ -2981,9 +3062,29 @@ MarkerInfo* Hs_NonZeroSet(HashSequence* hs)
 	    Mi_AppendValidRange(mi, hvi.start, hvi.end);
     }
 
+    Mi_Compact(mi);
+
     return mi;
 }
 
+/* The tables built from a sequence below often have many keys valid
+ * over the same set of intervals; these share one interned marker
+ * info.  The ranges are only final once the whole sequence has been
+ * read, so this is done as a last pass. */
+static void _Ht_InternMarkerInfo(HashTable *ht)
+{
+    _HashTableInternalIterator hti;
+    HashObject *h;
+
+    _Hti_INIT(ht, &hti);
+
+    while(_Hti_NEXT(&h, &hti))
+    {
+	Mi_Compact(H_Mi(h));
+	H_INTERN_MARKER_INFO(h);
+    }
+}
+
 HashTable* Hs_ToHashTable(HashSequence *hs)
 {
     assert(hs != NULL);
@@ -3018,6 +3119,8 @@ HashTable* Hs_ToHashTable(HashSequence *hs)
 	}
     }
 
+    _Ht_InternMarkerInfo(ht);
+
     return ht;
 }
 
@@ -3034,6 +3137,7 @@ static void _Hs_SummarizeFunction(hk_ptr hk_dest, chk_ptr hs_hk, chk_ptr ht_hk)
     Hk_REDUCE(hk_dest, hs_hk, &hk);
 }
 
+cpu_dispatch
 HashSequence *Ht_Summarize_Update(HashSequence *ht_accumulator, HashTable *ht)
 {    
     if(unlikely(ht_accumulator == NULL))
@@ -3071,6 +3175,22 @@ HashSequence *Ht_Summarize_Update(HashSequence *ht_accumulator, HashTable *ht)
     }
 }
 
+static void _Hs_SummarizeRemoveFunction(hk_ptr hk_dest, chk_ptr hs_hk, chk_ptr ht_hk)
+{
+    HashKey hk;
+    Hk_REHASH(&hk, ht_hk);
+    Hk_INPLACE_NEGATIVE(&hk);
+    Hk_REDUCE(hk_dest, hs_hk, &hk);
+}
+
+cpu_dispatch
+HashSequence *Ht_Summarize_Remove(HashSequence *ht_accumulator, HashTable *ht)
+{
+    assert(ht_accumulator != NULL);
+
+    return _Hs_Update(ht_accumulator, ht, _Hs_SummarizeRemoveFunction);
+}
+
 HashTable *Ht_Summarize_Finish(HashSequence *hs)
 {
     assert(hs != NULL);
@@ -3124,6 +3244,8 @@ HashTable *Ht_Summarize_Finish(HashSequence *hs)
 	}
     }
 
+    _Ht_InternMarkerInfo(ht);
+
     _Ht_debug_HashTableConsistent(ht);
 
     /* printf("Final hash table: \n"); */
@@ -3178,6 +3300,7 @@ MarkerInfo* Ht_EqualitySet(HashTable *ht1, HashTable *ht2)
     return Ht_EqualitySetFinish(hs);
 }
 
+cpu_dispatch
 MarkerInfo* Ht_EqualToHash(HashTable *ht, HashKey hk) 
 {
 
@@ -3193,6 +3316,8 @@ MarkerInfo* Ht_EqualToHash(HashTable *ht, HashKey hk)
 	    Mi_AppendValidRange(mi, hvi.start, hvi.end);
     }
 
+    Mi_Compact(mi);
+
     return mi;
 }
 
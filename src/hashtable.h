@@ -210,7 +210,7 @@ HashObject* Ht_Get(ht_crptr ht, const HashObject *hk);
 HashObject* Ht_GetByKey(ht_crptr ht, HashKey hk);
 
 HashObject* Ht_View(ht_crptr ht, const HashObject *hk);
-inline HashObject* Ht_ViewByKey(ht_crptr ht, HashKey hk);
+HashObject* Ht_ViewByKey(ht_crptr ht, HashKey hk);
 
 /* Finds the given key in the hash table, deletes it from the tree and
  * returns it.  The caller would then own a reference to the item.
@@ -268,6 +268,12 @@ bool Ht_ContainsByKey(ht_crptr ht, HashKey hk);
 bool Ht_ContainsAt(ht_crptr ht, const HashObject *hk, markertype m);
 bool Ht_ContainsAtByKey(ht_crptr ht, HashKey hk, markertype m);
 
+/* Answers Ht_ContainsAtByKey(ht, hk[i], m[i]) for n pairs at once,
+ * into bit i of out as with Mi_IsValidBatch.  The table lookups are
+ * prefetched a few pairs ahead. */
+void Ht_ContainsAtBatch(ht_crptr ht, const HashKey *hk, const markertype *m, 
+			size_t n, bitfield *out);
+
 /* This adds a new valid range [r_start, r_end) to an existing key, if
  * it exists.  Otherwise, it sets the marker range of hk to [r_start,
  * r_end) and inserts it.  A pointer to whichever one was inserted is
@@ -304,6 +310,12 @@ bool Ht_EqualAtMarker(ht_rptr ht1, ht_rptr ht2, markertype m);
 HashSequence *Ht_Summarize_Update(HashSequence *ht_accumulator, ht_rptr ht);
 HashTable *Ht_Summarize_Finish(HashSequence *ht_accumulator);
 
+/* Takes a table's contribution back out of an accumulator, so a
+ * summary can be patched when one of the tables it was built from
+ * changes.  The table must be as it was when it was added. */
+
+HashSequence *Ht_Summarize_Remove(HashSequence *ht_accumulator, ht_rptr ht);
+
 HashTable *Ht_ReduceTable(HashTable *ht);
 
 /* Returns a MarkerInfo object that denotes where the marked part of a
@@ -348,6 +360,10 @@ void Ht_Swap(ht_rptr ht1, ht_rptr ht2);
  * quickly. */
 static inline void Ht_ClearMarkerCache(ht_rptr ht);
 
+/* Builds the cache now if it isn't there, so that later queries only
+ * read the table, e.g. when several threads share it. */
+static inline void Ht_BuildMarkerCache(ht_rptr ht);
+
 /********************************************************************************
  *
  *  Iteration over the hash table. 
@@ -449,7 +465,7 @@ static inline bool Htmi_NEXT(HashValidityItem* dest, HashTableMarkerIterator *ht
 
 bool Htmi_Next(HashValidityItem* dest, HashTableMarkerIterator *htmi);
 
-inline void Htmi_Finish(HashTableMarkerIterator* htmi); 
+void Htmi_Finish(HashTableMarkerIterator* htmi); 
 
 
 /************************************************************
@@ -466,11 +482,11 @@ typedef struct {
     HashValidityItem current_item;
 } HashSequenceIterator;
 
-inline HashSequenceIterator* Hsi_New(HashSequence *hs);
+HashSequenceIterator* Hsi_New(HashSequence *hs);
 
-inline bool Hsi_Next(HashValidityItem* dest, HashSequenceIterator* hsi);
+bool Hsi_Next(HashValidityItem* dest, HashSequenceIterator* hsi);
 
-inline void Hsi_Finish(HashSequenceIterator* hsi);
+void Hsi_Finish(HashSequenceIterator* hsi);
 
 /************************************************************
  *
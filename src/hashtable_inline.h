@@ -244,4 +244,10 @@ static inline void Ht_ClearMarkerCache(ht_rptr ht)
 	_Ht_MSL_Drop(ht);
 }
 
+static inline void Ht_BuildMarkerCache(ht_rptr ht)
+{
+    if(ht->marker_sl == NULL)
+	_Ht_MSL_Init(ht);
+}
+
 #endif /* _HASHTABLE_INLINE_H_ */
@@ -12,6 +12,8 @@
 #include <ctype.h>
 
 #include "ibd_fatpack.c"
+#include "dglfparser.c"
+#include "dglbformat.c"
 
 // include all necessary header files.
 
@@ -39,11 +41,11 @@
 //#include "src/skiplists.h"
 
 
-#define EDGE_NAME_BUFFER_SIZE 64
-
 
 // function declarations
 static long createIBDGraphs(char* file, IBDGraphList *ibd_graphs);
+static IBDGraphLocationEquivalences* createLocationEquivalences(char *file, long *n_graphs, long *n_individuals);
+static void convertToBinary(char *file, char *out_file);
 /* static int checkEdgeList(int edge, int NUM_EDGES, int edge_list[]); */
 
 
@@ -75,6 +77,7 @@ int main(int argc, char **argv)
     }
 
     IBDGraphLocationEquivalences* igeq;
+    IBDGraphClassSweep *sweep;
 
     char help1[] = "-h";
     char help2[] = "--help";
@@ -87,7 +90,11 @@ int main(int argc, char **argv)
 	printf("\t\t-r <int> <int>\tPrints graphs same over range <> to <>\n");
 	printf("\t\t-s <int> <int>\tPrints validity range of graph around marker\n");
 	printf("\t\t-a <int>\tPrints entire validity range of graph\n");
-	printf("\t\t-e Prints equivalence classes at the resolution of the marker.\n\n");
+	printf("\t\t-e Prints equivalence classes at the resolution of the marker.\n");
+	printf("\t\t-w Prints how the equivalence classes change along the markers.\n");
+	printf("\t\t-b <file>\tWrites the graphs to <file> in the binary dglb format\n\n");
+	printf("The input may be either a dglf text file, possibly gzip or zstd compressed,\n");
+	printf("or a dglb file.\n\n");
 	return 0;
     }
 
@@ -96,7 +103,7 @@ int main(int argc, char **argv)
 
     IBDGraphEquivalences *ibd_equivalences;
 
-    long index, n_individuals;
+    long index, n_individuals, n_graphs;
     markertype m, ml, mu;
     IBDGraph *g;
     mi_ptr invariant_set;
@@ -113,7 +120,20 @@ int main(int argc, char **argv)
 	    printf("\t\t-r <int> <int>\tPrints graphs same over range <> to <>\n");
 	    printf("\t\t-s <int> <int>\tPrints invariance range of graph at marker.\n");
 	    printf("\t\t-v <int> <int>\tPrints entire invariance set of graph at marker.\n\n");
-	    printf("\t\t-e Prints equivalence classes at the resolution of the marker.\n\n");
+	    printf("\t\t-e Prints equivalence classes at the resolution of the marker.\n");
+	    printf("\t\t-w Prints how the equivalence classes change along the markers.\n");
+	    printf("\t\t-b <file>\tWrites the graphs to <file> in the binary dglb format\n\n");
+	    break;
+
+	case 'b':
+	    if(argc != 4) 
+	    {
+		printf("\nERROR: Incorrect number of arguments for the -b flag.\n");
+		printf("Use the -h or --help flag to see options and usage.\n\n");
+		exit(1);
+	    }
+
+	    convertToBinary(argv[1], argv[3]);
 	    break;
 
 	case 'm':
@@ -247,19 +267,18 @@ int main(int argc, char **argv)
 		exit(1);
 	    }
 
-	    // get graph number and specified marker
-	    createIBDGraphs(argv[1], ibd_graphs);
+	    // each graph is hashed and freed as soon as it is read
+	    igeq = createLocationEquivalences(argv[1], &n_graphs, &n_individuals);
 	    elapsed1 = (double)clock() - start;
 
-	    igeq = NewIBDGraphLocationEquivalences(ibd_graphs);
-
+	    IBDLocEq_Finish(igeq);
 
 	    elapsed2 = (double)clock() - elapsed1;
 
 	    IBDGraphLocationEquivalences_Print(igeq);
 
 	    printf("\nCreating the %ld IBD graphs took %.2lf seconds.\n", 
-		   Igl_Size(ibd_graphs), elapsed1/CLOCKS_PER_SEC);
+		   n_graphs, elapsed1/CLOCKS_PER_SEC);
 	    printf("Calculating everything else took %.2lf seconds.\n", elapsed2/CLOCKS_PER_SEC);
 	    printf("Grouped %ld locations into %ld equivalence classes.\n\n", 
 		   IBDLocEq_TotalSize(igeq), IBDLocEq_NumClasses(igeq));
@@ -268,6 +287,34 @@ int main(int argc, char **argv)
 
 	    break;
 
+	case 'w':
+	    if(argc != 3) 
+	    {
+		printf("\nERROR: Incorrect number of arguments for the -w flag.\n");
+		printf("Use the -h or --help flag to see options and usage.\n\n");
+		exit(1);
+	    }
+
+	    createIBDGraphs(argv[1], ibd_graphs);
+	    elapsed1 = (double)clock() - start;
+
+	    // only the graphs that change class are printed at each breakpoint
+	    sweep = NewIBDGraphClassSweep(ibd_graphs);
+	    IBDGraphClassSweep_Print(sweep);
+
+	    while(IBDSweep_Next(sweep))
+		IBDGraphClassSweep_Print(sweep);
+
+	    elapsed2 = (double)clock() - elapsed1;
+
+	    printf("\nCreating the %ld IBD graphs took %.2lf seconds.\n", 
+		   Igl_Size(ibd_graphs), elapsed1/CLOCKS_PER_SEC);
+	    printf("Sweeping the markers took %.2lf seconds.\n\n", elapsed2/CLOCKS_PER_SEC);
+
+	    O_DECREF(sweep);
+
+	    break;
+
 	case 'E':
 	    if(argc != 3) 
 	    {
@@ -276,18 +323,17 @@ int main(int argc, char **argv)
 		exit(1);
 	    }
 
-	    // get graph number and specified marker
-	    n_individuals = createIBDGraphs(argv[1], ibd_graphs);
+	    // each graph is hashed and freed as soon as it is read
+	    igeq = createLocationEquivalences(argv[1], &n_graphs, &n_individuals);
 	    elapsed1 = (double)clock() - start;
 
-	    igeq = NewIBDGraphLocationEquivalences(ibd_graphs);
-
+	    IBDLocEq_Finish(igeq);
 
 	    elapsed2 = (double)clock() - elapsed1;
 
 	    // IBDGraphLocationEquivalences_Print(igeq);
-	    printf("\n\n{Graphs:%d}{NIndividuals:%ld}{NConfigurations:%ld}{NUnique:%ld}{Time:%f}\n",
-		   Igl_Size(ibd_graphs), n_individuals, 
+	    printf("\n\n{Graphs:%ld}{NIndividuals:%ld}{NConfigurations:%ld}{NUnique:%ld}{Time:%f}\n",
+		   n_graphs, n_individuals, 
 		   IBDLocEq_TotalSize(igeq), IBDLocEq_NumClasses(igeq),
 		   (elapsed1 + elapsed2) / CLOCKS_PER_SEC
 		);
@@ -330,306 +376,139 @@ int main(int argc, char **argv)
 // FUNCTION DEFINITIONS
 
 
-// assume IBDGraph_ContainsNode(IBDGraph* g, int node)
-// step through until node is contained in "active" graph, then start
-// a new graph
-
-static inline bool verifyKeyAndAdvanceStream(char* name, FILE* fp)
+// starts decompressing the file if it is compressed, else returns NULL
+static DglfStream* openCompressed(char *file, DglfFile *df)
 {
-    long pos, r;
-
-    do{
-	r = fgetc(fp);
-	
-	if(unlikely(r == EOF))
-	    return false;
+    if(Dglf_Compression(df) == DGLF_UNCOMPRESSED)
+	return NULL;
 
-    }while(isspace(r));
+    DglfStream *stream = Dglf_OpenStream(df);
 
-    if(r != name[0])
-	return false;
-
-    for(pos = 1; pos < EDGE_NAME_BUFFER_SIZE; ++pos) 
-    {
-
-	r = fgetc(fp);
-
-	if(unlikely(r == EOF))
-	    return false;
-	      
-	if(isspace(r))
-	    return true;
-
-	if(r != name[pos])
-	    return false;
-	
+    if(stream == NULL) {
+	fprintf(stderr, "\nError!  File %s is compressed in a format this build can't read.  Aborting.\n\n", file);
+	exit(1);
     }
 
-    do{
-	r = fgetc(fp);
-
-	if(unlikely(r == EOF))
-	    return false;
-
-    }while(!isspace(r));
-
-    return true;
+    return stream;
 }
 
-static inline bool getKeyFromFileStream(HashKey* key, char* name, FILE* fp)
+static void closeCompressed(char *file, DglfStream *stream)
 {
-    // This version will handle anything!
-    Hk_CLEAR(key);
-
-    char buffer[EDGE_NAME_BUFFER_SIZE];
-    bool starting = true, first = true;
-
-    // First get rid of blank characters
-    while(true)
-    {
-	bool done = false, is_int = true;
-	long pos;
-
-	for(pos = 0; pos < EDGE_NAME_BUFFER_SIZE; ++pos)
-	{
-	    long r;
-
-	    do{
-		r = fgetc(fp);
+    if(!Dglf_CloseStream(stream)) {
+	fprintf(stderr, "\nError!  File %s is corrupt or cut short.  Aborting.\n\n", file);
+	exit(1);
+    }
+}
 
-		if(unlikely(r == EOF))
-		    return false;
+static long loadBinaryGraphs(char *file, const DglfFile *df, DglfSink *sink, long *n_graphs)
+{
+    long lines = Dglb_LoadGraphs(df, sink, n_graphs);
 
-	    }while(unlikely(starting && isspace(r)));
+    if(lines < 0) {
+	fprintf(stderr, "\nError!  File %s is not a dglb file this build can read.  Aborting.\n\n", file);
+	exit(1);
+    }
 
-	    if(isspace(r))
-	    {
-		buffer[pos] = '\0';
-		done = true;
-		if(first && name != NULL)
-		    name[pos] = '\0';
-		break;
-	    }
-	    else
-	    {
-		buffer[pos] = (char)r;
-		starting = false;
-		if(first && name != NULL)
-		    name[pos] = buffer[pos];
+    return lines;
+}
 
-		is_int &= !!isdigit(r);
-	    }
-	}
+// reads the graphs in file into sink, returning the number of individuals
+static long loadIBDGraphs(char *file, DglfSink *sink, long *n_graphs)
+{
+    DglfFile df;
 
-	// Catch case of exactly a 64 character string; this is next;
-	if(unlikely(pos == 0))
-	    return true;
+    if(!Dglf_Open(&df, file)) {
+	fprintf(stderr, "\nError!  File %s not found.  Aborting.\n\n", file);
+	exit(1);
+    }
 
-	if(likely(Hk_ISZERO(key)))
-	{
+    DglfCursor c = {df.data, df.data + df.size};
+    DglfStream *stream = openCompressed(file, &df);
+    long lines;
 
+    if(stream != NULL) {
+	DglfCursor sc = {NULL, NULL, stream};
 
-	    if(likely(done))
-	    {
-		// See if we can use the cheaper integer hash function
-		if(is_int)
-		{
-		    long n = atol(buffer);
-
-		    if(likely(n != 0))
-		    {
-			*key = Hk_FromInt(n);
-			return true;
-		    }
-		}
-
-		*key = Hk_FromCharBuffer(buffer, pos);
-		return true;
-
-	    } else {
-		assert(pos == EDGE_NAME_BUFFER_SIZE);
-		*key = Hk_FromCharBuffer(buffer, EDGE_NAME_BUFFER_SIZE);
-	    }
+	if(Dglb_CursorIsBinary(&sc)) {
+	    // a dglb file is read out of order, so is decompressed whole
+	    DglfFile bf;
+	    Dglf_ReadStream(&sc, &bf);
+	    closeCompressed(file, stream);
+	    lines = loadBinaryGraphs(file, &bf, sink, n_graphs);
+	    Dglf_Close(&bf);
 	} else {
-	    HashKey new_key = Hk_FromCharBuffer(buffer, pos);
-	    Hk_InplaceCombine(key, &new_key);
-
-	    if(done)
-		return true;
+	    // parsed as it is decompressed
+	    lines = Dglf_BuildGraphs(&sc, sink, 1, n_graphs);
+	    closeCompressed(file, stream);
 	}
+    } else if(Dglb_IsBinary(df.data, df.size)) {
+	lines = loadBinaryGraphs(file, &df, sink, n_graphs);
+    } else {
+	lines = Dglf_LoadGraphs(&c, sink, n_graphs);
     }
+
+    Dglf_Close(&df);
+   
+    return (lines / *n_graphs);
 }
 
 static long createIBDGraphs(char *file, IBDGraphList *ibd_graphs)
 {
+    DglfSink sink = Dglf_ListSink(ibd_graphs);
+    long n_graphs;
 
-    long i, lines, k;
-    long ibd0;
-    long ibd1;
-    long changes;
-    long ibd;
-    long change_pos;
-    long cur_range_min = 0;
-    long mr_graph_min = 0;
-
-    IBDGraph *ibd_graph;
-
-    /* char s[33]; */
-    /* s[32] = '\0'; */
-
-    IBDGraphEdge *e;
-    IBDGraphNode *cur_node;
+    return loadIBDGraphs(file, &sink, &n_graphs);
+}
 
-    char edge[EDGE_NAME_BUFFER_SIZE];
+// only the hashes of each graph are kept, so the graphs never all need
+// to be in memory; IBDLocEq_Finish has to be called on the result
+static IBDGraphLocationEquivalences* createLocationEquivalences(char *file, long *n_graphs, long *n_individuals)
+{
+    IBDGraphLocationEquivalences *igeq = NewEmptyIBDGraphLocationEquivalences();
+    DglfSink sink = Dglf_LocationSink(igeq);
 
-    /* Using new functions IBDGraphContainsEdge and IBDGraphContainsNode
-     * to build graphs by starting a new graph when a node is repeated */
+    *n_individuals = loadIBDGraphs(file, &sink, n_graphs);
 
-    ///////////////////////////
-    // Now go through NUM_GRAPHS of ibd graphs and build them
+    return igeq;
+}
 
-    // opening file
-    FILE *fp = fopen(file, "r");
+// writes the graphs in a dglf file out in the binary dglb format
+static void convertToBinary(char *file, char *out_file)
+{
+    DglfFile df;
 
-    if(fp == NULL) {
+    if(!Dglf_Open(&df, file)) {
 	fprintf(stderr, "\nError!  File %s not found.  Aborting.\n\n", file);
 	exit(1);
     }
 
-    /* printf("Preparing graphs.\n\n"); */
-
-    // Creating IBD graphs until file is empty
-
-    /* i keeps track of the number of graphs generated
-     * j keeps track of the number of edges per graph,
-     * useful for error checking */
-
-    /* k keeps the while loop going until reach  EOF */
-
-    i = 1;
-    lines = 0;
-    k = 1;
-	
-    ibd_graph = NewIBDGraph(i); /* since first run through, no edges in graph */
-	
-    /* printf("\nCreated new IBDGraph %d\n\n", i); */
-    
-    HashKey hkey;
-    HashKey key;
-    
-    // running through connections, start by reading a line of input
-    while (getKeyFromFileStream(&key, edge, fp) 
-	   && fscanf(fp, "%ld %ld %ld", &ibd0, &ibd1, &changes) == 3)
-    {
-	lines ++;
-
-	/* printf("Building graph %d\n", i); */
-	/* printf("Read %s %d %d %d\n", edge, ibd0, ibd1, changes); */
-	cur_range_min = mr_graph_min; // check
-
-	//key = Hk_FromInt(edge);
-	hkey = key;
-	
-	// Checking if the edge just read is already in the graph
-	// if so, start a new graph
-	if(IBDGraphContainsEdgeWithHashKey(ibd_graph, key)) 
-	{
-	    Igl_Give(ibd_graphs, ibd_graph);
-	    i++;
-	    mr_graph_min = 0;
-	    ibd_graph = NewIBDGraph(i);
-	    /* printf("** ** **"); */
-	}
-
-	// Adds an edge, with one set of connections, to the graph
-	e = IBDGraphEdgeByHashKey(ibd_graph, key); // edge is the edge_name
-	cur_node = IBDGraphNodeByNumber(ibd_graph, ibd0); // ibd0 is the base_node
-
-	/* H_ExtractHash(s, cur_node); */
-	/* printf("  @@ Adding node %s at range [0, 1)\n", s); */
-		
-	// call function to add the connection
-	IBDGraph_Connect(ibd_graph, e, cur_node, cur_range_min, 1);
-	/* printf("  connecting initial: 0 1\n"); */
-	cur_range_min = 1;
-	cur_node = IBDGraphNodeByNumber(ibd_graph, ibd1);
-	
-	if(changes > 0) // checking if there are changes to manage
-	{
-	    for(k=0; k<changes; k++) // if there are changes, run through and update graph
-	    {
-		fscanf(fp, "%ld %ld", &change_pos, &ibd);
-		/* printf("  Changes %d %d\n", change_pos, ibd); */
-
-		/* H_ExtractHash(s, cur_node); */
-		/* printf("  @@ Adding node %s at range [%d, %d)\n", s, change_pos, ibd); */
-
-		// call function to add the connection
-		IBDGraph_Connect(ibd_graph, e, cur_node, cur_range_min, change_pos);
-		/* printf("  connecting changes: %d %d\n", cur_range_min, change_pos); */
-		cur_range_min = change_pos;
-		cur_node = IBDGraphNodeByNumber(ibd_graph, ibd);
-	    }
-	}
+    if(Dglb_IsBinary(df.data, df.size)) {
+	fprintf(stderr, "\nError!  File %s is already in the dglb format.  Aborting.\n\n", file);
+	exit(1);
+    }
 
-	// no changes in this line so just add connection
-	IBDGraph_Connect(ibd_graph, e, cur_node, cur_range_min, Mr_Plus_Infinity());
+    DglfStream *stream = openCompressed(file, &df);
+    DglfCursor c = {df.data, df.data + df.size, stream};
 
-	/* Reading paired line to above */
-	
-	if (verifyKeyAndAdvanceStream(edge, fp) && fscanf(fp, "%ld %ld %ld", &ibd0, &ibd1, &changes) == 3)
-	{
-	    /* printf("Read %s %d %d %d\n", edge, ibd0, ibd1, changes); */
+    if(stream != NULL)
+	c.pos = c.end = NULL;
 
-	    // Adds an edge, with one set of connections, to the graph
-	    e = IBDGraphEdgeByHashKey(ibd_graph, key); // edge is the edge_name
-	    cur_node = IBDGraphNodeByNumber(ibd_graph, ibd0); // ibd0 is the base_node
+    if(stream != NULL && Dglb_CursorIsBinary(&c)) {
+	fprintf(stderr, "\nError!  File %s is already in the dglb format.  Aborting.\n\n", file);
+	exit(1);
+    }
 
-	    cur_range_min = mr_graph_min; // check
+    if(!Dglb_Convert(&c, out_file)) {
+	fprintf(stderr, "\nError!  Could not write %s.  Aborting.\n\n", out_file);
+	exit(1);
+    }
 
-	    /* H_ExtractHash(s, cur_node); */
-	    /* printf("  @@ Adding node %s at range [0, 1)\n", s); */
-		
-	    // call function to add the connection
-	    IBDGraph_Connect(ibd_graph, e, cur_node, cur_range_min, 1);
-	    /* printf("  connecting initial: 0 1\n"); */
-	    cur_range_min = 1;
-	    cur_node = IBDGraphNodeByNumber(ibd_graph, ibd1);
+    if(stream != NULL)
+	closeCompressed(file, stream);
 
-	    if(changes > 0) // checking if there are changes to manage
-	    {
-		for(k=0; k<changes; k++) // if there are changes, update graph
-		{
-		    fscanf(fp, "%ld %ld", &change_pos, &ibd);
-		    /* printf("  Changes %d %d\n", change_pos, ibd); */
-		    
-		    /* H_ExtractHash(s, cur_node); */
-		    /* printf("  @@ Adding node %s at range [%d, %d)\n", s, change_pos, ibd); */
-
-		    // call function to add the connection
-		    IBDGraph_Connect(ibd_graph, e, cur_node, cur_range_min, change_pos);
-		    /* printf("  connecting changes: %d %d\n", cur_range_min, change_pos); */
-		    cur_range_min = change_pos;
-		    cur_node = IBDGraphNodeByNumber(ibd_graph, ibd);
-		}
-	    }
+    Dglf_Close(&df);
 
-	    // no changes in this line so just add connection
-	    IBDGraph_Connect(ibd_graph, e, cur_node, cur_range_min, Mr_Plus_Infinity());
-	    /* printf("  connecting: %d %d\n", cur_range_min, (int)Mr_Plus_Infinity()); */
-	}
-	else
-	{
-	    printf("  ERROR: Parsing error.");
-	}
-		
-    }
-    
-    Igl_Give(ibd_graphs, ibd_graph);
-
-    fclose(fp);
-   
-    return (lines / i);
+    printf("\nWrote %s.\n", out_file);
 }
 
 
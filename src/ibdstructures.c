@@ -11,6 +11,16 @@
 #include "optimizations.h"
 #include "ksort.h"
 
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Graphs are shared with the hashing threads, so their counts have to
+ * be safe across threads. */
+#ifdef ENABLE_BIASED_REFCOUNT
+#include <pthread.h>
+#define IBD_PARALLEL_HASHING
+#endif
+
 /************************************************************
  *
  *  All the constructors / destructors for the hash table items.
@@ -24,6 +34,10 @@ void _IBDGraph_Construct(IBDGraph *g)
     g->nodes = NewHashTable();
     g->edges = NewHashTable();
     g->dirty = true;
+    g->summary = NULL;
+    g->dirty_nodes = NULL;
+    g->n_dirty_nodes = g->dirty_nodes_size = 0;
+    g->frozen = NULL;
 }
 
 IBDGraph* NewIBDGraph(long id)
@@ -34,16 +48,70 @@ IBDGraph* NewIBDGraph(long id)
     return g;
 }
 
-void _IBDGraph_Destroy(IBDGraph *g)
+static void _IBDGraph_DropTables(IBDGraph *g)
 {
+    if(g->edges == NULL)
+	return;
+
+    /* Uncounted tables are being released with their arena, along
+     * with the nodes and edges in them; the cycles don't matter, and
+     * the tables may be gone already. */
+    if(O_REF_COUNT(g->edges) < 0)
+	return;
+
+    /* Nodes and edges refer to each other; dropping the edges' side
+     * of that breaks the cycles so both get freed. */
+    HashTableIterator *hti = Hti_New(g->edges);
+    IBDGraphEdge *e;
+
+    while(Hti_NEXT((HashObject**)(&e), hti)) {
+	O_DECREF(e->nodes);
+	e->nodes = NULL;
+    }
+
+    Hti_Delete(hti);
+
     O_DECREF(g->nodes);
     O_DECREF(g->edges);
+
+    g->nodes = g->edges = NULL;
+}
+
+static void _IBDFrozenGraph_Delete(IBDFrozenGraph *fg)
+{
+    free(fg->node_keys);
+    free(fg->edge_keys);
+    free(fg->link_offsets);
+    free(fg->link_edges);
+    free(fg->range_offsets);
+    free(fg->ranges);
+    free(fg);
+}
+
+void _IBDGraph_Destroy(IBDGraph *g)
+{
+    _IBDGraph_DropTables(g);
+
+    if(g->frozen != NULL)
+	_IBDFrozenGraph_Delete(g->frozen);
+
+    if(g->graph_hashes != NULL)
+	O_DECREF(g->graph_hashes);
+
+    if(g->current_hash != NULL)
+	O_DECREF(g->current_hash);
+
+    if(g->summary != NULL)
+	O_DECREF(g->summary);
+
+    free(g->dirty_nodes);
 }
 
 /********** IBDGraphNode **********/
 void _IBDGraphNode_Construct(IBDGraphNode *n)
 {
     n->edges = NewHashTable();
+    n->dirty = false;
 }
 
 void _IBDGraphNode_Destroy(IBDGraphNode *n)
@@ -59,7 +127,8 @@ void _IBDGraphEdge_Construct(IBDGraphEdge *e)
 
 void _IBDGraphEdge_Destroy(IBDGraphEdge *e)
 {
-    O_DECREF(e->nodes);
+    if(e->nodes != NULL)
+	O_DECREF(e->nodes);
 }
 
 /********** _IBDGraphNodeReference **********/
@@ -133,6 +202,11 @@ DEFINE_OBJECT(
 
 static inline IBDGraphNode* _IBDGraphNodeByKey(IBDGraph *g, HashKey key)
 {
+    ERROR(g->frozen != NULL, "Nodes of a frozen IBD graph can't be retrieved or added.");
+
+    if(unlikely(g->frozen != NULL))
+	return NULL;
+
     /* See if anything is in there. */
     HashObject *retrieved_n = Ht_ViewByKey(g->nodes, key);
 
@@ -144,7 +218,7 @@ static inline IBDGraphNode* _IBDGraphNodeByKey(IBDGraph *g, HashKey key)
 	assert(n->edges != NULL);
 
 	Hf_COPY_FROM_KEY(n, &key);
-	H_SET_MARKER_INFO(n, Mi_NEW_INVALID());
+	H_GIVE_MARKER_INFO(n, Mi_Intern(Mi_NEW_INVALID()));
 
 	Ht_Give(g->nodes, (HashObject*)n);
 
@@ -166,7 +240,7 @@ IBDGraphNode* IBDGraphNodeByName(IBDGraph *g, const char *name)
 {
     assert(g != NULL);
     IBDGraphNode* n = _IBDGraphNodeByKey(g, Hk_FromString(name));
-    assert(Ht_ContainsByKey(g->nodes, Hk_FromString(name)));
+    assert(n == NULL || Ht_ContainsByKey(g->nodes, Hk_FromString(name)));
     return n;
 }
 
@@ -175,7 +249,7 @@ IBDGraphNode* IBDGraphNodeByNumber(IBDGraph *g, signed long number)
 {
     assert(g != NULL);
     IBDGraphNode* n =  _IBDGraphNodeByKey(g, Hk_FromInt(number));
-    assert(Ht_ContainsByKey(g->nodes, Hk_FromInt(number)));
+    assert(n == NULL || Ht_ContainsByKey(g->nodes, Hk_FromInt(number)));
     return n;
 }
 
@@ -183,7 +257,7 @@ IBDGraphNode* IBDGraphNodeByHashKey(IBDGraph *g, HashKey key)
 {
     assert(g != NULL);
     IBDGraphNode* n = _IBDGraphNodeByKey(g, key);
-    assert(Ht_ContainsByKey(g->nodes, key));
+    assert(n == NULL || Ht_ContainsByKey(g->nodes, key));
     return n;
 }
 
@@ -193,6 +267,11 @@ static inline IBDGraphEdge* _IBDGraphEdgeByKey(IBDGraph *g, HashKey key)
 {
     assert(g != NULL);
 
+    ERROR(g->frozen != NULL, "Edges of a frozen IBD graph can't be retrieved or added.");
+
+    if(unlikely(g->frozen != NULL))
+	return NULL;
+
     Ht_ClearMarkerCache(g->edges);
 
     /* See if anything is in there. */
@@ -204,7 +283,7 @@ static inline IBDGraphEdge* _IBDGraphEdgeByKey(IBDGraph *g, HashKey key)
 	assert(e->nodes != NULL);
 
 	Hf_COPY_FROM_KEY(e, &key);
-	H_SET_MARKER_INFO(e, Mi_NEW_INVALID());
+	H_GIVE_MARKER_INFO(e, Mi_Intern(Mi_NEW_INVALID()));
 	Ht_Give(g->edges, (HashObject*)e);
 
 	assert(Ht_Contains(g->edges, (HashObject*)e));
@@ -247,10 +326,38 @@ IBDGraphEdge* IBDGraphEdgeByHashKey(IBDGraph *g, HashKey key)
  *
  **************************************************/
 
+/* Once a graph has a summary, changing a node takes its old
+ * contribution out of the summary right away, while its edges are
+ * still as they were; the refresh then adds back only those nodes. */
+static inline void _IBDGraph_MarkNodeDirty(IBDGraph *g, IBDGraphNode *n)
+{
+    if(g->summary == NULL || n->dirty)
+	return;
+
+    g->summary = Ht_Summarize_Remove(g->summary, n->edges);
+
+    if(g->n_dirty_nodes == g->dirty_nodes_size)
+    {
+	g->dirty_nodes_size = max(16, 2*g->dirty_nodes_size);
+	g->dirty_nodes = (IBDGraphNode**)realloc(
+	    g->dirty_nodes, sizeof(IBDGraphNode*)*g->dirty_nodes_size);
+	CHECK_MALLOC(g->dirty_nodes);
+    }
+
+    g->dirty_nodes[g->n_dirty_nodes++] = n;
+    n->dirty = true;
+}
+
 void IBDGraph_Connect(IBDGraph *g, IBDGraphEdge *e, IBDGraphNode *n, 
 		      markertype valid_start, markertype valid_end)
 {
     assert(g != NULL);
+
+    ERROR(g->frozen != NULL, "A frozen IBD graph can't be changed.");
+
+    if(unlikely(g->frozen != NULL))
+	return;
+
     assert(e != NULL);
     assert(n != NULL);
 
@@ -260,6 +367,8 @@ void IBDGraph_Connect(IBDGraph *g, IBDGraphEdge *e, IBDGraphNode *n,
     assert(n->edges != NULL);
     assert(e->nodes != NULL);
 
+    _IBDGraph_MarkNodeDirty(g, n);
+
     /* Clear out caches if need be. */
     Ht_ClearMarkerCache(g->edges);
     Ht_ClearMarkerCache(g->nodes);
@@ -273,7 +382,9 @@ void IBDGraph_Connect(IBDGraph *g, IBDGraphEdge *e, IBDGraphNode *n,
     assert(Ht_Contains(g->edges, eh));
 
     /* Now add in the proper marker info to each of the edges and
-     * nodes. */
+     * nodes.  Many references share the same validity set, so these
+     * are interned; adding a range copies a shared set and the
+     * result is interned again. */
 
     HashObject *nr = Ht_View(e->nodes, nh);
     
@@ -281,13 +392,14 @@ void IBDGraph_Connect(IBDGraph *g, IBDGraphEdge *e, IBDGraphNode *n,
     {
 	nr = (HashObject*)NewIBDGraphNodeReference(n);
 	H_COPY_AS_UNMARKED(nr, nh);
-	H_GIVE_MARKER_INFO(nr, Mi_NEW(valid_start, valid_end));
+	H_GIVE_MARKER_INFO(nr, Mi_Intern(Mi_NEW(valid_start, valid_end)));
 	O_Cast(_IBDGraphNodeReference, nr)->node = n;
 	Ht_Give(e->nodes, nr);
     }
     else
     {
 	H_ADD_MARKER_VALID_RANGE(nr, valid_start, valid_end);
+	H_INTERN_MARKER_INFO(nr);
 	assert(O_REF_COUNT(nr) == 1);
 	assert(O_IsType(_IBDGraphNodeReference, nr));
 	assert( ((_IBDGraphNodeReference*)nr)->node == n);
@@ -299,13 +411,14 @@ void IBDGraph_Connect(IBDGraph *g, IBDGraphEdge *e, IBDGraphNode *n,
     {
 	er = (HashObject*)NewIBDGraphEdgeReference(e);
 	H_COPY_AS_UNMARKED(er, eh);
-	H_GIVE_MARKER_INFO(er, Mi_New(valid_start, valid_end));
+	H_GIVE_MARKER_INFO(er, Mi_Intern(Mi_New(valid_start, valid_end)));
 	O_Cast(_IBDGraphEdgeReference, er)->edge = e;
 	Ht_Give(n->edges, er);
     }
     else
     {
 	H_ADD_MARKER_VALID_RANGE(er, valid_start, valid_end);
+	H_INTERN_MARKER_INFO(er);
 	assert(O_REF_COUNT(er) == 1);
 	assert(O_IsType(_IBDGraphEdgeReference, er));
 	assert( ((_IBDGraphEdgeReference*)er)->edge == e);
@@ -327,15 +440,33 @@ static inline void IBDGraph_Refresh(IBDGraph *g)
     if(g->current_hash != NULL)
 	O_DECREF(g->current_hash);
 
-    _HashTableInternalIterator hti;
-    _Hti_INIT(g->nodes, &hti);
-    IBDGraphNode *n;
-    HashSequence *accumulator = NULL;
+    if(g->summary == NULL)
+    {
+	_HashTableInternalIterator hti;
+	_Hti_INIT(g->nodes, &hti);
+	IBDGraphNode *n;
+
+	while(_Hti_NEXT( (HashObject**)(&n), &hti))
+	    g->summary = Ht_Summarize_Update(g->summary, n->edges);
+    }
+    else
+    {
+	/* The summary is a sum over the nodes, and the old
+	 * contributions of these were taken out as they changed. */
+	size_t i;
+
+	for(i = 0; i < g->n_dirty_nodes; ++i)
+	{
+	    IBDGraphNode *n = g->dirty_nodes[i];
+	    g->summary = Ht_Summarize_Update(g->summary, n->edges);
+	    n->dirty = false;
+	}
+    }
 
-    while(_Hti_NEXT( (HashObject**)(&n), &hti))
-	accumulator = Ht_Summarize_Update(accumulator, n->edges);
+    g->n_dirty_nodes = 0;
 
-    g->graph_hashes = Ht_Summarize_Finish(accumulator);
+    /* A graph without nodes has no summary. */
+    g->graph_hashes = (g->summary != NULL) ? Ht_Summarize_Finish(g->summary) : NewHashTable();
     g->current_hash = Ht_HashOfEverything(NULL, g->graph_hashes);
     g->dirty = false;
 }
@@ -442,25 +573,201 @@ bool IBDGraphEqual(IBDGraph *g1, IBDGraph *g2)
     return H_Equal(h1, h2);
 }
 
+/* Binary search in the sorted key arrays of a frozen graph; returns n
+ * if key is not there. */
+static inline size_t _IBDFrozen_Find(const HashKey *keys, size_t n, const HashKey *key)
+{
+    size_t lo = 0, hi = n;
+
+    while(lo < hi)
+    {
+	size_t mid = lo + (hi - lo) / 2;
+
+	if(Hk_LT(&keys[mid], key))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return (lo < n && Hk_EQUAL(&keys[lo], key)) ? lo : n;
+}
+
 bool IBDGraphContainsEdge(IBDGraph *g, IBDGraphEdge *e)
 {
+    if(g->frozen != NULL)
+	return IBDGraphContainsEdgeWithHashKey(g, *H_Hash_RO(e));
+
     return Ht_Contains(g->edges, O_Cast(HashObject, e));
 }
 
 bool IBDGraphContainsEdgeWithHashKey(IBDGraph *g, HashKey key)
 {
+    if(g->frozen != NULL)
+	return (_IBDFrozen_Find(g->frozen->edge_keys, g->frozen->n_edges, &key)
+		!= g->frozen->n_edges);
+
     return Ht_ContainsByKey(g->edges, key);
 }
 
 bool IBDGraphContainsNode(IBDGraph *g, IBDGraphNode *n)
 {
+    if(g->frozen != NULL)
+	return IBDGraphContainsNodeWithHashKey(g, *H_Hash_RO(n));
+
     return Ht_Contains(g->nodes, O_Cast(HashObject, n));
 }
 
 bool IBDGraphContainsNodeWithHashKey(IBDGraph *g, HashKey key)
 {
+    if(g->frozen != NULL)
+	return (_IBDFrozen_Find(g->frozen->node_keys, g->frozen->n_nodes, &key)
+		!= g->frozen->n_nodes);
+
     return Ht_ContainsByKey(g->nodes, key);
 }
+
+/************************************************************
+ *
+ *  Freezing finished graphs.
+ *
+ ************************************************************/
+
+/* The keys of a table, in the table's order, which is sorted. */
+static HashKey* _IBDFrozen_Keys(HashTable *ht, size_t *n)
+{
+    _HashTableInternalIterator hti;
+    HashObject *h;
+    size_t i = 0;
+
+    *n = Ht_Size(ht);
+
+    HashKey *keys = (HashKey*)malloc(sizeof(HashKey)*max(1, *n));
+    CHECK_MALLOC(keys);
+
+    _Hti_INIT(ht, &hti);
+
+    while(_Hti_NEXT(&h, &hti))
+    {
+	keys[i] = *H_Hash_RO(h);
+	assert(i == 0 || Hk_LT(&keys[i-1], &keys[i]));
+	++i;
+    }
+
+    assert(i == *n);
+
+    return keys;
+}
+
+static IBDFrozenGraph* _IBDFrozenGraph_New(IBDGraph *g)
+{
+    IBDFrozenGraph *fg = (IBDFrozenGraph*)malloc(sizeof(IBDFrozenGraph));
+    CHECK_MALLOC(fg);
+
+    fg->node_keys = _IBDFrozen_Keys(g->nodes, &fg->n_nodes);
+    fg->edge_keys = _IBDFrozen_Keys(g->edges, &fg->n_edges);
+
+    /* Count the links first so those arrays are exact; the ranges are
+     * grown as they are read. */
+    _HashTableInternalIterator hti, hti_e;
+    IBDGraphNode *n;
+    HashObject *er;
+    size_t i = 0, ranges_size = 0;
+
+    fg->n_links = 0;
+    _Hti_INIT(g->nodes, &hti);
+
+    while(_Hti_NEXT((HashObject**)(&n), &hti))
+	fg->n_links += Ht_Size(n->edges);
+
+    fg->link_offsets = (size_t*)malloc(sizeof(size_t)*(fg->n_nodes + 1));
+    fg->link_edges = (size_t*)malloc(sizeof(size_t)*max(1, fg->n_links));
+    fg->range_offsets = (size_t*)malloc(sizeof(size_t)*(fg->n_links + 1));
+    fg->ranges = NULL;
+    fg->n_ranges = 0;
+    CHECK_MALLOC(fg->link_offsets);
+    CHECK_MALLOC(fg->link_edges);
+    CHECK_MALLOC(fg->range_offsets);
+
+    fg->link_offsets[0] = 0;
+    fg->range_offsets[0] = 0;
+    _Hti_INIT(g->nodes, &hti);
+
+    while(_Hti_NEXT((HashObject**)(&n), &hti))
+    {
+	size_t k = fg->link_offsets[i];
+
+	_Hti_INIT(n->edges, &hti_e);
+
+	while(_Hti_NEXT(&er, &hti_e))
+	{
+	    fg->link_edges[k] = _IBDFrozen_Find(fg->edge_keys, fg->n_edges, H_Hash_RO(er));
+	    assert(fg->link_edges[k] < fg->n_edges);
+
+	    MarkerIterator *mii = Mii_New(H_Mi(er));
+	    MarkerRange mr;
+
+	    while(Mii_NEXT(&mr, mii))
+	    {
+		if(fg->n_ranges == ranges_size)
+		{
+		    ranges_size = max(16, 2*ranges_size);
+		    fg->ranges = (MarkerRange*)realloc(fg->ranges, sizeof(MarkerRange)*ranges_size);
+		    CHECK_MALLOC(fg->ranges);
+		}
+
+		fg->ranges[fg->n_ranges++] = mr;
+	    }
+
+	    Mii_Delete(mii);
+
+	    fg->range_offsets[++k] = fg->n_ranges;
+	}
+
+	fg->link_offsets[++i] = k;
+    }
+
+    assert(i == fg->n_nodes);
+    assert(fg->link_offsets[i] == fg->n_links);
+
+    if(fg->n_ranges != 0)
+    {
+	fg->ranges = (MarkerRange*)realloc(fg->ranges, sizeof(MarkerRange)*fg->n_ranges);
+	CHECK_MALLOC(fg->ranges);
+    }
+
+    return fg;
+}
+
+void IBDGraph_Freeze(IBDGraph *g)
+{
+    if(g->frozen != NULL)
+	return;
+
+    IBDGraph_Refresh(g);
+
+    /* Otherwise the first query to need it builds this lazily, and
+     * would be writing to a graph other threads may be reading. */
+    Ht_BuildMarkerCache(g->graph_hashes);
+
+    g->frozen = _IBDFrozenGraph_New(g);
+
+    _IBDGraph_DropTables(g);
+
+    if(g->summary != NULL)
+    {
+	O_DECREF(g->summary);
+	g->summary = NULL;
+    }
+
+    free(g->dirty_nodes);
+    g->dirty_nodes = NULL;
+    g->dirty_nodes_size = 0;
+}
+
+bool IBDGraphIsFrozen(IBDGraph *g)
+{
+    return (g->frozen != NULL);
+}
     
 /************************************************************
  *
@@ -479,8 +786,42 @@ void IBDGraph_Print(IBDGraph *g)
     Ht_Print(g->graph_hashes);
 }
 
+static void _IBDFrozenGraph_debug_Print(IBDFrozenGraph *fg)
+{
+    size_t i, k, r;
+
+    printf("##>>>> FROZEN: %lu nodes, %lu edges <<<< ######################\n\n",
+	   (unsigned long)fg->n_nodes, (unsigned long)fg->n_edges);
+
+    for(i = 0; i < fg->n_nodes; ++i)
+    {
+	printf("\n>> Node ");
+	Hk_debug_PrintHash(&fg->node_keys[i]);
+	printf("\n");
+
+	for(k = fg->link_offsets[i]; k < fg->link_offsets[i+1]; ++k)
+	{
+	    printf("   Edge ");
+	    Hk_debug_PrintHash(&fg->edge_keys[fg->link_edges[k]]);
+	    printf("\n");
+
+	    for(r = fg->range_offsets[k]; r < fg->range_offsets[k+1]; ++r)
+		printf("     [%ld, %ld)\n", fg->ranges[r].start, fg->ranges[r].end);
+	}
+    }
+}
+
 void IBDGraph_debug_Print(IBDGraph *g)
 {
+    if(g->frozen != NULL)
+    {
+	_IBDFrozenGraph_debug_Print(g->frozen);
+
+	printf("##>>>> Hash List <<<< ######################\n\n");
+	Ht_debug_Print(g->graph_hashes);
+	return;
+    }
+
     printf("##>>>> EDGES <<<< ######################\n\n");
     Ht_debug_Print(g->edges);
 
@@ -539,26 +880,77 @@ IBDGraph* Igl_ViewItem(IBDGraphList* gl, size_t index)
     return Igl_AtIndex(gl, index);
 }
 
-/* These functions add in the bins. */
-static inline void _IGLBins_AddItem(HashTable *bc, const HashKey *key, IBDGraph* g)
+/* Grouping by hash.  Keys are put in the order the hash tables keep
+ * them in, with equal keys left in the order they came; a class is
+ * then a run of equal keys. */
+
+typedef struct {
+    uint64_t key;
+    size_t index;
+} _IBDSortItem;
+
+/* Sets order[i] to the index of the i-th key in that order.  A stable
+ * radix sort on the leading 64 bits does nearly all the work; keys
+ * that share those are finished off by comparing them in full. */
+static void _IBD_SortKeys(const HashKey *keys, size_t n, size_t *order)
 {
-    assert(bc != NULL);
+    _IBDSortItem *a = (_IBDSortItem*)malloc(sizeof(_IBDSortItem) * max(1, n));
+    _IBDSortItem *b = (_IBDSortItem*)malloc(sizeof(_IBDSortItem) * max(1, n));
+    size_t counts[8][256];
+    size_t i, j, d;
 
-    HashObject *h = Ht_ViewByKey(bc, *key);
-    IBDGraphList *gl;
+    CHECK_MALLOC(a);
+    CHECK_MALLOC(b);
 
-    if(h == NULL)
-    {
-	gl = NewIBDGraphList();
-	Hf_COPY_FROM_KEY(gl, key);
-	Ht_Give(bc, O_Cast(HashObject, gl));
+    memset(counts, 0, sizeof(counts));
+
+    for(i = 0; i < n; ++i) {
+	a[i].key = keys[i].hk64[HK64I(0)];
+	a[i].index = i;
+
+	for(d = 0; d < 8; ++d)
+	    ++counts[d][(a[i].key >> (8*d)) & 0xff];
     }
-    else
-    {
-	gl = O_Cast(IBDGraphList, h);
+
+    for(d = 0; d < 8 && n != 0; ++d) {
+	/* A byte that's the same everywhere leaves the order alone. */
+	if(counts[d][(a[0].key >> (8*d)) & 0xff] == n)
+	    continue;
+
+	size_t pos = 0;
+	for(j = 0; j < 256; ++j) {
+	    size_t c = counts[d][j];
+	    counts[d][j] = pos;
+	    pos += c;
+	}
+
+	for(i = 0; i < n; ++i)
+	    b[counts[d][(a[i].key >> (8*d)) & 0xff]++] = a[i];
+
+	_IBDSortItem *t = a; a = b; b = t;
     }
 
-    Igl_Append(gl, g);
+    /* Insertion sort over each run sharing the leading bits; such runs
+     * are nearly always of equal keys, which it passes over. */
+    for(i = 0; i < n; i = j) {
+	for(j = i + 1; j < n && a[j].key == a[i].key; ++j) {
+	    _IBDSortItem x = a[j];
+	    size_t k = j;
+
+	    while(k > i && Hk_LT(&keys[x.index], &keys[a[k-1].index])) {
+		a[k] = a[k-1];
+		--k;
+	    }
+
+	    a[k] = x;
+	}
+    }
+
+    for(i = 0; i < n; ++i)
+	order[i] = a[i].index;
+
+    free(a);
+    free(b);
 }
 
 /************************************************************
@@ -583,47 +975,49 @@ DEFINE_OBJECT(
     /* delete */    _IBDGraphEquivalences_Destroy);
 
 
-IBDGraphEquivalences* NewIBDGraphEquivalences(HashTable *ht, size_t n_graphs)
+/* Groups the graphs by their keys; keys[i] is that of graphs[i]. */
+static IBDGraphEquivalences* NewIBDGraphEquivalences(IBDGraph **graphs, const HashKey *keys, size_t n_graphs)
 {
     IBDGraphEquivalences *ige = ALLOCATEIBDGraphEquivalences();
 
-    ige->n_classes = Ht_SIZE(ht);
-    ige->classes = (_IBDGraphEquivalenceClass*)malloc(
-	sizeof(_IBDGraphEquivalenceClass) * ige->n_classes);
-    ige->graphs = (IBDGraph**) malloc(sizeof(IBDGraph*) * n_graphs);
-    ige->n_graphs = n_graphs;
+    size_t *order = (size_t*)malloc(sizeof(size_t) * max(1, n_graphs));
+    CHECK_MALLOC(order);
 
-    _HashTableInternalIterator hti;
+    _IBD_SortKeys(keys, n_graphs, order);
 
-    /* Hash Table stuff -- this one is always valid. */
-    _Hti_INIT(ht, &hti);
+    size_t g_idx, n_classes = 0;
 
-    size_t cl_idx = 0, g_idx = 0;
-    IBDGraphList *gl = NULL;
-    
-    while(_Hti_NEXT(O_CastPtr(HashObject, &gl), &hti))
-    {
-	ige->classes[cl_idx].n_graphs = Igl_Size(gl);
-	ige->classes[cl_idx].graphs = &(ige->graphs[g_idx]);
+    for(g_idx = 0; g_idx < n_graphs; ++g_idx)
+	if(g_idx == 0 || !Hk_EQUAL(&keys[order[g_idx]], &keys[order[g_idx - 1]]))
+	    ++n_classes;
 
-	IBDGraphListIterator gli;
-    	Igli_INIT(gl, &gli);
+    ige->n_classes = n_classes;
+    ige->classes = (_IBDGraphEquivalenceClass*)malloc(
+	sizeof(_IBDGraphEquivalenceClass) * max(1, n_classes));
+    ige->graphs = (IBDGraph**) malloc(sizeof(IBDGraph*) * max(1, n_graphs));
+    ige->n_graphs = n_graphs;
 
-	size_t count = 0;
-	IBDGraph *g;
-	while(Igli_NEXT(&g, &gli)) {
-	    O_INCREF(g);
-	    ige->graphs[g_idx++] = g;
-	    assert(ige->classes[cl_idx].graphs[count] == g);
+    size_t cl_idx = 0;
 
-	    ++count;
+    for(g_idx = 0; g_idx < n_graphs; ++g_idx)
+    {
+	if(g_idx == 0 || !Hk_EQUAL(&keys[order[g_idx]], &keys[order[g_idx - 1]]))
+	{
+	    ige->classes[cl_idx].n_graphs = 0;
+	    ige->classes[cl_idx].graphs = &(ige->graphs[g_idx]);
+	    ++cl_idx;
 	}
 
-	assert(count == Igl_Size(gl));
-    
-	++cl_idx;
+	IBDGraph *g = graphs[order[g_idx]];
+	O_INCREF(g);
+	ige->graphs[g_idx] = g;
+	++ige->classes[cl_idx - 1].n_graphs;
     }
 
+    assert(cl_idx == n_classes);
+
+    free(order);
+
 #ifdef RUN_CONSISTENCY_CHECKS
 
     IGEIterator *it = Igei_New(ige);
@@ -661,82 +1055,181 @@ IBDGraphEquivalences* NewIBDGraphEquivalences(HashTable *ht, size_t n_graphs)
     return ige;
 }
 
-IBDGraphEquivalences* IBDGraphEquivalenceClassesAtMarker(IBDGraphList *gl, markertype m)
-{
-    HashTable *ht = NewHashTable();
-    
-    IBDGraphListIterator gli;
-    IBDGraph* g;
-    Igli_INIT(gl, &gli);
+/* Hashing the graphs for the equivalence classes.  Each graph's key
+ * goes into its slot of an array, on several threads when there are
+ * any; binning the keys afterwards in list order keeps the classes,
+ * and the order of the graphs in them, the same however many threads
+ * there were. */
+
+typedef enum {
+    _IBD_HASH_AT_MARKER,
+    _IBD_HASH_OF_MARKER_RANGE,
+    _IBD_HASH_OF_EVERYTHING
+} _IBDHashMode;
+
+typedef struct {
+    IBDGraph **graphs;
+    HashKey *keys;
+    size_t n_graphs;
+    _IBDHashMode mode;
+    markertype start, end;
+#ifdef IBD_PARALLEL_HASHING
+    size_t n_chunks, next_chunk;
+#endif
+} _IBDHashJob;
 
+static void _IBD_HashGraphs(_IBDHashJob *job, size_t first, size_t last)
+{
     HashObject *h = NewHashObject();
+    size_t i;
 
-    while(Igli_NEXT(&g, &gli))
+    for(i = first; i < last; ++i)
     {
+	IBDGraph *g = job->graphs[i];
+
 	if(g->dirty)
 	    IBDGraph_Refresh(g);
 
-	Ht_HashAtMarkerPoint(h, g->graph_hashes, m);
-	_IGLBins_AddItem(ht, H_Hash_RO(h), g);
+	switch(job->mode) {
+	case _IBD_HASH_AT_MARKER:
+	    Ht_HashAtMarkerPoint(h, g->graph_hashes, job->start);
+	    break;
+	case _IBD_HASH_OF_MARKER_RANGE:
+	    Ht_HashOfMarkerRange(h, g->graph_hashes, job->start, job->end);
+	    break;
+	case _IBD_HASH_OF_EVERYTHING:
+	    Ht_HashOfEverything(h, g->graph_hashes);
+	    break;
+	}
+
+	job->keys[i] = *H_Hash_RO(h);
     }
 
     O_DECREF(h);
+}
 
-    IBDGraphEquivalences* ige = NewIBDGraphEquivalences(ht, Igl_Size(gl));
-    O_DECREF(ht);
-    return ige;
+size_t IBD_NumThreads(void)
+{
+    const char *s = getenv("HASHREDUCE_THREADS");
+    long n = (s != NULL) ? strtol(s, NULL, 10) : 0;
+
+    if(n < 1)
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (n < 1) ? 1 : (size_t)n;
 }
 
-IBDGraphEquivalences* IBDGraphEquivalenceClasses(IBDGraphList *gl)
+#ifdef IBD_PARALLEL_HASHING
+
+/* Graphs per thread; more pieces than threads evens out the load. */
+#define IBD_HASH_CHUNKS_PER_THREAD 8
+
+static void* _IBD_HashWorker(void *arg)
 {
-    HashTable *ht = NewHashTable();
-    
-    IBDGraphListIterator gli;
-    IBDGraph* g;
-    Igli_INIT(gl, &gli);
+    _IBDHashJob *job = (_IBDHashJob*)arg;
+    size_t k;
 
-    HashObject* h = NewHashObject();
+    while((k = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED)) < job->n_chunks)
+	_IBD_HashGraphs(job, (k * job->n_graphs) / job->n_chunks, 
+			((k + 1) * job->n_graphs) / job->n_chunks);
 
-    while(Igli_NEXT(&g, &gli))
-    {
-	if(g->dirty)
-	    IBDGraph_Refresh(g);
+    O_MergeRefCounts();
 
-	Ht_HashOfEverything(h, g->graph_hashes);
-	_IGLBins_AddItem(ht, H_Hash_RO(h), g);
-    }
+    return NULL;
+}
 
-    IBDGraphEquivalences* ige = NewIBDGraphEquivalences(ht, Igl_Size(gl));
-    O_DECREF(ht);
-    O_DECREF(h);
-    return ige;
+/* What the workers allocate in refreshing dirty graphs stays with the
+ * graphs after they exit, so is made unbiased. */
+static void* _IBD_HashThread(void *arg)
+{
+    O_BiasNewObjects(false);
+
+    return _IBD_HashWorker(arg);
 }
 
-IBDGraphEquivalences* IBDGraphEquivalenceClassesOfMarkerRange(IBDGraphList *gl, markertype start, markertype end)
+static void _IBD_HashGraphsInParallel(_IBDHashJob *job)
 {
-    HashTable *ht = NewHashTable();
-    
-    IBDGraphListIterator gli;
-    IBDGraph* g;
-    Igli_INIT(gl, &gli);
+    size_t n_threads = IBD_NumThreads(), k;
 
-    HashObject* h = NewHashObject();
+    job->n_chunks = max(1, min(job->n_graphs, IBD_HASH_CHUNKS_PER_THREAD * n_threads));
+    job->next_chunk = 0;
+    n_threads = min(n_threads, job->n_chunks);
 
-    while(Igli_NEXT(&g, &gli))
+    if(n_threads < 2)
     {
-	if(g->dirty)
-	    IBDGraph_Refresh(g);
-
-	Ht_HashOfMarkerRange(h, g->graph_hashes, start, end);
-	_IGLBins_AddItem(ht, H_Hash_RO(h), g);
+	_IBD_HashGraphs(job, 0, job->n_graphs);
+	return;
     }
 
-    IBDGraphEquivalences* ige = NewIBDGraphEquivalences(ht, Igl_Size(gl));
-    O_DECREF(ht);
-    O_DECREF(h);
+    pthread_t *threads = (pthread_t*)malloc(n_threads*sizeof(pthread_t));
+    size_t n_started = 0;
+
+    CHECK_MALLOC(threads);
+
+    /* This thread takes chunks too, so a thread that fails to start
+     * only slows things down. */
+    for(k = 1; k < n_threads; ++k)
+	if(pthread_create(&threads[n_started], NULL, _IBD_HashThread, job) == 0)
+	    ++n_started;
+
+    _IBD_HashWorker(job);
+
+    for(k = 0; k < n_started; ++k)
+	pthread_join(threads[k], NULL);
+
+    free(threads);
+}
+
+#endif
+
+static IBDGraphEquivalences* _IBDGraphEquivalencesByHash(
+    IBDGraphList *gl, _IBDHashMode mode, markertype start, markertype end)
+{
+    _IBDHashJob job;
+    size_t i, n = Igl_Size(gl);
+
+    job.graphs = (IBDGraph**)malloc(sizeof(IBDGraph*) * max(1, n));
+    job.keys = (HashKey*)malloc(sizeof(HashKey) * max(1, n));
+    job.n_graphs = n;
+    job.mode = mode;
+    job.start = start;
+    job.end = end;
+
+    CHECK_MALLOC(job.graphs);
+    CHECK_MALLOC(job.keys);
+
+    for(i = 0; i < n; ++i)
+	job.graphs[i] = Igl_ViewItem(gl, i);
+
+#ifdef IBD_PARALLEL_HASHING
+    _IBD_HashGraphsInParallel(&job);
+#else
+    _IBD_HashGraphs(&job, 0, n);
+#endif
+
+    IBDGraphEquivalences* ige = NewIBDGraphEquivalences(job.graphs, job.keys, n);
+
+    free(job.graphs);
+    free(job.keys);
+
     return ige;
 }
 
+IBDGraphEquivalences* IBDGraphEquivalenceClassesAtMarker(IBDGraphList *gl, markertype m)
+{
+    return _IBDGraphEquivalencesByHash(gl, _IBD_HASH_AT_MARKER, m, m);
+}
+
+IBDGraphEquivalences* IBDGraphEquivalenceClasses(IBDGraphList *gl)
+{
+    return _IBDGraphEquivalencesByHash(gl, _IBD_HASH_OF_EVERYTHING, 0, 0);
+}
+
+IBDGraphEquivalences* IBDGraphEquivalenceClassesOfMarkerRange(IBDGraphList *gl, markertype start, markertype end)
+{
+    return _IBDGraphEquivalencesByHash(gl, _IBD_HASH_OF_MARKER_RANGE, start, end);
+}
+
 LOCAL_MEMORY_POOL(IGEIterator);
 
 IGEIterator *Igei_New(IBDGraphEquivalences *ige)
@@ -859,10 +1352,25 @@ DEFINE_NEW_SEQUENCE_OBJECT(IBDGraphLocationList, HashObject, HASHOBJECT_ITEMS,
 
 void _IBDGraphLocationEquivalences_Destroy(IBDGraphLocationEquivalences * ibdle)
 {
-    O_DECREF(ibdle->graphs);
+    if(ibdle->graphs != NULL)
+	O_DECREF(ibdle->graphs);
+
+    free(ibdle->pending_keys);
+    free(ibdle->pending);
+
+    if(ibdle->location_lists != NULL) {
+	IBDGraphLocation *loc;
+
+	for(loc = ibdle->location_lists[0]; 
+	    loc != ibdle->location_lists[ibdle->n_equivalences]; ++loc) 
+	{
+	    if(loc->graph != NULL)
+		O_DECREF(loc->graph);
+	}
 
-    free(ibdle->location_lists[0]);
-    free(ibdle->location_lists);
+	free(ibdle->location_lists[0]);
+	free(ibdle->location_lists);
+    }
 }
 
 DEFINE_OBJECT(
@@ -875,92 +1383,144 @@ DEFINE_OBJECT(
  * Okay now for the real functions
  ****************************************/ 
 
-IBDGraphLocationEquivalences* NewIBDGraphLocationEquivalences(IBDGraphList *igl)
+IBDGraphLocationEquivalences* NewEmptyIBDGraphLocationEquivalences()
 {
     IBDGraphLocationEquivalences *loc_eq = ALLOCATEIBDGraphLocationEquivalences();
-    loc_eq->graphs = igl;
-    O_INCREF(loc_eq->graphs);
-    
 
-    /* Now populate the lookup tables. */
+    loc_eq->graphs = NULL;
+    loc_eq->pending_keys = NULL;
+    loc_eq->pending = NULL;
+    loc_eq->n_pending = loc_eq->pending_size = 0;
+    loc_eq->location_lists = NULL;
+    loc_eq->n_equivalences = 0;
 
-    IBDGraphLocation loc;
-    IBDGraph *g;
-    
-    IBDGraphListIterator gli;
-    
-    HashTable *le_ht = NewHashTable();
+    return loc_eq;
+}
 
-    size_t n_locs = 0;
+static void _IBDLocEq_Append(IBDGraphLocationEquivalences *loc_eq, const HashKey *hk, 
+			     const IBDGraphLocation *loc)
+{
+    assert(loc_eq->location_lists == NULL);
+
+    if(loc_eq->n_pending == loc_eq->pending_size) {
+	loc_eq->pending_size = max(64, 2*loc_eq->pending_size);
+	loc_eq->pending_keys = (HashKey*)realloc(
+	    loc_eq->pending_keys, sizeof(HashKey)*loc_eq->pending_size);
+	loc_eq->pending = (IBDGraphLocation*)realloc(
+	    loc_eq->pending, sizeof(IBDGraphLocation)*loc_eq->pending_size);
+	CHECK_MALLOC(loc_eq->pending_keys);
+	CHECK_MALLOC(loc_eq->pending);
+    }
 
-    Igli_INIT(igl, &gli);
+    loc_eq->pending_keys[loc_eq->n_pending] = *hk;
+    loc_eq->pending[loc_eq->n_pending] = *loc;
+    ++loc_eq->n_pending;
+}
 
-    while(Igli_NEXT(&g, &gli)) {
-	IBDGraph_Refresh(g);
+static void _IBDLocEq_AddGraph(IBDGraphLocationEquivalences *loc_eq, IBDGraph *g, bool keep_graph)
+{
+    IBDGraph_Refresh(g);
 	
-	HashTableMarkerIterator* htmi = Htmi_New(g->graph_hashes);
-	HashValidityItem hvi;
+    HashTableMarkerIterator* htmi = Htmi_New(g->graph_hashes);
+    HashValidityItem hvi;
 
-	while(Htmi_NEXT(&hvi, htmi)) {
+    IBDGraphLocation loc;
+    loc.graph = keep_graph ? g : NULL;
+    loc.graph_id = g->id;
 
-	    HashObject *h = Ht_ViewByKey(le_ht, hvi.hk);
+    while(Htmi_NEXT(&hvi, htmi)) {
+	loc.start = hvi.start;
+	loc.end = hvi.end;
 
-	    if(h == NULL) {
-		IBDGraphLocationList *igll_t = NewIBDGraphLocationList();
-		Hf_COPY_FROM_KEY(igll_t, &hvi.hk);
-		h = O_Cast(HashObject, igll_t);
-		Ht_Give(le_ht, h);
-	    }
+	_IBDLocEq_Append(loc_eq, &hvi.hk, &loc);
+    }
 
-	    IBDGraphLocationList *igll = O_Cast(IBDGraphLocationList, h);
+    Htmi_Finish(htmi);
+}
 
-	    IBDGraphLocation loc;
-	    loc.graph = g;
-	    loc.start = hvi.start;
-	    loc.end = hvi.end;
+void IBDLocEq_AddGraph(IBDGraphLocationEquivalences *loc_eq, IBDGraph *g)
+{
+    _IBDLocEq_AddGraph(loc_eq, g, false);
+}
 
-	    Igll_Append(igll, loc);
-	    ++n_locs;
-	}
+void IBDLocEq_AddLocation(IBDGraphLocationEquivalences *loc_eq, const HashKey *hk, 
+			  long graph_id, markertype start, markertype end)
+{
+    IBDGraphLocation loc;
+    loc.graph = NULL;
+    loc.graph_id = graph_id;
+    loc.start = start;
+    loc.end = end;
 
-	Htmi_Finish(htmi);
-    }
+    _IBDLocEq_Append(loc_eq, hk, &loc);
+}
+
+void IBDLocEq_Finish(IBDGraphLocationEquivalences *loc_eq)
+{
+    size_t n_locs = loc_eq->n_pending;
+    const HashKey *keys = loc_eq->pending_keys;
+
+    size_t *order = (size_t*)malloc(sizeof(size_t) * max(1, n_locs));
+    CHECK_MALLOC(order);
+
+    _IBD_SortKeys(keys, n_locs, order);
 
-    size_t n_classes = loc_eq->n_equivalences = Ht_SIZE(le_ht);
+    size_t i, n_classes = 0;
 
-    /* Go through the groups in the hash table. */
-    HashTableIterator* hti = Hti_New(le_ht);
-    IBDGraphLocationList *igll;
+    for(i = 0; i < n_locs; ++i)
+	if(i == 0 || !Hk_EQUAL(&keys[order[i]], &keys[order[i - 1]]))
+	    ++n_classes;
 
-    IBDGraphLocation *loc_v = (IBDGraphLocation*) malloc(sizeof(IBDGraphLocation) * n_locs);
+    loc_eq->n_equivalences = n_classes;
+
+    IBDGraphLocation *loc_v = (IBDGraphLocation*) malloc(sizeof(IBDGraphLocation) * max(1, n_locs));
 
     loc_eq->location_lists = (IBDGraphLocation**) malloc(sizeof(IBDGraphLocation*) * (n_classes + 1));
 
-    loc_eq->location_lists[0] = loc_v;
+    CHECK_MALLOC(loc_v);
+    CHECK_MALLOC(loc_eq->location_lists);
 
     size_t class_index = 0;
 
-    while(Hti_NEXT( (HashObject**)(&igll), hti)) {
-	
-	assert(class_index < n_classes);
-	loc_eq->location_lists[class_index] = loc_v;
+    for(i = 0; i < n_locs; ++i) {
+	if(i == 0 || !Hk_EQUAL(&keys[order[i]], &keys[order[i - 1]]))
+	    loc_eq->location_lists[class_index++] = loc_v + i;
 
-	IBDGraphLocationListIterator *lli = Iglli_New(igll);
+	loc_v[i] = loc_eq->pending[order[i]];
 
-	while(Iglli_NEXT(loc_v, lli)) {
-	    O_INCREF(loc_v->graph);
-	    ++loc_v;
-	}
+	if(loc_v[i].graph != NULL)
+	    O_INCREF(loc_v[i].graph);
+    }
 
-	Iglli_Finish(lli);
+    assert(class_index == n_classes);
+    loc_eq->location_lists[n_classes] = loc_v + n_locs;
 
-	++class_index;
-    }
+    free(order);
+    free(loc_eq->pending_keys);
+    free(loc_eq->pending);
 
-    loc_eq->location_lists[class_index] = loc_v;
+    loc_eq->pending_keys = NULL;
+    loc_eq->pending = NULL;
+    loc_eq->n_pending = loc_eq->pending_size = 0;
+}
 
-    Hti_Delete(hti);
-    O_DECREF(le_ht);
+IBDGraphLocationEquivalences* NewIBDGraphLocationEquivalences(IBDGraphList *igl)
+{
+    IBDGraphLocationEquivalences *loc_eq = NewEmptyIBDGraphLocationEquivalences();
+    loc_eq->graphs = igl;
+    O_INCREF(loc_eq->graphs);
+
+    /* Now populate the lookup tables. */
+
+    IBDGraph *g;
+    IBDGraphListIterator gli;
+
+    Igli_INIT(igl, &gli);
+
+    while(Igli_NEXT(&g, &gli))
+	_IBDLocEq_AddGraph(loc_eq, g, true);
+
+    IBDLocEq_Finish(loc_eq);
 
     return loc_eq;
 }
@@ -991,7 +1551,7 @@ void IBDGraphLocationEquivalences_Print(IBDGraphLocationEquivalences* ibdle)
 	for(j = 0; j < IBDLocEq_ClassSize(ibdle, i); ++j) {
 
 	    printf("(%ld:%ld-%ld) ", 
-		   IBDLocEq_ViewItem(ibdle, i, j)->graph->id,
+		   IBDLocEq_ViewItem(ibdle, i, j)->graph_id,
 		   IBDLocEq_ViewItem(ibdle, i, j)->start, 
 		   IBDLocEq_ViewItem(ibdle, i, j)->end);
 	}
@@ -999,3 +1559,428 @@ void IBDGraphLocationEquivalences_Print(IBDGraphLocationEquivalences* ibdle)
 	printf("\n");
     }
 }
+
+/********************************************************************************
+ *
+ *  Sweeping along the markers.
+ *
+ ********************************************************************************/
+
+DEFINE_OBJECT(
+    /* Name. */     _IBDSweepClass,
+    /* BaseType */  HashObject,
+    /* construct */ NULL,
+    /* delete */    NULL);
+
+#define _IBDSWEEP_NONE ((size_t)-1)
+
+void _IBDGraphClassSweep_Destroy(IBDGraphClassSweep *sweep)
+{
+    size_t i;
+    for(i = 0; i < sweep->n_slots; ++i)
+	Htmi_Finish(sweep->slots[i].htmi);
+
+    O_DECREF(sweep->graphs);
+    O_DECREF(sweep->classes);
+
+    free(sweep->slots);
+    free(sweep->heap);
+    free(sweep->moved);
+    free(sweep->groups);
+    free(sweep->groups_by_hash);
+    free(sweep->class_info);
+    free(sweep->free_indices);
+    free(sweep->emptied_indices);
+    free(sweep->changes);
+}
+
+DEFINE_OBJECT(
+    /* Name. */     IBDGraphClassSweep,
+    /* BaseType */  Object,
+    /* construct */ NULL,
+    /* delete */    _IBDGraphClassSweep_Destroy);
+
+/* The heap puts the slot whose current hash ends first on top. */
+typedef _IBDSweepSlot* _ibdsweepslot_ptr;
+
+static inline bool _IBDSweep_ends_later(_ibdsweepslot_ptr s1, _ibdsweepslot_ptr s2)
+{
+    return (s1->hvi.end > s2->hvi.end);
+}
+
+/* The graphs moving at a breakpoint are grouped by the class they
+ * leave and the hash they move on to, in list order within a group. */
+static inline bool _IBDSweep_batch_lt(_ibdsweepslot_ptr s1, _ibdsweepslot_ptr s2)
+{
+    if(s1->class_index != s2->class_index)
+	return (s1->class_index < s2->class_index);
+
+    if(!Hk_EQUAL(&(s1->hvi.hk), &(s2->hvi.hk)))
+	return Hk_LT(&(s1->hvi.hk), &(s2->hvi.hk));
+
+    return (s1 < s2);
+}
+
+typedef _IBDSweepGroup* _ibdsweepgroup_ptr;
+
+static inline bool _IBDSweep_group_hash_lt(_ibdsweepgroup_ptr g1, _ibdsweepgroup_ptr g2)
+{
+    return Hk_LT(&(g1->members[0]->hvi.hk), &(g2->members[0]->hvi.hk));
+}
+
+static inline bool _IBDSweep_graph_order_lt(_ibdsweepslot_ptr s1, _ibdsweepslot_ptr s2)
+{
+    return (s1 < s2);
+}
+
+KSORT_INIT(sweep_heap, _ibdsweepslot_ptr, _IBDSweep_ends_later);
+KSORT_INIT(sweep_batch, _ibdsweepslot_ptr, _IBDSweep_batch_lt);
+KSORT_INIT(sweep_groups, _ibdsweepgroup_ptr, _IBDSweep_group_hash_lt);
+KSORT_INIT(sweep_graph_order, _ibdsweepslot_ptr, _IBDSweep_graph_order_lt);
+
+/* The index of the class holding graphs with hash hk, created if need
+ * be. */
+static size_t _IBDSweep_ClassIndex(IBDGraphClassSweep *sweep, const HashKey *hk)
+{
+    HashObject *h = Ht_ViewByKey(sweep->classes, *hk);
+
+    if(h != NULL)
+	return O_Cast(_IBDSweepClass, h)->index;
+
+    size_t index;
+
+    if(sweep->n_free != 0) {
+	index = sweep->free_indices[--sweep->n_free];
+    } else {
+	if(sweep->n_class_indices == sweep->class_info_size) {
+	    sweep->class_info_size = max(16, 2*sweep->class_info_size);
+	    sweep->class_info = (_IBDSweepClassInfo*)realloc(
+		sweep->class_info, sizeof(_IBDSweepClassInfo)*sweep->class_info_size);
+	    sweep->free_indices = (size_t*)realloc(
+		sweep->free_indices, sizeof(size_t)*sweep->class_info_size);
+	    sweep->emptied_indices = (size_t*)realloc(
+		sweep->emptied_indices, sizeof(size_t)*sweep->class_info_size);
+	    CHECK_MALLOC(sweep->class_info);
+	    CHECK_MALLOC(sweep->free_indices);
+	    CHECK_MALLOC(sweep->emptied_indices);
+	}
+
+	index = sweep->n_class_indices++;
+    }
+
+    _IBDSweepClass *cl = ALLOCATE_IBDSweepClass();
+    Hf_COPY_FROM_KEY(cl, hk);
+    cl->index = index;
+    Ht_Give(sweep->classes, O_Cast(HashObject, cl));
+
+    _IBDSweepClassInfo *info = &(sweep->class_info[index]);
+    info->hk = *hk;
+    info->size = 0;
+    info->first = _IBDSWEEP_NONE;
+    info->keyed = true;
+
+    return index;
+}
+
+static void _IBDSweep_Join(IBDGraphClassSweep *sweep, size_t slot_index, size_t class_index)
+{
+    _IBDSweepSlot *slot = &(sweep->slots[slot_index]);
+    _IBDSweepClassInfo *info = &(sweep->class_info[class_index]);
+
+    slot->class_index = class_index;
+    slot->prev = _IBDSWEEP_NONE;
+    slot->next = info->first;
+
+    if(info->first != _IBDSWEEP_NONE)
+	sweep->slots[info->first].prev = slot_index;
+
+    info->first = slot_index;
+    ++info->size;
+}
+
+static void _IBDSweep_Leave(IBDGraphClassSweep *sweep, size_t slot_index)
+{
+    _IBDSweepSlot *slot = &(sweep->slots[slot_index]);
+    _IBDSweepClassInfo *info = &(sweep->class_info[slot->class_index]);
+
+    if(slot->prev != _IBDSWEEP_NONE)
+	sweep->slots[slot->prev].next = slot->next;
+    else
+	info->first = slot->next;
+
+    if(slot->next != _IBDSWEEP_NONE)
+	sweep->slots[slot->next].prev = slot->prev;
+
+    if(--info->size == 0) {
+	if(info->keyed)
+	    Ht_ClearByKey(sweep->classes, info->hk);
+	info->keyed = false;
+	sweep->emptied_indices[sweep->n_emptied++] = slot->class_index;
+    }
+}
+
+static inline void _IBDSweep_Advance(_IBDSweepSlot *slot)
+{
+    if(!Htmi_NEXT(&(slot->hvi), slot->htmi)) {
+	/* Only an empty table has nothing at all. */
+	Hk_CLEAR(&(slot->hvi.hk));
+	slot->hvi.start = MARKER_MINUS_INFTY;
+	slot->hvi.end = MARKER_PLUS_INFTY;
+    }
+}
+
+IBDGraphClassSweep* NewIBDGraphClassSweep(IBDGraphList *igl)
+{
+    IBDGraphClassSweep *sweep = ALLOCATEIBDGraphClassSweep();
+
+    sweep->graphs = igl;
+    O_INCREF(igl);
+
+    sweep->marker = MARKER_MINUS_INFTY;
+    sweep->n_slots = Igl_Size(igl);
+    sweep->slots = (_IBDSweepSlot*)malloc(sizeof(_IBDSweepSlot) * max(1, sweep->n_slots));
+    sweep->heap = (_IBDSweepSlot**)malloc(sizeof(_IBDSweepSlot*) * max(1, sweep->n_slots));
+    sweep->moved = (_IBDSweepSlot**)malloc(sizeof(_IBDSweepSlot*) * max(1, sweep->n_slots));
+    CHECK_MALLOC(sweep->slots);
+    CHECK_MALLOC(sweep->heap);
+    CHECK_MALLOC(sweep->moved);
+
+    sweep->groups = (_IBDSweepGroup*)malloc(sizeof(_IBDSweepGroup) * max(1, sweep->n_slots));
+    sweep->groups_by_hash = (_IBDSweepGroup**)malloc(sizeof(_IBDSweepGroup*) * max(1, sweep->n_slots));
+    CHECK_MALLOC(sweep->groups);
+    CHECK_MALLOC(sweep->groups_by_hash);
+
+    sweep->classes = NewHashTable();
+    sweep->class_info = NULL;
+    sweep->n_class_indices = sweep->class_info_size = 0;
+    sweep->free_indices = sweep->emptied_indices = NULL;
+    sweep->n_free = sweep->n_emptied = 0;
+
+    sweep->changes = NULL;
+    sweep->n_changes = sweep->changes_size = 0;
+
+    size_t i;
+    for(i = 0; i < sweep->n_slots; ++i) {
+	_IBDSweepSlot *slot = &(sweep->slots[i]);
+
+	slot->graph = Igl_ViewItem(igl, i);
+
+	if(slot->graph->dirty)
+	    IBDGraph_Refresh(slot->graph);
+
+	slot->htmi = Htmi_New(slot->graph->graph_hashes);
+	_IBDSweep_Advance(slot);
+
+	_IBDSweep_Join(sweep, i, _IBDSweep_ClassIndex(sweep, &(slot->hvi.hk)));
+
+	sweep->heap[i] = slot;
+    }
+
+    ks_heapmake_sweep_heap(sweep->n_slots, sweep->heap);
+
+    return sweep;
+}
+
+static void _IBDSweep_RecordChange(IBDGraphClassSweep *sweep, size_t slot_index,
+				   size_t from_class, size_t to_class)
+{
+    if(sweep->n_changes == sweep->changes_size) {
+	sweep->changes_size = max(16, 2*sweep->changes_size);
+	sweep->changes = (IBDGraphClassChange*)realloc(
+	    sweep->changes, sizeof(IBDGraphClassChange)*sweep->changes_size);
+	CHECK_MALLOC(sweep->changes);
+    }
+
+    IBDGraphClassChange *change = &(sweep->changes[sweep->n_changes++]);
+    change->graph = sweep->slots[slot_index].graph;
+    change->graph_index = slot_index;
+    change->from_class = from_class;
+    change->to_class = to_class;
+}
+
+/* Moves every graph whose hash ends at the next breakpoint on to its
+ * next hash, and records the graphs that change class.  Returns the
+ * breakpoint. */
+static markertype _IBDSweep_Step(IBDGraphClassSweep *sweep)
+{
+    markertype m = sweep->heap[0]->hvi.end;
+
+    /* Classes emptied at the last breakpoint can be reused now. */
+    memcpy(sweep->free_indices + sweep->n_free, sweep->emptied_indices, 
+	   sizeof(size_t) * sweep->n_emptied);
+    sweep->n_free += sweep->n_emptied;
+    sweep->n_emptied = 0;
+
+    /* Every graph whose hash ends here moves on to its next one, and
+     * sinks in the heap. */
+    size_t n_moved = 0, n_groups = 0, i, j;
+
+    while(sweep->heap[0]->hvi.end == m) {
+	_IBDSweepSlot *slot = sweep->heap[0];
+
+	sweep->moved[n_moved++] = slot;
+
+	_IBDSweep_Advance(slot);
+	assert(slot->hvi.start == m);
+
+	ks_heapadjust_sweep_heap(0, sweep->n_slots, sweep->heap);
+    }
+
+    ks_introsort_sweep_batch(n_moved, sweep->moved);
+
+    for(i = 0; i < n_moved; ++i) {
+	_IBDSweepSlot *slot = sweep->moved[i];
+
+	if(i == 0 || slot->class_index != sweep->moved[i-1]->class_index
+	   || !Hk_EQUAL(&(slot->hvi.hk), &(sweep->moved[i-1]->hvi.hk))) {
+
+	    _IBDSweepGroup *g = &(sweep->groups[n_groups]);
+	    g->members = &(sweep->moved[i]);
+	    g->n_members = 0;
+	    g->rekey = false;
+	    sweep->groups_by_hash[n_groups] = g;
+	    ++n_groups;
+	}
+
+	++sweep->groups[n_groups - 1].n_members;
+    }
+
+    /* A class all of whose graphs move gives up its hash; if they all
+     * move to the same one, the class may simply take that hash on. */
+    for(i = 0; i < n_groups; i = j) {
+	size_t class_index = sweep->groups[i].members[0]->class_index;
+	_IBDSweepClassInfo *info = &(sweep->class_info[class_index]);
+	size_t n_leaving = 0;
+
+	for(j = i; j < n_groups && sweep->groups[j].members[0]->class_index == class_index; ++j)
+	    n_leaving += sweep->groups[j].n_members;
+
+	if(n_leaving == info->size) {
+	    Ht_ClearByKey(sweep->classes, info->hk);
+	    info->keyed = false;
+	    sweep->groups[i].rekey = (j == i + 1);
+	}
+    }
+
+    /* That only keeps the class as it was if no other graph ends up
+     * with the hash. */
+    ks_introsort_sweep_groups(n_groups, sweep->groups_by_hash);
+
+    for(i = 0; i < n_groups; ++i) {
+	_IBDSweepGroup *g = sweep->groups_by_hash[i];
+
+	if(!g->rekey)
+	    continue;
+
+	const HashKey *hk = &(g->members[0]->hvi.hk);
+
+	if( (i != 0 && Hk_EQUAL(hk, &(sweep->groups_by_hash[i-1]->members[0]->hvi.hk)))
+	    || (i + 1 != n_groups && Hk_EQUAL(hk, &(sweep->groups_by_hash[i+1]->members[0]->hvi.hk)))
+	    || Ht_ViewByKey(sweep->classes, *hk) != NULL) {
+
+	    g->rekey = false;
+	}
+    }
+
+    for(i = 0; i < n_groups; ++i) {
+	_IBDSweepGroup *g = &(sweep->groups[i]);
+	size_t class_index = g->members[0]->class_index;
+
+	if(!g->rekey)
+	    continue;
+
+	_IBDSweepClassInfo *info = &(sweep->class_info[class_index]);
+	_IBDSweepClass *cl = ALLOCATE_IBDSweepClass();
+
+	info->hk = g->members[0]->hvi.hk;
+	info->keyed = true;
+
+	Hf_COPY_FROM_KEY(cl, &(info->hk));
+	cl->index = class_index;
+	Ht_Give(sweep->classes, O_Cast(HashObject, cl));
+    }
+
+    /* Everything else actually changes class; moving them in list
+     * order keeps the changes in that order. */
+    size_t n_changing = 0;
+
+    for(i = 0; i < n_groups; ++i) {
+	_IBDSweepGroup *g = &(sweep->groups[i]);
+
+	if(!g->rekey) {
+	    memmove(sweep->moved + n_changing, g->members, sizeof(_IBDSweepSlot*) * g->n_members);
+	    n_changing += g->n_members;
+	}
+    }
+
+    ks_introsort_sweep_graph_order(n_changing, sweep->moved);
+
+    sweep->n_changes = 0;
+
+    for(i = 0; i < n_changing; ++i) {
+	_IBDSweepSlot *slot = sweep->moved[i];
+	size_t slot_index = (size_t)(slot - sweep->slots);
+	size_t from_class = slot->class_index;
+	size_t to_class = _IBDSweep_ClassIndex(sweep, &(slot->hvi.hk));
+
+	if(to_class == from_class)
+	    continue;
+
+	_IBDSweep_Leave(sweep, slot_index);
+	_IBDSweep_Join(sweep, slot_index, to_class);
+	_IBDSweep_RecordChange(sweep, slot_index, from_class, to_class);
+    }
+
+    return m;
+}
+
+bool IBDSweep_Next(IBDGraphClassSweep *sweep)
+{
+    /* Breakpoints where classes only take on new hashes don't change
+     * anything visible, so are passed over. */
+    size_t n_changes = sweep->n_changes;
+
+    while(sweep->n_slots != 0 && sweep->heap[0]->hvi.end != MARKER_PLUS_INFTY) {
+	markertype m = _IBDSweep_Step(sweep);
+
+	if(sweep->n_changes != 0) {
+	    sweep->marker = m;
+	    return true;
+	}
+    }
+
+    sweep->n_changes = n_changes;
+
+    return false;
+}
+
+size_t IBDSweep_ClassGraphs(const IBDGraphClassSweep *sweep, size_t class_index, IBDGraph **dest)
+{
+    assert(class_index < sweep->n_class_indices);
+
+    size_t n = 0, s;
+
+    for(s = sweep->class_info[class_index].first; s != _IBDSWEEP_NONE; s = sweep->slots[s].next)
+	dest[n++] = sweep->slots[s].graph;
+
+    assert(n == sweep->class_info[class_index].size);
+
+    return n;
+}
+
+void IBDGraphClassSweep_Print(const IBDGraphClassSweep *sweep)
+{
+    size_t i;
+
+    printf("%ld\t : %ld classes; ", 
+	   (long)IBDSweep_Marker(sweep), (long)IBDSweep_NumClasses(sweep));
+
+    for(i = 0; i < IBDSweep_NumChanges(sweep); ++i) {
+	printf("(%ld:%ld->%ld) ", 
+	       IBDSweep_Change(sweep, i)->graph->id,
+	       (long)IBDSweep_Change(sweep, i)->from_class,
+	       (long)IBDSweep_Change(sweep, i)->to_class);
+    }
+
+    printf("\n");
+}
@@ -7,20 +7,42 @@
 
 /********** IBDGraph **********/
 
+/* The compact form of a frozen graph; see IBDGraph_Freeze.  The node
+ * and edge keys are sorted.  Node i links to the edges
+ * edge_keys[link_edges[k]] for k in [link_offsets[i],
+ * link_offsets[i+1]), and link k is valid over the ranges
+ * [range_offsets[k], range_offsets[k+1]). */
+typedef struct {
+    size_t n_nodes, n_edges, n_links, n_ranges;
+    HashKey *node_keys, *edge_keys;
+    size_t *link_offsets, *link_edges, *range_offsets;
+    MarkerRange *ranges;
+} IBDFrozenGraph;
+
 typedef struct {
     HASHOBJECT_ITEMS;
     long id;
     HashTable *nodes, *edges, *graph_hashes;
     HashObject *current_hash;
     bool dirty;
+
+    /* Set once the graph is frozen; nodes and edges are then NULL. */
+    IBDFrozenGraph *frozen;
+
+    /* The summary graph_hashes was last built from, and the nodes
+     * changed since; a refresh patches in only those nodes. */
+    HashSequence *summary;
+    struct _IBDGraphNode_s **dirty_nodes;
+    size_t n_dirty_nodes, dirty_nodes_size;
 }IBDGraph;
 
 DECLARE_OBJECT(IBDGraph);
 
 /********** IBDGraphNode **********/
-typedef struct {
+typedef struct _IBDGraphNode_s {
     HASHOBJECT_ITEMS;
     HashTable *edges;
+    bool dirty;
 } IBDGraphNode;
 
 DECLARE_OBJECT(IBDGraphNode);
@@ -79,6 +101,18 @@ IBDGraphEdge* IBDGraphEdgeByHashKey(IBDGraph *g, HashKey key);
 void IBDGraph_Connect(IBDGraph *g, IBDGraphEdge *e, IBDGraphNode *n, 
 		      markertype range_start, markertype range_end);
 
+/* Converts a finished graph to a compact, read-only form: its hashes
+ * are computed, and the node and edge tables are replaced by flat
+ * arrays (an IBDFrozenGraph).  All the query routines below still
+ * work, and are then safe to call on the graph from several threads
+ * at once.  The node and edge objects are gone, so the retrieval
+ * routines above report an error and return NULL, and connecting
+ * reports an error and does nothing.  Freezing a frozen graph does
+ * nothing. */
+void IBDGraph_Freeze(IBDGraph *g);
+
+bool IBDGraphIsFrozen(IBDGraph *g);
+
 /************************************************************
  *
  *  The only query routines written right now. :-(  More coming soon.
@@ -177,6 +211,13 @@ IBDGraphEquivalences* IBDGraphEquivalenceClassesOfMarkerRange(
 
 IBDGraphEquivalences* IBDGraphEquivalenceClasses(IBDGraphList *gl);
 
+/* The number of threads the routines above hash graphs on, in builds
+ * where they use threads at all: HASHREDUCE_THREADS from the
+ * environment if that is a positive number, otherwise the number of
+ * processors online. */
+
+size_t IBD_NumThreads(void);
+
 /* A convenience iterator for iterating through equivalence
  * classes. */
 
@@ -221,8 +262,12 @@ void IBDGraphEquivalences_Print(IBDGraphEquivalences* ige);
  *
  ********************************************************************************/
 
+/* graph is NULL for locations added without a graph; graph_id is
+ * always set. */
+
 typedef struct {
     IBDGraph *graph;
+    long graph_id;
     markertype start, end;
 } IBDGraphLocation; 
 
@@ -236,6 +281,12 @@ typedef struct {
     OBJECT_ITEMS;
     IBDGraphList *graphs;
 
+    /* The locations and their keys while they are still being added;
+     * NULL once finished. */
+    HashKey *pending_keys;
+    IBDGraphLocation *pending;
+    size_t n_pending, pending_size;
+
     IBDGraphLocation **location_lists;
     size_t n_equivalences;
 
@@ -250,6 +301,21 @@ DECLARE_OBJECT(IBDGraphLocationEquivalences);
 
 IBDGraphLocationEquivalences* NewIBDGraphLocationEquivalences(IBDGraphList *igl);
 
+/* Builds the same lookup table one graph at a time, so each graph can be
+ * freed as soon as it has been added.  Locations added this way keep no
+ * reference to their graph; only graph_id is set.  Call IBDLocEq_Finish
+ * once everything is added, before using any of the accessors below.
+ */
+
+IBDGraphLocationEquivalences* NewEmptyIBDGraphLocationEquivalences();
+
+void IBDLocEq_AddGraph(IBDGraphLocationEquivalences *ibdle, IBDGraph *g);
+
+void IBDLocEq_AddLocation(IBDGraphLocationEquivalences *ibdle, const HashKey *hk, 
+			  long graph_id, markertype start, markertype end);
+
+void IBDLocEq_Finish(IBDGraphLocationEquivalences *ibdle);
+
 /* Returns the number of equivalence classes present in the graph list.
  */
 
@@ -283,6 +349,144 @@ static inline IBDGraphLocation* IBDLocEq_ViewItem(IBDGraphLocationEquivalences *
 
 void IBDGraphLocationEquivalences_Print(IBDGraphLocationEquivalences* ibdle);
 
+/********************************************************************************
+ *
+ *  Sweeping along the markers.  The marker iterators of all the graphs
+ *  are merged in marker order, and the partition of the graphs into
+ *  equivalence classes is kept up to date as the sweep moves; at each
+ *  breakpoint only the graphs that changed class are reported.
+ *
+ ********************************************************************************/
+
+/* The graph at graph_index in the list moved from class from_class to
+ * class to_class.  Class indices stay the same for as long as the
+ * class has any graphs in it, and are reused after that. */
+
+typedef struct {
+    IBDGraph *graph;
+    size_t graph_index;
+    size_t from_class, to_class;
+} IBDGraphClassChange;
+
+/********** _IBDSweepClass **********/
+
+typedef struct {
+    HASHOBJECT_ITEMS;
+    size_t index;
+} _IBDSweepClass;
+
+DECLARE_OBJECT(_IBDSweepClass);
+
+typedef struct {
+    IBDGraph *graph;
+    HashTableMarkerIterator *htmi;
+    HashValidityItem hvi;
+    size_t class_index;
+    size_t prev, next;
+} _IBDSweepSlot;
+
+typedef struct {
+    HashKey hk;
+    size_t size, first;
+    bool keyed;
+} _IBDSweepClassInfo;
+
+/* The graphs of one class that move on to the same hash at a
+ * breakpoint. */
+typedef struct {
+    _IBDSweepSlot **members;
+    size_t n_members;
+    bool rekey;
+} _IBDSweepGroup;
+
+typedef struct {
+    OBJECT_ITEMS;
+    IBDGraphList *graphs;
+    markertype marker;
+
+    _IBDSweepSlot *slots;
+    _IBDSweepSlot **heap, **moved;
+    size_t n_slots;
+
+    _IBDSweepGroup *groups, **groups_by_hash;
+
+    /* Classes by the hash of their graphs, and what's known about each
+     * by index.  Indices emptied at a breakpoint are only reused from
+     * the next one on. */
+    HashTable *classes;
+    _IBDSweepClassInfo *class_info;
+    size_t n_class_indices, class_info_size;
+    size_t *free_indices, n_free;
+    size_t *emptied_indices, n_emptied;
+
+    IBDGraphClassChange *changes;
+    size_t n_changes, changes_size;
+} IBDGraphClassSweep;
+
+DECLARE_OBJECT(IBDGraphClassSweep);
+
+/* Starts a sweep over the graphs in igl, positioned before the first
+ * breakpoint; the classes are then those at MARKER_MINUS_INFTY. */
+
+IBDGraphClassSweep* NewIBDGraphClassSweep(IBDGraphList *igl);
+
+/* Moves the sweep to the next marker at which any graph changes
+ * class.  A class whose graphs all move on to a hash no other graph
+ * has keeps its index and is not reported.  Returns false, leaving
+ * everything as it was, once there are no more. */
+
+bool IBDSweep_Next(IBDGraphClassSweep *sweep);
+
+/* The marker the sweep is at; the classes hold from here up to the
+ * next breakpoint. */
+
+static inline markertype IBDSweep_Marker(const IBDGraphClassSweep *sweep)
+{
+    return sweep->marker;
+}
+
+static inline size_t IBDSweep_NumChanges(const IBDGraphClassSweep *sweep)
+{
+    return sweep->n_changes;
+}
+
+/* The changes at the current breakpoint, in the order of the graphs
+ * in the list. */
+
+static inline const IBDGraphClassChange* IBDSweep_Change(const IBDGraphClassSweep *sweep, size_t i)
+{
+    assert(i < sweep->n_changes);
+    return &(sweep->changes[i]);
+}
+
+static inline size_t IBDSweep_NumClasses(const IBDGraphClassSweep *sweep)
+{
+    return Ht_SIZE(sweep->classes);
+}
+
+/* The class of the graph at graph_index in the list. */
+
+static inline size_t IBDSweep_ClassOf(const IBDGraphClassSweep *sweep, size_t graph_index)
+{
+    assert(graph_index < sweep->n_slots);
+    return sweep->slots[graph_index].class_index;
+}
+
+static inline size_t IBDSweep_ClassSize(const IBDGraphClassSweep *sweep, size_t class_index)
+{
+    assert(class_index < sweep->n_class_indices);
+    return sweep->class_info[class_index].size;
+}
+
+/* Fills dest, which must hold IBDSweep_ClassSize() entries, with the
+ * graphs in the class; returns how many there are. */
+
+size_t IBDSweep_ClassGraphs(const IBDGraphClassSweep *sweep, size_t class_index, IBDGraph **dest);
+
+/* Prints the current breakpoint and the changes at it. */
+
+void IBDGraphClassSweep_Print(const IBDGraphClassSweep *sweep);
+
 /************************************************************
  *
  *  Debug routines.
@@ -8,11 +8,16 @@
 #include "errorhandling.h"
 #include "debugging.h"
 #include "utilities.h"
+#include "bitops.h"
 #include <stdbool.h>
 #include <stdlib.h>
 #include <memory.h>
 #include <stdio.h>
 
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
 static bool marker_range_warnings_enabled = true;
 
 void Mi_DisableWarnings()
@@ -20,561 +25,2007 @@ void Mi_DisableWarnings()
     marker_range_warnings_enabled = false;
 }
 
-/* Create a new marker info class. */
-mi_ptr Mi_New(markertype start, markertype end)
+/********************************************************************************
+ *
+ *  Bitmap form.  A bounded set made of many short ranges is stored
+ *  as a compressed bitmap over the marker values, in the style of
+ *  roaring bitmaps: the marker line is cut into chunks of
+ *  _MI_CHUNK_SIZE values, and only the chunks holding some valid
+ *  value are kept, sorted by key (m >> _MI_CHUNK_BITS).  A chunk that
+ *  is valid throughout stores no bits.  Union, intersection and
+ *  difference of two such sets then work a word at a time.
+ *
+ *  Partial chunks are never all zero or all one, so equal sets have
+ *  identical bitmaps.
+ *
+ ********************************************************************************/
+
+#define _MI_CHUNK_BITS       12
+#define _MI_CHUNK_SIZE       (1L << _MI_CHUNK_BITS)
+#define _MI_CHUNK_WORDS      (_MI_CHUNK_SIZE / bitsizeof(bitfield))
+#define _MI_FULL_CHUNK       (~(size_t)0)
+
+/* Only sets with at least this many ranges, lying within
+ * (-_MI_BITMAP_LIMIT, _MI_BITMAP_LIMIT), are put in bitmap form. */
+#define _MI_BITMAP_MIN_RANGES  64
+#define _MI_BITMAP_LIMIT       (1L << 62)
+
+typedef struct _MiBitmap {
+    size_t n_chunks, n_partial;
+
+    /* Unique to each bitmap made; see _Mi_BitmapAtIndex. */
+    size_t serial;
+
+    markertype *keys;
+
+    /* Word offset of each chunk's bits in data, or _MI_FULL_CHUNK. */
+    size_t *offsets;
+    bitfield *data;
+} _MiBitmap;
+
+#define _MI_BITMAP(mi)   ((_MiBitmap*)((mi)->range_list))
+#define _MI_KEY(m)       ((m) >> _MI_CHUNK_BITS)
+#define _MI_BASE(k)      ((k) * _MI_CHUNK_SIZE)
+
+static size_t _mi_bitmap_serial = 0;
+
+static _MiBitmap* _MiBm_New(size_t max_chunks, size_t max_partial)
 {
-    WARNING(start > end && marker_range_warnings_enabled, 
-	    "Start of range is > end of range; zeroing range.  Use Mi_DisableWarnings() to disable.");
+    _MiBitmap *bm = (_MiBitmap*)malloc(sizeof(_MiBitmap));
+
+    bm->n_chunks = 0;
+    bm->n_partial = 0;
+#ifdef ENABLE_THREADS
+    bm->serial = __atomic_add_fetch(&_mi_bitmap_serial, 1, __ATOMIC_RELAXED);
+#else
+    bm->serial = ++_mi_bitmap_serial;
+#endif
+    bm->keys = (markertype*)malloc(sizeof(markertype)*max(max_chunks, 1));
+    bm->offsets = (size_t*)malloc(sizeof(size_t)*max(max_chunks, 1));
+    bm->data = (bitfield*)malloc(sizeof(bitfield)*_MI_CHUNK_WORDS*max(max_partial, 1));
 
-    return Mi_NEW(start, end);
+    return bm;
 }
 
-/* Create a new marker info class. */
-mi_ptr Mi_NewInvalid()
+static void _MiBm_Delete(_MiBitmap *bm)
 {
-    return Mi_NEW_INVALID();
+    free(bm->keys);
+    free(bm->offsets);
+    free(bm->data);
+    free(bm);
 }
 
-/* Delete the marker info class. */
-void Mi_Destroy(mi_ptr mi)
+static inline size_t _MiBm_Bytes(size_t n_chunks, size_t n_partial)
 {
-    if(mi->allocated_array_ranges != 0)
-	free(mi->range_list);
+    return (sizeof(_MiBitmap) + n_chunks*(sizeof(markertype) + sizeof(size_t))
+	    + n_partial*_MI_CHUNK_WORDS*sizeof(bitfield));
 }
 
-DEFINE_OBJECT(
-    MarkerInfo,
-    Object,
-    NULL,
-    Mi_Destroy);
-
-
-/* Clear all the information out of the marker info class. */
-void Mi_Clear(mi_ptr mi)
+static inline bool _MiBm_IsFull(const _MiBitmap *bm, size_t c)
 {
-    assert(!Mi_IsDebugLocked(mi));
-
-    mi->r.start = 0;
-    mi->r.end = 0;
-    mi->num_array_ranges = 0;
-    mi->allocated_array_ranges = 0;
+    return bm->offsets[c] == _MI_FULL_CHUNK;
+}
 
-    if(mi->allocated_array_ranges != 0)
-	free(mi->range_list);
+static inline const bitfield* _MiBm_Words(const _MiBitmap *bm, size_t c)
+{
+    return bm->data + bm->offsets[c];
 }
 
-bool Mi_ValidEverywhere(const MarkerInfo* mi)
+static inline void _MiBm_PushFull(_MiBitmap *bm, markertype key)
 {
-    return Mi_VALID_EVERYWHERE(mi);
+    bm->keys[bm->n_chunks] = key;
+    bm->offsets[bm->n_chunks] = _MI_FULL_CHUNK;
+    ++bm->n_chunks;
 }
 
-bool Mi_ValidAnywhere(const MarkerInfo* mi)
+/* Adds a cleared chunk; _MiBm_Seal must be called once it's filled. */
+static inline bitfield* _MiBm_PushPartial(_MiBitmap *bm, markertype key)
 {
-    return Mi_VALID_ANYWHERE(mi);
+    bitfield *w = bm->data + bm->n_partial*_MI_CHUNK_WORDS;
+
+    memset(w, 0, sizeof(bitfield)*_MI_CHUNK_WORDS);
+
+    bm->keys[bm->n_chunks] = key;
+    bm->offsets[bm->n_chunks] = bm->n_partial*_MI_CHUNK_WORDS;
+    ++bm->n_chunks;
+    ++bm->n_partial;
+
+    return w;
 }
 
-static inline void _Mi_ConvertToArrayStyle(mi_ptr mi)
+/* Keeps the last chunk canonical: dropped if empty, full if all set. */
+static inline void _MiBm_Seal(_MiBitmap *bm)
 {
-    assert(mi->num_array_ranges == 0);
-    
-    if(likely(mi->allocated_array_ranges == 0))
-    {
+    size_t c = bm->n_chunks - 1, i;
 
-	assert(mi->range_list == NULL);
+    if(_MiBm_IsFull(bm, c))
+	return;
 
-	/* Be conservative about allocating new ranges, as 99.9% of the
-	 * cases will involve 1 or 2 validity ranges. */
+    const bitfield *w = _MiBm_Words(bm, c);
+    bitfield any = 0, all = ~((bitfield)0);
 
-	mi->allocated_array_ranges = 4;
-	mi->range_list = (mr_ptr)malloc(sizeof(MarkerRange)*mi->allocated_array_ranges);
+    for(i = 0; i < _MI_CHUNK_WORDS; ++i)
+    {
+	any |= w[i];
+	all &= w[i];
     }
 
-    mi->num_array_ranges = 1;
-    mi->range_list[0].start = mi->r.start;
-    mi->range_list[0].end = mi->r.end;
+    if(any == 0)
+    {
+	--bm->n_chunks;
+	--bm->n_partial;
+    }
+    else if(all == ~((bitfield)0))
+    {
+	bm->offsets[c] = _MI_FULL_CHUNK;
+	--bm->n_partial;
+    }
 }
 
-
-static inline void Mi_CheckRestructure(mi_ptr mi)
+/* Sets the bits [lo, hi) of a chunk. */
+static inline void _MiBm_SetBits(bitfield *w, size_t lo, size_t hi)
 {
-    if(unlikely(mi->num_array_ranges == 1))
+    const size_t B = bitsizeof(bitfield);
+
+    if(lo >= hi)
+	return;
+
+    size_t i0 = lo / B, i1 = (hi - 1) / B, i;
+    bitfield m0 = (~((bitfield)0)) << (lo % B);
+    bitfield m1 = (~((bitfield)0)) >> (B - 1 - (hi - 1) % B);
+
+    if(i0 == i1)
     {
-	mi->r = mi->range_list[0];
-	mi->num_array_ranges = 0;
+	w[i0] |= (m0 & m1);
+    }
+    else
+    {
+	w[i0] |= m0;
+
+	for(i = i0 + 1; i < i1; ++i)
+	    w[i] = ~((bitfield)0);
+
+	w[i1] |= m1;
     }
 }
 
-static inline size_t _Mi_Bisect(cmi_ptr mi, markertype s)
+/* The first bit at or after off that equals value, or _MI_CHUNK_SIZE. */
+static inline size_t _MiBm_NextBit(const bitfield *w, size_t off, bool value)
 {
-    size_t low = 0, high = mi->num_array_ranges;
+    const size_t B = bitsizeof(bitfield);
+    size_t i = off / B;
 
-    size_t b;
+    if(i >= _MI_CHUNK_WORDS)
+	return _MI_CHUNK_SIZE;
 
-#ifdef DEBUG_MODE
-    int i;
-    for(i = 0; i < mi->num_array_ranges; ++i)
-	assert(mi->range_list[i].start <= mi->range_list[i].end);
+    bitfield x = (value ? w[i] : ~w[i]) & ((~((bitfield)0)) << (off % B));
 
-    for(i = 0; i < mi->num_array_ranges-1; ++i)
-	assert(mi->range_list[i].end < mi->range_list[i+1].start);
-#endif
-    
-    assert(low < high);
+    while(x == 0)
+    {
+	if(++i == _MI_CHUNK_WORDS)
+	    return _MI_CHUNK_SIZE;
 
-    /* Optimize a bit for the case of a long sequential adding */
-    if(unlikely(mi->range_list[high-1].end < s))
-	return high - 1;
+	x = value ? w[i] : ~w[i];
+    }
 
-    while(1)
-    {
-	assert(low < high);
+    return i*B + getFirstBitOn(x);
+}
 
-	if(unlikely(high == low + 1))
-	    return low;
+/* The last bit before off that equals value, or -1. */
+static inline long _MiBm_PrevBit(const bitfield *w, size_t off, bool value)
+{
+    const size_t B = bitsizeof(bitfield);
 
-	b = low + (high - low) / 2;
+    if(off == 0)
+	return -1;
 
-	if(mi->range_list[b].start > s)
-	    high = b;
-	else
-	    low = b;
+    size_t i = (off - 1) / B;
+    bitfield x = (value ? w[i] : ~w[i]) & ((~((bitfield)0)) >> (B - 1 - (off - 1) % B));
+
+    while(x == 0)
+    {
+	if(i == 0)
+	    return -1;
+
+	--i;
+	x = value ? w[i] : ~w[i];
     }
+
+    return (long)(i*B) + getLastBitOn(x);
 }
 
-static void _Mi_Insert(mi_ptr mi, size_t idx, markertype start, markertype end)
+/* The next run of valid values starting at or after *pos; chunk is
+ * where to start looking. */
+static bool _MiBm_NextRun(const _MiBitmap *bm, size_t *chunk, markertype *pos, MarkerRange *dest)
 {
-    assert(idx <= mi->num_array_ranges);
+    size_t c, off = 0;
 
-    /* Allocate the space. */
-    ++mi->num_array_ranges;
-    
-    if(mi->num_array_ranges > mi->allocated_array_ranges)
+    for(c = *chunk; c < bm->n_chunks; ++c)
     {
-	mi->allocated_array_ranges = 2*mi->num_array_ranges;
-	assert(mi->range_list != NULL);
-	mi->range_list = (mr_ptr)realloc(mi->range_list, (sizeof(MarkerRange)*mi->allocated_array_ranges));
-    }
+	markertype base = _MI_BASE(bm->keys[c]);
 
-    /* Copy over any ranges above the current index.*/
+	off = (*pos > base) ? (size_t)(*pos - base) : 0;
 
-    size_t i;
+	if(off >= _MI_CHUNK_SIZE)
+	    continue;
 
-    for(i = mi->num_array_ranges - 1; i > idx; --i)
+	if(_MiBm_IsFull(bm, c))
+	    break;
+
+	off = _MiBm_NextBit(_MiBm_Words(bm, c), off, true);
+
+	if(off < _MI_CHUNK_SIZE)
+	    break;
+    }
+
+    if(c == bm->n_chunks)
     {
-	mi->range_list[i].start = mi->range_list[i-1].start;
-	mi->range_list[i].end = mi->range_list[i-1].end;
+	*chunk = c;
+	return false;
     }
 
-    /* Insert the new values. */
-    mi->range_list[idx].start = start;
-    mi->range_list[idx].end = end;
+    dest->start = _MI_BASE(bm->keys[c]) + (markertype)off;
 
-    Mi_CheckRestructure(mi);
+    /* The run may carry on into the following chunks. */
+    while(true)
+    {
+	size_t end_off = (_MiBm_IsFull(bm, c) 
+			  ? _MI_CHUNK_SIZE 
+			  : _MiBm_NextBit(_MiBm_Words(bm, c), off, false));
+
+	if(end_off < _MI_CHUNK_SIZE 
+	   || c + 1 == bm->n_chunks 
+	   || bm->keys[c+1] != bm->keys[c] + 1)
+	{
+	    dest->end = _MI_BASE(bm->keys[c]) + (markertype)end_off;
+	    *pos = dest->end;
+	    *chunk = c;
+	    return true;
+	}
+
+	++c;
+	off = 0;
+    }
 }
 
-static void _Mi_InsertAtEnd(mi_ptr mi, markertype start, markertype end)
+/* The last run of valid values ending at or before *pos; the chunks
+ * below *chunk_end are searched. */
+static bool _MiBm_PrevRun(const _MiBitmap *bm, size_t *chunk_end, markertype *pos, MarkerRange *dest)
 {
-    /* Allocate the space. */
-    size_t idx = mi->num_array_ranges;
+    size_t c;
+    long off = -1;
 
-    assert(idx >= 1);
+    for(c = *chunk_end; c != 0; --c)
+    {
+	markertype base = _MI_BASE(bm->keys[c-1]);
 
-    if(unlikely(start <= mi->range_list[idx-1].end))
-    {    
-	--idx;
-	if(unlikely(mi->range_list[idx].start > start))
+	if(*pos <= base)
+	    continue;
+
+	size_t lim = (*pos - base >= _MI_CHUNK_SIZE) ? _MI_CHUNK_SIZE : (size_t)(*pos - base);
+
+	if(_MiBm_IsFull(bm, c-1))
 	{
-	    while(idx >= 1 && mi->range_list[idx-1].end >= start)
-		--idx;
-	 
-	    /* Now we may have to go back a bit, swallowing the end. */
-	    mi->range_list[idx].start = min(mi->range_list[idx].start, start);
-	    mi->num_array_ranges = idx+1;
+	    off = (long)lim - 1;
+	    break;
 	}
 
-	mi->range_list[idx].end = end;
-	Mi_CheckRestructure(mi);
+	off = _MiBm_PrevBit(_MiBm_Words(bm, c-1), lim, true);
+
+	if(off >= 0)
+	    break;
     }
-    else
+
+    if(c == 0)
     {
-	++mi->num_array_ranges;
-    
-	if(mi->num_array_ranges > mi->allocated_array_ranges)
+	*chunk_end = 0;
+	return false;
+    }
+
+    --c;
+    dest->end = _MI_BASE(bm->keys[c]) + off + 1;
+
+    while(true)
+    {
+	long start_off = (_MiBm_IsFull(bm, c) 
+			  ? -1 
+			  : _MiBm_PrevBit(_MiBm_Words(bm, c), (size_t)off + 1, false));
+
+	if(start_off >= 0 || c == 0 || bm->keys[c-1] != bm->keys[c] - 1)
 	{
-	    mi->allocated_array_ranges = 2*mi->num_array_ranges;
-	    assert(mi->range_list != NULL);
-	    mi->range_list = (mr_ptr)realloc(mi->range_list, (sizeof(MarkerRange)*mi->allocated_array_ranges));
+	    dest->start = _MI_BASE(bm->keys[c]) + start_off + 1;
+	    *pos = dest->start;
+	    *chunk_end = c + 1;
+	    return true;
 	}
 
-	/* Insert the new values. */
-	mi->range_list[idx].start = start;
-	mi->range_list[idx].end = end;
+	--c;
+	off = _MI_CHUNK_SIZE - 1;
     }
-
-    Mi_CheckRestructure(mi);
 }
 
-void Mi_AppendValidRange(mi_ptr mi, markertype r_lower, markertype r_higher)
+static bool _MiBm_IsValid(const _MiBitmap *bm, markertype m)
 {
-    assert(!Mi_IsDebugLocked(mi));
+    const size_t B = bitsizeof(bitfield);
+    markertype key = _MI_KEY(m);
+    size_t low = 0, high = bm->n_chunks;
 
-    if(unlikely(r_lower >= r_higher))
-	return;
+    while(low < high)
+    {
+	size_t b = low + (high - low) / 2;
 
-    if(unlikely(mi->num_array_ranges == 0))
+	if(bm->keys[b] < key)
+	    low = b + 1;
+	else
+	    high = b;
+    }
+
+    if(low == bm->n_chunks || bm->keys[low] != key)
+	return false;
+
+    if(_MiBm_IsFull(bm, low))
+	return true;
+
+    size_t off = (size_t)(m - _MI_BASE(key));
+
+    return bitOn(_MiBm_Words(bm, low)[off / B], off % B);
+}
+
+size_t _Mi_BitmapNumRanges(cmi_ptr mi)
+{
+    const size_t B = bitsizeof(bitfield);
+    const _MiBitmap *bm = _MI_BITMAP(mi);
+    size_t c, i, count = 0;
+    bitfield carry = 0;
+
+    for(c = 0; c < bm->n_chunks; ++c)
     {
-	if(mi->r.start == mi->r.end)
-	{
-	    mi->r.start = r_lower;
-	    mi->r.end = r_higher;
-	    return;
-	}
-	else if(unlikely(r_lower <= mi->r.end))
+	/* Whether a run comes in from the chunk below. */
+	if(c == 0 || bm->keys[c] != bm->keys[c-1] + 1)
+	    carry = 0;
+
+	if(_MiBm_IsFull(bm, c))
 	{
-	    mi->r.start = min(r_lower, mi->r.start);
-	    mi->r.end = r_higher;
-	    return;
+	    count += (carry == 0);
+	    carry = 1;
 	}
 	else
 	{
-	    _Mi_ConvertToArrayStyle(mi);
+	    const bitfield *w = _MiBm_Words(bm, c);
+
+	    for(i = 0; i < _MI_CHUNK_WORDS; ++i)
+	    {
+		count += bitCount(w[i] & ~((w[i] << 1) | carry));
+		carry = w[i] >> (B - 1);
+	    }
 	}
     }
 
-    _Mi_InsertAtEnd(mi, r_lower, r_higher);
+    return count;
 }
 
+/* The run last decoded on this thread, so that walking the runs in
+ * order carries on from it instead of from the first chunk.  The
+ * serial tells a bitmap apart from an earlier one at the same
+ * address. */
+typedef struct {
+    const _MiBitmap *bm;
+    size_t serial, index, chunk;
+    markertype pos;
+    MarkerRange mr;
+} _MiBmIndexCache;
+
+#ifdef ENABLE_THREADS
+static __thread _MiBmIndexCache _mi_bitmap_index_cache;
+#else
+static _MiBmIndexCache _mi_bitmap_index_cache;
+#endif
 
-static inline void _Mi_Clear(mi_ptr mi, size_t first_idx, size_t last_idx)
+const MarkerRange* _Mi_BitmapAtIndex(cmi_ptr mi, size_t index)
 {
-    if(first_idx > last_idx) return;
-
+    _MiBmIndexCache *ic = &_mi_bitmap_index_cache;
+    const _MiBitmap *bm = _MI_BITMAP(mi);
     size_t i;
 
-    for(i = 0; last_idx + 1 + i < mi->num_array_ranges; ++i)
+    if(ic->bm == bm && ic->serial == bm->serial && ic->index <= index)
     {
-	mi->range_list[first_idx+i].start = mi->range_list[last_idx+1+i].start;
-	mi->range_list[first_idx+i].end = mi->range_list[last_idx+1+i].end;
+	if(ic->index == index)
+	    return &ic->mr;
+
+	i = ic->index + 1;
+    }
+    else
+    {
+	ic->bm = bm;
+	ic->serial = bm->serial;
+	ic->chunk = 0;
+	ic->pos = MARKER_MINUS_INFTY;
+	i = 0;
     }
 
-    mi->num_array_ranges -= (last_idx - first_idx) + 1;
+    for(; i <= index; ++i)
+    {
+	bool okay = _MiBm_NextRun(bm, &ic->chunk, &ic->pos, &ic->mr);
+	assert(okay);
+	(void)okay;
+    }
 
-    Mi_CheckRestructure(mi);
-}
+    ic->index = index;
 
+    return &ic->mr;
+}
 
-/* Add a range in which the marker is valid. */
-void Mi_AddValidRange(mi_ptr mi, markertype start, markertype end)
+/* Puts a set built as a bitmap into a new marker info. */
+static mi_ptr _Mi_FromBitmap(_MiBitmap *bm)
 {
-    assert(!Mi_IsDebugLocked(mi));
+    mi_ptr mi = Mi_NEW(0,0);
 
-    if(unlikely(start >= end && marker_range_warnings_enabled))
+    if(bm->n_chunks == 0)
     {
-        if(start != end)
-	    fprintf(stderr, "WARNING: Start of range (%ld) is > end of range (%ld); no range added.\n", start, end);
-	
-	return;
+	_MiBm_Delete(bm);
+	return mi;
     }
 
-    if(unlikely(mi == NULL))
-	return;
+    size_t last = bm->n_chunks - 1;
 
-    /* See if we are in array-of-ranges mode or just the regular
-     * markertype mode. */
+    mi->r.start = _MI_BASE(bm->keys[0]) 
+	+ (_MiBm_IsFull(bm, 0) ? 0 : (markertype)_MiBm_NextBit(_MiBm_Words(bm, 0), 0, true));
 
-    if(mi->num_array_ranges == 0)
-    {
-	assert(mi->r.start <= mi->r.end);
-	
-	/* If the original range is null, just set it to this and
-	 * go.  Unlikely, though. */
+    mi->r.end = _MI_BASE(bm->keys[last]) 
+	+ (_MiBm_IsFull(bm, last) ? _MI_CHUNK_SIZE : _MiBm_PrevBit(_MiBm_Words(bm, last), _MI_CHUNK_SIZE, true) + 1);
 
-	if(unlikely(mi->r.start >= mi->r.end) )
-	{
-	    mi->r.start = start;
-	    mi->r.end   = end;
-	    return;
-	}
-		
-        /* If it extends the original r.start, r.end range, we're good to
-	 * go. */
-  
-	if( !(start > mi->r.end || end < mi->r.start) )
+    mi->range_list = (MarkerRange*)bm;
+    mi->bitmap_form = true;
+
+    Mi_Compact(mi);
+
+    return mi;
+}
+
+static void _Mi_BitmapToRanges(mi_ptr mi)
+{
+    assert(mi->bitmap_form);
+
+    _MiBitmap *bm = _MI_BITMAP(mi);
+    size_t n = _Mi_BitmapNumRanges(mi), i;
+    size_t chunk = 0;
+    markertype pos = MARKER_MINUS_INFTY;
+
+    assert(n >= 1);
+
+    mr_ptr rl = (mr_ptr)malloc(sizeof(MarkerRange)*n);
+
+    for(i = 0; i < n; ++i)
+    {
+	bool okay = _MiBm_NextRun(bm, &chunk, &pos, &rl[i]);
+	assert(okay);
+	(void)okay;
+    }
+
+    _MiBm_Delete(bm);
+    mi->bitmap_form = false;
+
+    if(n == 1)
+    {
+	mi->r = rl[0];
+	free(rl);
+	mi->range_list = NULL;
+	mi->num_array_ranges = 0;
+	mi->allocated_array_ranges = 0;
+    }
+    else
+    {
+	mi->range_list = rl;
+	mi->num_array_ranges = n;
+	mi->allocated_array_ranges = n;
+    }
+}
+
+/* Counts the chunks, and those not entirely valid, that the range
+ * list of mi would need. */
+static void _Mi_CountChunks(cmi_ptr mi, size_t *n_chunks, size_t *n_partial)
+{
+    size_t i;
+    bool have_last = false;
+    markertype last_key = 0;
+
+    *n_chunks = 0;
+    *n_partial = 0;
+
+    for(i = 0; i < mi->num_array_ranges; ++i)
+    {
+	markertype s = mi->range_list[i].start, e = mi->range_list[i].end;
+	markertype key_lo = _MI_KEY(s), key_hi = _MI_KEY(e - 1);
+
+	bool f0 = (s == _MI_BASE(key_lo)) && (e >= _MI_BASE(key_lo) + _MI_CHUNK_SIZE);
+	bool f1 = (e == _MI_BASE(key_hi) + _MI_CHUNK_SIZE) && (s <= _MI_BASE(key_hi));
+
+	if(have_last && key_lo == last_key)
 	{
-	    mi->r.start = min(start, mi->r.start);
-	    mi->r.end = max(end, mi->r.end);
-	    return;
+	    /* Continues a chunk already counted as partial. */
+	    *n_chunks += (size_t)(key_hi - key_lo);
+
+	    if(key_hi > key_lo)
+		*n_partial += !f1;
 	}
 	else
 	{
-	    /* If not, now convert over to array-of-ranges and continue. */ 
-	    _Mi_ConvertToArrayStyle(mi);
-	    
-	    assert(mi->num_array_ranges == 1);
+	    *n_chunks += (size_t)(key_hi - key_lo) + 1;
+	    *n_partial += (key_lo == key_hi) ? !f0 : (!f0 + !f1);
+	}
 
-	    if(end < mi->range_list[0].start)
-	    {
-		_Mi_Insert(mi, 0, start, end);
-	    }
-	    else
+	have_last = true;
+	last_key = key_hi;
+    }
+}
+
+static void _Mi_RangesToBitmap(mi_ptr mi, size_t n_chunks, size_t n_partial)
+{
+    _MiBitmap *bm = _MiBm_New(n_chunks, n_partial);
+    size_t i;
+    bool have_last = false;
+    markertype last_key = 0;
+    bitfield *w = NULL;
+
+    for(i = 0; i < mi->num_array_ranges; ++i)
+    {
+	markertype s = mi->range_list[i].start, e = mi->range_list[i].end;
+	markertype k;
+
+	for(k = _MI_KEY(s); k <= _MI_KEY(e - 1); ++k)
+	{
+	    markertype base = _MI_BASE(k);
+	    markertype lo = max(s, base), hi = min(e, base + _MI_CHUNK_SIZE);
+
+	    if(!(have_last && k == last_key))
 	    {
-		ASSERTF(start > mi->range_list[0].start, Mi_debug_printMi(mi));
-		_Mi_InsertAtEnd(mi, start, end);
+		if(lo == base && hi == base + _MI_CHUNK_SIZE)
+		{
+		    _MiBm_PushFull(bm, k);
+		    w = NULL;
+		}
+		else
+		    w = _MiBm_PushPartial(bm, k);
 	    }
 
-	    return;
+	    if(w != NULL)
+		_MiBm_SetBits(w, (size_t)(lo - base), (size_t)(hi - base));
+
+	    have_last = true;
+	    last_key = k;
 	}
-    }    
-    else if(mi->range_list[mi->num_array_ranges - 1].end <= end) 
+    }
+
+    assert(bm->n_chunks == n_chunks);
+    assert(bm->n_partial == n_partial);
+
+    markertype start = mi->range_list[0].start;
+    markertype end = mi->range_list[mi->num_array_ranges - 1].end;
+
+    free(mi->range_list);
+
+    mi->r.start = start;
+    mi->r.end = end;
+    mi->num_array_ranges = 0;
+    mi->allocated_array_ranges = 0;
+    mi->range_list = (MarkerRange*)bm;
+    mi->bitmap_form = true;
+}
+
+void Mi_Compact(mi_ptr mi)
+{
+    if(unlikely(mi == NULL) || mi->interned)
+	return;
+
+    if(mi->bitmap_form)
     {
-	_Mi_InsertAtEnd(mi, start, end);
+	const _MiBitmap *bm = _MI_BITMAP(mi);
+	size_t n = _Mi_BitmapNumRanges(mi);
+
+	/* Go back to ranges only well below the switch over point, so
+	 * sets near it don't flip back and forth. */
+	if(n < _MI_BITMAP_MIN_RANGES / 2 
+	   || 2*n*sizeof(MarkerRange) < _MiBm_Bytes(bm->n_chunks, bm->n_partial))
+	    _Mi_BitmapToRanges(mi);
     }
-    else 
+    else if(mi->num_array_ranges >= _MI_BITMAP_MIN_RANGES
+	    && mi->range_list[0].start > -_MI_BITMAP_LIMIT
+	    && mi->range_list[mi->num_array_ranges - 1].end < _MI_BITMAP_LIMIT)
     {
-	/* Now have to insert the new range; possibly extending or
-	 * connecting ranges. */
+	size_t n_chunks, n_partial;
+	_Mi_CountChunks(mi, &n_chunks, &n_partial);
 
-	size_t idx = _Mi_Bisect(mi, start);
-	
-	/* Three factors control what we do: the insert idx, the final
-	 * end idx of the range we collapse (prob usually the same),
-	 * and whether we are extending the existing node there. */
+	if(_MiBm_Bytes(n_chunks, n_partial) < mi->num_array_ranges*sizeof(MarkerRange))
+	    _Mi_RangesToBitmap(mi, n_chunks, n_partial);
+    }
+}
 
-	/* See if idx or idx + 1 is the insert idx. */
-	size_t ins_idx, end_idx;
-	bool extends_idx;
+static void _MiBm_PushCopy(_MiBitmap *dest, const _MiBitmap *src, size_t c)
+{
+    if(_MiBm_IsFull(src, c))
+	_MiBm_PushFull(dest, src->keys[c]);
+    else
+	memcpy(_MiBm_PushPartial(dest, src->keys[c]), _MiBm_Words(src, c), 
+	       sizeof(bitfield)*_MI_CHUNK_WORDS);
+}
 
-	if(mi->range_list[idx].end >= start)
+static mi_ptr _Mi_BitmapUnion(const _MiBitmap *a, const _MiBitmap *b)
+{
+    _MiBitmap *bm = _MiBm_New(a->n_chunks + b->n_chunks, a->n_partial + b->n_partial);
+    size_t i = 0, j = 0, k;
+
+    while(i < a->n_chunks || j < b->n_chunks)
+    {
+	if(j == b->n_chunks || (i < a->n_chunks && a->keys[i] < b->keys[j]))
+	    _MiBm_PushCopy(bm, a, i++);
+	else if(i == a->n_chunks || b->keys[j] < a->keys[i])
+	    _MiBm_PushCopy(bm, b, j++);
+	else
 	{
-	    ins_idx = idx;
+	    if(_MiBm_IsFull(a, i) || _MiBm_IsFull(b, j))
+		_MiBm_PushFull(bm, a->keys[i]);
+	    else
+	    {
+		bitfield *w = _MiBm_PushPartial(bm, a->keys[i]);
+		const bitfield *wa = _MiBm_Words(a, i), *wb = _MiBm_Words(b, j);
 
-	    /* False if everything belongs beyond the first element. */
-	    extends_idx = (mi->range_list[idx].start <= end) ? true : false;
+		for(k = 0; k < _MI_CHUNK_WORDS; ++k)
+		    w[k] = wa[k] | wb[k];
 
-	    if(unlikely(mi->range_list[idx].end >= end && mi->range_list[idx].start <= start)) 
-	    {
-		/* No changes needed; encapsulated in existing range. */
-		return; 
+		_MiBm_Seal(bm);
 	    }
+
+	    ++i;
+	    ++j;
 	}
+    }
+
+    return _Mi_FromBitmap(bm);
+}
+
+static mi_ptr _Mi_BitmapIntersection(const _MiBitmap *a, const _MiBitmap *b)
+{
+    _MiBitmap *bm = _MiBm_New(min(a->n_chunks, b->n_chunks), a->n_partial + b->n_partial);
+    size_t i = 0, j = 0, k;
+
+    while(i < a->n_chunks && j < b->n_chunks)
+    {
+	if(a->keys[i] < b->keys[j])
+	    ++i;
+	else if(b->keys[j] < a->keys[i])
+	    ++j;
 	else
 	{
-	    ins_idx = idx + 1;
-	    extends_idx = (ins_idx < mi->num_array_ranges && mi->range_list[ins_idx].start <= end) ? true : false;
-	}
-
-	/* Set end_idx by seeing how many additional ranges we can
-	 * "eat" with this one. */
+	    if(_MiBm_IsFull(a, i))
+		_MiBm_PushCopy(bm, b, j);
+	    else if(_MiBm_IsFull(b, j))
+		_MiBm_PushCopy(bm, a, i);
+	    else
+	    {
+		bitfield *w = _MiBm_PushPartial(bm, a->keys[i]);
+		const bitfield *wa = _MiBm_Words(a, i), *wb = _MiBm_Words(b, j);
 
-	for(end_idx = ins_idx; 
-	    end_idx + 1 < mi->num_array_ranges && mi->range_list[end_idx + 1].start <= end; 
-	    ++end_idx);
-	
-	assert(end_idx == ins_idx || mi->num_array_ranges > end_idx);
+		for(k = 0; k < _MI_CHUNK_WORDS; ++k)
+		    w[k] = wa[k] & wb[k];
 
-	/* See if it actually does extend an existing one, just not at
-	 * ins_idx.*/
+		_MiBm_Seal(bm);
+	    }
 
-	if(!extends_idx && end_idx != ins_idx)
-	{
-	    ++ins_idx;
-	    extends_idx = true;
+	    ++i;
+	    ++j;
 	}
+    }
 
-	if(extends_idx)
-	{
-	    mi->range_list[ins_idx].start = min(start, mi->range_list[ins_idx].start);
-	    mi->range_list[ins_idx].end = max(end, mi->range_list[end_idx].end);
+    return _Mi_FromBitmap(bm);
+}
 
-	    /* Now delete any combined ranges if needed, and we're
-	     * done. */
+static mi_ptr _Mi_BitmapDifference(const _MiBitmap *a, const _MiBitmap *b)
+{
+    _MiBitmap *bm = _MiBm_New(a->n_chunks, a->n_chunks);
+    size_t i = 0, j = 0, k;
 
-	    _Mi_Clear(mi, ins_idx + 1, end_idx);
-	    return;
-	}
+    while(i < a->n_chunks)
+    {
+	if(j == b->n_chunks || a->keys[i] < b->keys[j])
+	    _MiBm_PushCopy(bm, a, i++);
+	else if(b->keys[j] < a->keys[i])
+	    ++j;
 	else
 	{
-	    _Mi_Insert(mi, ins_idx, start, end);
-	    return;
+	    if(!_MiBm_IsFull(b, j))
+	    {
+		bitfield *w = _MiBm_PushPartial(bm, a->keys[i]);
+		const bitfield *wb = _MiBm_Words(b, j);
+
+		if(_MiBm_IsFull(a, i))
+		{
+		    for(k = 0; k < _MI_CHUNK_WORDS; ++k)
+			w[k] = ~wb[k];
+		}
+		else
+		{
+		    const bitfield *wa = _MiBm_Words(a, i);
+
+		    for(k = 0; k < _MI_CHUNK_WORDS; ++k)
+			w[k] = wa[k] & ~wb[k];
+		}
+
+		_MiBm_Seal(bm);
+	    }
+
+	    ++i;
+	    ++j;
 	}
     }
 
+    return _Mi_FromBitmap(bm);
 }
 
-void Mi_Swap(mi_ptr mi1, mi_ptr mi2)
+static mi_ptr _Mi_BitmapCopy(cmi_ptr mi)
 {
-    assert(!Mi_IsDebugLocked(mi1));
-    assert(!Mi_IsDebugLocked(mi2));
+    const _MiBitmap *src = _MI_BITMAP(mi);
+    _MiBitmap *bm = _MiBm_New(src->n_chunks, src->n_partial);
 
-    assert(mi1 != NULL);
-    assert(mi2 != NULL);
+    bm->n_chunks = src->n_chunks;
+    bm->n_partial = src->n_partial;
+    memcpy(bm->keys, src->keys, sizeof(markertype)*src->n_chunks);
+    memcpy(bm->offsets, src->offsets, sizeof(size_t)*src->n_chunks);
+    memcpy(bm->data, src->data, sizeof(bitfield)*_MI_CHUNK_WORDS*src->n_partial);
 
-    MarkerRange r				= mi1->r;
-    unsigned long num_array_ranges		= mi1->num_array_ranges;
-    unsigned long allocated_array_ranges	= mi1->allocated_array_ranges;
-    mr_ptr range_list          			= mi1->range_list;
+    mi_ptr mic = Mi_NEW(0,0);
+    mic->r = mi->r;
+    mic->range_list = (MarkerRange*)bm;
+    mic->bitmap_form = true;
 
-    mi1->r					= mi2->r;
-    mi1->num_array_ranges			= mi2->num_array_ranges;
-    mi1->allocated_array_ranges			= mi2->allocated_array_ranges;
-    mi1->range_list				= mi2->range_list;
+    return mic;
+}
+
+static bool _Mi_BitmapEqual(const _MiBitmap *a, const _MiBitmap *b)
+{
+    size_t c;
+
+    if(a->n_chunks != b->n_chunks || a->n_partial != b->n_partial)
+	return false;
+
+    for(c = 0; c < a->n_chunks; ++c)
+    {
+	if(a->keys[c] != b->keys[c] || _MiBm_IsFull(a, c) != _MiBm_IsFull(b, c))
+	    return false;
+
+	if(!_MiBm_IsFull(a, c) 
+	   && memcmp(_MiBm_Words(a, c), _MiBm_Words(b, c), sizeof(bitfield)*_MI_CHUNK_WORDS) != 0)
+	    return false;
+    }
+
+    return true;
+}
+
+/* Frees whichever of the range list or bitmap mi holds. */
+static inline void _Mi_FreeStorage(mi_ptr mi)
+{
+    if(unlikely(mi->bitmap_form))
+	_MiBm_Delete(_MI_BITMAP(mi));
+    else if(mi->allocated_array_ranges != 0)
+	free(mi->range_list);
+
+    mi->range_list = NULL;
+    mi->num_array_ranges = 0;
+    mi->allocated_array_ranges = 0;
+    mi->bitmap_form = false;
+}
+
+/* Create a new marker info class. */
+mi_ptr Mi_New(markertype start, markertype end)
+{
+    WARNING(start > end && marker_range_warnings_enabled, 
+	    "Start of range is > end of range; zeroing range.  Use Mi_DisableWarnings() to disable.");
+
+    return Mi_NEW(start, end);
+}
+
+/* Create a new marker info class. */
+mi_ptr Mi_NewInvalid()
+{
+    return Mi_NEW_INVALID();
+}
+
+static void _Mi_InternRemove(cmi_ptr mi);
+
+/* Delete the marker info class. */
+void Mi_Destroy(mi_ptr mi)
+{
+    if(unlikely(mi->interned))
+	_Mi_InternRemove(mi);
+
+    _Mi_FreeStorage(mi);
+}
+
+DEFINE_OBJECT(
+    MarkerInfo,
+    Object,
+    NULL,
+    Mi_Destroy);
+
+
+/* Clear all the information out of the marker info class. */
+void Mi_Clear(mi_ptr mi)
+{
+    assert(!Mi_IsDebugLocked(mi));
+    assert(!mi->interned);
+
+    _Mi_FreeStorage(mi);
+
+    mi->r.start = 0;
+    mi->r.end = 0;
+}
+
+bool Mi_ValidEverywhere(const MarkerInfo* mi)
+{
+    return Mi_VALID_EVERYWHERE(mi);
+}
+
+bool Mi_ValidAnywhere(const MarkerInfo* mi)
+{
+    return Mi_VALID_ANYWHERE(mi);
+}
+
+static inline void _Mi_ConvertToArrayStyle(mi_ptr mi)
+{
+    assert(mi->num_array_ranges == 0);
+    
+    if(likely(mi->allocated_array_ranges == 0))
+    {
+
+	assert(mi->range_list == NULL);
+
+	/* Be conservative about allocating new ranges, as 99.9% of the
+	 * cases will involve 1 or 2 validity ranges. */
+
+	mi->allocated_array_ranges = 4;
+	mi->range_list = (mr_ptr)malloc(sizeof(MarkerRange)*mi->allocated_array_ranges);
+    }
+
+    mi->num_array_ranges = 1;
+    mi->range_list[0].start = mi->r.start;
+    mi->range_list[0].end = mi->r.end;
+}
+
+
+static inline void Mi_CheckRestructure(mi_ptr mi)
+{
+    if(unlikely(mi->num_array_ranges == 1))
+    {
+	mi->r = mi->range_list[0];
+	mi->num_array_ranges = 0;
+    }
+}
+
+static inline size_t _Mi_Bisect(cmi_ptr mi, markertype s)
+{
+    size_t low = 0, high = mi->num_array_ranges;
+
+    size_t b;
+
+#ifdef DEBUG_MODE
+    int i;
+    for(i = 0; i < mi->num_array_ranges; ++i)
+	assert(mi->range_list[i].start <= mi->range_list[i].end);
+
+    for(i = 0; i < mi->num_array_ranges-1; ++i)
+	assert(mi->range_list[i].end < mi->range_list[i+1].start);
+#endif
+    
+    assert(low < high);
+
+    /* Optimize a bit for the case of a long sequential adding */
+    if(unlikely(mi->range_list[high-1].end < s))
+	return high - 1;
+
+    /* Branch free halving, then a count over the last few starts,
+     * which the compiler can vectorize; the answer is the last range
+     * starting at or before s, or 0. */
+    const MarkerRange *base = mi->range_list;
+    size_t n = high - low;
+
+    while(n > 8)
+    {
+	b = n / 2;
+	base = (base[b].start <= s) ? base + b : base;
+	n -= b;
+    }
+
+    size_t k, c = 0;
+
+    for(k = 1; k < n; ++k)
+	c += (base[k].start <= s);
+
+    return (size_t)(base - mi->range_list) + c;
+}
+
+static void _Mi_Insert(mi_ptr mi, size_t idx, markertype start, markertype end)
+{
+    assert(idx <= mi->num_array_ranges);
+
+    /* Allocate the space. */
+    ++mi->num_array_ranges;
+    
+    if(mi->num_array_ranges > mi->allocated_array_ranges)
+    {
+	mi->allocated_array_ranges = 2*mi->num_array_ranges;
+	assert(mi->range_list != NULL);
+	mi->range_list = (mr_ptr)realloc(mi->range_list, (sizeof(MarkerRange)*mi->allocated_array_ranges));
+    }
+
+    /* Copy over any ranges above the current index.*/
+
+    size_t i;
+
+    for(i = mi->num_array_ranges - 1; i > idx; --i)
+    {
+	mi->range_list[i].start = mi->range_list[i-1].start;
+	mi->range_list[i].end = mi->range_list[i-1].end;
+    }
+
+    /* Insert the new values. */
+    mi->range_list[idx].start = start;
+    mi->range_list[idx].end = end;
+
+    Mi_CheckRestructure(mi);
+}
+
+static void _Mi_InsertAtEnd(mi_ptr mi, markertype start, markertype end)
+{
+    /* Allocate the space. */
+    size_t idx = mi->num_array_ranges;
+
+    assert(idx >= 1);
+
+    if(unlikely(start <= mi->range_list[idx-1].end))
+    {    
+	--idx;
+	if(unlikely(mi->range_list[idx].start > start))
+	{
+	    while(idx >= 1 && mi->range_list[idx-1].end >= start)
+		--idx;
+	 
+	    /* Now we may have to go back a bit, swallowing the end. */
+	    mi->range_list[idx].start = min(mi->range_list[idx].start, start);
+	    mi->num_array_ranges = idx+1;
+	}
+
+	mi->range_list[idx].end = end;
+	Mi_CheckRestructure(mi);
+    }
+    else
+    {
+	++mi->num_array_ranges;
+    
+	if(mi->num_array_ranges > mi->allocated_array_ranges)
+	{
+	    mi->allocated_array_ranges = 2*mi->num_array_ranges;
+	    assert(mi->range_list != NULL);
+	    mi->range_list = (mr_ptr)realloc(mi->range_list, (sizeof(MarkerRange)*mi->allocated_array_ranges));
+	}
+
+	/* Insert the new values. */
+	mi->range_list[idx].start = start;
+	mi->range_list[idx].end = end;
+    }
+
+    Mi_CheckRestructure(mi);
+}
+
+void Mi_AppendValidRange(mi_ptr mi, markertype r_lower, markertype r_higher)
+{
+    assert(!Mi_IsDebugLocked(mi));
+    assert(!mi->interned);
+
+    if(unlikely(r_lower >= r_higher))
+	return;
+
+    if(unlikely(mi->bitmap_form))
+	_Mi_BitmapToRanges(mi);
+
+    if(unlikely(mi->num_array_ranges == 0))
+    {
+	if(mi->r.start == mi->r.end)
+	{
+	    mi->r.start = r_lower;
+	    mi->r.end = r_higher;
+	    return;
+	}
+	else if(unlikely(r_lower <= mi->r.end))
+	{
+	    mi->r.start = min(r_lower, mi->r.start);
+	    mi->r.end = r_higher;
+	    return;
+	}
+	else
+	{
+	    _Mi_ConvertToArrayStyle(mi);
+	}
+    }
+
+    _Mi_InsertAtEnd(mi, r_lower, r_higher);
+}
+
+
+static inline void _Mi_Clear(mi_ptr mi, size_t first_idx, size_t last_idx)
+{
+    if(first_idx > last_idx) return;
+
+    size_t i;
+
+    for(i = 0; last_idx + 1 + i < mi->num_array_ranges; ++i)
+    {
+	mi->range_list[first_idx+i].start = mi->range_list[last_idx+1+i].start;
+	mi->range_list[first_idx+i].end = mi->range_list[last_idx+1+i].end;
+    }
+
+    mi->num_array_ranges -= (last_idx - first_idx) + 1;
+
+    Mi_CheckRestructure(mi);
+}
+
+
+/* Add a range in which the marker is valid. */
+void Mi_AddValidRange(mi_ptr mi, markertype start, markertype end)
+{
+    assert(!Mi_IsDebugLocked(mi));
+
+    if(unlikely(start >= end && marker_range_warnings_enabled))
+    {
+        if(start != end)
+	    fprintf(stderr, "WARNING: Start of range (%ld) is > end of range (%ld); no range added.\n", start, end);
+	
+	return;
+    }
+
+    if(unlikely(mi->bitmap_form))
+	_Mi_BitmapToRanges(mi);
+
+    if(unlikely(mi == NULL))
+	return;
+
+    assert(!mi->interned);
+
+    /* See if we are in array-of-ranges mode or just the regular
+     * markertype mode. */
+
+    if(mi->num_array_ranges == 0)
+    {
+	assert(mi->r.start <= mi->r.end);
+	
+	/* If the original range is null, just set it to this and
+	 * go.  Unlikely, though. */
+
+	if(unlikely(mi->r.start >= mi->r.end) )
+	{
+	    mi->r.start = start;
+	    mi->r.end   = end;
+	    return;
+	}
+		
+        /* If it extends the original r.start, r.end range, we're good to
+	 * go. */
+  
+	if( !(start > mi->r.end || end < mi->r.start) )
+	{
+	    mi->r.start = min(start, mi->r.start);
+	    mi->r.end = max(end, mi->r.end);
+	    return;
+	}
+	else
+	{
+	    /* If not, now convert over to array-of-ranges and continue. */ 
+	    _Mi_ConvertToArrayStyle(mi);
+	    
+	    assert(mi->num_array_ranges == 1);
+
+	    if(end < mi->range_list[0].start)
+	    {
+		_Mi_Insert(mi, 0, start, end);
+	    }
+	    else
+	    {
+		ASSERTF(start > mi->range_list[0].start, Mi_debug_printMi(mi));
+		_Mi_InsertAtEnd(mi, start, end);
+	    }
+
+	    return;
+	}
+    }    
+    else if(mi->range_list[mi->num_array_ranges - 1].end <= end) 
+    {
+	_Mi_InsertAtEnd(mi, start, end);
+    }
+    else 
+    {
+	/* Now have to insert the new range; possibly extending or
+	 * connecting ranges. */
+
+	size_t idx = _Mi_Bisect(mi, start);
+	
+	/* Three factors control what we do: the insert idx, the final
+	 * end idx of the range we collapse (prob usually the same),
+	 * and whether we are extending the existing node there. */
+
+	/* See if idx or idx + 1 is the insert idx. */
+	size_t ins_idx, end_idx;
+	bool extends_idx;
+
+	if(mi->range_list[idx].end >= start)
+	{
+	    ins_idx = idx;
+
+	    /* False if everything belongs beyond the first element. */
+	    extends_idx = (mi->range_list[idx].start <= end) ? true : false;
+
+	    if(unlikely(mi->range_list[idx].end >= end && mi->range_list[idx].start <= start)) 
+	    {
+		/* No changes needed; encapsulated in existing range. */
+		return; 
+	    }
+	}
+	else
+	{
+	    ins_idx = idx + 1;
+	    extends_idx = (ins_idx < mi->num_array_ranges && mi->range_list[ins_idx].start <= end) ? true : false;
+	}
+
+	/* Set end_idx by seeing how many additional ranges we can
+	 * "eat" with this one. */
+
+	for(end_idx = ins_idx; 
+	    end_idx + 1 < mi->num_array_ranges && mi->range_list[end_idx + 1].start <= end; 
+	    ++end_idx);
+	
+	assert(end_idx == ins_idx || mi->num_array_ranges > end_idx);
+
+	/* See if it actually does extend an existing one, just not at
+	 * ins_idx.*/
+
+	if(!extends_idx && end_idx != ins_idx)
+	{
+	    ++ins_idx;
+	    extends_idx = true;
+	}
+
+	if(extends_idx)
+	{
+	    mi->range_list[ins_idx].start = min(start, mi->range_list[ins_idx].start);
+	    mi->range_list[ins_idx].end = max(end, mi->range_list[end_idx].end);
+
+	    /* Now delete any combined ranges if needed, and we're
+	     * done. */
+
+	    _Mi_Clear(mi, ins_idx + 1, end_idx);
+	    return;
+	}
+	else
+	{
+	    _Mi_Insert(mi, ins_idx, start, end);
+	    return;
+	}
+    }
+
+}
+
+void Mi_Swap(mi_ptr mi1, mi_ptr mi2)
+{
+    assert(!Mi_IsDebugLocked(mi1));
+    assert(!Mi_IsDebugLocked(mi2));
+    assert(!mi1->interned && !mi2->interned);
+
+    assert(mi1 != NULL);
+    assert(mi2 != NULL);
+
+    MarkerRange r				= mi1->r;
+    unsigned long num_array_ranges		= mi1->num_array_ranges;
+    unsigned long allocated_array_ranges	= mi1->allocated_array_ranges;
+    mr_ptr range_list          			= mi1->range_list;
+    bool bitmap_form				= mi1->bitmap_form;
+
+    mi1->r					= mi2->r;
+    mi1->num_array_ranges			= mi2->num_array_ranges;
+    mi1->allocated_array_ranges			= mi2->allocated_array_ranges;
+    mi1->range_list				= mi2->range_list;
+    mi1->bitmap_form				= mi2->bitmap_form;
+
+    mi2->r					= r;
+    mi2->num_array_ranges			= num_array_ranges;
+    mi2->allocated_array_ranges			= allocated_array_ranges;
+    mi2->range_list				= range_list;
+    mi2->bitmap_form				= bitmap_form;
+}
+
+void Mi_RemoveValidRange(mi_ptr mi, markertype start, markertype end)
+{
+    /* Could be optimized a bunch more. */
+    assert(!Mi_IsDebugLocked(mi));
+
+    if(unlikely(start >= end))
+	return;
+
+    mi_ptr m = Mi_NEW(MARKER_MINUS_INFTY, start);
+    Mi_AppendValidRange(m, end, MARKER_PLUS_INFTY);
+
+    mi_ptr m2 = Mi_Intersection(mi, m);
+    
+    Mi_Swap(mi, m2);
+
+    O_DECREF(m);
+    O_DECREF(m2);
+}
+
+/* Query whether the range is valid at a certain point. */
+bool Mi_IsValid(cmi_ptr mi, markertype m)
+{
+    if(unlikely(mi == NULL))
+	return (m != MARKER_PLUS_INFTY);
+
+    if(mi->num_array_ranges == 0)
+    {
+	if(unlikely(mi->bitmap_form))
+	    return (mi->r.start <= m && m < mi->r.end && _MiBm_IsValid(_MI_BITMAP(mi), m));
+
+	return (mi->r.start <= m && m < mi->r.end);
+    }
+    else
+    {
+	size_t idx = _Mi_Bisect(mi, m);
+
+	return (mi->range_list[idx].start <= m && m < mi->range_list[idx].end);
+    }
+}
+
+/* One pass over the ranges for a sorted run of markers; any marker
+ * behind where the pass has got to gets its own lookup. */
+void Mi_IsValidBatch(cmi_ptr mi, const markertype *m, size_t n, bitfield *out)
+{
+    const size_t B = bitsizeof(bitfield);
+    size_t i;
+    bitfield w = 0;
+
+    MarkerIterator *mii = Mii_New(mi);
+    MarkerRange mr = {0, 0};
+    bool more = Mii_NEXT(&mr, mii);
+    markertype pos = MARKER_MINUS_INFTY;
+
+    for(i = 0; i < n; ++i)
+    {
+	bool valid;
+
+	if(unlikely(m[i] < pos))
+	{
+	    valid = Mi_IsValid(mi, m[i]);
+	}
+	else
+	{
+	    pos = m[i];
+
+	    while(more && mr.end <= pos)
+		more = Mii_NEXT(&mr, mii);
+
+	    valid = more && mr.start <= pos;
+	}
+
+	w |= ((bitfield)valid) << (i % B);
+
+	if(i % B == B - 1)
+	{
+	    out[i / B] = w;
+	    w = 0;
+	}
+    }
+
+    if(n % B != 0)
+	out[n / B] = w;
+
+    Mii_Delete(mii);
+}
+
+bool Mi_IsEmpty(cmi_ptr mi)
+{
+    return Mi_ISEMPTY(mi);
+}
+
+const MarkerRange* Mi_AtIndex(cmi_ptr mi, size_t index)
+{
+    return Mi_AT_INDEX(mi, index);
+}
+
+size_t Mi_NumMarkerRanges(cmi_ptr mi)
+{
+    return Mi_NUM_MARKER_RANGES(mi);
+}
+
+bool Mi_IsBitmap(cmi_ptr mi)
+{
+    return Mi_IS_BITMAP(mi);
+}
+
+bool Mi_IsInterned(cmi_ptr mi)
+{
+    return Mi_IS_INTERNED(mi);
+}
+
+/*****************************************
+ *
+ *  Set operations
+ *
+ ****************************************/
+
+/* Returns the complement of the two ranges. */
+mi_ptr Mi_Complement(cmi_ptr mi)
+{
+    if(unlikely(mi == NULL))
+	return Mi_NEW(0,0);
+
+    mi_ptr ret_mi = Mi_NEW(0,0);
+
+    MarkerIterator *mii = Mii_New(mi);
+    MarkerRange mr;
+
+    markertype last_r_end = MARKER_MINUS_INFTY;
+
+    while(Mii_NEXT(&mr, mii))
+    {
+	Mi_AppendValidRange(ret_mi, last_r_end, mr.start);
+	last_r_end = mr.end;
+    }
+
+    Mi_AppendValidRange(ret_mi, last_r_end, MARKER_PLUS_INFTY);
+
+    Mii_Delete(mii);
+
+    return ret_mi;
+}
+
+/* Compares a set in bitmap form against one in either form. */
+static bool _Mi_EqualMixed(cmi_ptr mi1, cmi_ptr mi2)
+{
+    if(mi1->r.start != Mi_Min(mi2) || mi1->r.end != Mi_Max(mi2))
+	return false;
+
+    MarkerIterator *mii1 = Mii_New(mi1);
+    MarkerIterator *mii2 = Mii_New(mi2);
+    MarkerRange mr1, mr2;
+    bool more1, more2, equal = true;
+
+    do {
+	more1 = Mii_NEXT(&mr1, mii1);
+	more2 = Mii_NEXT(&mr2, mii2);
+
+	if(more1 != more2 || (more1 && (mr1.start != mr2.start || mr1.end != mr2.end)))
+	{
+	    equal = false;
+	    break;
+	}
+    } while(more1);
+
+    Mii_Delete(mii1);
+    Mii_Delete(mii2);
+
+    return equal;
+}
+
+bool Mi_Equal(const MarkerInfo *mi1, const MarkerInfo* mi2)
+{
+    if(mi1 == NULL)
+	return Mi_ValidEverywhere(mi2);
+    else if(mi2 == NULL)
+	return Mi_ValidEverywhere(mi1);
+
+    if(unlikely(mi1->bitmap_form || mi2->bitmap_form))
+    {
+	if(mi1->bitmap_form && mi2->bitmap_form)
+	    return (mi1->r.start == mi2->r.start && mi1->r.end == mi2->r.end
+		    && _Mi_BitmapEqual(_MI_BITMAP(mi1), _MI_BITMAP(mi2)));
+	else
+	    return mi1->bitmap_form ? _Mi_EqualMixed(mi1, mi2) : _Mi_EqualMixed(mi2, mi1);
+    }
+
+    if(mi1->num_array_ranges == 0 || mi2->num_array_ranges == 0)
+    {
+	if(mi2->num_array_ranges < mi1->num_array_ranges)
+	{
+	    const MarkerInfo *mi_t = mi1; mi1 = mi2; mi2 = mi_t;
+	}
+
+	switch(mi2->num_array_ranges)
+	{
+	case 0:
+	    return (mi1->r.start == mi2->r.start) && (mi1->r.end == mi2->r.end);
+	case 1:
+	    return ((mi1->r.start == mi2->range_list[0].start) 
+		    && (mi1->r.end == mi2->range_list[0].end));
+	default:
+	    return false;
+	}
+    }
+    else
+    {
+	if(mi1->num_array_ranges != mi2->num_array_ranges)
+	    return false;
+
+	size_t i;
+	for(i = 0; i < mi1->num_array_ranges; ++i)
+	{
+	    if(! ((mi1->range_list[i].start == mi2->range_list[i].start) 
+		  && (mi1->range_list[i].end == mi2->range_list[i].end) ) )
+		return false;
+	}
+
+	return true;
+    }
+}
+
+mi_ptr Mi_Copy(cmi_ptr mi)
+{
+    if(unlikely(mi == NULL))
+	return Mi_NEW(MARKER_MINUS_INFTY, MARKER_PLUS_INFTY);
+
+    if(unlikely(mi->bitmap_form))
+	return _Mi_BitmapCopy(mi);
+
+    mi_ptr mic = Mi_NEW(0,0);
+
+    mic->r = mi->r;
+    
+    if(mi->num_array_ranges != 0)
+    {
+	mic->num_array_ranges = mi->num_array_ranges;
+	mic->range_list = (mr_ptr)malloc(sizeof(MarkerRange)*mi->num_array_ranges);
+	memcpy(mic->range_list, mi->range_list, sizeof(MarkerRange)*mi->num_array_ranges);
+	mic->allocated_array_ranges = mi->num_array_ranges;
+    }
+
+    return mic;
+}
+
+/********************************************************************************
+ *
+ *  Interning.  The pool is an open addressing table of the live
+ *  interned instances, probed linearly and keyed by a hash of the
+ *  range list.  It does not hold references; an interned marker info
+ *  removes itself when it is destroyed.
+ *
+ ********************************************************************************/
+
+typedef struct {
+    size_t hash;
+    MarkerInfo *mi;
+} _MiInternSlot;
+
+static _MiInternSlot *_mi_intern_slots = NULL;
+static size_t _mi_intern_size = 0, _mi_intern_count = 0;
+
+#ifdef ENABLE_THREADS
+static pthread_mutex_t _mi_intern_lock = PTHREAD_MUTEX_INITIALIZER;
+#define _MI_INTERN_LOCK()    pthread_mutex_lock(&_mi_intern_lock)
+#define _MI_INTERN_UNLOCK()  pthread_mutex_unlock(&_mi_intern_lock)
+#else
+#define _MI_INTERN_LOCK()
+#define _MI_INTERN_UNLOCK()
+#endif
+
+#define _MI_INTERN_INITIAL_SIZE 1024
+
+static inline size_t _Mi_HashMix(size_t h, uint64_t x)
+{
+    h ^= x + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+    return h;
+}
+
+static size_t _Mi_RangeHash(cmi_ptr mi)
+{
+    MarkerIterator *mii = Mii_New(mi);
+    MarkerRange mr;
+    uint64_t h = 0;
+
+    while(Mii_NEXT(&mr, mii))
+    {
+	h = _Mi_HashMix(h, (uint64_t)mr.start);
+	h = _Mi_HashMix(h, (uint64_t)mr.end);
+    }
+
+    Mii_Delete(mii);
+
+    /* Finalize so the low bits used for the slot depend on all of it. */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+
+    return (size_t)h;
+}
+
+static void _Mi_InternGrow()
+{
+    size_t old_size = _mi_intern_size, i;
+    _MiInternSlot *old_slots = _mi_intern_slots;
+
+    _mi_intern_size = (old_size == 0) ? _MI_INTERN_INITIAL_SIZE : 2*old_size;
+    _mi_intern_slots = (_MiInternSlot*)calloc(_mi_intern_size, sizeof(_MiInternSlot));
+
+    for(i = 0; i < old_size; ++i)
+    {
+	if(old_slots[i].mi != NULL)
+	{
+	    size_t j = old_slots[i].hash & (_mi_intern_size - 1);
+
+	    while(_mi_intern_slots[j].mi != NULL)
+		j = (j + 1) & (_mi_intern_size - 1);
+
+	    _mi_intern_slots[j] = old_slots[i];
+	}
+    }
+
+    free(old_slots);
+}
+
+mi_ptr Mi_Intern(mi_ptr mi)
+{
+    if(unlikely(mi == NULL) || mi->interned || O_IN_ARENA(mi))
+	return mi;
+
+    size_t hash = _Mi_RangeHash(mi);
+
+    _MI_INTERN_LOCK();
+
+    if(unlikely(2*(_mi_intern_count + 1) > _mi_intern_size))
+	_Mi_InternGrow();
+
+    size_t mask = _mi_intern_size - 1;
+    size_t j = hash & mask;
+
+    for(; _mi_intern_slots[j].mi != NULL; j = (j + 1) & mask)
+    {
+	MarkerInfo *c = _mi_intern_slots[j].mi;
+
+	/* An instance whose count has reached zero stays here until
+	 * its destruction takes it out, which needs the lock; it can't
+	 * be revived.  Checking and taking the reference is one atomic
+	 * step, so a last reference dropped meanwhile on another
+	 * thread can't slip in between. */
+	if(_mi_intern_slots[j].hash == hash && Mi_Equal(c, mi) && O_IncRefIfLive((Object*)c))
+	{
+	    _MI_INTERN_UNLOCK();
+	    O_DECREF(mi);
+	    return c;
+	}
+    }
+
+    /* Interned instances are counted through the shared count alone,
+     * which the lookup above needs.  Only the thread owning mi can
+     * switch it over, so another thread interns a copy instead. */
+    if(unlikely(!O_UnbiasRefCount((Object*)mi)))
+    {
+	mi_ptr mic = Mi_Copy(mi);
+	O_DECREF(mi);
+	mi = mic;
+	O_UnbiasRefCount((Object*)mi);
+    }
+
+    _mi_intern_slots[j].hash = hash;
+    _mi_intern_slots[j].mi = mi;
+    ++_mi_intern_count;
+
+    mi->interned = true;
+
+    _MI_INTERN_UNLOCK();
+
+    return mi;
+}
+
+/* Takes mi out of the table; the lock must be held. */
+static void _Mi_InternRemoveLocked(cmi_ptr mi, size_t hash)
+{
+    size_t mask = _mi_intern_size - 1;
+    size_t j = hash & mask;
+
+    while(_mi_intern_slots[j].mi != mi)
+    {
+	assert(_mi_intern_slots[j].mi != NULL);
+	j = (j + 1) & mask;
+    }
+
+    /* Shift later entries of the probe run back into the hole so no
+     * tombstones are needed. */
+    size_t k = j;
+
+    while(true)
+    {
+	k = (k + 1) & mask;
+
+	if(_mi_intern_slots[k].mi == NULL)
+	    break;
+
+	size_t home = _mi_intern_slots[k].hash & mask;
+
+	/* Only move the entry at k if its home slot is not in (j, k]. */
+	if( (j < k) ? (home <= j || home > k) : (home <= j && home > k))
+	{
+	    _mi_intern_slots[j] = _mi_intern_slots[k];
+	    j = k;
+	}
+    }
+
+    _mi_intern_slots[j].mi = NULL;
+    --_mi_intern_count;
+}
+
+static void _Mi_InternRemove(cmi_ptr mi)
+{
+    size_t hash = _Mi_RangeHash(mi);
+
+    _MI_INTERN_LOCK();
+    _Mi_InternRemoveLocked(mi, hash);
+    _MI_INTERN_UNLOCK();
+}
+
+mi_ptr Mi_Thaw(mi_ptr mi)
+{
+    if(mi == NULL || !mi->interned)
+	return mi;
+
+    size_t hash = _Mi_RangeHash(mi);
+
+    /* Other threads can only pick up a new reference through the
+     * table, so the count can't rise between checking it and taking
+     * mi out while the lock is held. */
+    _MI_INTERN_LOCK();
+
+    bool sole_owner = (O_REF_COUNT(mi) == 1);
+
+    if(sole_owner)
+    {
+	_Mi_InternRemoveLocked(mi, hash);
+	mi->interned = false;
+    }
+
+    _MI_INTERN_UNLOCK();
+
+    if(sole_owner)
+	return mi;
+
+    mi_ptr mic = Mi_Copy(mi);
+    O_DECREF(mi);
+    return mic;
+}
+
+size_t Mi_InternedCount()
+{
+    return _mi_intern_count;
+}
+
+/********************************************************************************
+ *
+ *  Galloping set operations.  When one range list is much longer
+ *  than the other, walking both in step wastes nearly all the work on
+ *  the long one.  Instead, each range of the short list is located
+ *  in the long one by exponential search, and the stretches of the
+ *  long list in between are copied over (union, difference) or
+ *  skipped (intersection) in bulk.  Only used when neither set is in
+ *  bitmap form.
+ *
+ ********************************************************************************/
+
+/* Use the galloping versions when one list is this many times longer
+ * than the other. */
+#define _MI_GALLOP_RATIO 16
+
+/* The ranges of a set in range form; n is 0 if it's empty. */
+static inline const MarkerRange* _Mi_RangeArray(cmi_ptr mi, size_t *n)
+{
+    assert(!mi->bitmap_form);
+
+    if(mi->num_array_ranges == 0)
+    {
+	*n = (mi->r.start < mi->r.end) ? 1 : 0;
+	return &(mi->r);
+    }
+    else
+    {
+	*n = mi->num_array_ranges;
+	return mi->range_list;
+    }
+}
+
+static inline bool _Mi_GallopOkay(size_t n1, size_t n2)
+{
+    return (n1 != 0 && n2 != 0
+	    && (n1 >= _MI_GALLOP_RATIO*n2 || n2 >= _MI_GALLOP_RATIO*n1));
+}
+
+/* The first index i >= lo with rl[i].end >= s, or n if none. */
+static inline size_t _Mi_Gallop(const MarkerRange *rl, size_t lo, size_t n, markertype s)
+{
+    size_t step = 1, hi = lo;
+
+    if(lo >= n || rl[lo].end >= s)
+	return lo;
+
+    /* rl[lo].end < s here; find a bracket [lo, hi] with rl[hi].end >= s. */
+    while(true)
+    {
+	hi = lo + step;
+
+	if(hi >= n)
+	{
+	    hi = n;
+	    break;
+	}
+
+	if(rl[hi].end >= s)
+	    break;
+
+	lo = hi;
+	step *= 2;
+    }
+
+    /* Now rl[lo].end < s <= rl[hi].end (taking rl[n].end as infinite). */
+    while(hi - lo > 1)
+    {
+	size_t b = lo + (hi - lo) / 2;
+
+	if(rl[b].end >= s)
+	    hi = b;
+	else
+	    lo = b;
+    }
+
+    return hi;
+}
+
+/* A range list under construction. */
+typedef struct {
+    mr_ptr rl;
+    size_t n, allocated;
+} _MiRangeBuffer;
 
-    mi2->r					= r;
-    mi2->num_array_ranges			= num_array_ranges;
-    mi2->allocated_array_ranges			= allocated_array_ranges;
-    mi2->range_list				= range_list;
+static inline void _Mrb_Init(_MiRangeBuffer *b, size_t size_hint)
+{
+    b->n = 0;
+    b->allocated = max(size_hint, 4);
+    b->rl = (mr_ptr)malloc(sizeof(MarkerRange)*b->allocated);
 }
 
-void Mi_RemoveValidRange(mi_ptr mi, markertype start, markertype end)
+static inline void _Mrb_Reserve(_MiRangeBuffer *b, size_t extra)
 {
-    /* Could be optimized a bunch more. */
-    assert(!Mi_IsDebugLocked(mi));
+    if(unlikely(b->n + extra > b->allocated))
+    {
+	b->allocated = max(2*b->allocated, b->n + extra);
+	b->rl = (mr_ptr)realloc(b->rl, sizeof(MarkerRange)*b->allocated);
+    }
+}
 
+/* Appends [start, end), joining it to the last range if they touch;
+ * ranges must come in order of start. */
+static inline void _Mrb_Push(_MiRangeBuffer *b, markertype start, markertype end)
+{
     if(unlikely(start >= end))
 	return;
 
-    mi_ptr m = Mi_NEW(MARKER_MINUS_INFTY, start);
-    Mi_AppendValidRange(m, end, MARKER_PLUS_INFTY);
+    if(b->n != 0 && start <= b->rl[b->n - 1].end)
+    {
+	b->rl[b->n - 1].end = max(b->rl[b->n - 1].end, end);
+	return;
+    }
 
-    mi_ptr m2 = Mi_Intersection(mi, m);
-    
-    Mi_Swap(mi, m2);
+    _Mrb_Reserve(b, 1);
+    b->rl[b->n].start = start;
+    b->rl[b->n].end = end;
+    ++b->n;
+}
 
-    O_DECREF(m);
-    O_DECREF(m2);
+/* Appends rl[lo, hi), which all lie after the ranges in b. */
+static inline void _Mrb_PushBlock(_MiRangeBuffer *b, const MarkerRange *rl, size_t lo, size_t hi)
+{
+    if(lo >= hi)
+	return;
+
+    /* Only the first can touch what's there. */
+    _Mrb_Push(b, rl[lo].start, rl[lo].end);
+    ++lo;
+
+    if(lo < hi)
+    {
+	_Mrb_Reserve(b, hi - lo);
+	memcpy(b->rl + b->n, rl + lo, sizeof(MarkerRange)*(hi - lo));
+	b->n += hi - lo;
+    }
 }
 
-/* Query whether the range is valid at a certain point. */
-bool Mi_IsValid(cmi_ptr mi, markertype m)
+/* Turns the buffer into a new marker info. */
+static mi_ptr _Mrb_Finish(_MiRangeBuffer *b)
 {
-    if(unlikely(mi == NULL))
-	return (m != MARKER_PLUS_INFTY);
+    mi_ptr mi = Mi_NEW(0,0);
 
-    if(mi->num_array_ranges == 0)
+    if(b->n <= 1)
     {
-	return (mi->r.start <= m && m < mi->r.end);
+	if(b->n == 1)
+	    mi->r = b->rl[0];
+
+	free(b->rl);
     }
     else
     {
-	size_t idx = _Mi_Bisect(mi, m);
-
-	return (mi->range_list[idx].start <= m && m < mi->range_list[idx].end);
+	mi->r.start = b->rl[0].start;
+	mi->r.end = b->rl[b->n - 1].end;
+	mi->range_list = b->rl;
+	mi->num_array_ranges = b->n;
+	mi->allocated_array_ranges = b->allocated;
     }
-}
 
-bool Mi_IsEmpty(cmi_ptr mi)
-{
-    return Mi_ISEMPTY(mi);
-}
+    Mi_Compact(mi);
 
-const MarkerRange* Mi_AtIndex(cmi_ptr mi, size_t index)
-{
-    return Mi_AT_INDEX(mi, index);
+    return mi;
 }
 
-size_t Mi_NumMarkerRanges(cmi_ptr mi)
+/* S is the short list, L the long one. */
+static mi_ptr _Mi_GallopUnion(const MarkerRange *S, size_t nS, const MarkerRange *L, size_t nL)
 {
-    return Mi_NUM_MARKER_RANGES(mi);
-}
+    _MiRangeBuffer b;
+    size_t i, j = 0;
 
-/*****************************************
- *
- *  Set operations
- *
- ****************************************/
+    _Mrb_Init(&b, nL + nS);
 
-/* Returns the complement of the two ranges. */
-mi_ptr Mi_Complement(cmi_ptr mi)
-{
-    if(unlikely(mi == NULL))
-	return Mi_NEW(0,0);
+    for(i = 0; i < nS; ++i)
+    {
+	markertype start = S[i].start, end = S[i].end;
 
-    mi_ptr ret_mi = Mi_NEW(0,0);
+	/* Everything that ends before this range starts goes over as is. */
+	size_t k = _Mi_Gallop(L, j, nL, start);
+	_Mrb_PushBlock(&b, L, j, k);
 
-    MarkerIterator *mii = Mii_New(mi);
-    MarkerRange mr;
+	if(k < nL && L[k].start < start)
+	    start = L[k].start;
 
-    markertype last_r_end = MARKER_MINUS_INFTY;
+	while(k < nL && L[k].start <= end)
+	{
+	    end = max(end, L[k].end);
+	    ++k;
+	}
 
-    while(Mii_NEXT(&mr, mii))
-    {
-	Mi_AppendValidRange(ret_mi, last_r_end, mr.start);
-	last_r_end = mr.end;
+	_Mrb_Push(&b, start, end);
+	j = k;
     }
 
-    Mi_AppendValidRange(ret_mi, last_r_end, MARKER_PLUS_INFTY);
+    _Mrb_PushBlock(&b, L, j, nL);
 
-    return ret_mi;
+    return _Mrb_Finish(&b);
 }
 
-bool Mi_Equal(const MarkerInfo *mi1, const MarkerInfo* mi2)
+static mi_ptr _Mi_GallopIntersection(const MarkerRange *S, size_t nS, const MarkerRange *L, size_t nL)
 {
-    if(mi1 == NULL)
-	return Mi_ValidEverywhere(mi2);
-    else if(mi2 == NULL)
-	return Mi_ValidEverywhere(mi1);
+    _MiRangeBuffer b;
+    size_t i, j = 0;
 
-    if(mi1->num_array_ranges == 0 || mi2->num_array_ranges == 0)
+    _Mrb_Init(&b, 2*nS);
+
+    for(i = 0; i < nS && j < nL; ++i)
     {
-	if(mi2->num_array_ranges < mi1->num_array_ranges)
-	{
-	    const MarkerInfo *mi_t = mi1; mi1 = mi2; mi2 = mi_t;
-	}
+	size_t k = j = _Mi_Gallop(L, j, nL, S[i].start);
 
-	switch(mi2->num_array_ranges)
+	while(k < nL && L[k].start < S[i].end)
 	{
-	case 0:
-	    return (mi1->r.start == mi2->r.start) && (mi1->r.end == mi2->r.end);
-	case 1:
-	    return ((mi1->r.start == mi2->range_list[0].start) 
-		    && (mi1->r.end == mi2->range_list[0].end));
-	default:
-	    return false;
+	    _Mrb_Push(&b, max(S[i].start, L[k].start), min(S[i].end, L[k].end));
+	    ++k;
 	}
+
+	/* The last one may reach into the next range of S. */
+	if(k > j)
+	    j = k - 1;
     }
-    else
+
+    return _Mrb_Finish(&b);
+}
+
+/* A - B, with A the short list. */
+static mi_ptr _Mi_GallopDifferenceShort(const MarkerRange *A, size_t nA, const MarkerRange *B, size_t nB)
+{
+    _MiRangeBuffer b;
+    size_t i, j = 0;
+
+    _Mrb_Init(&b, 2*nA);
+
+    for(i = 0; i < nA; ++i)
     {
-	if(mi1->num_array_ranges != mi2->num_array_ranges)
-	    return false;
+	markertype cur = A[i].start;
 
-	size_t i;
-	for(i = 0; i < mi1->num_array_ranges; ++i)
+	j = _Mi_Gallop(B, j, nB, cur);
+
+	while(j < nB && B[j].start < A[i].end)
 	{
-	    if(! ((mi1->range_list[i].start == mi2->range_list[i].start) 
-		  && (mi1->range_list[i].end == mi2->range_list[i].end) ) )
-		return false;
+	    _Mrb_Push(&b, cur, B[j].start);
+	    cur = max(cur, B[j].end);
+
+	    /* Keep it if it reaches past this range. */
+	    if(B[j].end > A[i].end)
+		break;
+
+	    ++j;
 	}
 
-	return true;
+	_Mrb_Push(&b, cur, A[i].end);
     }
+
+    return _Mrb_Finish(&b);
 }
 
-mi_ptr Mi_Copy(cmi_ptr mi)
+/* A - B, with B the short list. */
+static mi_ptr _Mi_GallopDifferenceLong(const MarkerRange *A, size_t nA, const MarkerRange *B, size_t nB)
 {
-    if(unlikely(mi == NULL))
-	return Mi_NEW(MARKER_MINUS_INFTY, MARKER_PLUS_INFTY);
+    _MiRangeBuffer b;
+    size_t i = 0, j;
 
-    mi_ptr mic = Mi_NEW(0,0);
+    /* The part of A[i] not yet cut away starts here. */
+    markertype cur = (nA != 0) ? A[0].start : 0;
 
-    mic->r = mi->r;
-    
-    if(mi->num_array_ranges != 0)
+    _Mrb_Init(&b, nA + nB);
+
+    for(j = 0; j < nB && i < nA; ++j)
     {
-	mic->num_array_ranges = mi->num_array_ranges;
-	mic->range_list = (mr_ptr)malloc(sizeof(MarkerRange)*mi->num_array_ranges);
-	memcpy(mic->range_list, mi->range_list, sizeof(MarkerRange)*mi->num_array_ranges);
-	mic->allocated_array_ranges = mi->num_array_ranges;
+	/* The first range of A that ends after B[j] starts. */
+	size_t k = _Mi_Gallop(A, i, nA, B[j].start + 1);
+
+	if(k > i)
+	{
+	    _Mrb_Push(&b, cur, A[i].end);
+	    _Mrb_PushBlock(&b, A, i + 1, k);
+	    i = k;
+
+	    if(i == nA)
+		break;
+
+	    cur = A[i].start;
+	}
+
+	while(i < nA && A[i].start < B[j].end)
+	{
+	    _Mrb_Push(&b, cur, B[j].start);
+
+	    if(A[i].end > B[j].end)
+	    {
+		cur = B[j].end;
+		break;
+	    }
+
+	    if(++i < nA)
+		cur = A[i].start;
+	}
     }
 
-    return mic;
+    if(i < nA)
+    {
+	_Mrb_Push(&b, cur, A[i].end);
+	_Mrb_PushBlock(&b, A, i + 1, nA);
+    }
+
+    return _Mrb_Finish(&b);
 }
 
 /* Intersection of two ranges. */
+cpu_dispatch
 mi_ptr Mi_Union(cmi_ptr mi1, cmi_ptr mi2)
 {
     if(unlikely(mi1 == NULL || mi2 == NULL) )
 	return NULL;
 
+    if(mi1->bitmap_form && mi2->bitmap_form)
+	return _Mi_BitmapUnion(_MI_BITMAP(mi1), _MI_BITMAP(mi2));
+
+    if(!mi1->bitmap_form && !mi2->bitmap_form)
+    {
+	size_t n1, n2;
+	const MarkerRange *rl1 = _Mi_RangeArray(mi1, &n1);
+	const MarkerRange *rl2 = _Mi_RangeArray(mi2, &n2);
+
+	if(_Mi_GallopOkay(n1, n2))
+	    return (n1 < n2) ? _Mi_GallopUnion(rl1, n1, rl2, n2) : _Mi_GallopUnion(rl2, n2, rl1, n1);
+    }
+
     MarkerRange mr1;
     MarkerIterator *mii1 = Mii_New(mi1);
     bool mr1_okay = Mii_NEXT(&mr1, mii1);
@@ -591,6 +2042,7 @@ mi_ptr Mi_Union(cmi_ptr mi1, cmi_ptr mi2)
 
     if(unlikely(!mr2_okay))
     {
+	Mii_Delete(mii1);
 	Mii_Delete(mii2);
 	return Mi_Copy(mi1);
     }
@@ -645,6 +2097,8 @@ MR_UNION_DONE:;
 
     Mii_Delete(mii1);
     Mii_Delete(mii2);
+
+    Mi_Compact(mi);
  
     return mi;
 }
@@ -656,6 +2110,9 @@ mi_ptr Mi_UnionUpdate(mi_ptr mi1, cmi_ptr mi2)
     if(unlikely(mi1 == NULL))
 	return Mi_Copy(mi2);
 
+    if(unlikely(mi1->interned))
+	mi1 = Mi_Thaw(mi1);
+
     mi_ptr mi = Mi_Union(mi1, mi2);
     Mi_Swap(mi, mi1);
     O_DECREF(mi);
@@ -669,6 +2126,9 @@ mi_ptr Mi_IntersectionUpdate(mi_ptr mi1, cmi_ptr mi2)
     if(unlikely(mi1 == NULL))
 	return Mi_Copy(mi2);
 
+    if(unlikely(mi1->interned))
+	mi1 = Mi_Thaw(mi1);
+
     mi_ptr mi = Mi_Intersection(mi1, mi2);
     Mi_Swap(mi, mi1);
     O_DECREF(mi);
@@ -676,6 +2136,7 @@ mi_ptr Mi_IntersectionUpdate(mi_ptr mi1, cmi_ptr mi2)
 }
 
 /* Intersection of two ranges. */
+cpu_dispatch
 mi_ptr Mi_Intersection(cmi_ptr mi1, cmi_ptr mi2)
 {
     if(unlikely(mi1 == NULL))
@@ -683,6 +2144,21 @@ mi_ptr Mi_Intersection(cmi_ptr mi1, cmi_ptr mi2)
     else if(unlikely(mi2 == NULL))
 	return Mi_Copy(mi1);
 
+    if(mi1->bitmap_form && mi2->bitmap_form)
+	return _Mi_BitmapIntersection(_MI_BITMAP(mi1), _MI_BITMAP(mi2));
+
+    if(!mi1->bitmap_form && !mi2->bitmap_form)
+    {
+	size_t n1, n2;
+	const MarkerRange *rl1 = _Mi_RangeArray(mi1, &n1);
+	const MarkerRange *rl2 = _Mi_RangeArray(mi2, &n2);
+
+	if(_Mi_GallopOkay(n1, n2))
+	    return ((n1 < n2) 
+		    ? _Mi_GallopIntersection(rl1, n1, rl2, n2) 
+		    : _Mi_GallopIntersection(rl2, n2, rl1, n1));
+    }
+
     mi_ptr mi = Mi_NEW(0,0);
 
     MarkerIterator *mii1 = Mii_New(mi1);
@@ -717,11 +2193,14 @@ mi_ptr Mi_Intersection(cmi_ptr mi1, cmi_ptr mi2)
 
     Mii_Delete(mii1);
     Mii_Delete(mii2);
+
+    Mi_Compact(mi);
  
     return mi;
 }
 
 /* All the elements in mi1 that aren't in mi2 */
+cpu_dispatch
 mi_ptr Mi_Difference(cmi_ptr mi1, cmi_ptr mi2)
 {
     if(unlikely(mi1 == NULL))
@@ -729,6 +2208,21 @@ mi_ptr Mi_Difference(cmi_ptr mi1, cmi_ptr mi2)
     else if(unlikely(mi2 == NULL))
 	return Mi_NEW(0,0);
 
+    if(mi1->bitmap_form && mi2->bitmap_form)
+	return _Mi_BitmapDifference(_MI_BITMAP(mi1), _MI_BITMAP(mi2));
+
+    if(!mi1->bitmap_form && !mi2->bitmap_form)
+    {
+	size_t n1, n2;
+	const MarkerRange *rl1 = _Mi_RangeArray(mi1, &n1);
+	const MarkerRange *rl2 = _Mi_RangeArray(mi2, &n2);
+
+	if(_Mi_GallopOkay(n1, n2))
+	    return ((n1 < n2) 
+		    ? _Mi_GallopDifferenceShort(rl1, n1, rl2, n2) 
+		    : _Mi_GallopDifferenceLong(rl1, n1, rl2, n2));
+    }
+
     mi_ptr mi2c = Mi_Complement(mi2);
     mi_ptr ret_mi = Mi_Intersection(mi1, mi2c);
 
@@ -751,6 +2245,174 @@ mi_ptr Mi_SymmetricDifference(cmi_ptr mi1, cmi_ptr mi2)
     return ret_mi;
 }
 
+/********************************************************************************
+ *
+ *  Many-way union and intersection.  All the range lists are swept
+ *  together, keeping the current range of each in a binary heap, so
+ *  the result comes out in one pass in O(R log n) for R ranges over
+ *  n sets, instead of being rebuilt once per set as with repeated
+ *  calls to the Update functions.
+ *
+ ********************************************************************************/
+
+typedef struct {
+    markertype key;
+    MarkerRange mr;
+    MarkerIterator *mii;
+} _MiHeapItem;
+
+static inline void _Mi_HeapSiftDown(_MiHeapItem *heap, size_t n, size_t i)
+{
+    _MiHeapItem item = heap[i];
+
+    while(2*i + 1 < n)
+    {
+	size_t c = 2*i + 1;
+
+	if(c + 1 < n && heap[c+1].key < heap[c].key)
+	    ++c;
+
+	if(item.key <= heap[c].key)
+	    break;
+
+	heap[i] = heap[c];
+	i = c;
+    }
+
+    heap[i] = item;
+}
+
+static inline void _Mi_HeapInit(_MiHeapItem *heap, size_t n)
+{
+    size_t i;
+
+    for(i = n / 2; i != 0; --i)
+	_Mi_HeapSiftDown(heap, n, i - 1);
+}
+
+mi_ptr Mi_UnionMany(const MarkerInfo **mis, size_t n)
+{
+    size_t i, n_heap = 0, n_ranges = 0;
+
+    for(i = 0; i < n; ++i)
+    {
+	if(unlikely(mis[i] == NULL))
+	    return NULL;
+
+	if(!mis[i]->bitmap_form)
+	    n_ranges += Mi_NUM_MARKER_RANGES(mis[i]);
+    }
+
+    if(n == 1)
+	return Mi_Copy(mis[0]);
+    else if(n == 2)
+	return Mi_Union(mis[0], mis[1]);
+
+    _MiHeapItem *heap = (_MiHeapItem*)malloc(sizeof(_MiHeapItem)*max(n, 1));
+
+    for(i = 0; i < n; ++i)
+    {
+	heap[n_heap].mii = Mii_New(mis[i]);
+
+	if(Mii_NEXT(&heap[n_heap].mr, heap[n_heap].mii))
+	{
+	    heap[n_heap].key = heap[n_heap].mr.start;
+	    ++n_heap;
+	}
+	else
+	    Mii_Delete(heap[n_heap].mii);
+    }
+
+    _Mi_HeapInit(heap, n_heap);
+
+    _MiRangeBuffer b;
+    _Mrb_Init(&b, n_ranges);
+
+    /* Ranges come off in order of start, so each either joins the
+     * last one out or starts a new one. */
+    while(n_heap != 0)
+    {
+	_Mrb_Push(&b, heap[0].mr.start, heap[0].mr.end);
+
+	if(Mii_NEXT(&heap[0].mr, heap[0].mii))
+	    heap[0].key = heap[0].mr.start;
+	else
+	{
+	    Mii_Delete(heap[0].mii);
+	    heap[0] = heap[--n_heap];
+	}
+
+	_Mi_HeapSiftDown(heap, n_heap, 0);
+    }
+
+    free(heap);
+
+    return _Mrb_Finish(&b);
+}
+
+mi_ptr Mi_IntersectionMany(const MarkerInfo **mis, size_t n)
+{
+    size_t i, n_heap = 0;
+
+    for(i = 0; i < n; ++i)
+    {
+	if(mis[i] != NULL && Mi_ISEMPTY(mis[i]))
+	    return Mi_NEW(0,0);
+    }
+
+    _MiHeapItem *heap = (_MiHeapItem*)malloc(sizeof(_MiHeapItem)*max(n, 1));
+
+    /* Every range of the result lies in the current range of each
+     * set, so it starts at the largest start and ends at the
+     * smallest end; starts only ever move forward. */
+    markertype lo = MARKER_MINUS_INFTY;
+
+    for(i = 0; i < n; ++i)
+    {
+	if(mis[i] == NULL)
+	    continue;
+
+	heap[n_heap].mii = Mii_New(mis[i]);
+	Mii_NEXT(&heap[n_heap].mr, heap[n_heap].mii);
+	heap[n_heap].key = heap[n_heap].mr.end;
+	lo = max(lo, heap[n_heap].mr.start);
+	++n_heap;
+    }
+
+    if(n_heap == 0)
+    {
+	free(heap);
+	return Mi_NEW(MARKER_MINUS_INFTY, MARKER_PLUS_INFTY);
+    }
+
+    _Mi_HeapInit(heap, n_heap);
+
+    _MiRangeBuffer b;
+    _Mrb_Init(&b, 8);
+
+    while(true)
+    {
+	/* The set whose range ends first gives the end of this piece,
+	 * then moves on to its next range. */
+	_Mrb_Push(&b, lo, heap[0].key);
+
+	if(!Mii_NEXT(&heap[0].mr, heap[0].mii))
+	    break;
+
+	heap[0].key = heap[0].mr.end;
+	lo = max(lo, heap[0].mr.start);
+
+	_Mi_HeapSiftDown(heap, n_heap, 0);
+    }
+
+    for(i = 0; i < n_heap; ++i)
+	Mii_Delete(heap[i].mii);
+
+    free(heap);
+
+    return _Mrb_Finish(&b);
+}
+
 LOCAL_MEMORY_POOL(MarkerIterator);
 LOCAL_MEMORY_POOL(MarkerRevIterator);
 
@@ -759,12 +2421,21 @@ static const MarkerRange _mr_all_valid = {MARKER_MINUS_INFTY, MARKER_PLUS_INFTY}
 MarkerIterator *Mii_New(cmi_ptr mi)
 {
     MarkerIterator *mii = Mp_NewMarkerIterator();
+
+    mii->bitmap = NULL;
     
     /* See if it's actually empty, and if so, set it up to terminate
      * after . */
     if(likely(mi != NULL))
     {
-	if(mi->num_array_ranges == 0)
+	if(unlikely(mi->bitmap_form))
+	{
+	    mii->bitmap = _MI_BITMAP(mi);
+	    mii->chunk = 0;
+	    mii->pos = MARKER_MINUS_INFTY;
+	    mii->counts_left = 0;
+	}
+	else if(mi->num_array_ranges == 0)
 	{
 	    if(mi->r.start == mi->r.end)
 	    {
@@ -793,6 +2464,11 @@ MarkerIterator *Mii_New(cmi_ptr mi)
     return mii;
 }
 
+bool _Mii_BitmapNext(MarkerRange *dest, MarkerIterator *mii)
+{
+    return _MiBm_NextRun(mii->bitmap, &mii->chunk, &mii->pos, dest);
+}
+
 /* Returns the next marker range in the sequence. */
 bool Mii_Next(MarkerRange *mr, MarkerIterator *mii)
 {
@@ -810,12 +2486,21 @@ void Mii_Delete(MarkerIterator *mii)
 MarkerRevIterator *Miri_New(cmi_ptr mi)
 {
     MarkerRevIterator *miri = Mp_NewMarkerRevIterator();
+
+    miri->bitmap = NULL;
     
     /* See if it's actually empty, and if so, set it up to terminate
      * after . */
     if(likely(mi != NULL))
     {
-	if(mi->num_array_ranges == 0)
+	if(unlikely(mi->bitmap_form))
+	{
+	    miri->bitmap = _MI_BITMAP(mi);
+	    miri->chunk = _MI_BITMAP(mi)->n_chunks;
+	    miri->pos = MARKER_PLUS_INFTY;
+	    miri->counts_left = 0;
+	}
+	else if(mi->num_array_ranges == 0)
 	{
 	    if(mi->r.start == mi->r.end)
 	    {
@@ -844,6 +2529,11 @@ MarkerRevIterator *Miri_New(cmi_ptr mi)
     return miri;
 }
 
+bool _Miri_BitmapNext(MarkerRange *dest, MarkerRevIterator *miri)
+{
+    return _MiBm_PrevRun(miri->bitmap, &miri->chunk, &miri->pos, dest);
+}
+
 /* Returns the next marker range in the sequence. */
 bool Miri_Next(MarkerRange* dest, MarkerRevIterator *miri)
 {
@@ -920,6 +2610,23 @@ void Mi_Print(cmi_ptr mi)
     {
 	printf("[-inf, inf)");
     }
+    else if(unlikely(mi->bitmap_form))
+    {
+	MarkerIterator *mii = Mii_New(mi);
+	MarkerRange mr;
+	bool first = true;
+
+	while(Mii_NEXT(&mr, mii))
+	{
+	    if(!first)
+		printf(", ");
+
+	    Mi_PrintInterval(mr.start, mr.end);
+	    first = false;
+	}
+
+	Mii_Delete(mii);
+    }
     else if(mi->num_array_ranges == 0)
     {
 	Mi_PrintInterval(mi->r.start, mi->r.end);
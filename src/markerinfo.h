@@ -34,11 +34,22 @@ typedef struct {
 typedef MarkerRange* mr_ptr;
 typedef const MarkerRange* cmr_ptr;
 
+/* A set is held either as a sorted list of ranges (r alone when there
+ * is only one), or, when it is bounded and made of many short ranges,
+ * in bitmap form (see markerinfo.c).  In bitmap form, range_list
+ * points to the bitmap, num_array_ranges is 0 and r holds the bounds
+ * of the set, so Mi_Min, Mi_Max and the emptiness tests need no
+ * special case. */
+
+struct _MiBitmap;
+
 typedef struct {
     OBJECT_ITEMS;
     MarkerRange r;
     size_t num_array_ranges, allocated_array_ranges;
     MarkerRange* range_list;
+    bool interned;
+    bool bitmap_form;
 #ifndef NDEBUG
     size_t lock_count;
 #endif
@@ -81,6 +92,12 @@ void Mi_RemoveValidRange(mi_ptr mi, markertype r_lower, markertype r_higher);
 /* Query whether the range is valid at a certain point. */
 bool Mi_IsValid(cmi_ptr mi, markertype m);
 
+/* Sets bit i of out (bit i % bitsizeof(bitfield) of word i /
+ * bitsizeof(bitfield)) to Mi_IsValid(mi, m[i]), for all n markers.
+ * out must hold ceil(n / bitsizeof(bitfield)) words.  If m is
+ * sorted, this is a single pass over the ranges of mi. */
+void Mi_IsValidBatch(cmi_ptr mi, const markertype *m, size_t n, bitfield *out);
+
 /* Query whether the range is valid everywhere. */
 bool Mi_ValidEverywhere(cmi_ptr mi);
 
@@ -99,6 +116,36 @@ bool Mi_Equal(cmi_ptr mi1, cmi_ptr);
 /* Swaps the validity info in the two markerinfo objects. */
 void Mi_Swap(mi_ptr mi1, mi_ptr mi2);
 
+/* Switches mi to whichever of the range list or bitmap forms is
+ * smaller.  The set operations do this for their results. */
+void Mi_Compact(mi_ptr mi);
+static inline bool Mi_IS_BITMAP(cmi_ptr mi);
+bool Mi_IsBitmap(cmi_ptr mi);
+
+/*****************************************
+ *
+ *  Interning.  Mi_Intern takes over the caller's reference to mi
+ *  and returns a reference to the one shared instance holding the
+ *  same ranges, so identical validity sets are stored once.  An
+ *  interned marker info is frozen; the Mi_* functions that change a
+ *  set in place must not be called on it.  Instead, Mi_Thaw (which
+ *  also takes over the reference) returns a private, changeable
+ *  version -- the same object if nothing else refers to it, else a
+ *  copy.  Mi_UnionUpdate and Mi_IntersectionUpdate do this
+ *  themselves, as do the H_*_MARKER_VALID_RANGE functions.
+ *
+ *  Objects allocated inside an arena are never interned.
+ *
+ ****************************************/
+
+mi_ptr Mi_Intern(mi_ptr mi);
+mi_ptr Mi_Thaw(mi_ptr mi);
+static inline bool Mi_IS_INTERNED(cmi_ptr mi);
+bool Mi_IsInterned(cmi_ptr mi);
+
+/* The number of distinct interned marker infos alive. */
+size_t Mi_InternedCount();
+
 
 /*****************************************
  *
@@ -123,6 +170,12 @@ mi_ptr Mi_Difference(cmi_ptr mi1, cmi_ptr mi2);
 /* All the elements in exactly one set but not both. */
 mi_ptr Mi_SymmetricDifference(cmi_ptr mi1, cmi_ptr mi2);
 
+/* Union and intersection of the n sets in mis, all in one pass.  As
+ * with the two set versions, a NULL set is valid everywhere, and
+ * Mi_UnionMany then returns NULL. */
+mi_ptr Mi_UnionMany(const MarkerInfo **mis, size_t n);
+mi_ptr Mi_IntersectionMany(const MarkerInfo **mis, size_t n);
+
 /*****************************************
  *
  *  Ways to look at the marker range parameters by index
@@ -165,8 +218,19 @@ static inline bool Mi_MINUS_INFTY_IS_VALID(cmi_ptr mi)
 	     : mi->range_list[0].start == MARKER_MINUS_INFTY));
 }
 
+size_t _Mi_BitmapNumRanges(cmi_ptr mi);
+const MarkerRange* _Mi_BitmapAtIndex(cmi_ptr mi, size_t index);
+
+static inline bool Mi_IS_BITMAP(cmi_ptr mi)
+{
+    return (mi != NULL) && mi->bitmap_form;
+}
+
 static inline size_t Mi_NUM_MARKER_RANGES(cmi_ptr mi) 
 {
+    if(unlikely(Mi_IS_BITMAP(mi)))
+	return _Mi_BitmapNumRanges(mi);
+
     return (Mi_ISEMPTY(mi) 
 	    ? 0
 	    : ((mi->num_array_ranges == 0) 
@@ -174,8 +238,16 @@ static inline size_t Mi_NUM_MARKER_RANGES(cmi_ptr mi)
 	       : mi->num_array_ranges));
 }
 
+/* In bitmap form, this decodes the ranges up to index, carrying on
+ * from the last index looked up on this thread if that was lower; so
+ * going through the indices in order costs no more than Mii_Next,
+ * while jumping back starts again from the first.  The range is only
+ * good until the next call. */
 static inline const MarkerRange* Mi_AT_INDEX(cmi_ptr mi, size_t index) 
 {
+    if(unlikely(mi->bitmap_form))
+	return _Mi_BitmapAtIndex(mi, index);
+
     return ((mi->num_array_ranges == 0) 
 	    ? &(mi->r)
 	    : &(mi->range_list[index]));
@@ -195,25 +267,46 @@ static inline markertype Mi_Max(cmi_ptr mi)
 	: MARKER_PLUS_INFTY;
 }
 
+static inline bool Mi_IS_INTERNED(cmi_ptr mi)
+{
+    return (mi != NULL) && mi->interned;
+}
+
+/* Interned instances are shared between threads, so with threads the
+ * debug lock count is kept atomically. */
 static inline void Mi_ClaimDebugLock(mi_ptr mi) 
 {
 #ifndef NDEBUG
+#ifdef ENABLE_THREADS
+    __atomic_add_fetch(&mi->lock_count, 1, __ATOMIC_RELAXED);
+#else
     ++(mi->lock_count);
 #endif
+#endif
 }
 
 static inline void Mi_ReleaseDebugLock(mi_ptr mi)
 {
 #ifndef NDEBUG
+#ifdef ENABLE_THREADS
+    size_t count = __atomic_fetch_sub(&mi->lock_count, 1, __ATOMIC_RELAXED);
+    assert(count >= 1);
+    (void)count;
+#else
     assert(mi->lock_count >= 1);
     --(mi->lock_count);
 #endif
+#endif
 }
 
 static inline size_t Mi_DebugLockCount(cmi_ptr mi)
 {
 #ifndef NDEBUG
+#ifdef ENABLE_THREADS
+    return __atomic_load_n(&mi->lock_count, __ATOMIC_RELAXED);
+#else
     return mi->lock_count;
+#endif
 #else
     return 0;
 #endif
@@ -250,14 +343,26 @@ typedef struct {
     MEMORY_POOL_ITEMS;
     const MarkerRange *next_mr;
     size_t counts_left;
+
+    /* Set when walking a set in bitmap form. */
+    const struct _MiBitmap *bitmap;
+    size_t chunk;
+    markertype pos;
 } MarkerIterator;
 
 typedef struct {
     MEMORY_POOL_ITEMS;
     const MarkerRange *next_mr;
     size_t counts_left;
+
+    const struct _MiBitmap *bitmap;
+    size_t chunk;
+    markertype pos;
 } MarkerRevIterator; 
 
+bool _Mii_BitmapNext(MarkerRange*, MarkerIterator *mii);
+bool _Miri_BitmapNext(MarkerRange*, MarkerRevIterator *miri);
+
 
 /****** Forward iterators (good for most purposes) ****/
 
@@ -48,6 +48,9 @@ static inline bool Mi_VALID_ANYWHERE(const MarkerInfo* mi)
 
 static inline bool Mii_NEXT(MarkerRange* dest, MarkerIterator *mii)
 {
+    if(unlikely(mii->bitmap != NULL))
+	return _Mii_BitmapNext(dest, mii);
+
     if(unlikely(mii->counts_left == 0))
        return false;
 
@@ -60,6 +63,9 @@ static inline bool Mii_NEXT(MarkerRange* dest, MarkerIterator *mii)
 
 static inline bool Miri_NEXT(MarkerRange* dest, MarkerRevIterator *miri)
 {
+    if(unlikely(miri->bitmap != NULL))
+	return _Miri_BitmapNext(dest, miri);
+
     if(unlikely(miri->counts_left == 0))
        return false;
 
@@ -8,10 +8,146 @@
 #include <stdlib.h>
 #include <string.h>
 
+/********************************************************************************
+ *
+ *  With ENABLE_THREADS, every thread gets its own instance of each
+ *  pool, so the allocation and free paths need no locking.  Each
+ *  item records the pool that it came from; an item freed on a
+ *  thread other than the one that allocated it is pushed onto a
+ *  lock-free list in the owning pool (_mpool_owner doubles as the
+ *  link), and the owner reclaims these the next time it runs out of
+ *  space on its current page.  Pools are allocated on the heap and
+ *  are not released when their thread exits, so items may outlive
+ *  the thread that created them.  Instead, a pthread key destructor
+ *  puts the pool of an exiting thread on a global orphan list, and
+ *  the next thread to need a pool of that type takes it over, along
+ *  with its pages and whatever other threads have freed to it since.
+ *
+ ********************************************************************************/
+
+#ifdef ENABLE_THREADS
+
+#include <pthread.h>
+
+#define MEMORY_POOL_ITEMS			\
+    size_t _mpool_origin_index;			\
+    void *_mpool_owner
+
+#define _MP_REMOTE_FREE_ITEMS			\
+    void *remote_free_list;			\
+    void *next_orphan
+
+#define _MP_POOL_STORAGE(Type)   __thread MemoryPool_##Type *_memorypool_##Type
+
+#define STATIC_MEMORY_POOL_VALUES NULL
+
+/* The pools left by exited threads, one list for each type. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_key_t key;
+    bool key_created;
+    void *pools;
+} _MP_OrphanList;
+
+#define _MP_ORPHANS_STORAGE(Type)  _MP_OrphanList _mp_orphans_##Type
+#define _MP_ORPHANS_INIT           {PTHREAD_MUTEX_INITIALIZER, 0, false, NULL}
+
+#define _MP_DECLARE_ORPHANS(Type)  extern _MP_ORPHANS_STORAGE(Type);
+#define _MP_DEFINE_ORPHANS(Type)   _MP_ORPHANS_STORAGE(Type) = _MP_ORPHANS_INIT;
+#define _MP_LOCAL_ORPHANS(Type)    static _MP_ORPHANS_STORAGE(Type) = _MP_ORPHANS_INIT;
+
+#else
+
 #define MEMORY_POOL_ITEMS			\
     size_t _mpool_origin_index
 
-#define STATIC_MEMORY_POOL_VALUES {0,0,NULL,NULL}
+#define _MP_REMOTE_FREE_ITEMS
+
+#define _MP_POOL_STORAGE(Type)   MemoryPool_##Type _memorypool_##Type
+
+#define STATIC_MEMORY_POOL_VALUES {0,0,NULL,NULL,NULL,NULL}
+
+#define _MP_DECLARE_ORPHANS(Type)
+#define _MP_DEFINE_ORPHANS(Type)
+#define _MP_LOCAL_ORPHANS(Type)
+
+#endif
+
+/********************************************************************************
+ *
+ *  With ENABLE_MMAP_POOLS, the full size page groups (everything past
+ *  the first _MP_MEM_POOL_STEP pages) are carved out of large
+ *  anonymous mappings, aligned to and advised for (transparent) huge
+ *  pages, instead of being calloc'd one by one.  Each pool maps
+ *  regions of doubling size and keeps the page groups it frees on a
+ *  list for reuse, so the memory is held until exit.  A freed group
+ *  is already zero, as Mp_Free clears each item.  With
+ *  ENABLE_HUGETLB, explicit huge pages are tried first.
+ *
+ ********************************************************************************/
+
+#ifdef ENABLE_MMAP_POOLS
+
+#include <sys/mman.h>
+
+#define _MP_SLAB_ITEMS				\
+    char *slab_next;				\
+    char *slab_end;				\
+    size_t slab_size
+
+#define _MP_HUGE_PAGE_SIZE       (2*1024*1024)
+#define _MP_MAX_SLAB_SIZE        (64*1024*1024)
+
+/* Maps an anonymous region of at least *size bytes, aligned to a huge
+ * page, and sets *size to its actual size. */
+static inline char* _MP_MapRegion(size_t *size)
+{
+    size_t sz = ((*size + _MP_HUGE_PAGE_SIZE - 1) / _MP_HUGE_PAGE_SIZE) * _MP_HUGE_PAGE_SIZE;
+    char *p;
+
+#if defined(ENABLE_HUGETLB) && defined(MAP_HUGETLB)
+    p = (char*)mmap(NULL, sz, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if(p != (char*)MAP_FAILED)
+    {
+	*size = sz;
+	return p;
+    }
+#endif
+
+    /* Over-map by a huge page, then trim so the region is aligned. */
+    p = (char*)mmap(NULL, sz + _MP_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(unlikely(p == (char*)MAP_FAILED))
+	p = NULL;
+
+    CHECK_MALLOC(p);
+
+    size_t lead = (_MP_HUGE_PAGE_SIZE - ((size_t)p % _MP_HUGE_PAGE_SIZE)) % _MP_HUGE_PAGE_SIZE;
+
+    if(lead != 0)
+	munmap(p, lead);
+
+    if(lead != _MP_HUGE_PAGE_SIZE)
+	munmap(p + lead + sz, _MP_HUGE_PAGE_SIZE - lead);
+
+    p += lead;
+
+#ifdef MADV_HUGEPAGE
+    madvise(p, sz, MADV_HUGEPAGE);
+#endif
+
+    *size = sz;
+    return p;
+}
+
+#else
+
+#define _MP_SLAB_ITEMS
+
+#endif
 
 #define _DECLARE_MEMORY_POOL_BASE_DATASTRUCTS(Type)			\
 									\
@@ -25,10 +161,61 @@
 	size_t first_page_with_free_spot;				\
 	_MP_Page_##Type *pages;						\
 	Type *reserve_memblock;						\
+	bitfield *free_pages;						\
+	bitfield *free_summary;						\
+	_MP_REMOTE_FREE_ITEMS;						\
+	_MP_SLAB_ITEMS;							\
     } MemoryPool_##Type;						
 
 #define _MP_MEM_POOL_STEP 8
 
+/* The free page index.  Bit p of free_pages is set if page p may have
+ * a free slot or is the unallocated master page of a group, and bit w
+ * of free_summary is set if word w of free_pages may be nonzero.
+ * Bits are set when a slot is freed and cleared lazily when a search
+ * finds them stale, so finding the lowest page with room is a couple
+ * of bit scans no matter how fragmented the pool is, and Mp_New's
+ * fast path doesn't touch the index at all. */
+
+static inline size_t _MP_BitmapWords(size_t n_bits)
+{
+    return (n_bits + bitsizeof(bitfield) - 1) / bitsizeof(bitfield);
+}
+
+static inline void _MP_MarkPage(bitfield *free_pages, bitfield *free_summary, size_t idx)
+{
+    const size_t w = idx / bitsizeof(bitfield);
+    setBitOn(free_pages[w], idx % bitsizeof(bitfield));
+    setBitOn(free_summary[w / bitsizeof(bitfield)], w % bitsizeof(bitfield));
+}
+
+static inline void _MP_UnmarkPage(bitfield *free_pages, size_t idx)
+{
+    setBitOff(free_pages[idx / bitsizeof(bitfield)], idx % bitsizeof(bitfield));
+}
+
+/* Returns the lowest marked page, or SIZE_T_INFTY if there is none. */
+static inline size_t _MP_FirstMarkedPage(bitfield *free_pages, bitfield *free_summary, size_t n_pages)
+{
+    const size_t n_summary_words = _MP_BitmapWords(_MP_BitmapWords(n_pages));
+    size_t sw;
+
+    for(sw = 0; sw < n_summary_words; ++sw)
+    {
+	while(free_summary[sw] != 0)
+	{
+	    size_t w = sw*bitsizeof(bitfield) + getFirstBitOn(free_summary[sw]);
+
+	    if(likely(free_pages[w] != 0))
+		return w*bitsizeof(bitfield) + getFirstBitOn(free_pages[w]);
+
+	    setBitOff(free_summary[sw], w % bitsizeof(bitfield));
+	}
+    }
+
+    return SIZE_T_INFTY;
+}
+
 static inline bool _MP_IndexMasterPage(size_t idx)	
 {
     return (idx <= _MP_MEM_POOL_STEP) ? true : ((idx & (_MP_MEM_POOL_STEP-1)) == 0);
@@ -40,60 +227,87 @@ static inline size_t _MP_IndexMasterPage_Size(size_t idx)
     return (idx < _MP_MEM_POOL_STEP) ? 1 : _MP_MEM_POOL_STEP;
 }
 
+#define _MP_GROUP_SIZE(Type) (_MP_MEM_POOL_STEP * bitsizeof(bitfield) * sizeof(Type))
+
 #define _DECLARE_MEMORY_POOL_BASE_FUNCTIONS(Type)			\
 									\
-    static void _MP_InitPages_##Type(size_t idx)			\
+    _DECLARE_MEMORY_POOL_GROUP_FUNCTIONS(Type)				\
+									\
+    static void _MP_InitPages_##Type(MemoryPool_##Type *mp, size_t idx) \
     {									\
-	MemoryPool_##Type *mp = &_memorypool_##Type;			\
 	_MP_Page_##Type *mpp = &(mp->pages[idx]);			\
 	size_t num = _MP_IndexMasterPage_Size(idx);			\
 	Type* ptr;							\
-	if(mp->reserve_memblock != NULL && idx > _MP_MEM_POOL_STEP)	\
-	{								\
-	    ptr = mp->reserve_memblock;					\
-	    mp->reserve_memblock = NULL;				\
-	}								\
+	if(num == _MP_MEM_POOL_STEP)					\
+	    ptr = _MP_NewGroup_##Type(mp);				\
 	else								\
 	{								\
 	    ptr = (Type*)calloc(bitsizeof(bitfield)*num, sizeof(Type)); \
 	    CHECK_MALLOC(ptr);						\
 	}								\
 									\
-	int i;								\
+	size_t i;							\
 	for(i = 0; i < num; ++i)					\
 	{								\
 	    assert( (mpp+i)->memblock == NULL);				\
 	    (mpp + i)->memblock = ptr + i*bitsizeof(bitfield);		\
 	    (mpp + i)->available_mask = ~((bitfield)0);			\
+	    _MP_MarkPage(mp->free_pages, mp->free_summary, idx + i);	\
 	}								\
     }									\
 									\
-    static void _MP_MorePages_##Type()					\
+    static void _MP_MarkMasterPages_##Type(MemoryPool_##Type *mp, size_t start) \
+    {									\
+	size_t idx;							\
+	for(idx = start; idx < mp->allocated_pages; ++idx)		\
+	    if(_MP_IndexMasterPage(idx))				\
+		_MP_MarkPage(mp->free_pages, mp->free_summary, idx);	\
+    }									\
+									\
+    static void _MP_AllocateIndex_##Type(MemoryPool_##Type *mp, size_t old_size) \
+    {									\
+	size_t old_words = _MP_BitmapWords(old_size);			\
+	size_t new_words = _MP_BitmapWords(mp->allocated_pages);	\
+	size_t old_summary_words = _MP_BitmapWords(old_words);		\
+	size_t new_summary_words = _MP_BitmapWords(new_words);		\
+									\
+	mp->free_pages = (bitfield*)realloc(mp->free_pages, new_words*sizeof(bitfield)); \
+	CHECK_MALLOC(mp->free_pages);					\
+	memset(mp->free_pages + old_words, 0, (new_words - old_words)*sizeof(bitfield)); \
+									\
+	mp->free_summary = (bitfield*)realloc(mp->free_summary, new_summary_words*sizeof(bitfield)); \
+	CHECK_MALLOC(mp->free_summary);					\
+	memset(mp->free_summary + old_summary_words, 0,			\
+	       (new_summary_words - old_summary_words)*sizeof(bitfield)); \
+									\
+	_MP_MarkMasterPages_##Type(mp, old_size);			\
+    }									\
+									\
+    static void _MP_MorePages_##Type(MemoryPool_##Type *mp)		\
     {									\
-	MemoryPool_##Type *mp = &_memorypool_##Type;			\
 									\
 	size_t old_size = mp->allocated_pages;				\
 	mp->allocated_pages *= 2;					\
 	mp->pages = (_MP_Page_##Type*)realloc(				\
 	    mp->pages, mp->allocated_pages * sizeof(_MP_Page_##Type) );	\
+	CHECK_MALLOC(mp->pages);					\
 	memset(mp->pages + old_size, 0,					\
 	       (mp->allocated_pages - old_size )* sizeof(_MP_Page_##Type) ); \
+	_MP_AllocateIndex_##Type(mp, old_size);				\
     }									\
 									\
-    static void _MP_Init_##Type()					\
+    static void _MP_Init_##Type(MemoryPool_##Type *mp)			\
     {									\
-	MemoryPool_##Type *mp = &_memorypool_##Type;			\
-									\
 	mp->allocated_pages = 4*_MP_MEM_POOL_STEP;			\
 	mp->first_page_with_free_spot = 0;				\
 	mp->pages = (_MP_Page_##Type*)calloc(mp->allocated_pages, sizeof(_MP_Page_##Type) ); \
-	_MP_InitPages_##Type(0);					\
+	CHECK_MALLOC(mp->pages);					\
+	_MP_AllocateIndex_##Type(mp, 0);				\
+	_MP_InitPages_##Type(mp, 0);					\
     }									\
 									\
-    static inline Type* _MP_ClearPages_##Type(size_t idx)		\
+    static inline Type* _MP_ClearPages_##Type(MemoryPool_##Type *mp, size_t idx) \
     {									\
-	MemoryPool_##Type *mp = &_memorypool_##Type;			\
-									\
 	_MP_Page_##Type *mpp = &(mp->pages[idx]);			\
 	size_t num = _MP_IndexMasterPage_Size(idx);			\
 	Type* memblock = mpp->memblock;					\
@@ -114,55 +328,104 @@ static inline size_t _MP_IndexMasterPage_Size(size_t idx)
 	return memblock;						\
     }									\
 									\
-    static void _MP_AdvancePagePointer_##Type()				\
+    static void _MP_AdvancePagePointer_##Type(MemoryPool_##Type *mp)	\
     {									\
-	MemoryPool_##Type *mp = &_memorypool_##Type;			\
-									\
 	assert(mp->first_page_with_free_spot < mp->allocated_pages);	\
 	assert(isPowerOf2(mp->allocated_pages));			\
+	assert(mp->pages[mp->first_page_with_free_spot].available_mask == 0); \
+									\
+	while(true)							\
+	{								\
+	    size_t idx = _MP_FirstMarkedPage(mp->free_pages, mp->free_summary, \
+					     mp->allocated_pages);	\
+									\
+	    /* Need more pages?  This marks the new master pages. */	\
+	    if(unlikely(idx == SIZE_T_INFTY))				\
+	    {								\
+		_MP_MorePages_##Type(mp);				\
+		continue;						\
+	    }								\
 									\
-	do{								\
-	    assert(mp->pages[mp->first_page_with_free_spot].available_mask == 0); \
+	    assert(idx < mp->allocated_pages);				\
 									\
-	    if(mp->pages[mp->first_page_with_free_spot].memblock != NULL) \
-		++mp->first_page_with_free_spot;			\
-	    else							\
-		assert(_MP_IndexMasterPage(mp->first_page_with_free_spot)); \
+	    _MP_Page_##Type *mpp = &(mp->pages[idx]);			\
 									\
-	    if(_MP_IndexMasterPage(mp->first_page_with_free_spot))	\
+	    if(likely(mpp->available_mask != 0))			\
 	    {								\
-		/* Need more pages? */					\
-		if(unlikely(mp->first_page_with_free_spot == mp->allocated_pages)) \
-		{							\
-		    _MP_MorePages_##Type();				\
-		    _MP_InitPages_##Type(mp->first_page_with_free_spot); \
-		    return;						\
-		}							\
-									\
-		assert(mp->first_page_with_free_spot < mp->allocated_pages); \
-									\
-		/* Need more allocation? */				\
-		if(likely(mp->pages[mp->first_page_with_free_spot].memblock == NULL)) \
-		{							\
-		    _MP_InitPages_##Type(mp->first_page_with_free_spot); \
-		    return;						\
-		}							\
+		mp->first_page_with_free_spot = idx;			\
+		return;							\
 	    }								\
 									\
-	    assert(mp->pages[mp->first_page_with_free_spot].memblock != NULL); \
+	    /* Need more allocation? */					\
+	    if(mpp->memblock == NULL && _MP_IndexMasterPage(idx))	\
+	    {								\
+		_MP_InitPages_##Type(mp, idx);				\
+		mp->first_page_with_free_spot = idx;			\
+		return;							\
+	    }								\
 									\
-	}while(unlikely(likely(mp->pages[mp->first_page_with_free_spot].available_mask == 0))); \
+	    /* Stale; the page filled up since it was marked. */	\
+	    _MP_UnmarkPage(mp->free_pages, idx);			\
+	}								\
     }									\
     									\
+    static inline void _MP_LocalFree_##Type(MemoryPool_##Type *mp, Type *obj) \
+    {									\
+	assert(obj->_mpool_origin_index < mp->allocated_pages);		\
+									\
+	size_t page_index = obj->_mpool_origin_index;			\
+									\
+	_MP_Page_##Type * mpp = &(mp->pages[page_index]);		\
+									\
+	size_t pos = (obj - mpp->memblock);				\
+	assert(pos < bitsizeof(bitfield));				\
+	assert(bitOff(mpp->available_mask, pos));			\
+									\
+	setBitOn(mpp->available_mask, pos);				\
+	_MP_MarkPage(mp->free_pages, mp->free_summary, page_index);	\
+									\
+	mp->first_page_with_free_spot = min(mp->first_page_with_free_spot, page_index); \
+									\
+	memset(obj, 0, sizeof(Type));					\
+									\
+	if(unlikely(_MP_IndexMasterPage(page_index) && (~(mpp->available_mask)) == 0) ) \
+	{								\
+	    bool okay = true;						\
+	    int i;							\
+	    int num = _MP_IndexMasterPage_Size(page_index);		\
+									\
+	    for(i = 1; i < num; ++i)					\
+	    {								\
+		if( (~((mpp + i)->available_mask)) != 0)		\
+		{okay = false; break; }					\
+	    }								\
+	    if(okay)							\
+	    {								\
+		Type* memblock = _MP_ClearPages_##Type(mp, page_index); \
+		if(page_index < _MP_MEM_POOL_STEP)			\
+		    free(memblock);					\
+		else							\
+		    _MP_ReleaseGroup_##Type(mp, memblock);		\
+	    }								\
+	}								\
+    }									\
+									\
+    _DECLARE_MEMORY_POOL_THREAD_FUNCTIONS(Type)				\
+									\
     static Type*  Mp_New##Type()					\
     {									\
-	MemoryPool_##Type *mp = &_memorypool_##Type;			\
+	MemoryPool_##Type *mp = _MP_GetPool_##Type();			\
 									\
 	if(unlikely(mp->pages == NULL))					\
 	    _MP_Init_##Type(mp);					\
 									\
 	if(unlikely(! (mp->pages[mp->first_page_with_free_spot].available_mask) )) \
-	    _MP_AdvancePagePointer_##Type(mp);				\
+	{								\
+	    _MP_ReclaimRemoteFrees_##Type(mp);				\
+									\
+	    if(likely(! (mp->pages[mp->first_page_with_free_spot].available_mask) )) \
+		_MP_AdvancePagePointer_##Type(mp);			\
+	}								\
 									\
 	_MP_Page_##Type *mpp = &(mp->pages[mp->first_page_with_free_spot]); \
 									\
@@ -178,63 +441,276 @@ static inline size_t _MP_IndexMasterPage_Size(size_t idx)
 									\
 	Type* r = &(mpp->memblock[idx]);				\
 	r->_mpool_origin_index = mp->first_page_with_free_spot;		\
+	_MP_SET_OWNER(r, mp);						\
 	return r;							\
     }									\
 									\
     static inline void Mp_Free##Type(void *v_obj)			\
     {									\
-	MemoryPool_##Type *mp = &_memorypool_##Type;			\
-									\
 	Type *obj = (Type*)(v_obj);					\
 									\
-	assert(obj->_mpool_origin_index < mp->allocated_pages);		\
+	_MP_FREE_TO_OWNER(Type, obj);					\
+    }									\
 									\
-	size_t page_index = obj->_mpool_origin_index;			\
+    /* Sizes this thread's pool to take at least n more items before \
+     * going back to the system for memory. */				\
+    static inline void Mp_Reserve##Type(size_t n)			\
+    {									\
+	MemoryPool_##Type *mp = _MP_GetPool_##Type();			\
 									\
-	_MP_Page_##Type * mpp = &(mp->pages[page_index]);		\
+	if(unlikely(mp->pages == NULL))					\
+	    _MP_Init_##Type(mp);					\
 									\
-	size_t pos = (obj - mpp->memblock);				\
-	assert(pos < bitsizeof(bitfield));				\
-	assert(bitOff(mpp->available_mask, pos));			\
+	size_t n_pages = _MP_BitmapWords(n);				\
+	size_t n_groups = (n_pages + _MP_MEM_POOL_STEP - 1) / _MP_MEM_POOL_STEP; \
 									\
-	setBitOn(mpp->available_mask, pos);				\
+	while(mp->allocated_pages < 2*_MP_MEM_POOL_STEP + n_groups*_MP_MEM_POOL_STEP) \
+	    _MP_MorePages_##Type(mp);					\
 									\
-	mp->first_page_with_free_spot = min(mp->first_page_with_free_spot, page_index); \
+	_MP_ReserveGroups_##Type(mp, n_groups);				\
+    }
+
+/********************************************************************************
+ *
+ *  Where the full size page groups come from.  _MP_NewGroup_ returns
+ *  zeroed memory for _MP_MEM_POOL_STEP pages, _MP_ReleaseGroup_ takes
+ *  back a group that is entirely free (and thus zeroed), and
+ *  _MP_ReserveGroups_ makes room for n more groups up front.
+ *
+ ********************************************************************************/
+
+#ifdef ENABLE_MMAP_POOLS
+
+#define _DECLARE_MEMORY_POOL_GROUP_FUNCTIONS(Type)			\
 									\
-	memset(obj, 0, sizeof(Type));					\
+    static inline void _MP_ReleaseGroup_##Type(MemoryPool_##Type *mp, Type *memblock) \
+    {									\
+	*((Type**)memblock) = mp->reserve_memblock;			\
+	mp->reserve_memblock = memblock;				\
+    }									\
 									\
-	if(unlikely(_MP_IndexMasterPage(page_index) && (~(mpp->available_mask)) == 0) ) \
+    static void _MP_MapSlab_##Type(MemoryPool_##Type *mp, size_t min_size) \
+    {									\
+	/* Don't waste the tail of the current region. */		\
+	while(mp->slab_next + _MP_GROUP_SIZE(Type) <= mp->slab_end)	\
 	{								\
-	    bool okay = true;						\
-	    int i;							\
-	    int num = _MP_IndexMasterPage_Size(page_index);		\
+	    _MP_ReleaseGroup_##Type(mp, (Type*)mp->slab_next);		\
+	    mp->slab_next += _MP_GROUP_SIZE(Type);			\
+	}								\
 									\
-	    for(i = 1; i < num; ++i)					\
-	    {								\
-		if( (~((mpp + i)->available_mask)) != 0)		\
-		{okay = false; break; }					\
-	    }								\
-	    if(okay)							\
+	size_t size = (mp->slab_size == 0)				\
+	    ? _MP_HUGE_PAGE_SIZE : min(2*mp->slab_size, (size_t)_MP_MAX_SLAB_SIZE); \
+									\
+	size = max(size, min_size);					\
+									\
+	mp->slab_next = _MP_MapRegion(&size);				\
+	mp->slab_end = mp->slab_next + size;				\
+	mp->slab_size = size;						\
+    }									\
+									\
+    static inline Type* _MP_NewGroup_##Type(MemoryPool_##Type *mp)	\
+    {									\
+	Type *memblock = mp->reserve_memblock;				\
+									\
+	if(memblock != NULL)						\
+	{								\
+	    mp->reserve_memblock = *((Type**)memblock);			\
+	    *((Type**)memblock) = NULL;					\
+	    return memblock;						\
+	}								\
+									\
+	if(unlikely(mp->slab_next + _MP_GROUP_SIZE(Type) > mp->slab_end)) \
+	    _MP_MapSlab_##Type(mp, _MP_GROUP_SIZE(Type));		\
+									\
+	memblock = (Type*)mp->slab_next;				\
+	mp->slab_next += _MP_GROUP_SIZE(Type);				\
+	return memblock;						\
+    }									\
+									\
+    static void _MP_ReserveGroups_##Type(MemoryPool_##Type *mp, size_t n_groups) \
+    {									\
+	size_t size = n_groups * _MP_GROUP_SIZE(Type);			\
+									\
+	if((size_t)(mp->slab_end - mp->slab_next) < size)		\
+	    _MP_MapSlab_##Type(mp, size);				\
+    }
+
+#else
+
+#define _DECLARE_MEMORY_POOL_GROUP_FUNCTIONS(Type)			\
+									\
+    static inline void _MP_ReleaseGroup_##Type(MemoryPool_##Type *mp, Type *memblock) \
+    {									\
+	if(mp->reserve_memblock != NULL)				\
+	    free(memblock);						\
+	else								\
+	    mp->reserve_memblock = memblock;				\
+    }									\
+									\
+    static inline Type* _MP_NewGroup_##Type(MemoryPool_##Type *mp)	\
+    {									\
+	Type *memblock = mp->reserve_memblock;				\
+									\
+	if(memblock != NULL)						\
+	{								\
+	    mp->reserve_memblock = NULL;				\
+	    return memblock;						\
+	}								\
+									\
+	memblock = (Type*)calloc(_MP_MEM_POOL_STEP*bitsizeof(bitfield), sizeof(Type)); \
+	CHECK_MALLOC(memblock);						\
+	return memblock;						\
+    }									\
+									\
+    /* Only the page table can be sized up front here. */		\
+    static inline void _MP_ReserveGroups_##Type(MemoryPool_##Type *mp, size_t n_groups) \
+    {									\
+    }
+
+#endif
+
+/********************************************************************************
+ *
+ *  The parts that differ between the threaded and single threaded
+ *  versions.  _MP_GetPool_ returns this thread's pool (creating it if
+ *  needed), _MP_ReclaimRemoteFrees_ moves items freed by other
+ *  threads back into the pool, and _MP_FREE_TO_OWNER frees an item
+ *  into whatever pool it came from.
+ *
+ ********************************************************************************/
+
+#ifdef ENABLE_THREADS
+
+#define _MP_SET_OWNER(obj, mp) do{ (obj)->_mpool_owner = (mp); }while(0)
+
+#define _DECLARE_MEMORY_POOL_THREAD_FUNCTIONS(Type)			\
+									\
+    /* Called through the pthread key as the thread exits. */		\
+    static void _MP_OrphanPool_##Type(void *v_mp)			\
+    {									\
+	MemoryPool_##Type *mp = (MemoryPool_##Type*)v_mp;		\
+	_MP_OrphanList *orphans = &_mp_orphans_##Type;			\
+									\
+	/* Later key destructors that allocate get a pool of their	\
+	 * own, rather than sharing this one with its next owner. */	\
+	if(_memorypool_##Type == mp)					\
+	    _memorypool_##Type = NULL;					\
+									\
+	pthread_mutex_lock(&orphans->lock);				\
+	mp->next_orphan = orphans->pools;				\
+	orphans->pools = mp;						\
+	pthread_mutex_unlock(&orphans->lock);				\
+    }									\
+									\
+    static MemoryPool_##Type* _MP_NewThreadPool_##Type()		\
+    {									\
+	_MP_OrphanList *orphans = &_mp_orphans_##Type;			\
+	MemoryPool_##Type *mp;						\
+									\
+	pthread_mutex_lock(&orphans->lock);				\
+									\
+	if(unlikely(!orphans->key_created))				\
+	{								\
+	    if(pthread_key_create(&orphans->key, _MP_OrphanPool_##Type) != 0) \
 	    {								\
-		Type* memblock = _MP_ClearPages_##Type(page_index);	\
-		if(page_index < _MP_MEM_POOL_STEP || mp->reserve_memblock != NULL) \
-		{							\
-		    free(memblock);					\
-		}							\
-		else							\
-		    mp->reserve_memblock = memblock;			\
+		fprintf(stderr, "Unable to create a memory pool thread key."); \
+		abort();						\
 	    }								\
+	    orphans->key_created = true;				\
 	}								\
+									\
+	mp = (MemoryPool_##Type*)orphans->pools;			\
+									\
+	if(mp != NULL)							\
+	    orphans->pools = mp->next_orphan;				\
+									\
+	pthread_mutex_unlock(&orphans->lock);				\
+									\
+	if(mp != NULL)							\
+	    mp->next_orphan = NULL;					\
+	else								\
+	{								\
+	    mp = (MemoryPool_##Type*)calloc(1, sizeof(MemoryPool_##Type)); \
+	    CHECK_MALLOC(mp);						\
+	}								\
+									\
+	pthread_setspecific(orphans->key, mp);				\
+	_memorypool_##Type = mp;					\
+	return mp;							\
+    }									\
+									\
+    static inline MemoryPool_##Type* _MP_GetPool_##Type()		\
+    {									\
+	MemoryPool_##Type *mp = _memorypool_##Type;			\
+	return likely(mp != NULL) ? mp : _MP_NewThreadPool_##Type();	\
+    }									\
+									\
+    static void _MP_ReclaimRemoteFrees_##Type(MemoryPool_##Type *mp)	\
+    {									\
+	if(likely(__atomic_load_n(&(mp->remote_free_list), __ATOMIC_RELAXED) == NULL)) \
+	    return;							\
+									\
+	Type *obj = (Type*)__atomic_exchange_n(				\
+	    &(mp->remote_free_list), NULL, __ATOMIC_ACQUIRE);		\
+									\
+	while(obj != NULL)						\
+	{								\
+	    Type *next = (Type*)(obj->_mpool_owner);			\
+	    _MP_LocalFree_##Type(mp, obj);				\
+	    obj = next;							\
+	}								\
+    }									\
+									\
+    static void _MP_RemoteFree_##Type(Type *obj)			\
+    {									\
+	MemoryPool_##Type *owner = (MemoryPool_##Type*)(obj->_mpool_owner); \
+	void *head = __atomic_load_n(&(owner->remote_free_list), __ATOMIC_RELAXED); \
+									\
+	do {								\
+	    obj->_mpool_owner = head;					\
+	} while(!__atomic_compare_exchange_n(				\
+		    &(owner->remote_free_list), &head, (void*)obj,	\
+		    true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));		\
+    }
+
+#define _MP_FREE_TO_OWNER(Type, obj)					\
+    do {								\
+	if(likely((obj)->_mpool_owner == (void*)_memorypool_##Type))	\
+	    _MP_LocalFree_##Type(_memorypool_##Type, (obj));		\
+	else								\
+	    _MP_RemoteFree_##Type(obj);					\
+    } while(0)
+
+#else
+
+#define _MP_SET_OWNER(obj, mp)
+
+#define _DECLARE_MEMORY_POOL_THREAD_FUNCTIONS(Type)			\
+									\
+    static inline MemoryPool_##Type* _MP_GetPool_##Type()		\
+    {									\
+	return &_memorypool_##Type;					\
+    }									\
+									\
+    static inline void _MP_ReclaimRemoteFrees_##Type(MemoryPool_##Type *mp) \
+    {									\
     }
 
+#define _MP_FREE_TO_OWNER(Type, obj)					\
+    _MP_LocalFree_##Type(&_memorypool_##Type, (obj))
+
+#endif
+
 #define DECLARE_GLOBAL_MEMORY_POOL(Type)				\
     _DECLARE_MEMORY_POOL_BASE_DATASTRUCTS(Type)				\
-    extern MemoryPool_##Type _memorypool_##Type;			\
+    extern _MP_POOL_STORAGE(Type);					\
+    _MP_DECLARE_ORPHANS(Type)						\
     _DECLARE_MEMORY_POOL_BASE_FUNCTIONS(Type)				\
     void Mp_Free##Type##_NonStatic(Type *);				
     
 #define DEFINE_GLOBAL_MEMORY_POOL(Type)					\
-    MemoryPool_##Type _memorypool_##Type = STATIC_MEMORY_POOL_VALUES;	\
+    _MP_POOL_STORAGE(Type) = STATIC_MEMORY_POOL_VALUES;			\
+    _MP_DEFINE_ORPHANS(Type)						\
 									\
     void Mp_Free##Type##_NonStatic(Type * obj)				\
     {									\
@@ -243,7 +719,8 @@ static inline size_t _MP_IndexMasterPage_Size(size_t idx)
 
 #define LOCAL_MEMORY_POOL(Type)						\
     _DECLARE_MEMORY_POOL_BASE_DATASTRUCTS(Type)				\
-    static MemoryPool_##Type _memorypool_##Type = STATIC_MEMORY_POOL_VALUES; \
+    static _MP_POOL_STORAGE(Type) = STATIC_MEMORY_POOL_VALUES;		\
+    _MP_LOCAL_ORPHANS(Type)						\
     _DECLARE_MEMORY_POOL_BASE_FUNCTIONS(Type)				\
 
 #endif /* _MEMORYPOOL_H_ */
@@ -5,6 +5,483 @@ ObjectInfo O_GlobalObjectInfoStruct(NULLType);
 
 DEFINE_OBJECT(Object, NULLType, NULL, NULL);
 
+/* The innermost open arena scope, if any. */
+#ifdef ENABLE_THREADS
+__thread Arena *_o_current_arena = NULL;
+#else
+Arena *_o_current_arena = NULL;
+#endif
+
+#define _ARENA_FIRST_CHUNK_SIZE  (64*1024)
+#define _ARENA_MAX_CHUNK_SIZE    (4*1024*1024)
+
+Arena* Arena_Begin()
+{
+    Arena *a = (Arena*)malloc(sizeof(Arena));
+    CHECK_MALLOC(a);
+
+    a->parent = _o_current_arena;
+    a->chunks = NULL;
+
+    _o_current_arena = a;
+
+    return a;
+}
+
+void* _Arena_AllocateSlow(Arena *a, size_t size)
+{
+    size_t chunk_size = _ARENA_FIRST_CHUNK_SIZE;
+
+    if(a->chunks != NULL)
+	chunk_size = min(2*a->chunks->size, (size_t)_ARENA_MAX_CHUNK_SIZE);
+
+    chunk_size = max(chunk_size, size);
+
+    /* Zeroed, as objects from the memory pools are. */
+    _ArenaChunk *c = (_ArenaChunk*)calloc(1, _ARENA_ROUND(sizeof(_ArenaChunk)) + chunk_size);
+    CHECK_MALLOC(c);
+
+    c->next = a->chunks;
+    c->size = chunk_size;
+    c->used = size;
+    a->chunks = c;
+
+    return _ARENA_CHUNK_DATA(c);
+}
+
+#define _ARENA_FOR_EACH_OBJECT(a, o)					\
+    for(_ArenaChunk *_c = (a)->chunks; _c != NULL; _c = _c->next)	\
+	for(char *_p = _ARENA_CHUNK_DATA(_c), *_end = _p + _c->used;	\
+	    _p != _end && ((o) = (Object*)_p, true);			\
+	    _p += _ARENA_ROUND((o)->_obj_type_info->object_size))
+
+void Arena_Release(Arena *a)
+{
+    _ArenaChunk *c, *next;
+    Object *o;
+
+    assert(a != NULL);
+    assert(a == _o_current_arena);
+
+    _o_current_arena = a->parent;
+
+#ifdef ENABLE_BIASED_REFCOUNT
+    /* Nothing in the arena may be left in the merge queue. */
+    O_MergeRefCounts();
+#endif
+
+    /* Switch off reference counting on everything still alive, so the
+     * delete functions below don't cascade through the arena; each
+     * live object is then destroyed exactly once. */
+    _ARENA_FOR_EACH_OBJECT(a, o)
+    {
+	if(O_REF_COUNT(o) > 0)
+	    _O_SET_UNCOUNTED(o);
+    }
+
+    /* Destroy them in the order they were allocated, so a graph or
+     * table normally goes before the nodes and keys it holds, as it
+     * would through its count; the chunks are kept newest first. */
+    for(c = a->chunks, a->chunks = NULL; c != NULL; c = next)
+    {
+	next = c->next;
+	c->next = a->chunks;
+	a->chunks = c;
+    }
+
+    _ARENA_FOR_EACH_OBJECT(a, o)
+    {
+	if(o->_obj_ref_count == -1 && o->_obj_type_info->delete_function != NULL)
+	    (*o->_obj_type_info->delete_function)(o);
+    }
+
+    for(c = a->chunks; c != NULL; c = next)
+    {
+	next = c->next;
+	free(c);
+    }
+
+    free(a);
+}
+
+#ifdef ENABLE_BIASED_REFCOUNT
+
+_ORefQueue _o_no_ref_queue = {NULL};
+__thread _ORefQueue *_o_ref_queue = &_o_no_ref_queue;
+
+_ORefQueue _o_unbiased_ref_queue = {NULL};
+
+/* This thread's own queue while it creates objects unbiased. */
+static __thread _ORefQueue *_o_biased_ref_queue = &_o_no_ref_queue;
+
+/* Like the memory pools, queues outlive their threads, so a late
+ * push from another thread is harmless. */
+_ORefQueue* _O_NewThreadRefQueue()
+{
+    _ORefQueue *q = (_ORefQueue*)calloc(1, sizeof(_ORefQueue));
+    CHECK_MALLOC(q);
+    _o_ref_queue = q;
+    return q;
+}
+
+static void _O_Destroy(Object *o)
+{
+    _O_DESTROY(o);
+}
+
+/* Folds the owner's count, plus extra, into the shared count and
+ * returns the total.  Only the owner may call this. */
+static long _O_ExplicitMergeRefCount(Object *o, long extra)
+{
+    long shared = __atomic_load_n(&o->_obj_shared_ref_count, __ATOMIC_RELAXED);
+    long count, new_shared;
+
+    do {
+	count = (shared >> _O_SHARED_SHIFT) + o->_obj_ref_count + extra;
+	new_shared = (count << _O_SHARED_SHIFT) | _O_SHARED_MERGED;
+    } while(!__atomic_compare_exchange_n(&o->_obj_shared_ref_count, &shared, new_shared,
+					 true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    o->_obj_ref_count = 0;
+    __atomic_store_n(&o->_obj_ref_owner, NULL, __ATOMIC_RELAXED);
+
+    return count;
+}
+
+void O_MergeRefCounts()
+{
+    Object *o = (Object*)__atomic_exchange_n(&(_o_ref_queue->head), NULL, __ATOMIC_ACQUIRE);
+
+    while(o != NULL)
+    {
+	Object *next = (Object*)o->_obj_ref_queue_next;
+	o->_obj_ref_queue_next = NULL;
+
+	/* The queue holds the decrement that sent the object here. */
+	if(_O_ExplicitMergeRefCount(o, -1) == 0)
+	    _O_Destroy(o);
+
+	o = next;
+    }
+}
+
+/* The owner's count has just reached zero.  The object is settled
+ * before the queue is drained: draining may destroy it, and if it is
+ * queued its shared count still holds the queue's decrement, so it
+ * cannot reach zero here and the drain destroys it exactly once. */
+void _O_MergeZeroLocalRefCount(Object *o)
+{
+    long shared = __atomic_load_n(&o->_obj_shared_ref_count, __ATOMIC_ACQUIRE);
+
+    /* Never shared; the common case. */
+    if(likely(shared == 0))
+    {
+	_O_Destroy(o);
+    }
+    else
+    {
+	__atomic_store_n(&o->_obj_ref_owner, NULL, __ATOMIC_RELAXED);
+
+	long new_shared;
+
+	do {
+	    new_shared = (shared & ~((long)(_O_SHARED_ONE - 1))) | _O_SHARED_MERGED;
+	} while(!__atomic_compare_exchange_n(&o->_obj_shared_ref_count, &shared, new_shared,
+					     true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	if(new_shared == _O_SHARED_MERGED)
+	    _O_Destroy(o);
+    }
+
+    if(unlikely(__atomic_load_n(&(_o_ref_queue->head), __ATOMIC_RELAXED) != NULL))
+	O_MergeRefCounts();
+}
+
+/* A decrement from a thread other than the owner. */
+void _O_DecRefShared(Object *o)
+{
+    long shared = __atomic_load_n(&o->_obj_shared_ref_count, __ATOMIC_RELAXED);
+    long new_shared;
+    bool queue;
+
+    do {
+	/* Going below zero; leave the decrement to the owner. */
+	queue = (shared == 0);
+	new_shared = queue ? _O_SHARED_QUEUED : shared - _O_SHARED_ONE;
+    } while(!__atomic_compare_exchange_n(&o->_obj_shared_ref_count, &shared, new_shared,
+					 true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    if(queue)
+    {
+	_ORefQueue *q = (_ORefQueue*)__atomic_load_n(&o->_obj_ref_owner, __ATOMIC_RELAXED);
+	void *head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+	do {
+	    o->_obj_ref_queue_next = head;
+	} while(!__atomic_compare_exchange_n(&q->head, &head, (void*)o,
+					     true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    else if(new_shared == _O_SHARED_MERGED)
+	_O_Destroy(o);
+}
+
+void O_BiasNewObjects(bool bias)
+{
+    if(!bias && _o_ref_queue != &_o_unbiased_ref_queue)
+    {
+	_o_biased_ref_queue = _o_ref_queue;
+	_o_ref_queue = &_o_unbiased_ref_queue;
+    }
+    else if(bias && _o_ref_queue == &_o_unbiased_ref_queue)
+    {
+	_o_ref_queue = _o_biased_ref_queue;
+    }
+}
+
+bool O_UnbiasRefCount(Object *o)
+{
+    void *owner = __atomic_load_n(&o->_obj_ref_owner, __ATOMIC_RELAXED);
+
+    if(owner == NULL)
+	return true;
+
+    if(owner != (void*)_o_ref_queue)
+	return false;
+
+    _O_ExplicitMergeRefCount(o, 0);
+    return true;
+}
+
+bool O_IncRefIfLive(Object *o)
+{
+    assert(__atomic_load_n(&o->_obj_ref_owner, __ATOMIC_RELAXED) == NULL);
+
+    long shared = __atomic_load_n(&o->_obj_shared_ref_count, __ATOMIC_RELAXED);
+
+    do {
+	if((shared >> _O_SHARED_SHIFT) == 0)
+	    return false;
+    } while(!__atomic_compare_exchange_n(&o->_obj_shared_ref_count, &shared, shared + _O_SHARED_ONE,
+					 true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    return true;
+}
+
+/* Exact on the owning thread; elsewhere, the owner's part is a
+ * snapshot. */
+long _O_RefCount(const Object *o)
+{
+    void *owner = __atomic_load_n(&o->_obj_ref_owner, __ATOMIC_RELAXED);
+
+    if(owner == _O_REF_UNCOUNTED)
+	return -1;
+
+    long shared = __atomic_load_n(&o->_obj_shared_ref_count, __ATOMIC_RELAXED) >> _O_SHARED_SHIFT;
+
+    if(owner == NULL)
+	return shared;
+
+    return shared + __atomic_load_n(&o->_obj_ref_count, __ATOMIC_RELAXED);
+}
+
+#endif
+
+#ifdef ENABLE_DEFERRED_FREE
+
+#ifdef ENABLE_THREADS
+__thread bool _o_defer_destruction = false;
+#else
+bool _o_defer_destruction = false;
+#endif
+
+/* The queue of objects awaiting destruction, linked through
+ * _obj_deferred_next. */
+static void *_o_deferred_head = NULL;
+
+/* Objects taken off the queue but not yet destroyed.  Batches are cut
+ * from the front, so the rest is never walked more than once. */
+static void *_o_deferred_pending = NULL;
+
+#ifdef ENABLE_THREADS
+
+#include <pthread.h>
+
+static pthread_mutex_t _o_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+#define _O_PENDING_LOCK()    pthread_mutex_lock(&_o_pending_lock)
+#define _O_PENDING_UNLOCK()  pthread_mutex_unlock(&_o_pending_lock)
+
+static pthread_t _o_destruction_thread;
+static pthread_mutex_t _o_destruction_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _o_destruction_cond = PTHREAD_COND_INITIALIZER;
+static bool _o_destruction_thread_running = false;
+
+static void _O_WakeDestructionThread()
+{
+    if(__atomic_load_n(&_o_destruction_thread_running, __ATOMIC_RELAXED))
+    {
+	pthread_mutex_lock(&_o_destruction_lock);
+	pthread_cond_signal(&_o_destruction_cond);
+	pthread_mutex_unlock(&_o_destruction_lock);
+    }
+}
+
+#else
+
+#define _O_PENDING_LOCK()
+#define _O_PENDING_UNLOCK()
+
+#endif
+
+static inline bool _O_DeferredQueueEmpty()
+{
+    return (__atomic_load_n(&_o_deferred_head, __ATOMIC_ACQUIRE) == NULL
+	    && __atomic_load_n(&_o_deferred_pending, __ATOMIC_ACQUIRE) == NULL);
+}
+
+/* Pushes the chain first ... last onto the queue. */
+static void _O_PushDeferred(Object *first, Object *last)
+{
+    void *head = __atomic_load_n(&_o_deferred_head, __ATOMIC_RELAXED);
+
+    do {
+	last->_obj_deferred_next = head;
+    } while(!__atomic_compare_exchange_n(&_o_deferred_head, &head, (void*)first,
+					 true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+#ifdef ENABLE_THREADS
+    if(head == NULL)
+	_O_WakeDestructionThread();
+#endif
+}
+
+void _O_DeferDestruction(Object *o)
+{
+    _O_PushDeferred(o, o);
+}
+
+void O_SetDeferredDestruction(bool defer)
+{
+    _o_defer_destruction = defer;
+}
+
+size_t O_DestroyDeferred(size_t max_objects)
+{
+    size_t n = 0;
+
+    while(max_objects == 0 || n < max_objects)
+    {
+	_O_PENDING_LOCK();
+
+	Object *o = (Object*)_o_deferred_pending;
+
+	if(o == NULL)
+	    o = (Object*)__atomic_exchange_n(&_o_deferred_head, NULL, __ATOMIC_ACQUIRE);
+
+	/* Cut this batch off the front; the rest waits for the next. */
+	Object *rest = NULL;
+
+	if(o != NULL && max_objects != 0)
+	{
+	    Object *last = o;
+	    size_t k;
+
+	    for(k = n + 1; k < max_objects && last->_obj_deferred_next != NULL; ++k)
+		last = (Object*)last->_obj_deferred_next;
+
+	    rest = (Object*)last->_obj_deferred_next;
+	    last->_obj_deferred_next = NULL;
+	}
+
+	__atomic_store_n(&_o_deferred_pending, (void*)rest, __ATOMIC_RELEASE);
+
+	_O_PENDING_UNLOCK();
+
+	if(o == NULL)
+	    break;
+
+#ifdef ENABLE_THREADS
+	if(rest != NULL)
+	    _O_WakeDestructionThread();
+#endif
+
+	while(o != NULL)
+	{
+	    Object *next = (Object*)o->_obj_deferred_next;
+	    _O_DESTROY_NOW(o);
+	    ++n;
+	    o = next;
+	}
+    }
+
+    return n;
+}
+
+#ifdef ENABLE_THREADS
+
+static void* _O_DestructionThreadMain(void *unused)
+{
+    while(true)
+    {
+	O_DestroyDeferred(0);
+
+	pthread_mutex_lock(&_o_destruction_lock);
+
+	while(_O_DeferredQueueEmpty() && _o_destruction_thread_running)
+	    pthread_cond_wait(&_o_destruction_cond, &_o_destruction_lock);
+
+	bool done = (!_o_destruction_thread_running && _O_DeferredQueueEmpty());
+
+	pthread_mutex_unlock(&_o_destruction_lock);
+
+	if(done)
+	    return NULL;
+    }
+}
+
+void O_StartDestructionThread()
+{
+    pthread_mutex_lock(&_o_destruction_lock);
+
+    if(!_o_destruction_thread_running)
+    {
+	__atomic_store_n(&_o_destruction_thread_running, true, __ATOMIC_RELAXED);
+
+	if(pthread_create(&_o_destruction_thread, NULL, _O_DestructionThreadMain, NULL) != 0)
+	    __atomic_store_n(&_o_destruction_thread_running, false, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&_o_destruction_lock);
+}
+
+void O_StopDestructionThread()
+{
+    pthread_mutex_lock(&_o_destruction_lock);
+
+    if(!_o_destruction_thread_running)
+    {
+	pthread_mutex_unlock(&_o_destruction_lock);
+	return;
+    }
+
+    __atomic_store_n(&_o_destruction_thread_running, false, __ATOMIC_RELAXED);
+    pthread_cond_signal(&_o_destruction_cond);
+    pthread_mutex_unlock(&_o_destruction_lock);
+
+    pthread_join(_o_destruction_thread, NULL);
+
+#ifdef ENABLE_BIASED_REFCOUNT
+    /* The thread's decrefs of objects owned by this one wait in this
+     * thread's merge queue; finish those cascades here. */
+    do {
+	O_MergeRefCounts();
+    } while(O_DestroyDeferred(0) != 0);
+#endif
+}
+
+#endif
+
+#endif
+
 /* Mostly just wrapping the macros defined previously. */
 void O_IncRef(void *obj) 
 {
@@ -28,7 +505,7 @@ void O_DeclareObjectAsValue(void *obj)
     assert(o != NULL);
     assert(o->_obj_ref_count == 0);
     
-    o->_obj_ref_count = -1;
+    _O_SET_UNCOUNTED(o);
 }
 
 
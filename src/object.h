@@ -103,8 +103,84 @@ typedef struct ObjectInfo {
      * Memory management operations. 
      *****************************************/
 
+    /* sizeof() the object structure; used to walk arena chunks. */
+    size_t object_size;
+
 } ObjectInfo;
 
+/***********************************************************************
+ *
+ *  Arena scopes.  Between Arena_Begin() and the matching
+ *  Arena_Release(), every object allocated on this thread through
+ *  ALLOCATE##Type (and thus New##Type, Construct##Type, etc.) is
+ *  carved out of large chunks owned by the arena instead of its type's
+ *  memory pool.  Arena_Release() then frees all of them at once: the
+ *  delete function of each object still alive is called, with
+ *  reference counting between arena objects switched off, so only
+ *  resources outside the arena (hash table storage, marker range
+ *  lists, references to older objects) are given back one at a time.
+ *  Only the object structures themselves go back a chunk at a time;
+ *  what they hold outside the arena is still freed object by object,
+ *  so releasing costs time in proportion to that too.  The delete
+ *  functions run in allocation order, and must not walk into other
+ *  uncounted objects, which may have been destroyed already.
+ *
+ *  Objects from an arena behave exactly like other objects until the
+ *  arena is released; an object whose count drops to zero early has
+ *  its delete function called, but its memory is only reclaimed with
+ *  the arena.  Nothing allocated in the arena may be referenced after
+ *  it is released.  Scopes nest; they must be released innermost
+ *  first.
+ *
+ **********************************************************************/
+
+typedef struct _ArenaChunk {
+    struct _ArenaChunk *next;
+    size_t used;
+    size_t size;
+} _ArenaChunk;
+
+typedef struct Arena {
+    struct Arena *parent;
+    _ArenaChunk *chunks;
+} Arena;
+
+/* Object alignment within a chunk; a HashKey may need 16. */
+#define _ARENA_ALIGN      16
+#define _ARENA_ROUND(n)   (((n) + (_ARENA_ALIGN - 1)) & ~((size_t)(_ARENA_ALIGN - 1)))
+#define _ARENA_CHUNK_DATA(c) (((char*)(c)) + _ARENA_ROUND(sizeof(_ArenaChunk)))
+
+/* Marks an object as owned by an arena rather than a memory pool. */
+#define _ARENA_ORIGIN     (~((size_t)0))
+#define O_IN_ARENA(obj)   (((const Object*)(obj))->_mpool_origin_index == _ARENA_ORIGIN)
+
+#ifdef ENABLE_THREADS
+extern __thread Arena *_o_current_arena;
+#else
+extern Arena *_o_current_arena;
+#endif
+
+Arena* Arena_Begin();
+void Arena_Release(Arena *a);
+
+void* _Arena_AllocateSlow(Arena *a, size_t size);
+
+static inline void* _Arena_Allocate(Arena *a, size_t size)
+{
+    _ArenaChunk *c = a->chunks;
+
+    size = _ARENA_ROUND(size);
+
+    if(likely(c != NULL && c->used + size <= c->size))
+    {
+	void *p = _ARENA_CHUNK_DATA(c) + c->used;
+	c->used += size;
+	return p;
+    }
+
+    return _Arena_AllocateSlow(a, size);
+}
+
 /***********************************************************************
  *
  *  OBJECT_ITEMS should be placed at the beginning of all object
@@ -134,10 +210,107 @@ typedef struct ObjectInfo {
     struct ObjectInfo *_obj_type_info;					\
 									\
     /* Reference counting. */						\
-    signed long int _obj_ref_count;
+    signed long int _obj_ref_count;					\
+    _OBJECT_SHARED_REFCOUNT_ITEMS					\
+    _OBJECT_DEFERRED_FREE_ITEMS
+
+#ifdef ENABLE_DEFERRED_FREE
+#define _OBJECT_DEFERRED_FREE_ITEMS  void *_obj_deferred_next;
+#else
+#define _OBJECT_DEFERRED_FREE_ITEMS
+#endif
+
+/***********************************************************************
+ *
+ *  With ENABLE_BIASED_REFCOUNT, reference counts are safe to change
+ *  from any thread.  Each object is biased toward the thread that
+ *  allocated it: that thread changes _obj_ref_count with plain
+ *  arithmetic, while every other thread atomically changes
+ *  _obj_shared_ref_count (the count shifted up by two, with two flag
+ *  bits below).  When the owner's count reaches zero the two are
+ *  merged and the object is counted through the shared count alone
+ *  from then on.  A thread that drops the shared count below zero
+ *  instead queues the object with its owner, which merges it at its
+ *  next O_MergeRefCounts() (also run whenever one of its own objects
+ *  reaches zero); the queue holds that pending decrement.
+ *
+ *  A thread that hands objects to other threads should call
+ *  O_MergeRefCounts() once they are done with them, and before it
+ *  exits; otherwise objects queued with it are never freed.  A
+ *  thread that exits while others still hold what it made should
+ *  first call O_BiasNewObjects(false), so those objects are created
+ *  already merged; nothing would merge them once it is gone.
+ *
+ **********************************************************************/
+
+#ifdef ENABLE_BIASED_REFCOUNT
+
+#define _OBJECT_SHARED_REFCOUNT_ITEMS					\
+    void *_obj_ref_owner;						\
+    signed long int _obj_shared_ref_count;				\
+    void *_obj_ref_queue_next;
+
+/* The per-thread queue of objects to merge; its address also
+ * identifies the owning thread. */
+typedef struct {
+    void *head;
+} _ORefQueue;
+
+/* Until a thread allocates an object, _o_ref_queue points to a
+ * placeholder that no object is owned by. */
+extern _ORefQueue _o_no_ref_queue;
+extern __thread _ORefQueue *_o_ref_queue;
+
+/* While _o_ref_queue points here, new objects are created unbiased. */
+extern _ORefQueue _o_unbiased_ref_queue;
+
+_ORefQueue* _O_NewThreadRefQueue();
+
+static inline _ORefQueue* _O_ThreadRefQueue()
+{
+    _ORefQueue *q = _o_ref_queue;
+    return likely(q != &_o_no_ref_queue) ? q : _O_NewThreadRefQueue();
+}
+
+/* Owner of value objects and released arena objects, which aren't
+ * counted at all. */
+#define _O_REF_UNCOUNTED         ((void*)1)
+
+#define _O_SHARED_QUEUED         1
+#define _O_SHARED_MERGED         2
+#define _O_SHARED_SHIFT          2
+#define _O_SHARED_ONE            (1L << _O_SHARED_SHIFT)
+
+#define _O_SET_REF_OWNER(obj)						\
+    do{									\
+	_ORefQueue *_q = _O_ThreadRefQueue();				\
+									\
+	if(likely(_q != &_o_unbiased_ref_queue))			\
+	    (obj)->_obj_ref_owner = (void*)_q;				\
+	else								\
+	{								\
+	    long _n = (obj)->_obj_ref_count;				\
+									\
+	    (obj)->_obj_ref_owner = NULL;				\
+	    (obj)->_obj_ref_count = 0;					\
+	    (obj)->_obj_shared_ref_count =				\
+		(_n << _O_SHARED_SHIFT) | _O_SHARED_MERGED;		\
+	}								\
+    }while(0)
+
+#define _O_SET_UNCOUNTED(obj)					\
+    do{ (obj)->_obj_ref_count = -1; (obj)->_obj_ref_owner = _O_REF_UNCOUNTED; }while(0)
+
+#else
+
+#define _OBJECT_SHARED_REFCOUNT_ITEMS
+#define _O_SET_REF_OWNER(obj)
+#define _O_SET_UNCOUNTED(obj)    do{ (obj)->_obj_ref_count = -1; }while(0)
+
+#endif
 
 /* A single global object info structure is defined for each type. */
-#define O_GlobalObjectInfoStruct(ObjectType) (ObjectType##_objinfo)
+#define O_GlobalObjectInfoStruct(ObjectType) ObjectType##_objinfo
 
 /* A null structure that Object is the base type of. */
 extern ObjectInfo O_GlobalObjectInfoStruct(NULLType);
@@ -150,12 +323,21 @@ extern ObjectInfo O_GlobalObjectInfoStruct(NULLType);
     									\
     static inline ObjectType* ALLOCATE##ObjectType()			\
     {									\
-	ObjectType *obj = Mp_New##ObjectType();				\
+	ObjectType *obj;						\
+									\
+	if(unlikely(_o_current_arena != NULL))				\
+	{								\
+	    obj = (ObjectType*)_Arena_Allocate(_o_current_arena, sizeof(ObjectType)); \
+	    obj->_mpool_origin_index = _ARENA_ORIGIN;			\
+	}								\
+	else								\
+	    obj = Mp_New##ObjectType();					\
 									\
 	_SET_OBJECT_MAGIC_NUMBER(obj);					\
 	obj->_obj_type_info = &O_GlobalObjectInfoStruct(ObjectType);	\
 	assert(obj->_obj_type_info != NULL);				\
 	obj->_obj_ref_count = 1;					\
+	_O_SET_REF_OWNER(obj);						\
 									\
 	assert(O_IsType(Object, obj));					\
 									\
@@ -212,7 +394,8 @@ extern ObjectInfo O_GlobalObjectInfoStruct(NULLType);
 	/* Base Type */	      &O_GlobalObjectInfoStruct(BaseType),	\
 	/* constructor */     (nullunaryobjectfunc)construction_function, \
         /* destructor */      (nullunaryobjectfunc)delete_function,	\
-	/* memory_pool */     (nullunaryobjectfunc)Mp_Free##ObjectType##_NonStatic \
+	/* memory_pool */     (nullunaryobjectfunc)Mp_Free##ObjectType##_NonStatic, \
+	/* object_size */     sizeof(ObjectType)			\
     };									\
 									\
     /* Functions for reporting casting errors. */			\
@@ -382,42 +565,184 @@ DECLARE_OBJECT(Object);
  *
  **********************************************************************/
 
+/**********************************************************************
+ *
+ *  Deferred destruction.  With ENABLE_DEFERRED_FREE, a thread that
+ *  turns on O_SetDeferredDestruction() no longer destroys objects
+ *  when their count reaches zero; they are pushed onto a global queue
+ *  instead, so dropping the last reference to a large table or graph
+ *  costs the same as dropping any other.  O_DestroyDeferred() then
+ *  destroys queued objects in batches of a given size; when called
+ *  on a deferring thread, the objects each destruction releases are
+ *  queued in turn, so the cascade is spread over the batches.  With
+ *  ENABLE_THREADS, O_StartDestructionThread() runs a thread that
+ *  drains the queue as it fills.  Objects are then destroyed on that
+ *  thread, so anything they reference must either be confined to it
+ *  or counted with ENABLE_BIASED_REFCOUNT.  In the latter case its
+ *  decrefs of objects owned by other threads are merged by those
+ *  threads, so the cascade moves on as they run O_MergeRefCounts().
+ *  Arena objects are always destroyed immediately.
+ *
+ **********************************************************************/
+
+#define _O_DESTROY_NOW(objp)						\
+    do{									\
+	if((objp)->_obj_type_info->delete_function != NULL)		\
+	    (*((objp)->_obj_type_info->delete_function))(objp);		\
+									\
+	assert((objp)->_obj_type_info->deallocate_function != NULL);	\
+	if(likely(!O_IN_ARENA(objp)))					\
+	    (*((objp)->_obj_type_info->deallocate_function))(objp);	\
+    }while(0)
+
+#ifdef ENABLE_DEFERRED_FREE
+
+#ifdef ENABLE_THREADS
+extern __thread bool _o_defer_destruction;
+#else
+extern bool _o_defer_destruction;
+#endif
+
+void _O_DeferDestruction(Object *o);
+
+/* Turns deferred destruction on or off for the calling thread. */
+void O_SetDeferredDestruction(bool defer);
+
+/* Destroys up to max_objects queued objects, or until the queue is
+ * empty if max_objects is 0; returns the number destroyed. */
+size_t O_DestroyDeferred(size_t max_objects);
+
+#ifdef ENABLE_THREADS
+/* Starts or stops the background thread draining the queue; stopping
+ * it waits until the queue is empty. */
+void O_StartDestructionThread();
+void O_StopDestructionThread();
+#endif
+
+#define _O_DESTROY(objp)						\
+    do{									\
+	if(unlikely(_o_defer_destruction) && !O_IN_ARENA(objp))		\
+	    _O_DeferDestruction(objp);					\
+	else								\
+	    _O_DESTROY_NOW(objp);					\
+    }while(0)
+
+#else
+
+#define _O_DESTROY(objp) _O_DESTROY_NOW(objp)
+
+#endif
+
 /*****************************************
  *
  *  Macros implementing the above.
  *
  ****************************************/
 
+#ifdef ENABLE_BIASED_REFCOUNT
+
+void _O_MergeZeroLocalRefCount(Object *o);
+void _O_DecRefShared(Object *o);
+long _O_RefCount(const Object *o);
+
+/* Merges the counts of objects other threads have queued with this
+ * one, freeing those that are no longer referenced. */
+void O_MergeRefCounts();
+
+/* Has an object be counted through its shared count alone from now
+ * on, so O_IncRefIfLive works on it from any thread.  Only the owner
+ * can do this; returns false if the calling thread isn't it. */
+bool O_UnbiasRefCount(Object *o);
+
+/* Adds a reference to an unbiased object unless its count has already
+ * reached zero; returns whether it did. */
+bool O_IncRefIfLive(Object *o);
+
+/* Whether the objects this thread allocates from now on are biased
+ * toward it, as they are by default.  If not, they are counted
+ * through their shared count alone, as after O_UnbiasRefCount. */
+void O_BiasNewObjects(bool bias);
+
 #define O_INCREF(obj)							\
     do {								\
 	assert(O_IsType(Object, obj));					\
 									\
 	Object *objp = (Object*)(obj);					\
+	void *owner = __atomic_load_n(&objp->_obj_ref_owner, __ATOMIC_RELAXED); \
 									\
-	if(likely(objp->_obj_ref_count >= 0))				\
+	if(likely(owner == (void*)_o_ref_queue))			\
 	    ++objp->_obj_ref_count;					\
+	else if(likely(owner != _O_REF_UNCOUNTED))			\
+	    __atomic_fetch_add(&objp->_obj_shared_ref_count, _O_SHARED_ONE, __ATOMIC_RELAXED); \
     } while(0)
 
 #define O_DECREF(obj)							\
     do{									\
 	Object *objp = (Object*)(obj);					\
 	assert(O_IsType(Object, objp));					\
-	assert(objp->_obj_ref_count > 0);				\
-    									\
-	--objp->_obj_ref_count;						\
-    									\
-	if(objp->_obj_ref_count == 0)					\
-	{								\
-	    if(objp->_obj_type_info->delete_function != NULL)		\
-		(*(objp->_obj_type_info->delete_function))(objp);	\
+	void *owner = __atomic_load_n(&objp->_obj_ref_owner, __ATOMIC_RELAXED); \
 									\
-	    assert(objp->_obj_type_info->deallocate_function != NULL);	\
-	    (*(objp->_obj_type_info->deallocate_function))(objp);	\
+	if(likely(owner == (void*)_o_ref_queue))			\
+	{								\
+	    assert(objp->_obj_ref_count > 0);				\
+	    if(unlikely(--objp->_obj_ref_count == 0))			\
+		_O_MergeZeroLocalRefCount(objp);			\
 	}								\
+	else if(likely(owner != _O_REF_UNCOUNTED))			\
+	    _O_DecRefShared(objp);					\
+    }while(0)
+
+#define O_REF_COUNT(obj) _O_RefCount((const Object*)(obj))
+
+#else
+
+#define O_INCREF(obj)							\
+    do {								\
+	assert(O_IsType(Object, obj));					\
+									\
+	Object *objp = (Object*)(obj);					\
+									\
+	if(likely(objp->_obj_ref_count >= 0))				\
+	    ++objp->_obj_ref_count;					\
+    } while(0)
+
+#define O_DECREF(obj)							\
+    do{									\
+	Object *objp = (Object*)(obj);					\
+	assert(O_IsType(Object, objp));					\
+	assert(objp->_obj_ref_count != 0);				\
+    									\
+	/* Value objects, and arena objects being released, are	\
+	 * not reference counted. */					\
+	if(likely(objp->_obj_ref_count > 0)				\
+	   && --objp->_obj_ref_count == 0)				\
+	    _O_DESTROY(objp);						\
     }while(0)
 
 #define O_REF_COUNT(obj) ((obj)->_obj_ref_count)
 
+static inline bool O_UnbiasRefCount(Object *o)
+{
+    (void)o;
+    return true;
+}
+
+static inline bool O_IncRefIfLive(Object *o)
+{
+    if(o->_obj_ref_count <= 0)
+	return false;
+
+    ++o->_obj_ref_count;
+    return true;
+}
+
+static inline void O_BiasNewObjects(bool bias)
+{
+    (void)bias;
+}
+
+#endif
+
 #endif
 
 
@@ -46,6 +46,20 @@
 
 #endif
 
+/* Runtime cpu dispatch.  With ENABLE_CPU_DISPATCH (set by cmake when
+ * the compiler supports it), functions marked cpu_dispatch are
+ * compiled once for each listed instruction set, and the best version
+ * for the running cpu is bound once at load time through an ifunc
+ * resolver.  Use it only on out-of-line functions that do a
+ * substantial amount of work per call -- the loops over keys and
+ * ranges -- as calls to them can't be inlined. */
+
+#if defined(ENABLE_CPU_DISPATCH) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define cpu_dispatch __attribute__((target_clones("default", "sse4.2", "avx2", "avx512f")))
+#else
+#define cpu_dispatch
+#endif
+
 #define SIZE_T_INFTY (~( (size_t) 0 ) )
 #define SIZE_T_IS_INFTY(x) ( !(~((size_t)(x))) )
 
@@ -23,7 +23,10 @@ typedef unsigned int128 uint128_type;
 #define NO_UINT128
 #endif
 
-#ifdef RESTRICT_USE_restrict
+#if defined(__cplusplus)
+/* C++ has no restrict keyword, but the major compilers accept this. */
+#define _restrict_ __restrict
+#elif defined(RESTRICT_USE_restrict)
 #define _restrict_ restrict
 #elif RESTRICT_USE___restrict
 #define _restrict_ __restrict
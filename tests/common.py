@@ -34,6 +34,118 @@ else:
     
 null_hash = '0'*32
 
+# Without argument types, ctypes passes every argument as an int,
+# which cuts pointers down on 64 bit systems; likewise the pointers
+# returned.  Functions not in this build (the debug ones) are skipped.
+
+_p = ctypes.c_void_p
+_m = ctypes.c_long
+
+def declare(name, restype, *argtypes):
+    try:
+        f = getattr(ibd, name)
+    except AttributeError:
+        return
+
+    f.restype = restype
+    f.argtypes = list(argtypes)
+
+for _name, _restype, _argtypes in [
+    ("O_RefCount",                     c_size_t, [_p]),
+    ("O_IncRef",                       None,     [_p]),
+    ("O_DecRef",                       None,     [_p]),
+
+    ("NewHashObject",                  _p,       []),
+    ("Hf_FromInt",                     _p,       [_p, c_long]),
+    # Given signed values too, to check they hash apart from Hf_FromInt.
+    ("Hf_FromUnsignedInt",             _p,       [_p, c_long]),
+    ("Hf_FromString",                  _p,       [_p, c_char_p]),
+    ("Hf_FillExact",                   _p,       [_p, c_char_p]),
+    ("Hf_FillFromComponents",          _p,       [_p, c_uint, c_uint, c_uint, c_uint]),
+    ("Hf_Combine",                     _p,       [_p, _p, _p]),
+    ("H_Reduce",                       _p,       [_p, _p, _p]),
+    ("H_ReduceUpdate",                 _p,       [_p, _p]),
+    ("H_Rehash",                       _p,       [_p, _p]),
+    ("H_Negative",                     _p,       [_p, _p]),
+    ("H_Equal",                        c_bool,   [_p, _p]),
+    ("H_ExtractHash",                  None,     [c_char_p, _p]),
+    ("H_ExtractHashComponent",         c_ulong,  [_p, c_uint]),
+    ("H_IsMarked",                     c_bool,   [_p]),
+    ("H_AddMarkerValidRange",          None,     [_p, _m, _m]),
+    ("H_GiveMarkerInfo",               None,     [_p, _p]),
+    ("H_ClearMarkerInfo",              None,     [_p]),
+    ("H_MarkerPointIsValid",           c_bool,   [_p, _m]),
+
+    ("NewHashTable",                   _p,       []),
+    ("Ht_Size",                        c_size_t, [_p]),
+    ("Ht_Give",                        None,     [_p, _p]),
+    ("Ht_Set",                         None,     [_p, _p]),
+    ("Ht_SetDefault",                  _p,       [_p, _p]),
+    ("Ht_InsertValidRange",            _p,       [_p, _p, _m, _m]),
+    ("Ht_Get",                         _p,       [_p, _p]),
+    ("Ht_View",                        _p,       [_p, _p]),
+    ("Ht_Pop",                         _p,       [_p, _p]),
+    ("Ht_Clear",                       c_bool,   [_p, _p]),
+    ("Ht_Contains",                    c_bool,   [_p, _p]),
+    ("Ht_ContainsAt",                  c_bool,   [_p, _p, _m]),
+    ("Ht_Union",                       _p,       [_p, _p]),
+    ("Ht_Intersection",                _p,       [_p, _p]),
+    ("Ht_Difference",                  _p,       [_p, _p]),
+    ("Ht_ReduceTable",                 _p,       [_p]),
+    ("Ht_Summarize_Update",            _p,       [_p, _p]),
+    ("Ht_Summarize_Finish",            _p,       [_p]),
+    ("Ht_HashAtMarkerPoint",           _p,       [_p, _p, _m]),
+    ("Ht_HashOfMarkerRange",           _p,       [_p, _p, _m, _m]),
+    ("Ht_MSL_debug_Print",             None,     [_p]),
+    ("Ht_debug_print",                 None,     [_p]),
+    ("_Ht_debug_HashTableConsistent",  None,     [_p]),
+    ("Hti_New",                        _p,       [_p]),
+    ("Hti_Next",                       c_bool,   [_p, _p]),
+    ("Htib_New",                       _p,       [_p]),
+    ("Htib_Next",                      c_bool,   [_p, _p]),
+
+    ("NewIBDGraph",                    _p,       [c_long]),
+    ("IBDGraph_Connect",               None,     [_p, _p, _p, _m, _m]),
+    ("IBDGraphNodeByNumber",           _p,       [_p, c_long]),
+    ("IBDGraphNodeByName",             _p,       [_p, c_char_p]),
+    ("IBDGraphEdgeByNumber",           _p,       [_p, c_long]),
+    ("IBDGraphEdgeByName",             _p,       [_p, c_char_p]),
+    ("IBDGraphViewHash",               _p,       [_p]),
+    ("IBDGraphGetHashAtMarker",        _p,       [_p, _m]),
+    ("IBDGraphEqual",                  c_bool,   [_p, _p]),
+    ("IBDGraphEqualAtMarker",          c_bool,   [_p, _p, _m]),
+    ("IBDGraphInvariantRegionLower",   _m,       [_p, _m]),
+    ("IBDGraphInvariantRegionUpper",   _m,       [_p, _m]),
+
+    ("Mi_New",                         _p,       [_m, _m]),
+    ("Mi_AddValidRange",               None,     [_p, _m, _m]),
+    ("Mi_IsValid",                     c_bool,   [_p, _m]),
+    ("Mi_ValidAnywhere",               c_bool,   [_p]),
+    ("Mi_Equal",                       c_bool,   [_p, _p]),
+    ("Mi_Copy",                        _p,       [_p]),
+    ("Mi_Complement",                  _p,       [_p]),
+    ("Mi_Union",                       _p,       [_p, _p]),
+    ("Mi_Intersection",                _p,       [_p, _p]),
+    ("Mi_Difference",                  _p,       [_p, _p]),
+    ("Mi_SymmetricDifference",         _p,       [_p, _p]),
+    ("Mi_debug_printMi",               None,     [_p]),
+    ("Mii_New",                        _p,       [_p]),
+    ("Mii_Next",                       c_bool,   [_p, _p]),
+    ("Mii_Delete",                     None,     [_p]),
+    ("Miri_New",                       _p,       [_p]),
+    ("Miri_Next",                      c_bool,   [_p, _p]),
+    ("Miri_Delete",                    None,     [_p]),
+    ("Mr_Start",                       _m,       [_p]),
+    ("Mr_End",                         _m,       [_p]),
+    ("Mr_Plus_Infinity",               _m,       []),
+    ("Mr_Minus_Infinity",              _m,       [])]:
+
+    declare(_name, _restype, *_argtypes)
+
+# The consistency checks are only built in debug mode.
+if not hasattr(ibd, '_Ht_debug_HashTableConsistent'):
+    ibd._Ht_debug_HashTableConsistent = lambda ht: None
+
 ibd.H_Reduce.restype = ctypes.c_void_p
 ibd.H_Rehash.restype = ctypes.c_void_p
 ibd.H_Negative.restype = ctypes.c_void_p
@@ -144,4 +256,24 @@ def decRef(*args):
     for a in args:
         ibd.O_DecRef(a)
 
+# Arrays of hash keys, as the batch queries and the like take them, are
+# laid out as the library lays them out: the 32 bit components, most
+# significant first, in reverse order on little endian machines.  With
+# 64 bit keys, the two upper components are always zero.
+
+def _keyComponents(hk):
+    return [ibd.H_ExtractHashComponent(hk, i) for i in range(4)]
+
+_probe_keys = [makeHashKey(i) for i in range(8)]
+hashkey_components = (2 if all(_keyComponents(hk)[:2] == [0, 0] for hk in _probe_keys)
+                      else 4)
+decRef(*_probe_keys)
+
+def hashKeyArray(hk_list):
+    words = []
+
+    for hk in hk_list:
+        c = _keyComponents(hk)[4 - hashkey_components:]
+        words += c[::-1] if sys.byteorder == 'little' else c
 
+    return (c_uint32 * max(1, len(words)))(*words)
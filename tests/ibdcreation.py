@@ -4,8 +4,8 @@ Routines for creating the various files.
 
 from common import *
 
-newIBDGraph = ibd.NewIBDGraph
-newIBDGraph.restype = ctypes.c_void_p
+def newIBDGraph(id = 0):
+    return ibd.NewIBDGraph(id)
 
 ibd.IBDGraphEdgeByName.restype = ctypes.c_void_p
 ibd.IBDGraphEdgeByNumber.restype = ctypes.c_void_p
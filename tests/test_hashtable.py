@@ -1890,6 +1890,72 @@ class TestHashTableSetOps(unittest.TestCase):
         self.setConsistencyTest("difference", (-100,100), 100, 10, 50)
         
 
+bitfield_bits = 8*sizeof(c_ulong)
+
+def batchBits(out, n):
+    return [bool((out[i // bitfield_bits] >> (i % bitfield_bits)) & 1) for i in range(n)]
+
+declare("Ht_ContainsAtBatch", None, c_void_p, c_void_p, POINTER(c_long), c_size_t, c_void_p)
+
+class TestHashTableBatch(unittest.TestCase):
+
+    def checkBatch(self, ht, hk_list, markers):
+        n = len(markers)
+        out = (c_ulong * max(1, (n + bitfield_bits - 1) // bitfield_bits))()
+
+        ibd.Ht_ContainsAtBatch(ht, hashKeyArray(hk_list), 
+                               (c_long * max(1, n))(*markers), n, out)
+
+        self.assert_(batchBits(out, n) == [bool(ibd.Ht_ContainsAt(ht, hk, m))
+                                           for hk, m in zip(hk_list, markers)])
+
+    def test01_Unmarked(self):
+        ht = newHT()
+        keys = [makeHashKey(i) for i in range(200)]
+
+        for hk in keys[::2]:
+            ibd.Ht_Set(ht, hk)
+
+        random.seed(0)
+
+        for n in [0, 1, 7, 8, 9, 63, 64, 65, 200]:
+            hk_list = [random.choice(keys) for i in range(n)]
+            self.checkBatch(ht, hk_list, [random.randint(-100, 100) for i in range(n)])
+
+        decRef(ht, *keys)
+
+    def test02_Marked(self):
+        ht = newHT()
+        random.seed(1)
+        keys = [makeHashKey(i) for i in range(300)]
+
+        for i, hk in enumerate(keys[:200]):
+            a = random.randint(-100, 100)
+            ibd.Ht_InsertValidRange(ht, hk, a, a + random.randint(1, 50))
+
+            if i % 3 == 0:
+                ibd.Ht_InsertValidRange(ht, hk, a + 60, a + 80)
+
+        for n in [1, 64, 65, 1000]:
+            hk_list = [random.choice(keys) for i in range(n)]
+            self.checkBatch(ht, hk_list, [random.randint(-120, 220) for i in range(n)])
+
+        decRef(ht, *keys)
+
+    def test03_Large(self):
+        # Past the prefetch distance, with the table grown.
+        ht = newHT()
+        keys = [makeHashKey(i) for i in range(5000)]
+
+        for hk in keys[1::3]:
+            ibd.Ht_InsertValidRange(ht, hk, 0, 100)
+
+        random.seed(2)
+        hk_list = [random.choice(keys) for i in range(3000)]
+        self.checkBatch(ht, hk_list, [random.randint(-10, 110) for i in range(3000)])
+
+        decRef(ht, *keys)
+
 if __name__ == '__main__':
     unittest.main()
 
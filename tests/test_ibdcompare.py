@@ -0,0 +1,509 @@
+#!/usr/bin/env python
+"""
+Tests the ibd_compare program on the files in datafiles, read from
+files, pipes and gzip compressed files and in the binary dglb format,
+loaded on any number of threads, its location equivalences and the
+sweep of its classes along the markers.  The program is looked
+for in the build tree, or given by the IBD_COMPARE environment variable.
+"""
+
+import unittest, os, subprocess, tempfile, shutil, struct, gzip, re
+
+data_dir = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'datafiles')
+
+data_files = ['test01.dglf1', 'test_dgl_1.dglf1', 'test_dgl_2.dglf1']
+
+def findIBDCompare():
+    if 'IBD_COMPARE' in os.environ:
+        return os.environ['IBD_COMPARE']
+
+    base = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+    for d in ['', 'build', 'src']:
+        p = os.path.join(base, d, 'ibd_compare')
+        if os.path.isfile(p) and os.access(p, os.X_OK):
+            return p
+
+    return None
+
+ibd_compare = findIBDCompare()
+
+def runIBDCompare(filename, options = [], stdin_data = None, threads = None):
+    """
+    Runs ibd_compare, returning its exit code and its output with the
+    timings taken out.  If threads is given, builds that load and hash
+    the graphs on several threads use that many.
+    """
+
+    env = dict(os.environ)
+
+    if threads is not None:
+        env['HASHREDUCE_THREADS'] = str(threads)
+
+    p = subprocess.Popen([ibd_compare, filename] + options, env = env,
+                         stdin = subprocess.PIPE if stdin_data is not None else None,
+                         stdout = subprocess.PIPE, stderr = subprocess.STDOUT)
+
+    out = p.communicate(stdin_data)[0]
+
+    if not isinstance(out, str):
+        out = out.decode('latin-1')
+
+    out = '\n'.join(l for l in out.split('\n') if 'seconds' not in l)
+
+    return p.returncode, out
+
+def dataFile(name):
+    return os.path.join(data_dir, name)
+
+def readFile(filename):
+    f = open(filename, 'rb')
+    d = f.read()
+    f.close()
+    return d
+
+def writeFile(filename, d):
+    f = open(filename, 'wb')
+    f.write(d)
+    f.close()
+
+################################################################################
+# The dglb layout; see dglbformat.c.
+
+dglb_header_size = 64
+
+def readDglb(d):
+    """
+    Splits a dglb file into its header, keys, graph offsets and records.
+    """
+    key_size, = struct.unpack_from('<I', d, 12)
+    n_graphs, n_edge_keys, n_node_keys = struct.unpack_from('<QQQ', d, 16)
+
+    keys_end = dglb_header_size + (n_edge_keys + n_node_keys)*key_size
+    offsets_end = keys_end + 8*(n_graphs + 1)
+
+    offsets = list(struct.unpack_from('<%dQ' % (n_graphs + 1), d, keys_end))
+
+    return d[:dglb_header_size], d[dglb_header_size:keys_end], offsets, d[offsets_end:]
+
+def writeDglb(header, keys, offsets, records):
+    """
+    Puts a dglb file back together; offsets are as they would be with
+    the original number of graphs, and are moved to fit.
+    """
+    n_graphs = len(offsets) - 1
+    old_n_graphs, = struct.unpack_from('<Q', header, 16)
+    shift = 8*(n_graphs - old_n_graphs)
+
+    header = header[:16] + struct.pack('<Q', n_graphs) + header[24:]
+
+    return (header + keys
+            + struct.pack('<%dQ' % (n_graphs + 1), *[o + shift for o in offsets])
+            + records)
+
+################################################################################
+# Reading the outputs
+
+def parseClasses(out):
+    """
+    Parses the output of -m into a set of classes, each a frozenset of
+    graph ids.
+    """
+    classes = set()
+
+    for l in out.split('\n'):
+        m = re.match(r'^\s*(\d+)\s*:\s*(.*)$', l)
+        if m is None:
+            continue
+
+        ids = frozenset(int(x) for x in m.group(2).split(','))
+        assert len(ids) == int(m.group(1))
+        classes.add(ids)
+
+    return classes
+def parseLocations(out):
+    """
+    Parses the output of -e into a list of classes, each a list of
+    (graph, start, end) locations.
+    """
+    classes = []
+
+    for l in out.split('\n'):
+        m = re.match(r'^\s*(\d+)\s*:\s*(\(.*)$', l)
+        if m is None:
+            continue
+
+        classes.append([tuple(int(x) for x in loc)
+                        for loc in re.findall(r'\((\d+):(-?\d+)-(-?\d+)\)', m.group(2))])
+
+    return classes
+
+def parseSweep(out):
+    """
+    Parses the output of -w into a list of (marker, number of classes,
+    [(graph, from, to), ...]) tuples.
+    """
+    steps = []
+
+    for l in out.split('\n'):
+        m = re.match(r'^(-?\d+)\s*:\s*(\d+) classes;(.*)$', l)
+        if m is None:
+            continue
+
+        changes = [tuple(int(x) for x in c)
+                   for c in re.findall(r'\((\d+):(\d+)->(\d+)\)', m.group(3))]
+
+        steps.append( (int(m.group(1)), int(m.group(2)), changes) )
+
+    return steps
+
+
+class TestIBDCompare(unittest.TestCase):
+
+    def setUp(self):
+        if ibd_compare is None:
+            self.skipTest("ibd_compare not built; set IBD_COMPARE to its location.")
+
+        self.tmp_dir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        if ibd_compare is not None:
+            shutil.rmtree(self.tmp_dir)
+
+    def tmpFile(self, name):
+        return os.path.join(self.tmp_dir, name)
+
+    def makeDglb(self, name):
+        out_file = self.tmpFile(name + '.dglb')
+        ret, out = runIBDCompare(dataFile(name), ['-b', out_file])
+        self.assert_(ret == 0, out)
+        return out_file
+
+    def checkSameOutput(self, f1, f2, option_list = None, stdin_data = None):
+        if option_list is None:
+            option_list = [[], ['-e'], ['-w'], ['-m', '2']]
+
+        for options in option_list:
+            ret1, out1 = runIBDCompare(f1, options)
+            ret2, out2 = runIBDCompare(f2, options, stdin_data)
+
+            self.assert_(ret1 == 0 and ret2 == 0, out1 + out2)
+            self.assert_(out1 == out2, "Output of %s differs with %s." % (f2, ' '.join(options)))
+
+    ############################################################
+    # dglb
+
+    def test01_Dglb_RoundTrip(self):
+        for name in data_files:
+            self.checkSameOutput(dataFile(name), self.makeDglb(name))
+
+    def test02_Dglb_NoGraphs(self):
+        header, keys, offsets, records = readDglb(readFile(self.makeDglb('test01.dglf1')))
+
+        bad_file = self.tmpFile('empty.dglb')
+        writeFile(bad_file, writeDglb(header, keys, offsets[:1], ''.encode()))
+
+        ret, out = runIBDCompare(bad_file, ['-e'])
+        self.assert_(ret != 0)
+        self.assert_('not a dglb file' in out, out)
+
+    def test03_Dglb_TrailingEmptyGraphs(self):
+        header, keys, offsets, records = readDglb(readFile(self.makeDglb('test_dgl_2.dglf1')))
+        n = len(offsets) - 1
+
+        padded_file = self.tmpFile('padded.dglb')
+        writeFile(padded_file, writeDglb(header, keys, offsets + [offsets[-1]]*3, records))
+
+        ret, out = runIBDCompare(padded_file, ['-m', '2'])
+        self.assert_(ret == 0, out)
+
+        classes = parseClasses(out)
+        self.assert_(sum(len(c) for c in classes) == n + 3)
+
+        # Empty graphs are all the same.
+        self.assert_(frozenset([n+1, n+2, n+3]) in classes)
+
+        ret, orig_out = runIBDCompare(dataFile('test_dgl_2.dglf1'), ['-m', '2'])
+        self.assert_(classes - set([frozenset([n+1, n+2, n+3])]) == parseClasses(orig_out))
+
+    def test04_Dglb_EmptyGraphsBetween(self):
+        header, keys, offsets, records = readDglb(readFile(self.makeDglb('test_dgl_2.dglf1')))
+
+        # Two empty graphs after each of the first ten graphs.
+        new_offsets = []
+        empty_ids = set()
+
+        for i, o in enumerate(offsets[:-1]):
+            new_offsets.append(o)
+
+            if i < 10:
+                new_offsets += [offsets[i+1]]*2
+                empty_ids |= set([len(new_offsets) - 1, len(new_offsets)])
+
+        new_offsets.append(offsets[-1])
+
+        spaced_file = self.tmpFile('spaced.dglb')
+        writeFile(spaced_file, writeDglb(header, keys, new_offsets, records))
+
+        ret, out = runIBDCompare(spaced_file, ['-m', '2'])
+        self.assert_(ret == 0, out)
+
+        classes = parseClasses(out)
+        self.assert_(sum(len(c) for c in classes) == len(new_offsets) - 1)
+        self.assert_(frozenset(empty_ids) in classes)
+
+    ############################################################
+    # Pipes and compressed files
+
+    def test10_Pipe_Text(self):
+        for name in data_files:
+            self.checkSameOutput(dataFile(name), '/dev/stdin', [['-e'], ['-m', '2']],
+                                 stdin_data = readFile(dataFile(name)))
+
+    def test10_Pipe_Long(self):
+        # Longer than the first buffer a pipe is read into.
+        long_file = self.tmpFile('long.dglf1')
+        writeFile(long_file, readFile(dataFile('test01.dglf1'))*4)
+
+        self.checkSameOutput(long_file, '/dev/stdin', [['-e']],
+                             stdin_data = readFile(long_file))
+
+    def test11_Pipe_Dglb(self):
+        dglb_file = self.makeDglb('test01.dglf1')
+        self.checkSameOutput(dataFile('test01.dglf1'), '/dev/stdin', [['-e']],
+                             stdin_data = readFile(dglb_file))
+
+    def gzipFile(self, name, *parts):
+        """
+        Writes the parts out as consecutive gzip members.
+        """
+        gz_file = self.tmpFile(name)
+
+        for i, d in enumerate(parts):
+            f = gzip.open(gz_file, 'wb' if i == 0 else 'ab')
+            f.write(d)
+            f.close()
+
+        ret, out = runIBDCompare(gz_file, ['-e'])
+
+        if 'compressed in a format' in out:
+            self.skipTest("ibd_compare built without gzip support.")
+
+        return gz_file
+
+    def test12_Gzip(self):
+        for name in data_files:
+            gz_file = self.gzipFile(name + '.gz', readFile(dataFile(name)))
+            self.checkSameOutput(dataFile(name), gz_file)
+
+    def test13_Gzip_Dglb(self):
+        gz_file = self.gzipFile('test01.dglb.gz', readFile(self.makeDglb('test01.dglf1')))
+        self.checkSameOutput(dataFile('test01.dglf1'), gz_file, [['-e'], ['-w']])
+
+    def test14_Gzip_Pipe(self):
+        gz_file = self.gzipFile('test01.gz', readFile(dataFile('test01.dglf1')))
+        self.checkSameOutput(dataFile('test01.dglf1'), '/dev/stdin', [['-e']],
+                             stdin_data = readFile(gz_file))
+
+    def test15_Gzip_Members(self):
+        # Read as the members' concatenation, as gzip does.
+        d = readFile(dataFile('test01.dglf1'))
+        split = d.index('\n'.encode(), len(d) // 2) + 1
+
+        gz_file = self.gzipFile('members.gz', d[:split], d[split:])
+        self.checkSameOutput(dataFile('test01.dglf1'), gz_file)
+
+    ############################################################
+    # Loading on several threads; the output shouldn't depend on how
+    # the graphs are split up between them.
+
+    def checkThreads(self, filename, option_list = None):
+        if option_list is None:
+            option_list = [[], ['-e'], ['-w'], ['-m', '2']]
+
+        for options in option_list:
+            ret, out = runIBDCompare(filename, options, threads = 1)
+            self.assert_(ret == 0, out)
+
+            for threads in [2, 3, 7, 16]:
+                ret, t_out = runIBDCompare(filename, options, threads = threads)
+                self.assert_(ret == 0, t_out)
+                self.assert_(t_out == out, "Output of %s with %s differs on %d threads."
+                             % (filename, ' '.join(options), threads))
+
+    def test30_Threads_Text(self):
+        for name in data_files:
+            self.checkThreads(dataFile(name))
+
+    def test31_Threads_Dglb(self):
+        for name in data_files:
+            self.checkThreads(self.makeDglb(name))
+
+    def test32_Threads_FewGraphs(self):
+        # Fewer graphs than threads.
+        header, keys, offsets, records = readDglb(readFile(self.makeDglb('test_dgl_2.dglf1')))
+
+        for n in [2, 3, 5]:
+            few_file = self.tmpFile('few_%d.dglb' % n)
+            writeFile(few_file, writeDglb(header, keys, offsets[:n+1], records))
+
+            self.checkThreads(few_file, [['-e'], ['-m', '2']])
+
+    def test33_Threads_Copies(self):
+        # Many copies of the same graphs, so the pieces handed to the
+        # threads fall at every point in them; each copy of a graph has
+        # to land in the class of the original, under its own number.
+        name = 'test_dgl_2.dglf1'
+
+        ret, out = runIBDCompare(dataFile(name), ['-m', '2'])
+        self.assert_(ret == 0, out)
+
+        classes = parseClasses(out)
+        n = sum(len(c) for c in classes)
+        n_copies = 9
+
+        copies_file = self.tmpFile('copies.dglf1')
+        writeFile(copies_file, readFile(dataFile(name))*n_copies)
+
+        for threads in [1, 4, 16]:
+            ret, out = runIBDCompare(copies_file, ['-m', '2'], threads = threads)
+            self.assert_(ret == 0, out)
+
+            copy_classes = set(frozenset(g + k*n for g in c for k in range(n_copies))
+                               for c in classes)
+
+            self.assert_(parseClasses(out) == copy_classes,
+                         "Classes of the copies wrong on %d threads." % threads)
+
+        self.checkThreads(copies_file, [['-e'], ['-w']])
+
+    ############################################################
+    # Location equivalences.  These are built one graph at a time,
+    # each graph freed once added, so are checked against the classes
+    # at each marker, worked out from all the graphs at once.
+
+    def checkLocations(self, filename):
+        ret, out = runIBDCompare(filename, ['-e'])
+        self.assert_(ret == 0, out)
+
+        classes = parseLocations(out)
+        self.assert_(len(classes) >= 2)
+
+        m = re.search(r'Grouped (\d+) locations into (\d+) equivalence classes', out)
+        self.assert_(m is not None, out)
+        self.assert_(int(m.group(1)) == sum(len(c) for c in classes))
+        self.assert_(int(m.group(2)) == len(classes))
+
+        ret, summary = runIBDCompare(filename, ['-E'])
+        self.assert_(ret == 0, summary)
+        self.assert_('{NConfigurations:%s}{NUnique:%s}' % (m.group(1), m.group(2)) in summary,
+                     summary)
+
+        # Each graph's locations don't overlap.
+        graph_locations = {}
+
+        for c, locs in enumerate(classes):
+            for g, start, end in locs:
+                self.assert_(start <= end)
+                graph_locations.setdefault(g, []).append( (start, end, c) )
+
+        for g, locs in graph_locations.items():
+            locs.sort()
+
+            for (s1, e1, c1), (s2, e2, c2) in zip(locs[:-1], locs[1:]):
+                self.assert_(e1 <= s2, "Graph %d has overlapping locations." % g)
+
+        markers = sorted(set(s for locs in classes for g, s, e in locs
+                             if abs(s) < 2**62))
+
+        for marker in range(markers[0] - 1, markers[-1] + 2):
+
+            ret, out = runIBDCompare(filename, ['-m', str(marker)])
+            self.assert_(ret == 0, out)
+
+            at_marker = {}
+
+            for g, locs in graph_locations.items():
+                c = [c for s, e, c in locs if s <= marker < e]
+                self.assert_(len(c) == 1, "Graph %d is in %d locations at %d."
+                             % (g, len(c), marker))
+                at_marker.setdefault(c[0], set()).add(g)
+
+            self.assert_(set(frozenset(gs) for gs in at_marker.values()) == parseClasses(out),
+                         "Locations of %s differ from -m at %d." % (filename, marker))
+
+    def test25_Locations_01(self):
+        self.checkLocations(dataFile('test01.dglf1'))
+
+    def test25_Locations_02(self):
+        self.checkLocations(dataFile('test_dgl_1.dglf1'))
+
+    def test25_Locations_03(self):
+        self.checkLocations(dataFile('test_dgl_2.dglf1'))
+
+    def test26_Locations_Gzip(self):
+        # Streamed straight from the decompressor.
+        gz_file = self.gzipFile('test_dgl_2.gz', readFile(dataFile('test_dgl_2.dglf1')))
+        self.checkLocations(gz_file)
+
+    def test27_Locations_Dglb(self):
+        self.checkLocations(self.makeDglb('test_dgl_2.dglf1'))
+
+    ############################################################
+    # Sweep
+
+    def checkSweep(self, name):
+        ret, out = runIBDCompare(dataFile(name), ['-w'])
+        self.assert_(ret == 0, out)
+
+        steps = parseSweep(out)
+        self.assert_(len(steps) >= 2)
+
+        # The test files all start with every graph alike, in class 0.
+        self.assert_(steps[0][1] == 1 and steps[0][2] == [])
+
+        ret, out = runIBDCompare(dataFile(name), ['-m', str(steps[1][0] - 1)])
+        graph_ids = set().union(*parseClasses(out))
+        classes = dict( (g, 0) for g in graph_ids )
+
+        def members(c):
+            return frozenset(g for g, cl in classes.items() if cl == c)
+
+        for marker, n_classes, changes in steps[1:]:
+
+            self.assert_(len(changes) != 0, "Nothing changes at %d." % marker)
+            self.assert_([g for g, f, t in changes] == sorted(g for g, f, t in changes))
+
+            before = dict( (c, members(c)) for c in set(classes.values()) )
+
+            for g, f, t in changes:
+                self.assert_(classes[g] == f)
+                self.assert_(f != t)
+                classes[g] = t
+
+            # No class simply takes on a new index.
+            for g, f, t in changes:
+                self.assert_(members(t) != before[f],
+                             "Class %d is only relabeled %d at %d." % (f, t, marker))
+
+            ret, out = runIBDCompare(dataFile(name), ['-m', str(marker)])
+            true_classes = parseClasses(out)
+
+            self.assert_(len(set(classes.values())) == n_classes)
+            self.assert_(len(true_classes) == n_classes)
+            self.assert_(set(members(c) for c in set(classes.values())) == true_classes,
+                         "Classes differ from -m at %d." % marker)
+
+    def test20_Sweep_01(self):
+        self.checkSweep('test01.dglf1')
+
+    def test20_Sweep_02(self):
+        self.checkSweep('test_dgl_1.dglf1')
+
+    def test20_Sweep_03(self):
+        self.checkSweep('test_dgl_2.dglf1')
+
+
+if __name__ == '__main__':
+    unittest.main()
+
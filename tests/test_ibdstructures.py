@@ -3,7 +3,7 @@
 Tests the basics ibd routines.
 """
 
-import unittest
+import unittest, os, random, re, tempfile
 
 from common import *
 from ibdcreation import *    
@@ -624,6 +624,544 @@ class TestIBDComparisons(unittest.TestCase):
         #dl = parse_F1_file('tests/datafiles/test01.ibdf1')
         #displayDuplicationCount(dl)
 
+
+################################################################################
+# Equivalence classes, which builds with biased reference counting
+# work out on several threads.
+
+declare("ConstructIBDGraphList", c_void_p)
+declare("Igl_Add", None, c_void_p, c_void_p)
+declare("IBDGraphGetHashOfMarkerRange", c_void_p, c_void_p, c_long, c_long)
+declare("IBDGraphEquivalenceClassesAtMarker", c_void_p, c_void_p, c_long)
+declare("IBDGraphEquivalenceClassesOfMarkerRange", c_void_p, c_void_p, c_long, c_long)
+declare("IBDGraphEquivalenceClasses", c_void_p, c_void_p)
+declare("Igei_New", c_void_p, c_void_p)
+declare("Igei_Next", c_bool, POINTER(c_void_p), POINTER(c_size_t), c_void_p)
+declare("Igei_Finish", None, c_void_p)
+
+data_dir = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'datafiles')
+
+def equivalenceClasses(graphs, threads, *args):
+    """
+    Returns the classes, in order, as lists of indices into graphs;
+    args gives the marker, the marker range or nothing.
+    """
+    old_threads = os.environ.get('HASHREDUCE_THREADS')
+    os.environ['HASHREDUCE_THREADS'] = str(threads)
+
+    gl = ibd.ConstructIBDGraphList()
+
+    for g in graphs:
+        ibd.Igl_Add(gl, g)
+
+    try:
+        if len(args) == 1:
+            ige = ibd.IBDGraphEquivalenceClassesAtMarker(gl, args[0])
+        elif len(args) == 2:
+            ige = ibd.IBDGraphEquivalenceClassesOfMarkerRange(gl, args[0], args[1])
+        else:
+            ige = ibd.IBDGraphEquivalenceClasses(gl)
+    finally:
+        if old_threads is None:
+            del os.environ['HASHREDUCE_THREADS']
+        else:
+            os.environ['HASHREDUCE_THREADS'] = old_threads
+
+    index = dict( (g, i) for i, g in enumerate(graphs) )
+    classes = []
+
+    igei = ibd.Igei_New(ige)
+    g = c_void_p()
+    c = c_size_t()
+
+    while ibd.Igei_Next(byref(g), byref(c), igei):
+        if c.value == len(classes):
+            classes.append([])
+
+        classes[c.value].append(index[g.value])
+
+    ibd.Igei_Finish(igei)
+    decRef(ige, gl)
+
+    return classes
+
+def modelClasses(graphs, *args):
+    """
+    Groups the graphs by their hashes, worked out one at a time.
+    """
+    groups = {}
+
+    for i, g in enumerate(graphs):
+        if len(args) == 1:
+            h = getIBDHashAtMarker(g, args[0])
+        elif len(args) == 2:
+            hk = ibd.IBDGraphGetHashOfMarkerRange(g, args[0], args[1])
+            h = extractHash(hk)
+            decRef(hk)
+        else:
+            h = extractHash(ibd.IBDGraphViewHash(g))
+
+        groups.setdefault(h, set()).add(i)
+
+    return set(frozenset(c) for c in groups.values())
+
+class TestEquivalenceClasses(unittest.TestCase):
+
+    queries = [(m,) for m in range(-1, 6)] + [(0, 2), (1, 4), (3, 100), ()]
+
+    def loadGraphs(self, name = 'test_dgl_2.dglf1'):
+        return parse_F1_file(os.path.join(data_dir, name))
+
+    def changeGraphs(self, graphs):
+        # Adds an edge to every third graph, in one of a few ways, so
+        # they are left dirty.
+        for i, g in enumerate(graphs[::3]):
+            addToGraph(g, 7000 + (i % 2), 9 + (i % 3), [(10, 2 + (i % 4))])
+
+    def checkClasses(self, graphs, *args):
+        classes = equivalenceClasses(graphs, 1, *args)
+
+        self.assert_(sorted(sum(classes, [])) == range(len(graphs)))
+        self.assert_(set(frozenset(c) for c in classes) == modelClasses(graphs, *args),
+                     "Classes differ from the graphs' hashes for %s." % str(args))
+
+        for threads in [2, 3, 8, 16]:
+            self.assert_(equivalenceClasses(graphs, threads, *args) == classes,
+                         "Classes differ on %d threads for %s." % (threads, str(args)))
+
+    def test01_Threads(self):
+        for name in ['test01.dglf1', 'test_dgl_1.dglf1', 'test_dgl_2.dglf1']:
+            graphs = self.loadGraphs(name)
+
+            for args in self.queries:
+                self.checkClasses(graphs, *args)
+
+            delIBD(*graphs)
+
+    def test02_Threads_FewGraphs(self):
+        graphs = self.loadGraphs()[:5]
+
+        for n in range(1, 6):
+            for args in self.queries:
+                self.checkClasses(graphs[:n], *args)
+
+        delIBD(*graphs)
+
+    def test03_Threads_Dirty(self):
+        # The graphs changed since they were last hashed are refreshed
+        # on the threads that hash them; each set is changed the same
+        # way, then hashed first on a different number of threads.
+        for args in self.queries:
+
+            classes = None
+
+            for threads in [1, 2, 8]:
+                graphs = self.loadGraphs()
+
+                equivalenceClasses(graphs, threads, *args)
+                self.changeGraphs(graphs)
+
+                c = equivalenceClasses(graphs, threads, *args)
+                self.assert_(set(frozenset(cl) for cl in c) == modelClasses(graphs, *args),
+                             "Changed classes differ on %d threads for %s." % (threads, str(args)))
+
+                if classes is None:
+                    classes = c
+
+                self.assert_(c == classes)
+
+                delIBD(*graphs)
+
+################################################################################
+# Grouping by key: the classes come in the order of their keys, and
+# the graphs or locations in each in the order they were added.
+
+declare("NewEmptyIBDGraphLocationEquivalences", c_void_p)
+declare("IBDLocEq_AddLocation", None, c_void_p, c_void_p, c_long, c_long, c_long)
+declare("IBDLocEq_Finish", None, c_void_p)
+declare("IBDGraphLocationEquivalences_Print", None, c_void_p)
+
+libc = ctypes.CDLL(None)
+
+def printedOutput(fd, f, *args):
+    """
+    Returns what f writes to the file descriptor fd (1 for stdout, 2
+    for stderr).
+    """
+    sys.stdout.flush()
+    sys.stderr.flush()
+    libc.fflush(None)
+
+    out = tempfile.TemporaryFile()
+    saved_fd = os.dup(fd)
+    os.dup2(out.fileno(), fd)
+
+    try:
+        f(*args)
+        libc.fflush(None)
+    finally:
+        os.dup2(saved_fd, fd)
+        os.close(saved_fd)
+
+    out.seek(0)
+    d = out.read()
+    out.close()
+
+    return d
+
+def keyNumber(hi, lo):
+    # With 64 bit keys, only hi is kept.
+    return hi if hashkey_components == 2 else hi*(2**64) + lo
+
+def locationClasses(locations):
+    """
+    Groups (key number, graph id, start, end) locations through the
+    location equivalences, returning the classes as printed.
+    """
+    hk_list = [numberToHashKey(k) for k, g, s, e in locations]
+    keys = hashKeyArray(hk_list)
+    key_size = 4*hashkey_components
+
+    le = ibd.NewEmptyIBDGraphLocationEquivalences()
+
+    for i, (k, g, s, e) in enumerate(locations):
+        ibd.IBDLocEq_AddLocation(le, addressof(keys) + i*key_size, g, s, e)
+
+    ibd.IBDLocEq_Finish(le)
+
+    out = printedOutput(1, ibd.IBDGraphLocationEquivalences_Print, le)
+    decRef(le, *hk_list)
+
+    return [[tuple(int(x) for x in loc)
+             for loc in re.findall(r'\((\d+):(-?\d+)-(-?\d+)\)', l)]
+            for l in out.split('\n') if l.strip() != '']
+
+def modelLocationClasses(locations):
+    classes = {}
+
+    for k, g, s, e in locations:
+        classes.setdefault(k, []).append( (g, s, e) )
+
+    return [classes[k] for k in sorted(classes)]
+
+class TestGrouping(unittest.TestCase):
+
+    def checkLocations(self, key_numbers):
+        locations = [(k, i + 1, i, i + 1 + (i % 3)) for i, k in enumerate(key_numbers)]
+
+        self.assert_(locationClasses(locations) == modelLocationClasses(locations))
+
+    def randomKeys(self, n, n_distinct, hi_f, lo_f):
+        pool = [keyNumber(hi_f(), lo_f()) for i in range(n_distinct)]
+        return [random.choice(pool) for i in range(n)]
+
+    def test01_Locations_Random(self):
+        for n, n_distinct in [(1, 1), (2, 2), (10, 3), (500, 50), (2000, 1500)]:
+            self.checkLocations(self.randomKeys(n, n_distinct,
+                                                lambda: random.getrandbits(64),
+                                                lambda: random.getrandbits(64)))
+
+    def test02_Locations_SameLeadingBits(self):
+        # Only the lower half differs, so the order all comes down to
+        # comparing the keys in full.
+        hi = random.getrandbits(64)
+
+        for n, n_distinct in [(2, 2), (40, 10), (300, 300)]:
+            self.checkLocations(self.randomKeys(n, n_distinct, lambda: hi,
+                                                lambda: random.getrandbits(64)))
+
+    def test03_Locations_FewLeadingBits(self):
+        # Runs sharing the leading bits mixed with ones that don't.
+        his = [random.getrandbits(64) for i in range(4)]
+
+        self.checkLocations(self.randomKeys(1000, 200, lambda: random.choice(his),
+                                            lambda: random.getrandbits(64)))
+
+    def test04_Locations_OneByte(self):
+        # Keys differing in only one byte, so every other byte is the
+        # same throughout.
+        base = random.getrandbits(64)
+
+        for d in range(8):
+            self.checkLocations(self.randomKeys(
+                300, 40, lambda: base ^ (random.getrandbits(8) << (8*d)),
+                lambda: random.getrandbits(64)))
+
+    def test05_Locations_OneKey(self):
+        self.checkLocations([keyNumber(5, 7)]*100)
+
+    def test06_Locations_Empty(self):
+        self.assert_(locationClasses([]) == [])
+
+    def test07_Locations_Extremes(self):
+        top = 2**64 - 1
+        self.checkLocations([keyNumber(hi, lo) for hi in [0, 1, top] for lo in [0, 1, top]]*3)
+
+    def test08_Locations_Outliers(self):
+        # A byte the same in all the keys but one or two.
+        base = random.getrandbits(64)
+
+        for d in range(8):
+            for n_outliers in [1, 2]:
+                outliers = [keyNumber(base ^ (random.randint(1, 255) << (8*d)), 0)
+                            for i in range(n_outliers)]
+
+                for pos in [0, 10, 49]:
+                    keys = [keyNumber(base, 0)]*50
+                    keys[pos:pos] = outliers
+                    self.checkLocations(keys)
+
+    def test10_Graphs_KeyOrder(self):
+        for name in ['test01.dglf1', 'test_dgl_2.dglf1']:
+            graphs = parse_F1_file(os.path.join(data_dir, name))
+
+            for args in [(0,), (3,), (0, 2), ()]:
+                if len(args) == 1:
+                    keys = [getIBDHashAtMarker(g, args[0]) for g in graphs]
+                elif len(args) == 2:
+                    hk_list = [ibd.IBDGraphGetHashOfMarkerRange(g, *args) for g in graphs]
+                    keys = [extractHash(hk) for hk in hk_list]
+                    decRef(*hk_list)
+                else:
+                    keys = [extractHash(ibd.IBDGraphViewHash(g)) for g in graphs]
+
+                model = {}
+
+                for i, k in enumerate(keys):
+                    model.setdefault(int(k, 16), []).append(i)
+
+                self.assert_(equivalenceClasses(graphs, 1, *args)
+                             == [model[k] for k in sorted(model)])
+
+            delIBD(*graphs)
+
+
+################################################################################
+# A graph hashed as it is built is patched for the nodes changed since,
+# so should hash the same as one built whole and hashed once.
+
+def randomConnections(n_edges, n_nodes, max_marker):
+    """
+    Returns the IBDGraph_Connect calls, as (edge, node, start, end),
+    that addToGraph would make for random edges.
+    """
+    calls = []
+
+    for e in range(n_edges):
+        markers = sorted(random.sample(range(1, max_marker), random.randint(0, 3)))
+        bounds = [mr_graph_min] + markers + [mr_graph_max]
+
+        for start, end in zip(bounds[:-1], bounds[1:]):
+            calls.append( (100 + e, random.randint(1, n_nodes), start, end) )
+
+    return calls
+
+def connectAll(g, calls):
+    for e, n, start, end in calls:
+        ibd.IBDGraph_Connect(g, getEdge(g, e), getNode(g, n), start, end)
+
+def graphHashes(g):
+    hashes = [extractHash(ibd.IBDGraphViewHash(g))]
+    hashes += [getIBDHashAtMarker(g, m) for m in range(-1, 8)]
+
+    for start, end in [(0, 3), (2, 6)]:
+        hk = ibd.IBDGraphGetHashOfMarkerRange(g, start, end)
+        hashes.append(extractHash(hk))
+        decRef(hk)
+
+    return hashes
+
+class TestIncrementalHashing(unittest.TestCase):
+
+    def checkIncremental(self, calls, checkpoints):
+        g = newIBDGraph()
+        done = 0
+
+        for step in checkpoints:
+            connectAll(g, calls[done:step])
+            done = step
+
+            whole = newIBDGraph()
+            connectAll(whole, calls[:step])
+
+            self.assert_(graphHashes(g) == graphHashes(whole),
+                         "Hashes differ after %d of %d connections." % (step, len(calls)))
+
+            self.assert_(ibd.IBDGraphEqual(g, whole))
+
+            delIBD(whole)
+
+        delIBD(g)
+
+    def test01_EachConnection(self):
+        for i in range(20):
+            calls = randomConnections(6, 5, 7)
+            self.checkIncremental(calls, range(1, len(calls) + 1))
+
+    def test02_EachEdge(self):
+        for i in range(20):
+            calls = randomConnections(8, 6, 7)
+            ends = [j + 1 for j in range(len(calls))
+                    if j + 1 == len(calls) or calls[j+1][0] != calls[j][0]]
+            self.checkIncremental(calls, ends)
+
+    def test03_Shuffled(self):
+        # The connections in any order, so nodes already summarized are
+        # changed again and again.
+        for i in range(20):
+            calls = randomConnections(6, 3, 7)
+            random.shuffle(calls)
+            self.checkIncremental(calls, sorted(random.sample(range(1, len(calls) + 1),
+                                                              min(len(calls), 5))))
+
+    def test04_OneNode(self):
+        calls = randomConnections(10, 1, 7)
+        self.checkIncremental(calls, range(1, len(calls) + 1))
+
+    def test05_Large(self):
+        calls = randomConnections(60, 30, 7)
+        self.checkIncremental(calls, [len(calls) // 3, len(calls) // 2, len(calls)])
+
+
+################################################################################
+# Frozen graphs answer every query as they did before freezing, and
+# can't be changed.
+
+declare("IBDGraph_Freeze", None, c_void_p)
+declare("IBDGraphIsFrozen", c_bool, c_void_p)
+declare("IBDGraphContainsEdge", c_bool, c_void_p, c_void_p)
+declare("IBDGraphContainsNode", c_bool, c_void_p, c_void_p)
+declare("IBDGraphInvariantSet", c_void_p, c_void_p, c_long)
+
+class TestFreeze(unittest.TestCase):
+
+    markers = range(-1, 8)
+
+    def frozenPair(self, calls):
+        g = newIBDGraph()
+        connectAll(g, calls)
+
+        fg = newIBDGraph()
+        connectAll(fg, calls)
+        ibd.IBDGraph_Freeze(fg)
+
+        self.assert_(not ibd.IBDGraphIsFrozen(g))
+        self.assert_(ibd.IBDGraphIsFrozen(fg))
+
+        return g, fg
+
+    def checkSame(self, g, fg, n_nodes, n_edges):
+        self.assert_(graphHashes(fg) == graphHashes(g))
+        self.assert_(ibd.IBDGraphEqual(g, fg))
+
+        for m in self.markers:
+            self.assert_(ibd.IBDGraphEqualAtMarker(g, fg, m))
+            self.assert_(getInvariantRegion(fg, m) == getInvariantRegion(g, m))
+
+            mi, fmi = ibd.IBDGraphInvariantSet(g, m), ibd.IBDGraphInvariantSet(fg, m)
+            self.assert_(ibd.Mi_Equal(mi, fmi))
+            decRef(mi, fmi)
+
+        # Nodes and edges made in another graph have the same keys;
+        # a couple past the end are in neither.
+        other = newIBDGraph()
+
+        for i in range(1, n_nodes + 3):
+            n = getNode(other, i)
+            self.assert_(ibd.IBDGraphContainsNode(fg, n) == ibd.IBDGraphContainsNode(g, n))
+
+        for i in range(98, 100 + n_edges + 2):
+            e = getEdge(other, i)
+            self.assert_(ibd.IBDGraphContainsEdge(fg, e) == ibd.IBDGraphContainsEdge(g, e))
+
+        delIBD(other)
+
+    def test01_Queries(self):
+        for i in range(20):
+            calls = randomConnections(6, 5, 7)
+            g, fg = self.frozenPair(calls)
+            self.checkSame(g, fg, 5, 6)
+            delIBD(g, fg)
+
+    def test02_Queries_Large(self):
+        calls = randomConnections(60, 30, 7)
+        g, fg = self.frozenPair(calls)
+        self.checkSame(g, fg, 30, 60)
+        delIBD(g, fg)
+
+    def test03_Empty(self):
+        g, fg = self.frozenPair([])
+        self.checkSame(g, fg, 0, 0)
+        delIBD(g, fg)
+
+    def test04_AfterChanges(self):
+        # Hashed, then changed, then frozen without hashing again.
+        calls = randomConnections(8, 4, 7)
+        g, fg = self.frozenPair(calls)
+
+        cg = newIBDGraph()
+        connectAll(cg, calls[:len(calls) // 2])
+        graphHashes(cg)
+        connectAll(cg, calls[len(calls) // 2:])
+        ibd.IBDGraph_Freeze(cg)
+
+        self.checkSame(g, cg, 4, 8)
+        delIBD(g, fg, cg)
+
+    def test05_FreezeTwice(self):
+        calls = randomConnections(6, 5, 7)
+        g, fg = self.frozenPair(calls)
+
+        ibd.IBDGraph_Freeze(fg)
+
+        self.assert_(ibd.IBDGraphIsFrozen(fg))
+        self.checkSame(g, fg, 5, 6)
+        delIBD(g, fg)
+
+    def test06_NoChanges(self):
+        calls = randomConnections(6, 5, 7)
+        g, fg = self.frozenPair(calls)
+        hashes = graphHashes(fg)
+
+        for f, args in [(ibd.IBDGraphNodeByNumber, (fg, 1)),
+                        (ibd.IBDGraphNodeByName, (fg, "a")),
+                        (ibd.IBDGraphEdgeByNumber, (fg, 100)),
+                        (ibd.IBDGraphEdgeByName, (fg, "b"))]:
+
+            ret = []
+            err = printedOutput(2, lambda: ret.append(f(*args)))
+
+            self.assert_(ret == [None], "%s gave a node or edge." % f.__name__)
+            self.assert_('frozen' in err, err)
+
+        # Connecting nodes and edges from another graph does nothing.
+        other = newIBDGraph()
+        err = printedOutput(2, ibd.IBDGraph_Connect, fg, getEdge(other, 100),
+                            getNode(other, 1), 0, 3)
+
+        self.assert_('frozen' in err, err)
+        self.assert_(graphHashes(fg) == hashes)
+        self.checkSame(g, fg, 5, 6)
+
+        delIBD(g, fg, other)
+
+    def test07_Classes(self):
+        # Frozen graphs are only read in finding the classes, on any
+        # number of threads.
+        graphs = parse_F1_file(os.path.join(data_dir, 'test_dgl_2.dglf1'))
+        frozen = parse_F1_file(os.path.join(data_dir, 'test_dgl_2.dglf1'))
+
+        for g in frozen:
+            ibd.IBDGraph_Freeze(g)
+
+        for args in TestEquivalenceClasses.queries:
+            classes = equivalenceClasses(graphs, 1, *args)
+
+            for threads in [1, 3, 8]:
+                self.assert_(equivalenceClasses(frozen, threads, *args) == classes)
+
+        delIBD(*(graphs + frozen))
+
+
 if __name__ == '__main__':
     unittest.main()
-
@@ -1,5 +1,5 @@
 #!/usr/bin/env python
-import unittest, random
+import unittest, random, bisect
 
 from common import *
 from ctypes import *
@@ -43,6 +43,20 @@ Mi_Difference.restype = ctypes.c_void_p
 Mi_SymmetricDifference = ibd.Mi_SymmetricDifference
 Mi_SymmetricDifference.restype = ctypes.c_void_p
 
+declare("Mi_Intern", c_void_p, c_void_p)
+declare("Mi_Thaw", c_void_p, c_void_p)
+declare("Mi_IsInterned", c_bool, c_void_p)
+declare("Mi_InternedCount", c_size_t)
+declare("Mi_Compact", None, c_void_p)
+declare("Mi_IsBitmap", c_bool, c_void_p)
+declare("Mi_NumMarkerRanges", c_size_t, c_void_p)
+declare("Mi_AtIndex", POINTER(MarkerRange), c_void_p, c_size_t)
+declare("Mi_UnionMany", c_void_p, POINTER(c_void_p), c_size_t)
+declare("Mi_IntersectionMany", c_void_p, POINTER(c_void_p), c_size_t)
+
+Mi_Intern = ibd.Mi_Intern
+Mi_Thaw = ibd.Mi_Thaw
+
 ibd.Mr_Plus_Infinity.restype = ctypes.c_long
 ibd.Mr_Minus_Infinity.restype = ctypes.c_long
 
@@ -884,6 +898,600 @@ class TestMarkers(unittest.TestCase):
             checkSetOperation("symmetricDifference", *miSet_07_large( (-1000, 1000), i)) 
         
 
+# Sets made of many short ranges, which Mi_Compact keeps as bitmaps.
+
+def newFragmentedMi(ranges):
+    mi = newMi(*ranges[0])
+
+    for r1, r2 in ranges[1:]:
+        addMiRange(mi, r1, r2)
+
+    ibd.Mi_Compact(mi)
+
+    return mi
+
+def fragmentedRanges(n, step, width, offset = 0):
+    return [(offset + i*step, offset + i*step + width) for i in range(n)]
+
+def rangeSet(ranges):
+    return set(m for r1, r2 in ranges for m in range(r1, r2))
+
+def miSet_08_fragmented(offset):
+    return (newFragmentedMi(fragmentedRanges(100, 10, 3)),
+            newFragmentedMi(fragmentedRanges(100, 10, 4, offset)))
+
+def miSet_09_fragmented_and_plain(offset):
+    return (newFragmentedMi(fragmentedRanges(100, 10, 3)),
+            newMi(offset, offset + 250, offset + 400, offset + 900))
+
+fragmented_test_range = [mr_minus_inf] + range(-20, 1020) + [mr_plus_inf]
+
+class TestMarkerInfoBitmaps(unittest.TestCase):
+
+    def checkAgainst(self, mi, ranges):
+        s = rangeSet(ranges)
+        checkRanges(mi, s, set(fragmented_test_range) - s)
+
+    def test01_FragmentedIsBitmap(self):
+        ranges = fragmentedRanges(100, 10, 3)
+        mi = newFragmentedMi(ranges)
+
+        self.assert_(ibd.Mi_IsBitmap(mi))
+        self.assert_(ibd.Mi_NumMarkerRanges(mi) == 100)
+        self.checkAgainst(mi, ranges)
+        delMi(mi)
+
+    def test02_FewRangesStayRanges(self):
+        ranges = fragmentedRanges(5, 10, 3)
+        mi = newFragmentedMi(ranges)
+
+        self.assert_(not ibd.Mi_IsBitmap(mi))
+        self.checkAgainst(mi, ranges)
+        delMi(mi)
+
+    def test03_UnboundedStaysRanges(self):
+        ranges = fragmentedRanges(100, 10, 3) + [(2000, mr_plus_inf)]
+        mi = newFragmentedMi(ranges)
+
+        self.assert_(not ibd.Mi_IsBitmap(mi))
+        delMi(mi)
+
+    def test04_AcrossChunks(self):
+        # Short ranges either side of a wholly valid chunk, and ranges
+        # straddling the chunk boundaries.
+        ranges = (fragmentedRanges(150, 13, 5, 2000)
+                  + [(4090, 4100), (8192, 3*4096), (16380, 16390)]
+                  + fragmentedRanges(150, 13, 5, 13000))
+        mi = newFragmentedMi(ranges)
+
+        self.assert_(ibd.Mi_IsBitmap(mi))
+        self.assert_(ibd.Mi_NumMarkerRanges(mi) == len(ranges))
+
+        s = rangeSet(ranges)
+        test_range = range(1990, 16400)
+        checkRanges(mi, s, set(test_range) - s)
+        delMi(mi)
+
+    def test05_Iteration(self):
+        ranges = fragmentedRanges(100, 10, 3, -500)
+        mi = newFragmentedMi(ranges)
+        self.assert_(ibd.Mi_IsBitmap(mi))
+
+        mr = MarkerRange()
+
+        mii = newMii(mi)
+        found = []
+        while Mii_Next(byref(mr), mii):
+            found.append( (mr.start, mr.end) )
+        delMii(mii)
+
+        self.assert_(found == ranges)
+
+        miri = newMiri(mi)
+        found = []
+        while Miri_Next(byref(mr), miri):
+            found.append( (mr.start, mr.end) )
+        delMiri(miri)
+
+        self.assert_(found == ranges[::-1])
+        delMi(mi)
+
+    def test06_EqualToRangeForm(self):
+        ranges = fragmentedRanges(100, 10, 3)
+        mi_b = newFragmentedMi(ranges)
+
+        mi_r = newMi(*ranges[0])
+        for r1, r2 in ranges[1:]:
+            addMiRange(mi_r, r1, r2)
+
+        self.assert_(ibd.Mi_IsBitmap(mi_b))
+        self.assert_(not ibd.Mi_IsBitmap(mi_r))
+        self.assert_(ibd.Mi_Equal(mi_b, mi_r))
+        self.assert_(ibd.Mi_Equal(mi_r, mi_b))
+
+        mi_c = MiCopy(mi_b)
+        self.assert_(ibd.Mi_IsBitmap(mi_c))
+        self.assert_(ibd.Mi_Equal(mi_b, mi_c))
+
+        addMiRange(mi_r, 5, 6)
+        self.assert_(not ibd.Mi_Equal(mi_b, mi_r))
+
+        delMi(mi_b, mi_r, mi_c)
+
+    def test07_DifferenceBackToRanges(self):
+        ranges = fragmentedRanges(100, 10, 3)
+        mi = newFragmentedMi(ranges)
+        mi_s = newMi(0, 950)
+
+        mi_d = Mi_Difference(mi, mi_s)
+
+        self.assert_(not ibd.Mi_IsBitmap(mi_d))
+        self.assert_(ibd.Mi_NumMarkerRanges(mi_d) == 5)
+        self.checkAgainst(mi_d, ranges[95:])
+
+        delMi(mi, mi_s, mi_d)
+
+    def checkAtIndex(self, mi, ranges, order):
+        for i in order:
+            mr = ibd.Mi_AtIndex(mi, i).contents
+            self.assert_( (mr.start, mr.end) == ranges[i] )
+
+    def test08_AtIndex(self):
+        # In order, resuming from the last lookup, then going back,
+        # repeating and skipping about.
+        ranges = sorted(fragmentedRanges(150, 13, 5, 2000)
+                        + [(4090, 4100), (8192, 3*4096), (16380, 16390)]
+                        + fragmentedRanges(150, 13, 5, 13000))
+        mi = newFragmentedMi(ranges)
+        self.assert_(ibd.Mi_IsBitmap(mi))
+
+        n = len(ranges)
+        random.seed(0)
+
+        self.checkAtIndex(mi, ranges, range(n))
+        self.checkAtIndex(mi, ranges, range(n)[::-1])
+        self.checkAtIndex(mi, ranges, [5, 5, 6, 6, 0, n-1, n-1, 3])
+        self.checkAtIndex(mi, ranges, [random.randrange(n) for i in range(500)])
+
+        delMi(mi)
+
+    def test09_AtIndex_Interleaved(self):
+        ranges_1 = fragmentedRanges(100, 10, 3)
+        ranges_2 = fragmentedRanges(100, 10, 4, 5)
+
+        mi_1 = newFragmentedMi(ranges_1)
+        mi_2 = newFragmentedMi(ranges_2)
+
+        for i in range(100):
+            self.checkAtIndex(mi_1, ranges_1, [i])
+            self.checkAtIndex(mi_2, ranges_2, [i])
+
+        # A new bitmap may be put where an old one was.
+        for k in range(20):
+            mi_3 = newFragmentedMi(ranges_2)
+            self.checkAtIndex(mi_3, ranges_2, [0, 1, 2])
+            delMi(mi_3)
+
+            mi_3 = newFragmentedMi(ranges_1)
+            self.checkAtIndex(mi_3, ranges_1, [3, 4])
+            delMi(mi_3)
+
+        delMi(mi_1, mi_2)
+
+    def test10_Union_Bitmaps(self):
+        for offset in [0, 1, 3, 5, 1000]:
+            checkSetOperation("union", *miSet_08_fragmented(offset), 
+                              test_range = fragmented_test_range)
+
+    def test10_Intersection_Bitmaps(self):
+        for offset in [0, 1, 3, 5, 1000]:
+            checkSetOperation("intersection", *miSet_08_fragmented(offset),
+                              test_range = fragmented_test_range)
+
+    def test10_Difference_Bitmaps(self):
+        for offset in [0, 1, 3, 5, 1000]:
+            checkSetOperation("difference", *miSet_08_fragmented(offset),
+                              test_range = fragmented_test_range)
+
+    def test10_SymmetricDifference_Bitmaps(self):
+        for offset in [0, 1, 3, 5, 1000]:
+            checkSetOperation("symmetricDifference", *miSet_08_fragmented(offset),
+                              test_range = fragmented_test_range)
+
+    def test11_Union_Mixed(self):
+        for offset in [-50, 0, 7, 600]:
+            checkSetOperation("union", *miSet_09_fragmented_and_plain(offset),
+                              test_range = fragmented_test_range)
+
+    def test11_Intersection_Mixed(self):
+        for offset in [-50, 0, 7, 600]:
+            checkSetOperation("intersection", *miSet_09_fragmented_and_plain(offset),
+                              test_range = fragmented_test_range)
+
+    def test11_Difference_Mixed(self):
+        for offset in [-50, 0, 7, 600]:
+            checkSetOperation("difference", *miSet_09_fragmented_and_plain(offset),
+                              test_range = fragmented_test_range)
+
+    def test11_Difference_Mixed_Reversed(self):
+        for offset in [-50, 0, 7, 600]:
+            mi1, mi2 = miSet_09_fragmented_and_plain(offset)
+            checkSetOperation("difference", mi2, mi1,
+                              test_range = fragmented_test_range)
+
+
+# A plain model of validity sets: sorted, disjoint, non-adjacent lists
+# of [start, end) ranges.
+
+def modelNormalize(ranges):
+    result = []
+
+    for r1, r2 in sorted(r for r in ranges if r[0] < r[1]):
+        if result and r1 <= result[-1][1]:
+            result[-1] = (result[-1][0], max(result[-1][1], r2))
+        else:
+            result.append( (r1, r2) )
+
+    return result
+
+def modelOperation(operation, ranges_1, ranges_2):
+    inside = {"union"               : lambda a, b: a or b,
+              "intersection"        : lambda a, b: a and b,
+              "difference"          : lambda a, b: a and not b,
+              "symmetricDifference" : lambda a, b: a != b}[operation]
+
+    def contains(ranges, m):
+        i = bisect.bisect_right(ranges, (m, mr_plus_inf)) - 1
+        return i >= 0 and m < ranges[i][1]
+
+    points = sorted(set(m for r in ranges_1 + ranges_2 for m in r))
+
+    return modelNormalize([(a, b) for a, b in zip(points, points[1:])
+                           if inside(contains(ranges_1, a), contains(ranges_2, a))])
+
+def miRanges(mi):
+    mr = MarkerRange()
+    mii = newMii(mi)
+    found = []
+
+    while Mii_Next(byref(mr), mii):
+        found.append( (mr.start, mr.end) )
+
+    delMii(mii)
+
+    return found
+
+def newRangeFormMi(ranges):
+    if not ranges:
+        return newMi(0, 0)
+
+    mi = newMi(*ranges[0])
+
+    for r1, r2 in ranges[1:]:
+        addMiRange(mi, r1, r2)
+
+    return mi
+
+def randomRanges(n, lo, hi, max_width):
+    ranges = []
+
+    for i in range(n):
+        r1 = random.randint(lo, hi)
+        ranges.append( (r1, r1 + random.randint(1, max_width)) )
+
+    return ranges
+
+set_operations = {"union"               : Mi_Union,
+                  "intersection"        : Mi_Intersection,
+                  "difference"          : Mi_Difference,
+                  "symmetricDifference" : Mi_SymmetricDifference}
+
+class TestMarkerInfoSetModel(unittest.TestCase):
+
+    def checkOperations(self, ranges_1, ranges_2, bitmap_1 = False, bitmap_2 = False):
+        make_1 = newFragmentedMi if bitmap_1 else newRangeFormMi
+        make_2 = newFragmentedMi if bitmap_2 else newRangeFormMi
+
+        mi_1 = make_1(ranges_1)
+        mi_2 = make_2(ranges_2)
+
+        self.assert_(not bitmap_1 or ibd.Mi_IsBitmap(mi_1))
+        self.assert_(not bitmap_2 or ibd.Mi_IsBitmap(mi_2))
+
+        model_1 = modelNormalize(ranges_1)
+        model_2 = modelNormalize(ranges_2)
+
+        self.assert_(miRanges(mi_1) == model_1)
+        self.assert_(miRanges(mi_2) == model_2)
+
+        for operation, mi_f in set_operations.iteritems():
+            mi_r = mi_f(mi_1, mi_2)
+
+            self.assert_(miRanges(mi_r) == modelOperation(operation, model_1, model_2),
+                         "%s differs from the model." % operation)
+            delMi(mi_r)
+
+        delMi(mi_1, mi_2)
+
+    def checkBothWays(self, ranges_1, ranges_2, bitmap_1 = False, bitmap_2 = False):
+        self.checkOperations(ranges_1, ranges_2, bitmap_1, bitmap_2)
+        self.checkOperations(ranges_2, ranges_1, bitmap_2, bitmap_1)
+
+    def test01_Random_Ranges(self):
+        random.seed(0)
+
+        for n_1, n_2 in [(1, 1), (3, 5), (20, 30), (100, 80)]:
+            self.checkBothWays(randomRanges(n_1, -200, 200, 20),
+                               randomRanges(n_2, -200, 200, 20))
+
+    def test02_Skewed(self):
+        # Many times as many ranges in one set as the other, for which
+        # the short set's ranges are galloped to in the long one.
+        random.seed(1)
+        long_ranges = fragmentedRanges(800, 10, 4)
+
+        for n in [1, 2, 5, 20, 45]:
+            self.checkBothWays(long_ranges, randomRanges(n, -100, 8100, 50))
+
+    def test03_Skewed_Edges(self):
+        # Short ranges touching, straddling and covering the long ones,
+        # and lying before or after all of them.
+        long_ranges = fragmentedRanges(400, 10, 4)
+
+        for short in [[(-50, -10)], [(4000, 4500)], [(-50, 0)], [(3994, 4100)],
+                      [(0, 4)], [(4, 10)], [(3, 11)], [(4, 5)], [(5, 6)],
+                      [(-10, 5000)], [(5, 2005)], [(1000, 1004), (2004, 2010)],
+                      [(mr_minus_inf, 15)], [(3985, mr_plus_inf)],
+                      [(mr_minus_inf, 100), (200, 300), (3000, mr_plus_inf)]]:
+            self.checkBothWays(long_ranges, short)
+
+    def test04_Skewed_Random(self):
+        random.seed(2)
+
+        for trial in range(20):
+            long_ranges = randomRanges(random.randint(200, 600), 0, 20000, 15)
+            short_ranges = randomRanges(random.randint(1, 10), -500, 20500, 400)
+            self.checkBothWays(long_ranges, short_ranges)
+
+    def test05_Bitmaps(self):
+        random.seed(3)
+
+        for trial in range(10):
+            ranges_1 = randomRanges(300, 0, 20000, 8)
+            ranges_2 = randomRanges(random.choice([400, 600, 1000]), -100, 20100, 12)
+            self.checkBothWays(ranges_1, ranges_2, True, True)
+
+    def test06_Bitmap_And_Ranges(self):
+        random.seed(4)
+        bitmap_ranges = fragmentedRanges(400, 10, 4)
+
+        for short in [[(-50, -10)], [(5, 2005)], [(3, 11), (500, 503)],
+                      [(mr_minus_inf, 15)], [(3985, mr_plus_inf)],
+                      randomRanges(10, -100, 4100, 30),
+                      randomRanges(300, -100, 4100, 6)]:
+            self.checkBothWays(bitmap_ranges, short, True, False)
+
+    def checkMany(self, range_lists, forms = None):
+        if forms is None:
+            forms = [random.random() < 0.5 for rl in range_lists]
+
+        mis = [(newFragmentedMi if bitmap else newRangeFormMi)(rl)
+               for rl, bitmap in zip(range_lists, forms)]
+        models = [modelNormalize(rl) for rl in range_lists]
+
+        array = (c_void_p * max(1, len(mis)))(*mis)
+
+        for operation, mi_f in [("union", ibd.Mi_UnionMany),
+                                ("intersection", ibd.Mi_IntersectionMany)]:
+            model = reduce(lambda a, b: modelOperation(operation, a, b), models)
+            mi_r = mi_f(array, len(mis))
+
+            self.assert_(miRanges(mi_r) == model, "%s differs from the model." % operation)
+            delMi(mi_r)
+
+        delMi(*mis)
+
+    def test07_Many_Random(self):
+        random.seed(5)
+
+        for k in [3, 4, 5, 8, 16]:
+            for trial in range(4):
+                self.checkMany([randomRanges(random.randint(1, 100), -300, 3000, 40)
+                                for i in range(k)])
+
+    def test08_Many_Skewed(self):
+        random.seed(6)
+
+        for k in [3, 6]:
+            self.checkMany([fragmentedRanges(500, 10, 6)]
+                           + [randomRanges(random.randint(1, 5), -100, 5100, 300)
+                              for i in range(k - 1)])
+
+    def test09_Many_Bitmaps(self):
+        random.seed(7)
+
+        for k in [3, 5]:
+            self.checkMany([fragmentedRanges(300, 9, 5, i) for i in range(k)],
+                           [True] * k)
+
+            self.checkMany([randomRanges(500, 0, 10000, 12) for i in range(k)],
+                           [True] * k)
+
+    def test10_Many_Nested(self):
+        # Each set inside the one before.
+        self.checkMany([[(-100*i, 1000 - 100*i)] for i in range(1, 6)][::-1])
+        self.checkMany([[(mr_minus_inf, 50 + i)] for i in range(5)])
+        self.checkMany([[(i, mr_plus_inf)] for i in range(5)])
+
+    def test11_Many_Edges(self):
+        random.seed(8)
+        ranges = [randomRanges(20, 0, 1000, 30) for i in range(4)]
+
+        # With an empty set, the intersection is empty.
+        self.checkMany(ranges + [[]], [False] * 5)
+
+        # One or two sets.
+        self.checkMany(ranges[:1])
+        self.checkMany(ranges[:2])
+
+        # Sets that meet end to start but don't overlap.
+        self.checkMany([[(0, 10)], [(10, 20)], [(20, 30)]])
+        self.checkMany([[(0, 10), (20, 30)], [(5, 25)], [(9, 21)]])
+
+    def test12_Many_Null(self):
+        # A NULL set is valid everywhere.
+        mis = [newMi(0, 10), newMi(5, 20), newMi(7, 8, 9, 30)]
+        null = (c_void_p * 4)(mis[0], None, mis[1], mis[2])
+
+        self.assert_(ibd.Mi_UnionMany(null, 4) is None)
+
+        mi_r = ibd.Mi_IntersectionMany(null, 4)
+        self.assert_(miRanges(mi_r) == [(7, 8), (9, 10)])
+        delMi(mi_r)
+
+        mi_r = ibd.Mi_IntersectionMany((c_void_p * 2)(None, None), 2)
+        self.assert_(miRanges(mi_r) == [(mr_minus_inf, mr_plus_inf)])
+        delMi(mi_r)
+
+        delMi(*mis)
+
+declare("Mi_IsValidBatch", None, c_void_p, POINTER(c_long), c_size_t, c_void_p)
+
+bitfield_bits = 8*sizeof(c_ulong)
+
+class TestMarkerInfoBatch(unittest.TestCase):
+
+    def checkBatch(self, mi, markers):
+        n = len(markers)
+        out = (c_ulong * max(1, (n + bitfield_bits - 1) // bitfield_bits))()
+
+        ibd.Mi_IsValidBatch(mi, (c_long * max(1, n))(*markers), n, out)
+
+        found = [bool((out[i // bitfield_bits] >> (i % bitfield_bits)) & 1)
+                 for i in range(n)]
+
+        self.assert_(found == [bool(isValid(mi, c_long(m))) for m in markers])
+
+    def checkSortedAndNot(self, mi, lo, hi):
+        random.seed(lo + hi)
+
+        for n in [0, 1, 63, 64, 65, 500]:
+            markers = [random.randint(lo, hi) for i in range(n)]
+            self.checkBatch(mi, sorted(markers))
+            self.checkBatch(mi, markers)
+
+        # Repeats, and a run that goes back partway.
+        self.checkBatch(mi, [lo, lo, lo + 1, hi, hi])
+        self.checkBatch(mi, range(lo, hi, 7) + range(lo + 3, hi, 11))
+
+    def test01_Ranges(self):
+        mi = newRangeFormMi(randomRanges(50, -500, 500, 20))
+        self.checkSortedAndNot(mi, -520, 520)
+        delMi(mi)
+
+    def test02_Bitmap(self):
+        mi = newFragmentedMi(fragmentedRanges(300, 13, 5, -1000))
+        self.assert_(ibd.Mi_IsBitmap(mi))
+        self.checkSortedAndNot(mi, -1100, 3000)
+        delMi(mi)
+
+    def test03_Unbounded(self):
+        mi = newMi(mr_minus_inf, -10, 0, 10, 20, mr_plus_inf)
+        self.checkSortedAndNot(mi, -30, 30)
+        self.checkBatch(mi, [mr_minus_inf, -10, 10, mr_plus_inf])
+        delMi(mi)
+
+    def test04_Empty(self):
+        mi = newMi(0, 0)
+        self.checkSortedAndNot(mi, -10, 10)
+        delMi(mi)
+
+class TestMarkerInfoInterning(unittest.TestCase):
+
+    def test01_SameSetsShared(self):
+        n = ibd.Mi_InternedCount()
+
+        mi1 = Mi_Intern(newMi(2, 5, 8, 12))
+        mi2 = Mi_Intern(newMi(2, 5, 8, 12))
+
+        self.assert_(mi1 == mi2)
+        self.assert_(ibd.Mi_IsInterned(mi1))
+        self.assert_(ibd.Mi_InternedCount() == n + 1)
+        self.assert_(ibd.O_RefCount(mi1) == 2)
+
+        delMi(mi1, mi2)
+        self.assert_(ibd.Mi_InternedCount() == n)
+
+    def test02_DifferentSetsNotShared(self):
+        n = ibd.Mi_InternedCount()
+
+        mi1 = Mi_Intern(newMi(2, 5))
+        mi2 = Mi_Intern(newMi(2, 6))
+
+        self.assert_(mi1 != mi2)
+        self.assert_(not ibd.Mi_Equal(mi1, mi2))
+        self.assert_(ibd.Mi_InternedCount() == n + 2)
+
+        delMi(mi1, mi2)
+        self.assert_(ibd.Mi_InternedCount() == n)
+
+    def test03_ThawShared(self):
+        mi1 = Mi_Intern(newMi(2, 5))
+        mi2 = Mi_Intern(newMi(2, 5))
+        self.assert_(mi1 == mi2)
+
+        mi_t = Mi_Thaw(mi2)
+
+        self.assert_(mi_t != mi1)
+        self.assert_(not ibd.Mi_IsInterned(mi_t))
+        self.assert_(ibd.Mi_IsInterned(mi1))
+        self.assert_(ibd.Mi_Equal(mi_t, mi1))
+
+        addMiRange(mi_t, 10, 20)
+
+        self.assert_(not ibd.Mi_Equal(mi_t, mi1))
+        checkRanges(mi1, [2,3,4], [1,5,10,15])
+        checkRanges(mi_t, [2,3,4,10,15], [1,5,20])
+
+        delMi(mi1, mi_t)
+
+    def test04_ThawUnshared(self):
+        n = ibd.Mi_InternedCount()
+
+        mi = Mi_Intern(newMi(2, 5))
+        mi_t = Mi_Thaw(mi)
+
+        self.assert_(mi_t == mi)
+        self.assert_(not ibd.Mi_IsInterned(mi_t))
+        self.assert_(ibd.Mi_InternedCount() == n)
+
+        addMiRange(mi_t, 10, 20)
+        checkRanges(mi_t, [2,3,4,10,15], [1,5,20])
+
+        delMi(mi_t)
+
+    def test05_ReinternAfterRelease(self):
+        mi1 = Mi_Intern(newMi(3, 7))
+        delMi(mi1)
+
+        mi2 = Mi_Intern(newMi(3, 7))
+        self.assert_(ibd.Mi_IsInterned(mi2))
+        checkRanges(mi2, [3,4,5,6], [2,7])
+        delMi(mi2)
+    def test06_BitmapsShared(self):
+        ranges = fragmentedRanges(100, 10, 3)
+
+        mi1 = Mi_Intern(newFragmentedMi(ranges))
+        mi2 = Mi_Intern(newFragmentedMi(ranges))
+
+        self.assert_(ibd.Mi_IsBitmap(mi1))
+        self.assert_(mi1 == mi2)
+
+        s = rangeSet(ranges)
+        checkRanges(mi1, s, set(fragmented_test_range) - s)
+
+        delMi(mi1, mi2)
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -0,0 +1,530 @@
+#!/usr/bin/env python
+import unittest, threading, random, time
+from common import *
+from ibdcreation import *
+
+declare("O_MergeRefCounts", None)
+declare("Arena_Begin", c_void_p)
+declare("Arena_Release", None, c_void_p)
+declare("O_BiasNewObjects", None, c_bool)
+declare("O_SetDeferredDestruction", None, c_bool)
+declare("O_DestroyDeferred", c_size_t, c_size_t)
+declare("O_StartDestructionThread", None)
+declare("O_StopDestructionThread", None)
+
+# The reference counting across threads is only built in with
+# ENABLE_BIASED_REFCOUNT.
+biased_refcount = hasattr(ibd, 'O_MergeRefCounts')
+
+# Likewise the per thread memory pools with ENABLE_THREADS, and the
+# deferred destruction queue with ENABLE_DEFERRED_FREE.
+thread_pools = hasattr(ibd, '_mp_orphans_HashTable')
+deferred_free = hasattr(ibd, 'O_DestroyDeferred')
+
+def inThread(f, *args):
+    # Runs f in a thread of its own, which has exited on return.
+    result = []
+    t = threading.Thread(target = lambda: result.append(f(*args)))
+    t.start()
+    t.join()
+    return result[0]
+
+def inThreads(n, f, *args):
+    threads = [threading.Thread(target = f, args = args) for i in range(n)]
+
+    for t in threads:
+        t.start()
+
+    for t in threads:
+        t.join()
+
+def incDecRef(obj, n):
+    for i in range(n):
+        ibd.O_IncRef(obj)
+        ibd.O_DecRef(obj)
+
+def decIncRef(obj):
+    ibd.O_DecRef(obj)
+    ibd.O_IncRef(obj)
+
+def checkFreshTables(self, n):
+    # A block freed twice is handed out twice by its pool.
+    tables = [ibd.NewHashTable() for i in range(n)]
+
+    self.assert_(len(set(tables)) == n)
+
+    for ht in tables:
+        self.assert_(ibd.O_RefCount(ht) == 1)
+
+    decRef(*tables)
+
+class TestBiasedRefCount(unittest.TestCase):
+
+    def setUp(self):
+        if not biased_refcount:
+            self.skipTest("Built without ENABLE_BIASED_REFCOUNT.")
+
+    def test01_OwnerOnly(self):
+        ht = ibd.NewHashTable()
+        ibd.O_IncRef(ht)
+        self.assert_(ibd.O_RefCount(ht) == 2)
+        ibd.O_DecRef(ht)
+        self.assert_(ibd.O_RefCount(ht) == 1)
+        ibd.O_DecRef(ht)
+
+        checkFreshTables(self, 8)
+
+    def test02_SharedIncDec(self):
+        ht = ibd.NewHashTable()
+
+        inThread(ibd.O_IncRef, ht)
+        self.assert_(ibd.O_RefCount(ht) == 2)
+
+        inThread(ibd.O_DecRef, ht)
+        self.assert_(ibd.O_RefCount(ht) == 1)
+
+        ibd.O_DecRef(ht)
+        checkFreshTables(self, 8)
+
+    def test03_ReleasedByOtherThread(self):
+        ht = ibd.NewHashTable()
+
+        ibd.O_IncRef(ht)
+        ibd.O_DecRef(ht)
+
+        # The last reference goes from another thread, so the object
+        # waits in this thread's queue until the counts are merged.
+        inThread(ibd.O_DecRef, ht)
+        ibd.O_MergeRefCounts()
+
+        checkFreshTables(self, 8)
+
+    def test04_OwnerReleasesLast(self):
+        ht = ibd.NewHashTable()
+        inThread(ibd.O_IncRef, ht)
+
+        ibd.O_DecRef(ht)
+        self.assert_(ibd.O_RefCount(ht) == 1)
+
+        inThread(ibd.O_DecRef, ht)
+        checkFreshTables(self, 8)
+
+    def test05_QueuedThenOwnerReachesZero(self):
+        # The other thread's decrement queues the table with its owner,
+        # and its increment leaves it referenced.  Merging the queue
+        # when the owner's count hits zero frees the table; it must
+        # not then be looked at, nor freed a second time.
+        ht = ibd.NewHashTable()
+        ibd.O_IncRef(ht)
+
+        inThread(decIncRef, ht)
+
+        ibd.O_DecRef(ht)
+        ibd.O_DecRef(ht)
+
+        checkFreshTables(self, 8)
+
+    def test06_QueuedStillReferenced(self):
+        ht = ibd.NewHashTable()
+        ibd.O_IncRef(ht)
+        ibd.O_IncRef(ht)
+
+        inThread(decIncRef, ht)
+
+        ibd.O_DecRef(ht)
+        ibd.O_DecRef(ht)
+
+        ibd.O_MergeRefCounts()
+        self.assert_(ibd.O_RefCount(ht) == 1)
+
+        ibd.O_DecRef(ht)
+        checkFreshTables(self, 8)
+
+    def test07_ManyThreads(self):
+        ht = ibd.NewHashTable()
+
+        inThreads(8, incDecRef, ht, 2000)
+        ibd.O_MergeRefCounts()
+
+        self.assert_(ibd.O_RefCount(ht) == 1)
+        ibd.O_DecRef(ht)
+
+        checkFreshTables(self, 8)
+
+    def test08_ManyThreads_OwnerToo(self):
+        ht = ibd.NewHashTable()
+
+        for i in range(16):
+            ibd.O_IncRef(ht)
+
+        threads = [threading.Thread(target = incDecRef, args = (ht, 2000))
+                   for i in range(8)]
+
+        for t in threads:
+            t.start()
+
+        incDecRef(ht, 2000)
+
+        for t in threads:
+            t.join()
+
+        ibd.O_MergeRefCounts()
+        self.assert_(ibd.O_RefCount(ht) == 17)
+
+        for i in range(17):
+            ibd.O_DecRef(ht)
+
+        checkFreshTables(self, 8)
+
+def randomConnections(n_nodes, n_edges, n_changes, seed):
+    random.seed(seed)
+
+    def connection(e):
+        changes = sorted(random.sample(range(1, 1000), n_changes))
+        nodes = [random.randrange(n_nodes) for c in changes]
+        return (e, random.randrange(n_nodes), zip(nodes, changes))
+
+    return [connection(e) for e in range(n_edges)]
+
+class TestArenas(unittest.TestCase):
+
+    def checkGraphInArena(self, connections):
+        g = createIBDGraph(connections)
+        h = [getIBDHashAtMarker(g, m) for m in range(0, 1000, 50)]
+        delIBD(g)
+
+        a = ibd.Arena_Begin()
+        g = createIBDGraph(connections)
+
+        self.assert_([getIBDHashAtMarker(g, m) for m in range(0, 1000, 50)] == h)
+
+        # Released with the arena; its tables and their nodes and
+        # edges may be destroyed in any order.
+        ibd.Arena_Release(a)
+
+        checkFreshTables(self, 8)
+
+    def test01_Graph(self):
+        self.checkGraphInArena(randomConnections(4, 4, 2, 0))
+
+    def test02_Graph_ManyChunks(self):
+        self.checkGraphInArena(randomConnections(50, 500, 10, 1))
+
+    def test03_ManyGraphs(self):
+        # Across several chunks, some graph has its tables in the next
+        # one.
+        a = ibd.Arena_Begin()
+
+        for i in range(5000):
+            addToGraph(newIBDGraph(), 0, 0, [(1, 500)])
+
+        ibd.Arena_Release(a)
+
+        checkFreshTables(self, 8)
+
+    def test04_DroppedInside(self):
+        connections = randomConnections(10, 20, 4, 2)
+
+        a = ibd.Arena_Begin()
+
+        g = createIBDGraph(connections)
+        delIBD(g)
+
+        g = createIBDGraph(connections)
+        ibd.Arena_Release(a)
+
+        checkFreshTables(self, 8)
+
+    def test05_Nested(self):
+        connections = randomConnections(10, 20, 4, 3)
+
+        a = ibd.Arena_Begin()
+        g1 = createIBDGraph(connections)
+
+        # Worked out here, as the graph keeps it; made inside the inner
+        # arena, it would be gone with that.
+        h = extractHash(ibd.IBDGraphViewHash(g1))
+
+        b = ibd.Arena_Begin()
+        g2 = createIBDGraph(connections)
+        self.assert_(extractHash(ibd.IBDGraphViewHash(g2)) == h)
+        ibd.Arena_Release(b)
+
+        ibd.Arena_Release(a)
+        checkFreshTables(self, 8)
+
+def newTables(n):
+    # Made to be released from other threads, so unbiased when counts
+    # are biased.
+    if not biased_refcount:
+        return [ibd.NewHashTable() for i in range(n)]
+
+    ibd.O_BiasNewObjects(False)
+    tables = [ibd.NewHashTable() for i in range(n)]
+    ibd.O_BiasNewObjects(True)
+
+    return tables
+
+def splitAnchored(tables):
+    # Every page keeps a live item, so none is handed back to the
+    # system once the others are freed.
+    return tables[::50], [ht for i, ht in enumerate(tables) if i % 50 != 0]
+
+def refillOf(freed):
+    # The pool first finishes the page it is on, at most a page of
+    # other items.
+    return newTables(len(freed) + 64)
+
+def checkRefilled(self, freed, refill):
+    # Bar those the maker put in the page it started on, which may lie
+    # past free slots the refill takes first.
+    self.assert_(len(set(freed) - set(refill)) <= 64)
+
+class TestThreadPools(unittest.TestCase):
+
+    def setUp(self):
+        if not thread_pools:
+            self.skipTest("Built without ENABLE_THREADS.")
+
+    def test01_FreedOnOtherThread(self):
+        # Freed here into the running thread's pool, which it takes back
+        # once its current page is full.
+        made = threading.Event()
+        freed = threading.Event()
+        result = []
+
+        def run():
+            result.append(splitAnchored(newTables(2000)))
+            made.set()
+            freed.wait()
+            result.append(refillOf(result[0][1]))
+
+        t = threading.Thread(target = run)
+        t.start()
+        made.wait()
+        decRef(*result[0][1])
+        freed.set()
+        t.join()
+
+        anchors, freed = result[0]
+        checkRefilled(self, freed, result[1])
+        decRef(*(anchors + result[1]))
+
+        checkFreshTables(self, 8)
+
+    def test02_FreedOnManyThreads(self):
+        anchors, tables = splitAnchored(newTables(8000))
+
+        parts = [tables[k::8] for k in range(8)]
+
+        inThreads(8, lambda: decRef(*parts.pop()))
+
+        refill = refillOf(tables)
+        checkRefilled(self, tables, refill)
+        decRef(*(anchors + refill))
+
+        checkFreshTables(self, 8)
+
+    def test03_PoolOfExitedThread(self):
+        # The second thread takes over the pool the first left, with
+        # the items freed into it here in the meantime.
+        anchors, tables = splitAnchored(inThread(newTables, 2000))
+        decRef(*tables)
+
+        # The pool is handed on as the thread exits, just after join
+        # returns.
+        time.sleep(0.1)
+
+        refill = inThread(refillOf, tables)
+        checkRefilled(self, tables, refill)
+        decRef(*(anchors + refill))
+
+        checkFreshTables(self, 8)
+
+    def test04_ManyThreads(self):
+        def churn(n):
+            for i in range(10):
+                tables = newTables(n)
+                checkFreshTables(self, 8)
+                decRef(*tables)
+
+        inThreads(8, churn, 500)
+        checkFreshTables(self, 8)
+
+def tablesWithKeys(n):
+    tables = [ibd.NewHashTable() for i in range(n)]
+
+    for i, ht in enumerate(tables):
+        ibd.Ht_Give(ht, makeHashKey(i))
+
+    return tables
+
+class TestDeferredDestruction(unittest.TestCase):
+
+    def setUp(self):
+        if not deferred_free:
+            self.skipTest("Built without ENABLE_DEFERRED_FREE.")
+
+    def tearDown(self):
+        if deferred_free:
+            ibd.O_SetDeferredDestruction(False)
+            ibd.O_DestroyDeferred(0)
+
+    def test01_Queued(self):
+        ibd.O_SetDeferredDestruction(True)
+
+        tables = [ibd.NewHashTable() for i in range(100)]
+        decRef(*tables)
+
+        # Still held by the queue, so not handed out again.
+        others = [ibd.NewHashTable() for i in range(100)]
+        self.assert_(not (set(tables) & set(others)))
+        decRef(*others)
+
+        self.assert_(ibd.O_DestroyDeferred(0) == 200)
+        self.assert_(ibd.O_DestroyDeferred(0) == 0)
+
+        ibd.O_SetDeferredDestruction(False)
+        checkFreshTables(self, 8)
+
+    def test02_Batches(self):
+        # The keys a table releases are queued in turn, after the
+        # tables ahead of them.
+        ibd.O_SetDeferredDestruction(True)
+
+        decRef(*tablesWithKeys(100))
+
+        counts = []
+
+        while True:
+            n = ibd.O_DestroyDeferred(15)
+            self.assert_(n <= 15)
+
+            if n == 0:
+                break
+
+            counts.append(n)
+
+        self.assert_(sum(counts) == 200)
+        self.assert_(counts[:-1] == [15] * (len(counts) - 1))
+
+        ibd.O_SetDeferredDestruction(False)
+        checkFreshTables(self, 8)
+
+    def test03_NotDeferring(self):
+        # Queued objects wait for O_DestroyDeferred even once the thread
+        # stops deferring; what they release then goes at once.
+        ibd.O_SetDeferredDestruction(True)
+        decRef(*tablesWithKeys(50))
+        ibd.O_SetDeferredDestruction(False)
+
+        self.assert_(ibd.O_DestroyDeferred(0) == 50)
+        checkFreshTables(self, 8)
+
+    def test04_DestructionThread(self):
+        if not hasattr(ibd, 'O_StartDestructionThread'):
+            self.skipTest("Built without ENABLE_THREADS.")
+
+        ibd.O_StartDestructionThread()
+        ibd.O_SetDeferredDestruction(True)
+
+        for i in range(20):
+            decRef(*tablesWithKeys(100))
+
+        ibd.O_SetDeferredDestruction(False)
+        ibd.O_StopDestructionThread()
+
+        # The keys were made here, so with biased counts the last
+        # references the thread dropped are merged here.
+        if biased_refcount:
+            ibd.O_MergeRefCounts()
+
+        self.assert_(ibd.O_DestroyDeferred(0) == 0)
+        checkFreshTables(self, 8)
+
+class TestMemoryPools(unittest.TestCase):
+
+    def checkRefill(self, n, freed):
+        # Everything below the highest item is in use after the first
+        # fill, so the pool hands back exactly the slots freed.
+        tables = [ibd.NewHashTable() for i in range(n)]
+        freed = sorted(set(freed))
+
+        decRef(*[tables[i] for i in freed])
+
+        refill = [ibd.NewHashTable() for i in freed]
+        self.assert_(set(refill) == set(tables[i] for i in freed))
+
+        for ht in refill:
+            self.assert_(ibd.O_RefCount(ht) == 1)
+            self.assert_(ibd.Ht_Size(ht) == 0)
+
+        kept = set(range(n)) - set(freed)
+        decRef(*([tables[i] for i in kept] + refill))
+
+    def test01_Refill_Scattered(self):
+        random.seed(0)
+        self.checkRefill(20000, random.sample(range(20000), 6000))
+
+    def test02_Refill_FarEnd(self):
+        self.checkRefill(20000, range(19900, 20000))
+
+    def test03_Refill_FarEndAndFront(self):
+        self.checkRefill(20000, [0, 1, 2] + range(19990, 20000))
+
+    def test04_Refill_EveryOther(self):
+        self.checkRefill(5000, range(0, 5000, 2))
+
+    def test05_Refill_Single(self):
+        self.checkRefill(10000, [5000])
+
+    def checkTablesUsable(self, tables):
+        # Memory reused from freed page groups must come back zeroed.
+        self.assert_(len(set(tables)) == len(tables))
+
+        for i, ht in enumerate(tables):
+            self.assert_(ibd.O_RefCount(ht) == 1)
+            self.assert_(ibd.Ht_Size(ht) == 0)
+
+            if i % 97 == 0:
+                ibd.Ht_Give(ht, makeHashKey(i))
+                self.assert_(ibd.Ht_Size(ht) == 1)
+
+    def test06_Groups_Churn(self):
+        # Enough to take several slabs, each twice the last.
+        for n in [2000, 40000, 120000, 40000]:
+            tables = [ibd.NewHashTable() for i in range(n)]
+            self.checkTablesUsable(tables)
+            decRef(*tables)
+
+        checkFreshTables(self, 8)
+
+    def test07_Groups_FreedInMiddle(self):
+        tables = [ibd.NewHashTable() for i in range(40000)]
+        middle = tables[10000:30000]
+
+        decRef(*middle)
+
+        refill = [ibd.NewHashTable() for i in range(20000)]
+        self.checkTablesUsable(refill)
+
+        decRef(*(tables[:10000] + tables[30000:] + refill))
+        checkFreshTables(self, 8)
+
+    def test08_Groups_FreedInArena(self):
+        # Groups emptied while an arena is open still go back to the
+        # pool.
+        tables = [ibd.NewHashTable() for i in range(20000)]
+
+        a = ibd.Arena_Begin()
+        decRef(*tables)
+        ibd.Arena_Release(a)
+
+        refill = [ibd.NewHashTable() for i in range(20000)]
+        self.checkTablesUsable(refill)
+        decRef(*refill)
+
+        checkFreshTables(self, 8)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -6,6 +6,8 @@ import test_hashkeys
 import test_hashtable
 import test_markers
 import test_ibdstructures
+import test_ibdcompare
+import test_objects
 
 if __name__ == '__main__':
     dtl = unittest.defaultTestLoader
@@ -14,7 +16,9 @@ if __name__ == '__main__':
             dtl.loadTestsFromModule(test_hashkeys),
             dtl.loadTestsFromModule(test_markers),
             dtl.loadTestsFromModule(test_ibdstructures),
-            dtl.loadTestsFromModule(test_hashtable)])
+            dtl.loadTestsFromModule(test_hashtable),
+            dtl.loadTestsFromModule(test_ibdcompare),
+            dtl.loadTestsFromModule(test_objects)])
 
     if '--verbose' in sys.argv:
         unittest.TextTestRunner(verbosity=2).run(ts)